@@ -3,30 +3,529 @@
 ソースコード：testSoundGen.c
 ************************************************/
 #include <stdio.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
-#include "sndfile.h" 
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "sndfile.h"
 
-static int fs = 44100;             	/* 標本化周波数(Hz) */
-static int numBits = 16;		/* 量子化ビット数 */
-static int numChannels = 2;             /* チャンネル数（ステレオ固定） */
+#define BLOCK_FRAMES (16384)		/* 1回のsf_writef_intで書くフレーム数 */
+#define MULTITONE_MAX (8)		/* 多重純音の最大成分数 */
+#define MAX_CHANNELS (32)		/* チャンネル数の上限 */
+#define CORPUS_VALUES (8)		/* 音源集の仕様の1項目に指定できる値の数 */
+#define MAX_THREADS (256)		/* 音源集生成のスレッド数の上限 */
+
+/* 信号種別の定義 */
+enum { SIGNAL_TONE, SIGNAL_SWEEP, SIGNAL_MULTITONE, SIGNAL_NOISE };
+static const char *signalName[] = {"tone", "sweep", "multitone", "noise"};
+
+/* 試験音源の仕様を表す構造体の定義 */
+typedef struct{
+  int fs;				/* 標本化周波数(Hz) */
+  int numBits;				/* 量子化ビット数 */
+  int numChannels;			/* チャンネル数 */
+  int format;				/* ファイル形式(SF_FORMAT_WAV, FLAC, AIFF) */
+  int signal;				/* 信号種別 */
+  double duration;			/* 再生時間(秒) */
+  double frequency;			/* 純音の周波数、掃引開始周波数、多重純音の基本周波数(Hz) */
+  double endFrequency;			/* 掃引終了周波数(Hz) */
+} TONE_SPEC;
+
+/* 発振器の状態を表す構造体の定義 */
+typedef struct{
+  sf_count_t pos;			/* 次に生成するフレーム位置 */
+  sf_count_t numFrames;			/* 総フレーム数 */
+  double factor;			/* 振幅減衰係数 */
+  double omega;				/* 位相角の増分(rad/標本) */
+  double chirp;				/* 位相角の増分の増分(rad/標本^2) */
+  int numTones;				/* 多重純音の成分数 */
+  uint64_t seed;			/* 雑音の乱数状態 */
+} OSCILLATOR;
+
+static void osc_init(OSCILLATOR *osc, const TONE_SPEC *spec);
+static void osc_fill(OSCILLATOR *osc, const TONE_SPEC *spec, int *block, long frames);
+static int generate(const TONE_SPEC *spec, const char *filename, sf_count_t *written, uint32_t *pcmCrc);
+static void crc32_init(void);
+static uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len);
+static int file_crc32(const char *path, uint32_t *crc, long long *bytes);
+static int parse_corpus(const char *specString, const TONE_SPEC *base);
+static void *corpus_worker(void *arg);
+static int corpus_generate(const char *dir, int numJobs);
+static int parse_count(const char *s, long min, long max, long *value);
+static void usage(void);
+
+static uint32_t crcTable[256];		/* CRC-32(ISO-HDLC)の剰余表 */
+
+/* 音源集の1ファイルを表す構造体の定義 */
+typedef struct{
+  TONE_SPEC spec;			/* 音源の仕様 */
+  char name[64];			/* ファイル名(出力ディレクトリからの相対パス) */
+  char path[4096];			/* ファイルのパス名 */
+  sf_count_t frames;			/* 書き込んだフレーム数 */
+  long long bytes;			/* ファイルのバイト数 */
+  uint32_t fileCrc;			/* ファイル全体のCRC-32 */
+  uint32_t pcmCrc;			/* 量子化ビット数に切り詰めたリトルエンディアンPCMのCRC-32 */
+  int status;				/* 生成結果: 0=成功 */
+} CORPUS_JOB;
+
+static CORPUS_JOB *jobs = NULL;		/* 音源集を構成するファイルの配列 */
+static int numJobs = 0;			/* 音源集を構成するファイル数 */
+static atomic_int nextJob;		/* 次に生成するファイルの番号 */
+
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
 
 /* 使用法を表示するユーティリティ関数の定義 */
-static void usage(void)
+void usage(void)
 {
-  int k;
   printf(
 	 "Usage: testSoundGen [オプション]...\n"
 	 "-h,--help	  使用法\n"
 	 "-f,--format	  ファイル拡張子: (デフォルトwav), オプション flacまたはaiff\n"
 	 "-r,--rate	  標本化速度: 最小44100(デフォルト),最大192000\n"
 	 "-b,--bits         量子化ビット数: 16(デフォルト), 24, 32\n"
-	 "\n");
+	 "-c,--channels=数  チャンネル数: 2(デフォルト), 1〜%d\n"
+	 "-d,--duration=秒  再生時間: 5(デフォルト)\n"
+	 "-s,--signal=種別  tone(減衰純音、デフォルト), sweep(線形掃引), multitone(オクターブ間隔の多重純音), noise(白色雑音)\n"
+	 "-F,--frequency=Hz 純音の周波数、掃引開始周波数、多重純音の基本周波数: 1000(デフォルト)\n"
+	 "-E,--end-frequency=Hz 掃引終了周波数: 20000(デフォルト)\n"
+	 "-o,--output=ファイル名 音源ファイル名(省略時は信号種別、チャンネル数、量子化ビット数、標本化速度から生成)\n"
+	 "                  音源集生成では出力ディレクトリ(デフォルト .)\n"
+	 "-C,--corpus=仕様  音源集を並列生成: 項目=値,値...を:で区切って並べる\n"
+	 "                  項目 rate(allで全標本化速度), bits, format, channels, signal\n"
+	 "                  例 rate=all:bits=16,24,32:format=wav,flac,aiff\n"
+	 "-j,--jobs=数      音源集生成のスレッド数: 1〜%d(デフォルト オンラインCPU数)\n"
+	 "\n", MAX_CHANNELS, MAX_THREADS);
   printf("適用ファイルフォーマット:WAVE, FLAC, AIFF\n");
+  printf("音源集生成では出力ディレクトリに manifest.tsv (ファイル名, 形式, 標本化速度, 量子化ビット数,\n"
+	 "チャンネル数, 信号種別, フレーム数, バイト数, ファイルのCRC-32, PCMのCRC-32)を書く\n");
+  printf("\n");
+}
+
+/* 発振器を初期化するユーティリティ関数の定義 */
+void osc_init(OSCILLATOR *osc, const TONE_SPEC *spec)
+{
+  double pi = 4 * atan(1.);		/* 円周率 */
+  double start = 1.0;			/* 標本初期値(0dB) */
+  double end = 1.0e-4;			/* 標本最終値(-80dB)*/
+
+  osc->pos = 0;
+  osc->numFrames = (sf_count_t)(spec->duration * spec->fs);
+  osc->factor = pow(end/start, 1.0/(double)osc->numFrames); /* pow(x,y):xのy乗 , <math.h> */
+  osc->omega = 2. * pi * spec->frequency / spec->fs;
+  osc->chirp = osc->numFrames > 0 ? 2. * pi * (spec->endFrequency - spec->frequency) / spec->fs / (double)osc->numFrames : 0.0;
+  /* 多重純音はナイキスト周波数未満のオクターブ成分に限る */
+  osc->numTones = 0;
+  while (osc->numTones < MULTITONE_MAX && spec->frequency * (1 << osc->numTones) < spec->fs / 2.0)
+    osc->numTones++;
+  osc->seed = 0x9E3779B97F4A7C15ull ^ ((uint64_t)spec->fs << 32) ^ (uint64_t)spec->numChannels;
+}
+
+/* 発振器でインタリーブ配置のデータブロックを生成するユーティリティ関数の定義
+   正弦波は複素回転子の漸化式で生成する。誤差の蓄積を防ぐため、回転子はデータブロックごとに
+   位置posの厳密な位相角から作り直す */
+void osc_fill(OSCILLATOR *osc, const TONE_SPEC *spec, int *block, long frames)
+{
+  const int ch = spec->numChannels;
+  const double n0 = (double)osc->pos;
+  double re, im, cr, ci, t, fsample;
+
+  switch (spec->signal) {
+  case SIGNAL_TONE: {
+    /* 単調に減衰する純音 */
+    double current = pow(osc->factor, n0);	/* 標本現在値 */
+    re = cos(osc->omega * n0), im = sin(osc->omega * n0);
+    cr = cos(osc->omega), ci = sin(osc->omega);
+    for (long i = 0 ; i < frames ; i++) {
+      int s = (int)(INT_MAX * (current * im));	/* INT_MAX:int型の最大値 */
+      for (int c = 0 ; c < ch ; c++)
+	block[i * ch + c] = s;
+      current *= osc->factor;
+      t = re * cr - im * ci;
+      im = re * ci + im * cr;
+      re = t;
+    }
+    break;
+  }
+  case SIGNAL_SWEEP: {
+    /* 位相角 phi(n) = omega*n + chirp*n^2/2 の線形掃引。増分の回転子も漸化式で回す */
+    double phi = osc->omega * n0 + 0.5 * osc->chirp * n0 * n0;
+    double delta = osc->omega + osc->chirp * (n0 + 0.5);
+    double dr = cos(osc->chirp), di = sin(osc->chirp);
+    re = cos(phi), im = sin(phi);
+    cr = cos(delta), ci = sin(delta);
+    for (long i = 0 ; i < frames ; i++) {
+      int s = (int)(INT_MAX * im);
+      for (int c = 0 ; c < ch ; c++)
+	block[i * ch + c] = s;
+      t = re * cr - im * ci;
+      im = re * ci + im * cr;
+      re = t;
+      t = cr * dr - ci * di;
+      ci = cr * di + ci * dr;
+      cr = t;
+    }
+    break;
+  }
+  case SIGNAL_MULTITONE: {
+    /* 振幅を成分数で等分したオクターブ間隔の純音の和 */
+    double mre[MULTITONE_MAX], mim[MULTITONE_MAX], mcr[MULTITONE_MAX], mci[MULTITONE_MAX];
+    double gain = 1.0 / osc->numTones;
+    for (int k = 0 ; k < osc->numTones ; k++) {
+      double w = osc->omega * (1 << k);
+      mre[k] = cos(w * n0), mim[k] = sin(w * n0);
+      mcr[k] = cos(w), mci[k] = sin(w);
+    }
+    for (long i = 0 ; i < frames ; i++) {
+      fsample = 0.0;
+      for (int k = 0 ; k < osc->numTones ; k++) {
+	fsample += mim[k];
+	t = mre[k] * mcr[k] - mim[k] * mci[k];
+	mim[k] = mre[k] * mci[k] + mim[k] * mcr[k];
+	mre[k] = t;
+      }
+      int s = (int)(INT_MAX * (gain * fsample));
+      for (int c = 0 ; c < ch ; c++)
+	block[i * ch + c] = s;
+    }
+    break;
+  }
+  case SIGNAL_NOISE:
+    /* チャンネルごとに無相関な一様白色雑音(xorshift64*の上位32bitをそのまま標本とする) */
+    for (long i = 0 ; i < frames * ch ; i++) {
+      osc->seed ^= osc->seed >> 12;
+      osc->seed ^= osc->seed << 25;
+      osc->seed ^= osc->seed >> 27;
+      block[i] = (int)(int32_t)((osc->seed * 0x2545F4914F6CDD1Dull) >> 32);
+    }
+    break;
+  }
+  osc->pos += frames;
+}
+
+/* 仕様に従って試験音源ファイルを生成するユーティリティ関数の定義 */
+int generate(const TONE_SPEC *spec, const char *filename, sf_count_t *written, uint32_t *pcmCrc)
+{
+  SNDFILE *outfile = NULL;
+  SF_INFO outfileInfo = {0};
+  OSCILLATOR osc;
+  int *block = NULL;			/* インタリーブ配置のデータブロック */
+  unsigned char *packed = NULL;		/* CRC計算用のリトルエンディアンPCM */
+  int sampleBytes = spec->numBits / 8;	/* 標本当りのバイト数 */
+  int subformat = SF_FORMAT_PCM_16, err = 0;
+
+  /* libsndfileデータフォーマット設定 */
+  switch (spec->numBits) {
+  case 16:
+    subformat = SF_FORMAT_PCM_16;
+    break;
+  case 24:
+    subformat = SF_FORMAT_PCM_24;
+    break;
+  case 32:
+    if (spec->format == SF_FORMAT_FLAC){
+      fprintf(stderr, "FLAC形式では32bitをサポートしていません\n");
+      return -1;
+    }
+    subformat = SF_FORMAT_PCM_32;
+    break;
+  }
+
+  /* 音源ファイルのパラメータ設定 */
+  outfileInfo.samplerate = spec->fs;
+  outfileInfo.channels = spec->numChannels;
+  outfileInfo.format = spec->format | subformat;
+  if(!(outfile = sf_open(filename, SFM_WRITE, &outfileInfo))){
+    fprintf(stderr, "出力ファイルオープン失敗: %s: %s\n", filename, sf_strerror(NULL));
+    return -1;
+  }
+  block = (int *)malloc(sizeof(int) * BLOCK_FRAMES * spec->numChannels);
+  if (pcmCrc != NULL)
+    packed = (unsigned char *)malloc((size_t)sampleBytes * BLOCK_FRAMES * spec->numChannels);
+  if (block == NULL || (pcmCrc != NULL && packed == NULL)) {
+    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+    err = -1;
+    goto cleaning;
+  }
+
+  /* データブロック単位で生成して音源ファイルにwrite */
+  osc_init(&osc, spec);
+  *written = 0;
+  if (pcmCrc != NULL)
+    *pcmCrc = 0;
+  while (osc.pos < osc.numFrames) {
+    long frames = osc.numFrames - osc.pos < BLOCK_FRAMES ? (long)(osc.numFrames - osc.pos) : BLOCK_FRAMES;
+    osc_fill(&osc, spec, block, frames);
+    if (sf_writef_int(outfile, block, frames) != frames) {
+      fprintf(stderr, "音源ファイル書込み失敗: %s: %s\n", filename, sf_strerror(outfile));
+      err = -1;
+      goto cleaning;
+    }
+    *written += frames;
+    if (pcmCrc != NULL) {
+      /* libsndfileと同じく上位ビットに切り詰めた標本のCRCを取る(再生プログラムのRAW出力と照合できる) */
+      unsigned char *q = packed;
+      for (long i = 0 ; i < frames * spec->numChannels ; i++) {
+	int v = block[i] >> (32 - spec->numBits);
+	for (int b = 0 ; b < sampleBytes ; b++)
+	  *q++ = (unsigned char)(v >> (8 * b));
+      }
+      *pcmCrc = crc32_update(*pcmCrc, packed, (size_t)(q - packed));
+    }
+  }
+
+ cleaning:
+  if(packed != NULL)
+    free(packed);
+  if(block != NULL)
+    free(block);
+  if(outfile != NULL)
+    sf_close(outfile);
+  return err;
+}
+
+/* CRC-32の剰余表を作るユーティリティ関数の定義 */
+void crc32_init(void)
+{
+  for (uint32_t i = 0 ; i < 256 ; i++) {
+    uint32_t c = i;
+    for (int k = 0 ; k < 8 ; k++)
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crcTable[i] = c;
+  }
+}
+
+/* CRC-32を更新するユーティリティ関数の定義(初期値0から順次呼び出す) */
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+  crc = ~crc;
+  while (len-- > 0)
+    crc = crcTable[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+/* ファイル全体のCRC-32とバイト数を求めるユーティリティ関数の定義 */
+int file_crc32(const char *path, uint32_t *crc, long long *bytes)
+{
+  unsigned char buf[65536];
+  size_t n;
+  FILE *fp;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    fprintf(stderr, "音源ファイル読込み失敗: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  *crc = 0;
+  *bytes = 0;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    *crc = crc32_update(*crc, buf, n);
+    *bytes += (long long)n;
+  }
+  fclose(fp);
+  return 0;
+}
+
+/* 音源集の仕様を解析して生成するファイルを列挙するユーティリティ関数の定義
+   仕様は 項目=値,値... を:で区切って並べる。指定の無い項目は単一ファイル生成時のオプション値を用いる */
+int parse_corpus(const char *specString, const TONE_SPEC *base)
+{
+  static const char *allRates = "44100,48000,88200,96000,176400,192000";
+  static const char *extName[] = {"wav", "flac", "aiff"};
+  static const int formats[] = {SF_FORMAT_WAV, SF_FORMAT_FLAC, SF_FORMAT_AIFF};
+  int rates[CORPUS_VALUES] = {base->fs}, bits[CORPUS_VALUES] = {base->numBits};
+  int fmts[CORPUS_VALUES] = {0}, chans[CORPUS_VALUES] = {base->numChannels}, sigs[CORPUS_VALUES] = {base->signal};
+  int numRates = 1, numBits = 1, numFmts = 1, numChans = 1, numSigs = 1;
+  char *copy = strdup(specString), *item, *saveItem = NULL;
+
+  for (int i = 0 ; i < 3 ; i++)
+    if (formats[i] == base->format)
+      fmts[0] = i;
+  for (item = strtok_r(copy, ":", &saveItem) ; item != NULL ; item = strtok_r(NULL, ":", &saveItem)) {
+    char *values = strchr(item, '='), *value, *saveValue = NULL;
+    int *list, *count;
+    if (values == NULL)
+      goto invalid;
+    *values++ = '\0';
+    if (strcmp(item, "rate") == 0)
+      list = rates, count = &numRates;
+    else if (strcmp(item, "bits") == 0)
+      list = bits, count = &numBits;
+    else if (strcmp(item, "format") == 0)
+      list = fmts, count = &numFmts;
+    else if (strcmp(item, "channels") == 0)
+      list = chans, count = &numChans;
+    else if (strcmp(item, "signal") == 0)
+      list = sigs, count = &numSigs;
+    else
+      goto invalid;
+    if (list == rates && strcmp(values, "all") == 0)
+      values = (char *)allRates;
+    values = strdup(values);
+    *count = 0;
+    for (value = strtok_r(values, ",", &saveValue) ; value != NULL ; value = strtok_r(NULL, ",", &saveValue)) {
+      int v = -1;
+      long n;
+      if (*count >= CORPUS_VALUES) {
+	free(values);
+	goto invalid;
+      }
+      if (list == fmts || list == sigs) {
+	for (int i = 0 ; i < 4 ; i++)
+	  if ((list == fmts && i < 3 && strcmp(value, extName[i]) == 0) ||
+	      (list == sigs && strcmp(value, signalName[i]) == 0))
+	    v = i;
+      } else {
+	v = parse_count(value, 1, INT_MAX, &n) < 0 ? -1 : (int)n;
+	if ((list == rates && (v < 44100 || v > 192000)) || (list == bits && v != 16 && v != 24 && v != 32) ||
+	    (list == chans && (v < 1 || v > MAX_CHANNELS)))
+	  v = -1;
+      }
+      if (v < 0) {
+	fprintf(stderr, "音源集の仕様の値が不正: %s=%s\n", item, value);
+	free(values);
+	goto invalid;
+      }
+      list[(*count)++] = v;
+    }
+    free(values);
+    if (*count == 0)
+      goto invalid;
+  }
+  free(copy);
+
+  /* 全組合せを列挙する。形式が対応しない組合せは除く */
+  jobs = (CORPUS_JOB *)calloc((size_t)numRates * numBits * numFmts * numChans * numSigs, sizeof(CORPUS_JOB));
+  if (jobs == NULL) {
+    fprintf(stderr, "メモリ不足で音源集を列挙できない\n");
+    return -1;
+  }
+  for (int s = 0 ; s < numSigs ; s++)
+    for (int f = 0 ; f < numFmts ; f++)
+      for (int ch = 0 ; ch < numChans ; ch++)
+	for (int b = 0 ; b < numBits ; b++)
+	  for (int r = 0 ; r < numRates ; r++) {
+	    CORPUS_JOB *job = &jobs[numJobs];
+	    if (formats[fmts[f]] == SF_FORMAT_FLAC && (bits[b] == 32 || chans[ch] > 8)) {
+	      printf("FLAC形式で対応しない組合せを除く: %d bit, %d チャンネル\n", bits[b], chans[ch]);
+	      continue;
+	    }
+	    job->spec = *base;
+	    job->spec.fs = rates[r];
+	    job->spec.numBits = bits[b];
+	    job->spec.format = formats[fmts[f]];
+	    job->spec.numChannels = chans[ch];
+	    job->spec.signal = sigs[s];
+	    snprintf(job->name, sizeof(job->name), "%s%d_%d_%d.%s", signalName[sigs[s]], chans[ch], bits[b],
+		     rates[r], extName[fmts[f]]);
+	    numJobs++;
+	  }
+  return 0;
+
+ invalid:
+  free(copy);
+  fprintf(stderr, "音源集の仕様が不正: %s\n", specString);
+  return -1;
+}
+
+/* 音源集のファイルを順に取り出して生成するスレッド関数の定義(スレッドごとに別のSNDFILEを用いる) */
+void *corpus_worker(void *arg)
+{
+  int k;
+
+  while ((k = atomic_fetch_add(&nextJob, 1)) < numJobs) {
+    CORPUS_JOB *job = &jobs[k];
+    job->status = generate(&job->spec, job->path, &job->frames, &job->pcmCrc);
+    if (job->status == 0)
+      job->status = file_crc32(job->path, &job->fileCrc, &job->bytes);
+  }
+  return NULL;
+}
+
+/* 音源集をスレッドプールで生成し、目録を書くユーティリティ関数の定義 */
+int corpus_generate(const char *dir, int numThreads)
+{
+  pthread_t *threads = NULL;
+  char manifest[4096];
+  FILE *fp = NULL;
+  int started = 0, failed = 0, err = 0;
+  struct stat st;
+
+  /* 出力ディレクトリが無ければ作る。作れなければ生成を始める前に失敗する */
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "出力ディレクトリ作成失敗: %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "出力先がディレクトリではない: %s\n", dir);
+    return -1;
+  }
+  for (int k = 0 ; k < numJobs ; k++)
+    snprintf(jobs[k].path, sizeof(jobs[k].path), "%s/%s", dir, jobs[k].name);
+  if (numThreads > numJobs)
+    numThreads = numJobs;
+  if (numThreads < 1)
+    numThreads = 1;
+  printf("音源集: %d ファイルを %d スレッドで生成\n", numJobs, numThreads);
+
+  atomic_init(&nextJob, 0);
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * numThreads);
+  if (threads == NULL) {
+    fprintf(stderr, "メモリ不足でスレッドを起動できない\n");
+    return -1;
+  }
+  for (started = 0 ; started < numThreads ; started++) {
+    if ((err = pthread_create(&threads[started], NULL, corpus_worker, NULL)) != 0) {
+      fprintf(stderr, "生成スレッド起動失敗: %s\n", strerror(err));
+      break;
+    }
+  }
+  if (started == 0)
+    corpus_worker(NULL);		/* スレッドを1つも起動できなければ自スレッドで生成する */
+  for (int t = 0 ; t < started ; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+
+  /* 目録を書く。失敗したファイルは載せない */
+  snprintf(manifest, sizeof(manifest), "%s/manifest.tsv", dir);
+  if ((fp = fopen(manifest, "w")) == NULL) {
+    fprintf(stderr, "目録ファイル作成失敗: %s: %s\n", manifest, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "# name\tformat\trate\tbits\tchannels\tsignal\tframes\tbytes\tfile_crc32\tpcm_crc32\n");
+  for (int k = 0 ; k < numJobs ; k++) {
+    CORPUS_JOB *job = &jobs[k];
+    if (job->status != 0) {
+      failed++;
+      continue;
+    }
+    fprintf(fp, "%s\t%s\t%d\t%d\t%d\t%s\t%lld\t%lld\t%08x\t%08x\n", job->name, strrchr(job->name, '.') + 1, job->spec.fs,
+	    job->spec.numBits, job->spec.numChannels, signalName[job->spec.signal], (long long)job->frames,
+	    job->bytes, job->fileCrc, job->pcmCrc);
+  }
+  fclose(fp);
+  printf("目録 %s に %d ファイルを記録", manifest, numJobs - failed);
+  if (failed > 0)
+    printf(" (%d ファイルは生成失敗)", failed);
   printf("\n");
+  return failed > 0 ? -1 : 0;
 }
 
 int main(int argc, char *argv[])
@@ -37,120 +536,156 @@ int main(int argc, char *argv[])
       {"format", 1, NULL, 'f'},
       {"rate", 1, NULL, 'r'},
       {"bits", 1, NULL, 'b'},
+      {"channels", 1, NULL, 'c'},
+      {"duration", 1, NULL, 'd'},
+      {"signal", 1, NULL, 's'},
+      {"frequency", 1, NULL, 'F'},
+      {"end-frequency", 1, NULL, 'E'},
+      {"output", 1, NULL, 'o'},
+      {"corpus", 1, NULL, 'C'},
+      {"jobs", 1, NULL, 'j'},
       {NULL, 0, NULL, 0},
     };
 
   /* (1) 変数定義 */
   int c;
-  char *formatID[3] = {"16", "44100", "wav"};		
-  char filename[256] = "tone2_";	/* 音源ファイル名 */                 
-  int     sample[2];               	/* サウンド標本(整数型）フレーム */
-  int     numSamples;       	 	/* 標本数 */
-  float   duration = 5.0;        	/* 再生時間(秒) */
-  float   frequency = 1000.0;		/* 純音の周波数(Hz) */
-  double  fsample;			/* サウンド標本(浮動少数点型） */
-  double  pi = 4 * atan(1.);		/* 円周率 */
-  double  start = 1.0;			/* 標本初期値(0dB) */
-  double  end = 1.0e-4; 		/* 標本最終値(-80dB)*/                                                                                               
-  double  current;			/* 標本現在値 */  
-  double  factor;			/* 振幅減衰係数 */  
-  double  angleIncrement;		/* 純音の位相角の増分 */
-    
-  /* libsndfile */
-  SNDFILE *outfile;
-  SF_INFO outfileInfo = {0};
-  int subformat, format = SF_FORMAT_WAV;
-             
+  long value;				/* 数値オプションの値 */
+  const char *formatID = "wav";		/* ファイル拡張子 */
+  char filename[256];			/* 音源ファイル名 */
+  const char *outPath = NULL;		/* 指定された音源ファイル名 */
+  const char *corpusSpec = NULL;	/* 音源集の仕様: NULL=単一ファイル生成 */
+  int numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);	/* 音源集生成のスレッド数 */
+  sf_count_t written = 0;		/* 書き込んだフレーム数 */
+  struct timespec t0, t1;		/* 生成時間の計測 */
+  double elapsed;
+  TONE_SPEC spec = {
+    .fs = 44100, .numBits = 16, .numChannels = 2, .format = SF_FORMAT_WAV,
+    .signal = SIGNAL_TONE, .duration = 5.0, .frequency = 1000.0, .endFrequency = 20000.0,
+  };
+
   /* (2) コマンドライン・オプション処理 */
-  while ((c = getopt_long(argc, argv, "hf:r:b:", long_option, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "hf:r:b:c:d:s:F:E:o:C:j:", long_option, NULL)) != -1) {
     switch (c) {
     case 'h':
       usage();
       return 0;
     case 'f':
-      formatID[2] = strdup(optarg); 
-      if (strcmp(formatID[2], "flac") == 0){
-	format = SF_FORMAT_FLAC;
-      }else if (strcmp(formatID[2], "aiff") == 0){
-	format = SF_FORMAT_AIFF;
+      formatID = strdup(optarg);
+      if (strcmp(formatID, "flac") == 0){
+	spec.format = SF_FORMAT_FLAC;
+      }else if (strcmp(formatID, "aiff") == 0){
+	spec.format = SF_FORMAT_AIFF;
+      }else if (strcmp(formatID, "wav") == 0){
+	spec.format = SF_FORMAT_WAV;
       }else{
 	usage();
 	exit(-1);
       }
       break;
     case 'r':
-      fs = atoi(optarg);
-      if ((fs > 192000) || (fs < 44100)){
+      if (parse_count(optarg, 44100, 192000, &value) < 0){
 	usage();
 	exit(-1);
       }
-      formatID[1] = strdup(optarg);		
+      spec.fs = (int)value;
       break;
     case 'b':
-      numBits = atoi(optarg);
-      if (!((numBits == 32)||(numBits == 24)||(numBits == 16))){
+      if (parse_count(optarg, 16, 32, &value) < 0 || !((value == 32)||(value == 24)||(value == 16))){
+	usage();
+	exit(-1);
+      }
+      spec.numBits = (int)value;
+      break;
+    case 'c':
+      if (parse_count(optarg, 1, MAX_CHANNELS, &value) < 0){
+	usage();
+	exit(-1);
+      }
+      spec.numChannels = (int)value;
+      break;
+    case 'd':
+      spec.duration = atof(optarg);
+      if (spec.duration <= 0.0){
+	usage();
+	exit(-1);
+      }
+      break;
+    case 's':
+      if (strcmp(optarg, "tone") == 0)
+	spec.signal = SIGNAL_TONE;
+      else if (strcmp(optarg, "sweep") == 0)
+	spec.signal = SIGNAL_SWEEP;
+      else if (strcmp(optarg, "multitone") == 0)
+	spec.signal = SIGNAL_MULTITONE;
+      else if (strcmp(optarg, "noise") == 0)
+	spec.signal = SIGNAL_NOISE;
+      else {
 	usage();
 	exit(-1);
       }
-      formatID[0] = strdup(optarg);
-      break;	
+      break;
+    case 'F':
+      spec.frequency = atof(optarg);
+      break;
+    case 'E':
+      spec.endFrequency = atof(optarg);
+      break;
+    case 'o':
+      outPath = optarg;
+      break;
+    case 'C':
+      corpusSpec = optarg;
+      break;
+    case 'j':
+      if (parse_count(optarg, 1, MAX_THREADS, &value) < 0){
+	fprintf(stderr, "スレッド数は1〜%dの整数\n", MAX_THREADS);
+	exit(-1);
+      }
+      numThreads = (int)value;
+      break;
     default:
       fprintf(stderr, "`--help'で使用方法を確認\n");
       exit(-1);
     }
   }
-  
-  /* (3) 音源ファイル名生成 */
-  strcat(filename, formatID[0]);
-  strcat(filename, "_");
-  strcat(filename, formatID[1]);
-  strcat(filename, ".");
-  strcat(filename, formatID[2]);
- 
-  /* (4) libsndfileデータフォーマット設定 */
-  switch (numBits) {
-  case 16:
-    subformat = SF_FORMAT_PCM_16;
-    break;
-  case 24:
-    subformat = SF_FORMAT_PCM_24;
-    break;
-  case 32:
-    if (format == SF_FORMAT_FLAC){
-      fprintf(stderr, "FLAC形式では32bitをサポートしていません\n");
+  if ((spec.frequency <= 0.0) || (spec.frequency >= spec.fs / 2.0) ||
+      (spec.endFrequency <= 0.0) || (spec.endFrequency >= spec.fs / 2.0)){
+    fprintf(stderr, "周波数は0より大きくナイキスト周波数(%d Hz)未満\n", spec.fs / 2);
+    exit(-1);
+  }
+  if (corpusSpec != NULL){
+    /* 音源集を並列生成する */
+    crc32_init();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (parse_corpus(corpusSpec, &spec) < 0)
       exit(-1);
-    }
-    subformat = SF_FORMAT_PCM_32;
-    break;
+    c = corpus_generate(outPath != NULL ? outPath : ".", numThreads);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("生成時間：%.3f 秒\n", (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9);
+    free(jobs);
+    return c < 0 ? -1 : 0;
+  }
+  if ((spec.format == SF_FORMAT_FLAC) && (spec.numChannels > 8)){
+    fprintf(stderr, "FLAC形式では8チャンネルを超える音源をサポートしていません\n");
+    exit(-1);
   }
-    
-  /* (5) 再生純音を規定するパラメータ算出 */
-  numSamples = (int)(duration * fs);
-  angleIncrement = 2. * pi * frequency / fs;
-  factor = pow(end/start, 1.0/numSamples); /* pow(x,y):xのy乗 , <math.h> */
 
-  /* (6) 音源ファイルのパラメータ設定 */
-  outfileInfo.samplerate = fs;
-  outfileInfo.channels = numChannels;
-  outfileInfo.format = format | subformat;
-  if(!(outfile = sf_open(filename, SFM_WRITE, &outfileInfo))){
-    fprintf(stderr, "出力ファイルオープン失敗\n");
-    exit(-1);	
-  }
-    
-  /* (7) 単調に減衰する純音データ標本を音源ファイルにwrite */
-  current = start;
-  for(int i=0; i < numSamples; i++){
-    fsample = current * sin(angleIncrement*i);
-    current *= factor;
-    sample[0] = sample[1] = (int)(INT_MAX * fsample); /* INT_MAX:int型の最大値 */
-    sf_write_int(outfile, sample, 2);
-  }
-  printf("%d サンプルをファイル %s に書く\n", numSamples, filename);
-    
-  /* (8) 資源を開放して、プログラムを終了 */
-  if(outfile != NULL)
-    sf_close(outfile);
+  /* (3) 音源ファイル名生成 */
+  if (outPath != NULL)
+    snprintf(filename, sizeof(filename), "%s", outPath);
+  else
+    snprintf(filename, sizeof(filename), "%s%d_%d_%d.%s", signalName[spec.signal], spec.numChannels,
+	     spec.numBits, spec.fs, formatID);
+
+  /* (4) データブロック単位で音源を生成してファイルにwrite */
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (generate(&spec, filename, &written, NULL) < 0)
+    exit(-1);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  elapsed = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("%lld サンプルをファイル %s に書く\n", (long long)written, filename);
+  printf("生成時間：%.3f 秒 (%.1f Mフレーム/秒)\n", elapsed, elapsed > 0 ? (double)written / elapsed / 1e6 : 0.0);
+
+  /* (5) プログラムを終了 */
   return 0;
 }
-
@@ -0,0 +1,504 @@
+/*****************************************************************************
+ 実例プログラム：再生プログラム性能評価プログラム
+ ソースコード：playback_bench.c
+ ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <sys/user.h>
+#endif
+
+/*** 評価対象の転送経路の定義 ***/
+enum { IN_WAVE = 1, IN_FLAC = 2, IN_AIFF = 4 };	/* 対応する信号ファイル形式 */
+
+typedef struct{
+  const char *path;					/* 転送経路名 */
+  const char *program;					/* 再生プログラム名 */
+  const char *option;					/* 追加オプション: NULL=無し */
+  int inputs;						/* 対応する信号ファイル形式 */
+} BENCH_PATH;
+
+static const BENCH_PATH paths[] = {
+  {"write_uchar",         "wave_rw_player_uchar",     NULL, IN_WAVE},
+  {"write_uchar(mmap)",   "wave_rw_player_uchar",     "-m", IN_WAVE},
+  {"direct_uchar",        "wave_direct_player_uchar", NULL, IN_WAVE},
+  {"flac_write_int",      "flac_rw_player_int",       NULL, IN_FLAC},
+  {"multi_fmt_write_int", "multiFmt_rw_player_int",   NULL, IN_WAVE | IN_FLAC | IN_AIFF},
+};
+#define NUM_PATHS (sizeof(paths) / sizeof(paths[0]))
+
+/*** 1回の測定結果の定義 ***/
+typedef struct{
+  int status;						/* 終了状態: 0=正常 */
+  double wall;						/* 経過時間(秒) */
+  double cpu;						/* CPU時間(user + system, 秒) */
+  long maxRss;						/* 最大常駐メモリ(KB) */
+  long minFaults;					/* マイナー・ページフォールト数 */
+  unsigned long frames;					/* 再生フレーム数 */
+  unsigned long period;					/* 転送周期(frames) */
+  unsigned int rate;					/* 標本化速度(Hz) */
+  unsigned long syscalls;				/* システムコール数(-s指定時) */
+  unsigned long memSyscalls;				/* brk/mmap/munmap/mremapの回数(-s指定時) */
+  int verified;						/* RAW出力の照合結果: 0=未照合 1=一致 -1=不一致 */
+} BENCH_RESULT;
+
+/*** 信号ファイルの定義 ***/
+typedef struct{
+  char *path;						/* 信号ファイルのパス名 */
+  int hasCrc;						/* 目録にPCMのCRC-32がある: set=1 clear=0 */
+  uint32_t pcmCrc;					/* 目録に記録されたPCMのCRC-32 */
+} BENCH_FILE;
+
+/* ユーティリティ関数のプロトタイプ宣言 */
+static int input_kind(const char *file);
+static int run_player(const BENCH_PATH *bp, const char *device, const char *file, int trace, BENCH_RESULT *res);
+static unsigned long trace_syscalls(pid_t pid, unsigned long *memSyscalls, int *status);
+static unsigned long parse_number(const char *text, const char *key);
+static void print_result(const BENCH_PATH *bp, const char *pcmName, const BENCH_RESULT *res);
+static int read_manifest(const char *manifest);
+static int add_file(const char *path, int hasCrc, uint32_t pcmCrc);
+static int file_crc32(const char *path, uint32_t *crc);
+static void usage(void);
+
+/*** アプリケーション制御フラグの初期化 ***/
+static const char *binDir = ".";			/* 再生プログラムのディレクトリ */
+static const char *rtDevice = NULL;			/* 実時間で消費するPCMデバイス名: NULL=測定しない */
+static int countSyscalls = 0;				/* システムコール計数フラグ: set=1 clear=0 */
+static int repeat = 3;					/* 測定の繰返し回数(最良値を採る) */
+static int verbose = 0;					/* 詳細情報表示フラグ: set=1 clear=0 */
+static BENCH_FILE *files = NULL;			/* 測定する信号ファイルの配列 */
+static int numFiles = 0;				/* 測定する信号ファイル数 */
+
+/* 信号ファイルの拡張子から形式を判定するユーティリティ関数の定義 */
+int input_kind(const char *file)
+{
+  const char *ext = strrchr(file, '.');
+
+  if (ext == NULL)
+    return 0;
+  if (strcasecmp(ext, ".wav") == 0)
+    return IN_WAVE;
+  if (strcasecmp(ext, ".flac") == 0)
+    return IN_FLAC;
+  if (strcasecmp(ext, ".aiff") == 0 || strcasecmp(ext, ".aif") == 0)
+    return IN_AIFF;
+  return 0;
+}
+
+/* 再生プログラムを子プロセスとして実行し、資源使用量を測定するユーティリティ関数の定義 */
+int run_player(const BENCH_PATH *bp, const char *device, const char *file, int trace, BENCH_RESULT *res)
+{
+  char program[PATH_MAX];
+  char *argv[8];
+  char *text = NULL;					/* 子プロセスの標準出力 */
+  size_t textLength = 0, textSize = 0;
+  int pipefd[2], argc = 0, wstatus;
+  struct timespec t0, t1;
+  struct rusage usage;
+  pid_t pid;
+  ssize_t n;
+
+  memset(res, 0, sizeof(*res));
+  snprintf(program, sizeof(program), "%s/%s", binDir, bp->program);
+  argv[argc++] = program;
+  if (bp->option != NULL)
+    argv[argc++] = (char *)bp->option;
+  argv[argc++] = "-D";
+  argv[argc++] = (char *)device;
+  argv[argc++] = (char *)file;
+  argv[argc] = NULL;
+
+  if (pipe(pipefd) < 0) {
+    fprintf(stderr, "パイプ作成失敗: %s\n", strerror(errno));
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "プロセス生成失敗: %s\n", strerror(errno));
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    /* 子プロセス: 標準出力をパイプ(計数時は/dev/null)に接続して再生プログラムを起動する */
+    if (trace) {
+      int nullfd = open("/dev/null", O_WRONLY);
+      dup2(nullfd, STDOUT_FILENO);
+      close(nullfd);
+    } else
+      dup2(pipefd[1], STDOUT_FILENO);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (trace)
+      ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    execv(program, argv);
+    fprintf(stderr, "%s を起動できない: %s\n", program, strerror(errno));
+    _exit(127);
+  }
+  close(pipefd[1]);
+
+  if (trace) {
+    /* 計数時は時間と表示を使わない。子プロセスの標準出力は/dev/nullなので、パイプは追跡前に閉じ、
+       終了状態はtrace_syscalls()が回収したものを返す */
+    close(pipefd[0]);
+    res->syscalls = trace_syscalls(pid, &res->memSyscalls, &res->status);
+    return res->status;
+  }
+
+  /* 子プロセスの標準出力を全て読み込む */
+  for (;;) {
+    if (textSize - textLength < 4096) {
+      char *p = (char *)realloc(text, textSize + 65536);
+      if (p == NULL)
+	break;
+      text = p;
+      textSize += 65536;
+    }
+    n = read(pipefd[0], text + textLength, textSize - textLength - 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    textLength += (size_t)n;
+  }
+  close(pipefd[0]);
+  if (text != NULL)
+    text[textLength] = '\0';
+
+  while (wait4(pid, &wstatus, 0, &usage) < 0 && errno == EINTR)
+    ;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  res->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+  res->wall = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+  res->cpu = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6
+    + (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+  res->maxRss = usage.ru_maxrss;
+  res->minFaults = usage.ru_minflt;
+
+  /* 再生プログラムの表示から標本化速度、転送周期、再生フレーム数を取り出す */
+  if (text != NULL) {
+    if (verbose > 0)
+      fputs(text, stdout);
+    res->rate = (unsigned int)parse_number(text, "標本化速度");
+    res->period = parse_number(text, "転送周期");
+    res->frames = parse_number(text, "合計");
+    free(text);
+  }
+  return res->status;
+}
+
+/* 子プロセスのシステムコールをptraceで計数するユーティリティ関数の定義
+   子プロセスを回収し、*statusにその終了状態(異常終了は-1)を返す */
+unsigned long trace_syscalls(pid_t pid, unsigned long *memSyscalls, int *status)
+{
+  unsigned long stops = 0, entries = 0;
+  int wstatus, sig;
+  pid_t tid;
+
+  *memSyscalls = 0;
+  *status = -1;
+  /* execv直後の停止を待ち、スレッドも追跡対象にする */
+  if (waitpid(pid, &wstatus, 0) < 0)
+    return 0;
+  if (!WIFSTOPPED(wstatus)) {
+    if (WIFEXITED(wstatus))
+      *status = WEXITSTATUS(wstatus);
+    return 0;
+  }
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	 (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+  while ((tid = waitpid(-1, &wstatus, __WALL)) > 0) {
+    if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)) {
+      if (tid == pid) {
+	*status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+	break;
+      }
+      continue;
+    }
+    sig = 0;
+    if (WIFSTOPPED(wstatus)) {
+      if (WSTOPSIG(wstatus) == (SIGTRAP | 0x80)) {
+	stops++;
+#if defined(__x86_64__)
+	/* x86-64では、入口の停止でraxが-ENOSYSになっている */
+	struct user_regs_struct regs;
+	if (ptrace(PTRACE_GETREGS, tid, NULL, &regs) == 0 && (long)regs.rax == -ENOSYS) {
+	  entries++;
+	  if (regs.orig_rax == SYS_brk || regs.orig_rax == SYS_mmap
+	      || regs.orig_rax == SYS_munmap || regs.orig_rax == SYS_mremap)
+	    (*memSyscalls)++;
+	}
+#endif
+      } else if (WSTOPSIG(wstatus) != SIGTRAP && WSTOPSIG(wstatus) != SIGSTOP)
+	sig = WSTOPSIG(wstatus);			/* 子プロセス宛てのシグナルはそのまま渡す */
+    }
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+  }
+  return entries > 0 ? entries : stops / 2;
+}
+
+/* 表示テキスト中のキーワードに続く最初の数値を取り出すユーティリティ関数の定義 */
+unsigned long parse_number(const char *text, const char *key)
+{
+  const char *p = strstr(text, key);
+
+  if (p == NULL)
+    return 0;
+  p += strlen(key);
+  while (*p != '\0' && *p != '\n' && (*p < '0' || *p > '9'))
+    p++;
+  return strtoul(p, NULL, 10);
+}
+
+/* 測定結果を1行で表示するユーティリティ関数の定義 */
+void print_result(const BENCH_PATH *bp, const char *pcmName, const BENCH_RESULT *res)
+{
+  double audioSec = res->rate > 0 ? (double)res->frames / (double)res->rate : 0.0;
+  double periods = res->period > 0 ? (double)res->frames / (double)res->period : 0.0;
+
+  if (res->status != 0) {
+    printf("%-20s %-6s 失敗 (終了状態 %d)\n", bp->path, pcmName, res->status);
+    return;
+  }
+  printf("%-20s %-6s %12.0f %10.4f %9ld %9ld", bp->path, pcmName,
+	 res->wall > 0.0 ? (double)res->frames / res->wall : 0.0,
+	 audioSec > 0.0 ? res->cpu / audioSec : 0.0, res->maxRss, res->minFaults);
+  if (countSyscalls)
+    printf(" %9.1f %9lu", periods > 0.0 ? (double)res->syscalls / periods : 0.0, res->memSyscalls);
+  if (res->verified != 0)
+    printf(" 照合:%s", res->verified > 0 ? "一致" : "不一致");
+  printf("\n");
+}
+
+/* 信号ファイルを測定対象に加えるユーティリティ関数の定義 */
+int add_file(const char *path, int hasCrc, uint32_t pcmCrc)
+{
+  BENCH_FILE *p = (BENCH_FILE *)realloc(files, sizeof(BENCH_FILE) * (numFiles + 1));
+
+  if (p == NULL) {
+    fprintf(stderr, "メモリ不足で信号ファイルを登録できない\n");
+    return -1;
+  }
+  files = p;
+  files[numFiles].path = strdup(path);
+  files[numFiles].hasCrc = hasCrc;
+  files[numFiles].pcmCrc = pcmCrc;
+  numFiles++;
+  return 0;
+}
+
+/* 試験音源生成プログラムの目録(manifest.tsv)から信号ファイルを登録するユーティリティ関数の定義
+   1列目のファイル名は目録のディレクトリからの相対パス、10列目はPCMのCRC-32 */
+int read_manifest(const char *manifest)
+{
+  char line[1024], path[PATH_MAX];
+  const char *slash = strrchr(manifest, '/');
+  int dirLength = slash != NULL ? (int)(slash - manifest) : 1;
+  const char *dir = slash != NULL ? manifest : ".";
+  FILE *fp;
+
+  if ((fp = fopen(manifest, "r")) == NULL) {
+    fprintf(stderr, "目録ファイルを開けない: %s: %s\n", manifest, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *field[10], *save = NULL;
+    int n = 0;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    for (char *f = strtok_r(line, "\t\n", &save) ; f != NULL && n < 10 ; f = strtok_r(NULL, "\t\n", &save))
+      field[n++] = f;
+    if (n < 1)
+      continue;
+    snprintf(path, sizeof(path), "%.*s/%s", dirLength, dir, field[0]);
+    if (add_file(path, n >= 10, n >= 10 ? (uint32_t)strtoul(field[9], NULL, 16) : 0) < 0) {
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+/* ファイル全体のCRC-32(ISO-HDLC)を求めるユーティリティ関数の定義 */
+int file_crc32(const char *path, uint32_t *crc)
+{
+  static uint32_t table[256];
+  unsigned char buf[65536];
+  uint32_t c = 0xFFFFFFFFu;
+  ssize_t n;
+  int fd;
+
+  if (table[1] == 0) {
+    for (uint32_t i = 0 ; i < 256 ; i++) {
+      uint32_t t = i;
+      for (int k = 0 ; k < 8 ; k++)
+	t = (t & 1) ? 0xEDB88320u ^ (t >> 1) : t >> 1;
+      table[i] = t;
+    }
+  }
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    for (ssize_t i = 0 ; i < n ; i++)
+      c = table[(c ^ buf[i]) & 0xFF] ^ (c >> 8);
+  close(fd);
+  *crc = ~c;
+  return n < 0 ? -1 : 0;
+}
+
+/* 使用法を表示するユーティリティ関数の定義 */
+void usage(void)
+{
+  printf(
+	 "使用法: playback_bench [オプション]... [信号ファイル]...\n"
+	 "-h,--help	  使用法\n"
+	 "-b,--bindir=ディレクトリ 再生プログラムのディレクトリ(デフォルト .)\n"
+	 "-R,--realtime=デバイス  実時間で消費するPCMデバイスでも測定\n"
+	 "-s,--syscalls           ptraceで転送周期当りのシステムコール数を計数\n"
+	 "-r,--repeat=回数        測定の繰返し回数(デフォルト 3、最良値を表示)\n"
+	 "-v,--verbose            再生プログラムの表示を出力\n"
+	 "-M,--manifest=ファイル  試験音源生成プログラムの目録に載った信号ファイルを測定し、\n"
+	 "                        file PCMのRAW出力を目録のPCMのCRC-32と照合する\n"
+	 "\n"
+	 "信号ファイルは試験音源生成プログラム(testSoundGen)の出力を想定する\n"
+	 "評価経路: write_uchar, write_uchar(mmap), direct_uchar, flac_write_int, multi_fmt_write_int\n"
+	 "PCM: null(待ち無し), file(RAW出力、待ち無し), rt(-R指定時、実時間)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option long_option[] =
+    {
+      {"help", 0, NULL, 'h'},
+      {"bindir", 1, NULL, 'b'},
+      {"realtime", 1, NULL, 'R'},
+      {"syscalls", 0, NULL, 's'},
+      {"repeat", 1, NULL, 'r'},
+      {"verbose", 0, NULL, 'v'},
+      {"manifest", 1, NULL, 'M'},
+      {NULL, 0, NULL, 0},
+    };
+  char fileDevice[PATH_MAX + 32];			/* file PCMの指定文字列 */
+  char rawPath[] = "/tmp/playback_bench_XXXXXX";	/* file PCMの出力先 */
+  const char *devices[3], *pcmNames[3] = {"null", "file", "rt"};
+  int numDevices, c, fd, exit_code = 0;
+
+  while ((c = getopt_long(argc, argv, "hb:R:sr:vM:", long_option, NULL)) != -1) {
+    switch (c) {
+    case 'h':
+      usage();
+      return 0;
+    case 'b':
+      binDir = optarg;
+      break;
+    case 'R':
+      rtDevice = optarg;
+      break;
+    case 's':
+      countSyscalls = 1;
+      break;
+    case 'r':
+      if ((repeat = atoi(optarg)) < 1)
+	repeat = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'M':
+      if (read_manifest(optarg) < 0)
+	return EXIT_FAILURE;
+      break;
+    default:
+      fprintf(stderr, "`--help'で使用方法を確認\n");
+      return EXIT_FAILURE;
+    }
+  }
+  for (int f = optind ; f < argc ; f++)
+    if (add_file(argv[f], 0, 0) < 0)
+      return EXIT_FAILURE;
+  if (numFiles == 0) {
+    usage();
+    return 0;
+  }
+
+  /* 待ち無しのnull, file PCMと、指定があれば実時間のPCMで測定する */
+  if ((fd = mkstemp(rawPath)) < 0) {
+    fprintf(stderr, "一時ファイル作成失敗: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  snprintf(fileDevice, sizeof(fileDevice), "file:FILE=%s,FORMAT=raw", rawPath);
+  devices[0] = "null";
+  devices[1] = fileDevice;
+  numDevices = 2;
+  if (rtDevice != NULL)
+    devices[numDevices++] = rtDevice;
+
+  for (int f = 0 ; f < numFiles ; f++) {
+    const char *file = files[f].path;
+    int kind = input_kind(file);
+
+    printf("*** 信号ファイル: %s ***\n", file);
+    printf("%-20s %-6s %12s %10s %9s %9s", "経路", "PCM", "フレーム/秒", "CPU秒/秒", "RSS(KB)", "フォールト");
+    if (countSyscalls)
+      printf(" %9s %9s", "syscall/周期", "メモリ系");
+    printf("\n");
+    for (unsigned int p = 0 ; p < NUM_PATHS ; p++) {
+      if ((paths[p].inputs & kind) == 0)
+	continue;
+      for (int d = 0 ; d < numDevices ; d++) {
+	BENCH_RESULT best, res;
+	/* 実時間のPCMは再生時間だけ掛かるので1回だけ測定する */
+	int runs = (d == 2) ? 1 : repeat;
+
+	memset(&best, 0, sizeof(best));
+	for (int r = 0 ; r < runs ; r++) {
+	  if (run_player(&paths[p], devices[d], file, 0, &res) != 0 || r == 0 || res.wall < best.wall)
+	    best = res;
+	  if (res.status != 0)
+	    break;
+	}
+	/* システムコール数は別途ptrace下で1回だけ計数する(時間は計測しない) */
+	if (countSyscalls && best.status == 0) {
+	  if (run_player(&paths[p], devices[d], file, 1, &res) == 0) {
+	    best.syscalls = res.syscalls;
+	    best.memSyscalls = res.memSyscalls;
+	  } else
+	    fprintf(stderr, "%s: システムコール計数中の再生が失敗 (終了状態 %d)\n", paths[p].path, res.status);
+	}
+	/* file PCMのRAW出力(最後の測定分)を目録のPCMのCRC-32と照合する */
+	if (d == 1 && files[f].hasCrc && best.status == 0) {
+	  uint32_t crc;
+	  best.verified = (file_crc32(rawPath, &crc) == 0 && crc == files[f].pcmCrc) ? 1 : -1;
+	  if (best.verified < 0)
+	    exit_code = EXIT_FAILURE;
+	}
+	if (best.status != 0)
+	  exit_code = EXIT_FAILURE;
+	print_result(&paths[p], pcmNames[d], &best);
+      }
+    }
+    printf("\n");
+  }
+  unlink(rawPath);
+  return exit_code;
+}
@@ -0,0 +1,72 @@
+/******************************************************
+ 再入可能な再生エンジン・ライブラリ
+ ヘッダ・ファイル：PlaybackEngine.h
+ ******************************************************/
+#ifndef PLAYBACK_ENGINE_H
+#define PLAYBACK_ENGINE_H
+
+#include "alsa/asoundlib.h"
+
+/*** レイテンシ・プロファイルの定義 ***/
+enum { PB_LATENCY_LOW, PB_LATENCY_BALANCED, PB_LATENCY_THROUGHPUT };
+
+/*** 出力方式(シンク)の定義 ***/
+enum { PB_SINK_RW, PB_SINK_MMAP, PB_SINK_DIRECT };
+
+/* 音源(ソース)インタフェースの定義
+   音源はPCMへそのまま書けるサンプル・フォーマットのインタリーブ配置フレームを供給する。
+   readをNULLにした音源はフォーマットの記述だけで、転送は呼出し側が行う(pb_engine_pcm()) */
+typedef struct pb_source PB_SOURCE;
+struct pb_source{
+  const char *kind;					/* 音源の種類名 */
+  snd_pcm_format_t format;				/* 供給するサンプル・フォーマット */
+  unsigned int rate;					/* 標本化速度(Hz) */
+  unsigned int channels;				/* チャンネル数 */
+  long frames;						/* 総フレーム数 */
+  /* bufにframesまで読み込む: 戻り値は読んだフレーム数、0=終端、負=エラー */
+  long (*read)(PB_SOURCE *src, void *buf, long frames);
+  /* 先頭からframe番目のフレームへ移動する: 0=成功、負=エラー */
+  int (*seek)(PB_SOURCE *src, long frame);
+  void (*close)(PB_SOURCE *src);
+  void *priv;						/* 音源ごとの内部状態 */
+};
+
+/* 再生設定構造体の定義 */
+typedef struct{
+  const char *device;					/* 再生PCMデバイス名 */
+  int sink;						/* 出力方式: PB_SINK_RW, PB_SINK_MMAP, PB_SINK_DIRECT */
+  int resample;						/* 標本化速度変換設定フラグ: set=1 clear=0 */
+  int latency;						/* レイテンシ・プロファイル */
+  snd_pcm_uframes_t periodFrames;			/* 転送周期の要求値(frames): 0=プロファイルに従う */
+  unsigned int periods;					/* バッファ当りの周期数の要求値: 0=プロファイルに従う */
+  int noninterleaved;					/* 非インタリーブmmap領域: 呼出し側が転送する場合のみ */
+} PB_CONFIG;
+
+#define PB_CONFIG_INIT	{"plughw:0,0", PB_SINK_RW, 1, PB_LATENCY_THROUGHPUT, 0, 0, 0}
+
+/* 再生エンジン(ストリームごとの文脈)。内容はplayback_engine.cだけが扱う */
+typedef struct pb_engine PB_ENGINE;
+
+/*** 音源の生成 (playback_source.c) ***/
+PB_SOURCE *pb_source_open(const char *path);		/* ファイル先頭の識別子で音源を選ぶ */
+PB_SOURCE *pb_source_open_wave(const char *path);	/* LPCM WAVEを直接read */
+PB_SOURCE *pb_source_open_flac(const char *path);	/* libFLACでデコード */
+PB_SOURCE *pb_source_open_sndfile(const char *path);	/* libsndfileで読込み */
+void pb_source_close(PB_SOURCE *src);
+
+/*** 再生エンジン (playback_engine.c) ***/
+PB_ENGINE *pb_engine_open(const PB_CONFIG *config, PB_SOURCE *src);
+int pb_engine_run(PB_ENGINE *e);			/* 終端または停止要求まで再生する */
+void pb_engine_stop(PB_ENGINE *e);			/* 他スレッドから停止を要求する */
+long pb_engine_position(PB_ENGINE *e);			/* 再生済フレーム数 */
+unsigned long pb_engine_xruns(PB_ENGINE *e);		/* アンダーラン回復回数 */
+void pb_engine_print(PB_ENGINE *e, FILE *fp);		/* ALSAパラメータを表示する */
+void pb_engine_close(PB_ENGINE *e);			/* 音源は閉じない */
+
+/*** 呼出し側が転送する場合のPCM操作 (playback_engine.c) ***/
+snd_pcm_t *pb_engine_pcm(PB_ENGINE *e);			/* 構成済のPCMハンドル */
+snd_pcm_uframes_t pb_engine_period(PB_ENGINE *e);	/* 現在の転送周期(frames): 回復時に拡大されうる */
+snd_pcm_uframes_t pb_engine_buffer(PB_ENGINE *e);	/* バッファサイズ(frames) */
+int pb_engine_recover(PB_ENGINE *e, int err);		/* 転送エラーからの回復: 負=失敗 0=回復 1=転送周期を拡大 */
+
+#endif
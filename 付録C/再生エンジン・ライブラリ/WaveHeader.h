@@ -0,0 +1,267 @@
+/******************************************************
+ RIFF/RF64/BW64 WAVEヘッダの解析
+ ヘッダ・ファイル：WaveHeader.h
+ ******************************************************/
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define WAVE_HEADER_READ_BYTES	(64 * 1024)	/* 一括して読み込むヘッダ領域のバイト数 */
+#define WAVE_MAX_CHUNKS		(256)		/* 'data'を探すまでに走査するサブチャンク数の上限 */
+#define RF64_SIZE_IN_DS64	(0xffffffffu)	/* 実サイズを'ds64'に置くRF64の32bitサイズ値 */
+#define DS64_BODY_SIZE		(28)		/* 'ds64'サブチャンクの固定部のバイト数 */
+#define DS64_TABLE_ENTRY_SIZE	(12)		/* 'ds64'チャンクサイズ表の1項目のバイト数 */
+
+/* 解析したWAVEヘッダ情報構造体の定義 */
+typedef struct{
+  WAVEFORMATDESC fmt;				/* サウンド・フォーマット */
+  DWORD fmtChunkSize;				/* 'fmt 'サブチャンクサイズ */
+  int rf64;					/* RF64/BW64形式フラグ: set=1 clear=0 */
+  int truncated;				/* 'data'がファイル終端で切れているフラグ */
+  uint64_t dataBytes;				/* サウンドデータのバイト数 */
+  off_t dataOffset;				/* サウンドデータ先頭位置(bytes) */
+  long frames;					/* サウンド総フレーム数(frames) */
+  int cached;					/* 索引から得たフラグ: set=1 clear=0 */
+  char error[160];				/* 解析失敗時のエラーメッセージ */
+} WAVEHEADER;
+
+/* ヘッダ読込みバッファ構造体の定義 */
+typedef struct{
+  unsigned char *data;				/* 読込み領域(WAVE_HEADER_READ_BYTES) */
+  off_t start;					/* 読込み領域先頭のファイル位置 */
+  size_t length;				/* 読み込めたバイト数 */
+} WAVE_HEADER_BUF;
+
+/* リトル・エンディアン整数を読み出す関数の定義 */
+static inline DWORD wave_le32(const unsigned char *p)
+{
+  return (DWORD)p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24;
+}
+
+static inline uint64_t wave_le64(const unsigned char *p)
+{
+  return (uint64_t)wave_le32(p) | (uint64_t)wave_le32(p + 4) << 32;
+}
+
+/* ファイル位置posからbytesバイトを指すポインタを返す関数の定義
+   バッファ外のときだけその位置から一括で読み直す。読めなければNULL */
+static const unsigned char *wave_header_span(int fd, WAVE_HEADER_BUF *hb, off_t pos, size_t bytes)
+{
+  ssize_t n;
+
+  if (pos < hb->start || (uint64_t)(pos - hb->start) + bytes > hb->length) {
+    n = pread(fd, hb->data, WAVE_HEADER_READ_BYTES, pos);
+    hb->start = pos;
+    hb->length = n > 0 ? (size_t)n : 0;
+    if (bytes > hb->length)
+      return NULL;
+  }
+  return hb->data + (pos - hb->start);
+}
+
+/* WAVEヘッダを解析し、ファイル位置をサウンドデータ先頭に合わせる関数の定義
+   RIFF(4GBまで)とRF64/BW64('ds64'の64bitサイズ)を扱う。ヘッダは通常1回のpreadで読み、
+   サブチャンク数とファイル・サイズで走査を打ち切るので不正なファイルでも必ず終わる
+   戻り値: 0=成功、-1=失敗(理由はwh->error) */
+static int wave_parse_header(int fd, WAVEHEADER *wh)
+{
+  WAVE_HEADER_BUF hb = {NULL, 0, 0};
+  const unsigned char *p;
+  struct stat st;
+  off_t pos = 12;
+  uint64_t chunkSize, ds64DataBytes = 0, available;
+  DWORD size32, tableLength = 0, i;
+  off_t ds64Table = 0;
+  int haveDs64 = 0, haveFormat = 0, chunks, result = -1;
+  GUID SubFormat;
+  char id[4];						/* サブチャンクID */
+
+  memset(wh, 0, sizeof(*wh));
+  if (fstat(fd, &st) == -1) {
+    snprintf(wh->error, sizeof(wh->error), "ファイルエラー：%s", strerror(errno));
+    return -1;
+  }
+  if ((hb.data = (unsigned char *)malloc(WAVE_HEADER_READ_BYTES)) == NULL) {
+    snprintf(wh->error, sizeof(wh->error), "ヘッダ読込みバッファを確保できない");
+    return -1;
+  }
+
+  /* RIFF/RF64/BW64チャンクとWAVE IDを読む */
+  if ((p = wave_header_span(fd, &hb, 0, 12)) == NULL
+      || (memcmp(p, RIFF_ID, 4) != 0 && memcmp(p, RF64_ID, 4) != 0 && memcmp(p, BW64_ID, 4) != 0)) {
+    snprintf(wh->error, sizeof(wh->error), "ファイルエラー：RIFF形式でない");
+    goto cleaning;
+  }
+  wh->rf64 = memcmp(p, RIFF_ID, 4) != 0;
+  if (memcmp(p + 8, WAVE_ID, 4) != 0) {
+    snprintf(wh->error, sizeof(wh->error), "ファイルエラー：WAVEフォーマットでない");
+    goto cleaning;
+  }
+
+  /* 'ds64', 'fmt ', 'data'サブチャンクの情報を読む */
+  for (chunks = 0; chunks < WAVE_MAX_CHUNKS; chunks++) {
+    if (pos > st.st_size - 8 || (p = wave_header_span(fd, &hb, pos, 8)) == NULL) {
+      snprintf(wh->error, sizeof(wh->error), "ファイルエラー：'data'サブチャンクが無い");
+      goto cleaning;
+    }
+    memcpy(id, p, 4);
+    size32 = wave_le32(p + 4);
+    chunkSize = size32;
+    /* RF64では32bitサイズが0xffffffffのサブチャンクの実サイズを'ds64'から得る */
+    if (wh->rf64 && size32 == RF64_SIZE_IN_DS64 && haveDs64) {
+      if (memcmp(id, DATA_ID, 4) == 0)
+	chunkSize = ds64DataBytes;
+      else {
+	for (i = 0; i < tableLength; i++) {
+	  const unsigned char *e = wave_header_span(fd, &hb, ds64Table + (off_t)i * DS64_TABLE_ENTRY_SIZE,
+						    DS64_TABLE_ENTRY_SIZE);
+	  if (e != NULL && memcmp(e, id, 4) == 0) {
+	    chunkSize = wave_le64(e + 4);
+	    break;
+	  }
+	}
+      }
+    }
+    pos += 8;
+
+    if (memcmp(id, DS64_ID, 4) == 0 && wh->rf64) {
+      if (chunkSize < DS64_BODY_SIZE || (p = wave_header_span(fd, &hb, pos, DS64_BODY_SIZE)) == NULL) {
+	snprintf(wh->error, sizeof(wh->error), "ファイルエラー：'ds64'サブチャンクが短い");
+	goto cleaning;
+      }
+      ds64DataBytes = wave_le64(p + 8);
+      tableLength = wave_le32(p + 24);
+      /* チャンクサイズ表はチャンク内に収まる項目だけを使う */
+      if ((uint64_t)tableLength > (chunkSize - DS64_BODY_SIZE) / DS64_TABLE_ENTRY_SIZE)
+	tableLength = (DWORD)((chunkSize - DS64_BODY_SIZE) / DS64_TABLE_ENTRY_SIZE);
+      ds64Table = pos + DS64_BODY_SIZE;
+      haveDs64 = 1;
+    }
+    else if (memcmp(id, FMT_ID, 4) == 0) {
+      if ((chunkSize != FORMAT_CHUNK_PCM_SIZE) && (chunkSize != FORMAT_CHUNK_EX_SIZE)
+	  && (chunkSize != FORMAT_CHUNK_EXTENSIBLE_SIZE)) {
+	snprintf(wh->error, sizeof(wh->error), "チャンクサイズ ＝ %llu でWAVE規定サイズではない",
+		 (unsigned long long)chunkSize);
+	goto cleaning;
+      }
+      if ((p = wave_header_span(fd, &hb, pos, (size_t)chunkSize)) == NULL) {
+	snprintf(wh->error, sizeof(wh->error), "ファイルエラー：'fmt 'サブチャンクが短い");
+	goto cleaning;
+      }
+      /* サウンド・フォーマット情報を読み込む */
+      memcpy(&wh->fmt, p, FORMAT_CHUNK_PCM_SIZE);
+      wh->fmtChunkSize = (DWORD)chunkSize;
+      /* formatTagの値を検査する */
+      if ((wh->fmt.formatTag != WAVE_FORMAT_PCM) && (wh->fmt.formatTag != WAVE_FORMAT_EXTENSIBLE)) {
+	snprintf(wh->error, sizeof(wh->error), "フォマットコード ＝ %x でPCMフォーマットではない",
+		 wh->fmt.formatTag);
+	goto cleaning;
+      }
+      if (chunkSize == FORMAT_CHUNK_EXTENSIBLE_SIZE) {
+	memcpy(&SubFormat, p + 24, sizeof(GUID));
+	if (SubFormat.subFormatCode != WAVE_FORMAT_PCM) {
+	  snprintf(wh->error, sizeof(wh->error), "拡張サブフォマットコード ＝ %x でLPCMフォーマットではない",
+		   SubFormat.subFormatCode);
+	  goto cleaning;
+	}
+	if (memcmp(SubFormat.wave_guid_tag, WAVE_GUID_TAG, 14) != 0) {
+	  snprintf(wh->error, sizeof(wh->error), "GUIDタグがWAVE_GUID_TAGではない");
+	  goto cleaning;
+	}
+      }
+      if (wh->fmt.dataFrameSize == 0 || wh->fmt.numChannels == 0) {
+	snprintf(wh->error, sizeof(wh->error), "フレームサイズ ＝ %d, チャンネル数 ＝ %d で再生できない",
+		 wh->fmt.dataFrameSize, wh->fmt.numChannels);
+	goto cleaning;
+      }
+      haveFormat = 1;
+    }
+    else if (memcmp(id, DATA_ID, 4) == 0) {
+      if (!haveFormat) {
+	snprintf(wh->error, sizeof(wh->error), "ファイルエラー：'fmt 'サブチャンクより前に'data'サブチャンクがある");
+	goto cleaning;
+      }
+      if (wh->rf64 && size32 == RF64_SIZE_IN_DS64 && !haveDs64) {
+	snprintf(wh->error, sizeof(wh->error), "ファイルエラー：RF64形式なのに'ds64'サブチャンクが無い");
+	goto cleaning;
+      }
+      /* 書込み途中や切り詰められたファイルはファイル終端までを再生する */
+      available = (uint64_t)(st.st_size - pos);
+      if (chunkSize > available) {
+	chunkSize = available;
+	wh->truncated = 1;
+      }
+      /* サウンドデータの全フレーム数とデータ先頭位置を設定する */
+      wh->dataOffset = pos;
+      wh->dataBytes = chunkSize;
+      wh->frames = (long)(chunkSize / wh->fmt.dataFrameSize);
+      if (lseek(fd, pos, SEEK_SET) == -1) {
+	snprintf(wh->error, sizeof(wh->error), "ファイルエラー：%s", strerror(errno));
+	goto cleaning;
+      }
+      result = 0;
+      goto cleaning;
+    }
+    /* その他のサブチャンクを読み飛ばす。サブチャンクは偶数バイト境界に整列 */
+    if (chunkSize > (uint64_t)(st.st_size - pos)) {
+      snprintf(wh->error, sizeof(wh->error), "ファイルエラー：'data'サブチャンクが無い");
+      goto cleaning;
+    }
+    pos += (off_t)(chunkSize + (chunkSize & 1));
+  }
+  snprintf(wh->error, sizeof(wh->error), "ファイルエラー：サブチャンクが %d 個を超えても'data'が無い", WAVE_MAX_CHUNKS);
+
+ cleaning:
+  free(hb.data);
+  return result;
+}
+
+/* 索引キャッシュはMediaIndex.hを先に取り込んだ再生プログラム(-Iオプション)だけが使う */
+#ifdef MEDIA_INDEX_H
+/* 索引キャッシュを引いてからWAVEヘッダを解析する関数の定義
+   ヒットすればヘッダを読まずに済ませ、ミスなら解析結果を登録する。mi == NULLなら解析だけ行う
+   戻り値: 0=成功、-1=失敗(理由はwh->error) */
+static int wave_parse_header_cached(int fd, const char *path, MEDIA_INDEX *mi, WAVEHEADER *wh)
+{
+  MI_ENTRY e;
+  struct stat st;
+
+  if (mi == NULL || mi->fd < 0 || fstat(fd, &st) == -1)
+    return wave_parse_header(fd, wh);
+
+  if (mi_lookup(mi, path, &st, &e) == 0 && e.kind == MI_KIND_WAVE && e.formatBytes <= MI_FORMAT_BYTES) {
+    memset(wh, 0, sizeof(*wh));
+    memcpy(&wh->fmt, e.format, FORMAT_CHUNK_PCM_SIZE);
+    wh->fmtChunkSize = e.formatBytes;
+    wh->rf64 = (e.flags & MI_FLAG_RF64) != 0;
+    wh->dataOffset = (off_t)e.dataOffset;
+    wh->frames = (long)e.frames;
+    wh->dataBytes = e.frames * wh->fmt.dataFrameSize;
+    wh->cached = 1;
+    if (lseek(fd, wh->dataOffset, SEEK_SET) != -1)
+      return 0;
+  }
+
+  if (wave_parse_header(fd, wh) != 0)
+    return -1;
+  /* 書込み途中のファイルはサイズが変わるので登録しない */
+  if (!wh->truncated) {
+    memset(&e, 0, sizeof(e));
+    e.kind = MI_KIND_WAVE;
+    e.flags = wh->rf64 ? MI_FLAG_RF64 : 0;
+    e.rate = wh->fmt.samplesPerSec;
+    e.channels = wh->fmt.numChannels;
+    e.bits = wh->fmt.bitsPerSample;
+    e.formatBytes = wh->fmtChunkSize;
+    memcpy(e.format, &wh->fmt, FORMAT_CHUNK_PCM_SIZE);
+    e.dataOffset = (uint64_t)wh->dataOffset;
+    e.frames = (uint64_t)wh->frames;
+    mi_store(mi, path, &st, &e);
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,217 @@
+/*****************************************************************************
+ 実例プログラム：再生エンジン・ライブラリによる多重ストリーム再生プログラム
+ 		     - ストリームごとの再生エンジンをスレッドで並列実行 -
+ ソースコード：engine_player.c
+ ****************************************************************************/
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include "alsa/asoundlib.h"
+#include "PlaybackEngine.h"
+
+#define MAX_STREAMS	(16)				/* 同時再生できるストリーム数の上限 */
+#define MAX_PERIOD_FRAMES (1 << 20)			/* 転送周期の要求値(-F)の上限(frames) */
+#define MAX_PERIODS (1024)				/* バッファ当りの周期数の要求値(-B)の上限 */
+
+/* 再生ストリーム構造体の定義 */
+typedef struct{
+  const char *path;					/* 再生ファイルパス名 */
+  PB_CONFIG config;					/* 再生設定 */
+  PB_SOURCE *src;					/* 音源 */
+  PB_ENGINE *engine;					/* 再生エンジン */
+  pthread_t thread;					/* 再生スレッドID */
+  int started;						/* 再生スレッド起動済フラグ */
+  int result;						/* pb_engine_run()の戻り値 */
+} STREAM;
+
+/*** ユーティリティ関数プロトタイプ宣言 ***/
+static void *stream_thread(void *arg);
+static void stop_all(int sig);
+static int parse_count(const char *s, long min, long max, long *value);
+static void usage(void);
+
+static STREAM streams[MAX_STREAMS];			/* 再生ストリーム */
+static int numStreams = 0;				/* 再生ストリーム数 */
+
+/* 1ストリームを再生するスレッド関数の定義 */
+void *stream_thread(void *arg)
+{
+  STREAM *s = (STREAM *)arg;
+
+  s->result = pb_engine_run(s->engine);
+  return NULL;
+}
+
+/* 割込みシグナルで全ストリームに停止を要求するハンドラ関数の定義 */
+void stop_all(int sig)
+{
+  int i;
+
+  for (i = 0; i < numStreams; i++)
+    if (streams[i].engine != NULL)
+      pb_engine_stop(streams[i].engine);
+}
+
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
+
+/* 使用法を表示するユーティリティ関数の定義 */
+void usage(void)
+{
+  printf(
+	 "使用法: engine_player [オプション]... サウンドファイル[@デバイス]...\n"
+	 "-h,--help	         使用法\n"
+	 "-D,--device=デバイス名   @で指定しないファイルの再生デバイス\n"
+	 "-m,--mmap	         mmap_write転送\n"
+	 "-d,--direct              mmap_direct転送(音源からmmap領域へ直接読込み)\n"
+	 "-n,--noresample          再標本化禁止\n"
+	 "-L,--latency=プロファイル low(最小周期), balanced(10 msec周期), throughput(500 msecバッファ)\n"
+	 "-F,--period-frames=数    転送周期(frames)\n"
+	 "-B,--periods=数          バッファ当りの周期数\n"
+	 "\n"
+	 "ファイルごとに再生エンジンを作り、別スレッドで並列に再生する(最大 %d ストリーム)\n", MAX_STREAMS);
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option long_option[] =
+    {
+      {"help", 0, NULL, 'h'},
+      {"device", 1, NULL, 'D'},
+      {"mmap", 0, NULL, 'm'},
+      {"direct", 0, NULL, 'd'},
+      {"noresample", 0, NULL, 'n'},
+      {"latency", 1, NULL, 'L'},
+      {"period-frames", 1, NULL, 'F'},
+      {"periods", 1, NULL, 'B'},
+      {NULL, 0, NULL, 0},
+    };
+  PB_CONFIG config = PB_CONFIG_INIT;	/* 全ストリーム共通の再生設定 */
+  struct sigaction sa;
+  char *at;
+  int i, c, err, exit_code = 0;
+  long value;
+
+  while ((c = getopt_long(argc, argv, "hD:mdnL:F:B:", long_option, NULL)) != -1) {
+    switch (c) {
+    case 'h':
+      usage();
+      return 0;
+    case 'D':
+      config.device = strdup(optarg);
+      break;
+    case 'm':
+      config.sink = PB_SINK_MMAP;
+      break;
+    case 'd':
+      config.sink = PB_SINK_DIRECT;
+      break;
+    case 'n':
+      config.resample = 0;
+      break;
+    case 'L':
+      if (strcmp(optarg, "low") == 0)
+	config.latency = PB_LATENCY_LOW;
+      else if (strcmp(optarg, "balanced") == 0)
+	config.latency = PB_LATENCY_BALANCED;
+      else if (strcmp(optarg, "throughput") == 0)
+	config.latency = PB_LATENCY_THROUGHPUT;
+      else {
+	fprintf(stderr, "レイテンシ・プロファイルは low, balanced, throughput のいずれか\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_count(optarg, 0, MAX_PERIOD_FRAMES, &value) < 0) {
+	fprintf(stderr, "転送周期は0〜%dフレームの整数\n", MAX_PERIOD_FRAMES);
+	return EXIT_FAILURE;
+      }
+      config.periodFrames = (snd_pcm_uframes_t)value;
+      break;
+    case 'B':
+      if (parse_count(optarg, 0, MAX_PERIODS, &value) < 0) {
+	fprintf(stderr, "バッファ当りの周期数は0〜%dの整数\n", MAX_PERIODS);
+	return EXIT_FAILURE;
+      }
+      config.periods = (unsigned int)value;
+      break;
+    default:
+      fprintf(stderr, "`--help'で使用方法を確認\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind > argc - 1) {
+    usage();
+    return 0;
+  }
+  if (argc - optind > MAX_STREAMS) {
+    fprintf(stderr, "同時再生は %d ストリームまで\n", MAX_STREAMS);
+    return EXIT_FAILURE;
+  }
+
+  /* ストリームごとに音源と再生エンジンを用意する。エンジン同士は状態を共有しない */
+  for (i = optind; i < argc; i++) {
+    STREAM *s = &streams[numStreams];
+    s->path = strdup(argv[i]);
+    s->config = config;
+    if ((at = strrchr((char *)s->path, '@')) != NULL) {
+      *at = '\0';
+      s->config.device = at + 1;
+    }
+    if ((s->src = pb_source_open(s->path)) == NULL) {
+      exit_code = EXIT_FAILURE;
+      goto cleaning;
+    }
+    numStreams++;
+    if ((s->engine = pb_engine_open(&s->config, s->src)) == NULL) {
+      exit_code = EXIT_FAILURE;
+      goto cleaning;
+    }
+    printf("*** ストリーム %d: %s ***\n", numStreams - 1, s->path);
+    pb_engine_print(s->engine, stdout);
+    printf("\n");
+  }
+
+  /* Ctrl-Cで全ストリームを止める */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_all;
+  sigaction(SIGINT, &sa, NULL);
+
+  for (i = 0; i < numStreams; i++) {
+    if ((err = pthread_create(&streams[i].thread, NULL, stream_thread, &streams[i])) != 0) {
+      fprintf(stderr, "再生スレッド起動失敗: %s\n", strerror(err));
+      stop_all(0);
+      exit_code = EXIT_FAILURE;
+      break;
+    }
+    streams[i].started = 1;
+  }
+  for (i = 0; i < numStreams; i++) {
+    if (!streams[i].started)
+      continue;
+    pthread_join(streams[i].thread, NULL);
+    printf(" ストリーム %d: 合計 %ld フレームを再生して終了 (アンダーラン回復 %lu 回)%s\n", i,
+	   pb_engine_position(streams[i].engine), pb_engine_xruns(streams[i].engine),
+	   streams[i].result < 0 ? " 転送エラー" : "");
+    if (streams[i].result < 0)
+      exit_code = EXIT_FAILURE;
+  }
+
+ cleaning:
+  for (i = 0; i < numStreams; i++) {
+    pb_engine_close(streams[i].engine);
+    pb_source_close(streams[i].src);
+  }
+  snd_config_update_free_global();
+  return exit_code;
+}
@@ -0,0 +1,367 @@
+/*****************************************************************************
+ 再生エンジン・ライブラリ：音源(ソース)の実装
+ 		     - LPCM WAVE直接read, libFLAC, libsndfile -
+ ソースコード：playback_source.c
+ ****************************************************************************/
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "alsa/asoundlib.h"
+#include "FLAC/stream_decoder.h"
+#include "sndfile.h"
+#include "WaveFormat.h"
+#include "WaveHeader.h"
+#include "PlaybackEngine.h"
+
+/* WAVE音源の内部状態 */
+typedef struct{
+  int fd;						/* 再生ファイル記述子 */
+  off_t dataOffset;					/* サウンドデータ先頭位置(bytes) */
+  size_t frameBytes;					/* 1フレーム当りのバイト数 */
+  long pos;						/* 次に読むフレーム位置 */
+} WAVE_PRIV;
+
+/* FLAC音源の内部状態 */
+typedef struct{
+  FLAC__StreamDecoder *decoder;				/* ストリーム・デコーダ */
+  FLAC__int32 *buffer;					/* デコード済ブロック(32bitインタリーブ配置) */
+  unsigned int bufFrames;				/* デコード済ブロックのフレーム数 */
+  unsigned int bufPos;					/* デコード済ブロックの読出し位置 */
+  unsigned int qbits;					/* 量子化ビット数 */
+} FLAC_PRIV;
+
+/*** ユーティリティ関数プロトタイプ宣言 ***/
+static PB_SOURCE *source_alloc(const char *kind, size_t privSize);
+static long wave_read(PB_SOURCE *src, void *buf, long frames);
+static int wave_seek(PB_SOURCE *src, long frame);
+static void wave_close(PB_SOURCE *src);
+static long flac_read(PB_SOURCE *src, void *buf, long frames);
+static int flac_seek(PB_SOURCE *src, long frame);
+static void flac_close(PB_SOURCE *src);
+static long sndfile_read(PB_SOURCE *src, void *buf, long frames);
+static int sndfile_seek(PB_SOURCE *src, long frame);
+static void sndfile_close(PB_SOURCE *src);
+static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+						     const FLAC__int32 *const buffer[], void *user_data);
+static void metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *user_data);
+static void error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *user_data);
+
+/* 音源構造体と内部状態をまとめて割り当てるユーティリティ関数の定義 */
+PB_SOURCE *source_alloc(const char *kind, size_t privSize)
+{
+  PB_SOURCE *src;
+
+  if ((src = (PB_SOURCE *)calloc(1, sizeof(PB_SOURCE) + privSize)) == NULL) {
+    fprintf(stderr, "メモリ不足で音源を割当てられない\n");
+    return NULL;
+  }
+  src->kind = kind;
+  src->priv = src + 1;
+  return src;
+}
+
+/* ファイル先頭の識別子で音源を選ぶ関数の定義 */
+PB_SOURCE *pb_source_open(const char *path)
+{
+  char id[4] = {0};
+  PB_SOURCE *src = NULL;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr, "%s: 再生ファイルを開けない: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (read(fd, id, sizeof(id)) != (ssize_t)sizeof(id))
+    memset(id, 0, sizeof(id));
+  close(fd);
+  if (memcmp(id, RIFF_ID, 4) == 0 || memcmp(id, RF64_ID, 4) == 0 || memcmp(id, BW64_ID, 4) == 0)
+    src = pb_source_open_wave(path);
+  else if (memcmp(id, "fLaC", 4) == 0)
+    src = pb_source_open_flac(path);
+  /* 上記以外と、直接読めないWAVE(浮動小数点など)はlibsndfileに任せる */
+  if (src == NULL)
+    src = pb_source_open_sndfile(path);
+  return src;
+}
+
+/* 音源を閉じる関数の定義 */
+void pb_source_close(PB_SOURCE *src)
+{
+  if (src != NULL)
+    src->close(src);
+}
+
+/* LPCM WAVEファイルを直接readする音源を開く関数の定義 */
+PB_SOURCE *pb_source_open_wave(const char *path)
+{
+  PB_SOURCE *src;
+  WAVE_PRIV *p;
+  WAVEHEADER wh;
+
+  if ((src = source_alloc("WAVE", sizeof(WAVE_PRIV))) == NULL)
+    return NULL;
+  p = (WAVE_PRIV *)src->priv;
+  if ((p->fd = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr, "%s: 再生ファイルを開けない: %s\n", path, strerror(errno));
+    free(src);
+    return NULL;
+  }
+  src->read = wave_read;
+  src->seek = wave_seek;
+  src->close = wave_close;
+
+  /* RIFF, RF64/BW64ヘッダを一括読込みで解析する。解析できないものはlibsndfileに任せる */
+  if (wave_parse_header(p->fd, &wh) != 0)
+    goto not_supported;
+  p->dataOffset = wh.dataOffset;
+  p->frameBytes = wh.fmt.dataFrameSize;
+  src->frames = wh.frames;
+
+  src->rate = wh.fmt.samplesPerSec;
+  src->channels = wh.fmt.numChannels;
+  switch (wh.fmt.bitsPerSample) {
+  case 8:
+    src->format = SND_PCM_FORMAT_U8;
+    break;
+  case 16:
+    src->format = SND_PCM_FORMAT_S16_LE;
+    break;
+  case 24:
+    src->format = SND_PCM_FORMAT_S24_3LE;
+    break;
+  case 32:
+    src->format = SND_PCM_FORMAT_S32_LE;
+    break;
+  default:
+    goto not_supported;
+  }
+  return src;
+
+ not_supported:
+  wave_close(src);
+  return NULL;
+}
+
+/* WAVE音源から読み込む関数の定義: 位置指定readなので他の音源と並行しても干渉しない */
+long wave_read(PB_SOURCE *src, void *buf, long frames)
+{
+  WAVE_PRIV *p = (WAVE_PRIV *)src->priv;
+  ssize_t readBytes;
+
+  if (frames > src->frames - p->pos)
+    frames = src->frames - p->pos;
+  if (frames <= 0)
+    return 0;
+  readBytes = pread(p->fd, buf, (size_t)frames * p->frameBytes, p->dataOffset + (off_t)p->pos * p->frameBytes);
+  if (readBytes < 0)
+    return -errno;
+  frames = (long)((size_t)readBytes / p->frameBytes);
+  p->pos += frames;
+  return frames;
+}
+
+/* WAVE音源の位置を移動する関数の定義 */
+int wave_seek(PB_SOURCE *src, long frame)
+{
+  WAVE_PRIV *p = (WAVE_PRIV *)src->priv;
+
+  if (frame < 0 || frame > src->frames)
+    return -EINVAL;
+  p->pos = frame;
+  return 0;
+}
+
+/* WAVE音源を閉じる関数の定義 */
+void wave_close(PB_SOURCE *src)
+{
+  WAVE_PRIV *p = (WAVE_PRIV *)src->priv;
+
+  if (p->fd != -1)
+    close(p->fd);
+  free(src);
+}
+
+/* libFLACでデコードする音源を開く関数の定義 */
+PB_SOURCE *pb_source_open_flac(const char *path)
+{
+  PB_SOURCE *src;
+  FLAC_PRIV *p;
+  FLAC__StreamDecoderInitStatus status;
+
+  if ((src = source_alloc("FLAC", sizeof(FLAC_PRIV))) == NULL)
+    return NULL;
+  p = (FLAC_PRIV *)src->priv;
+  src->read = flac_read;
+  src->seek = flac_seek;
+  src->close = flac_close;
+  if ((p->decoder = FLAC__stream_decoder_new()) == NULL) {
+    fprintf(stderr, "FLACデコーダを割当てられない\n");
+    goto cleaning;
+  }
+  status = FLAC__stream_decoder_init_file(p->decoder, path, write_callback, metadata_callback, error_callback, src);
+  if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+    fprintf(stderr, "%s: FLACデコーダ初期化エラー: %s\n", path, FLAC__StreamDecoderInitStatusString[status]);
+    goto cleaning;
+  }
+  /* STREAMINFOから音源パラメータを得て、デコード済ブロックを割り当てる */
+  if (!FLAC__stream_decoder_process_until_end_of_metadata(p->decoder) || src->channels == 0) {
+    fprintf(stderr, "%s: FLACメタデータを読めない\n", path);
+    goto cleaning;
+  }
+  if (p->qbits < 8 || p->qbits > 32
+      || (p->buffer = (FLAC__int32 *)malloc((size_t)FLAC__MAX_BLOCK_SIZE * src->channels * sizeof(FLAC__int32))) == NULL) {
+    fprintf(stderr, "%s: FLAC音源を準備できない\n", path);
+    goto cleaning;
+  }
+  return src;
+
+ cleaning:
+  flac_close(src);
+  return NULL;
+}
+
+/* デコード済ブロックから読み出し、不足すれば次のFLACフレームをデコードする関数の定義 */
+long flac_read(PB_SOURCE *src, void *buf, long frames)
+{
+  FLAC_PRIV *p = (FLAC_PRIV *)src->priv;
+  FLAC__int32 *out = (FLAC__int32 *)buf;
+  long n, done = 0;
+
+  while (done < frames) {
+    if (p->bufPos == p->bufFrames) {
+      p->bufPos = p->bufFrames = 0;
+      if (FLAC__stream_decoder_get_state(p->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM)
+	break;
+      if (!FLAC__stream_decoder_process_single(p->decoder))
+	return done > 0 ? done : -EIO;
+      continue;
+    }
+    n = (long)(p->bufFrames - p->bufPos);
+    if (n > frames - done)
+      n = frames - done;
+    memcpy(out + (size_t)done * src->channels, p->buffer + (size_t)p->bufPos * src->channels,
+	   (size_t)n * src->channels * sizeof(FLAC__int32));
+    p->bufPos += (unsigned int)n;
+    done += n;
+  }
+  return done;
+}
+
+/* FLAC音源の位置を移動する関数の定義: 移動先を含むFLACフレームは移動先から書込みコールバックへ渡される */
+int flac_seek(PB_SOURCE *src, long frame)
+{
+  FLAC_PRIV *p = (FLAC_PRIV *)src->priv;
+
+  p->bufPos = p->bufFrames = 0;
+  if (!FLAC__stream_decoder_seek_absolute(p->decoder, (FLAC__uint64)frame)) {
+    FLAC__stream_decoder_flush(p->decoder);
+    return -EIO;
+  }
+  return 0;
+}
+
+/* FLAC音源を閉じる関数の定義 */
+void flac_close(PB_SOURCE *src)
+{
+  FLAC_PRIV *p = (FLAC_PRIV *)src->priv;
+
+  if (p->decoder != NULL) {
+    FLAC__stream_decoder_finish(p->decoder);
+    FLAC__stream_decoder_delete(p->decoder);
+  }
+  free(p->buffer);
+  free(src);
+}
+
+/* デコードしたFLACフレームを32bitインタリーブ配置でデコード済ブロックへ移すコールバック関数 */
+FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+					      const FLAC__int32 *const buffer[], void *user_data)
+{
+  PB_SOURCE *src = (PB_SOURCE *)user_data;
+  FLAC_PRIV *p = (FLAC_PRIV *)src->priv;
+  const unsigned int shift = 32 - p->qbits;
+  FLAC__int32 *out = p->buffer;
+  unsigned int i, ch;
+
+  if (frame->header.blocksize > FLAC__MAX_BLOCK_SIZE) {
+    fprintf(stderr, "FLACブロックサイズが上限を超えた (%u)\n", frame->header.blocksize);
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  }
+  for (i = 0; i < frame->header.blocksize; i++)
+    for (ch = 0; ch < src->channels; ch++)
+      *out++ = (FLAC__int32)((uint32_t)buffer[ch][i] << shift);
+  p->bufFrames = frame->header.blocksize;
+  p->bufPos = 0;
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+/* STREAMINFOから音源パラメータを取得するコールバック関数 */
+void metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *user_data)
+{
+  PB_SOURCE *src = (PB_SOURCE *)user_data;
+  FLAC_PRIV *p = (FLAC_PRIV *)src->priv;
+
+  if (metadata->type == FLAC__METADATA_TYPE_STREAMINFO) {
+    src->frames = (long)metadata->data.stream_info.total_samples;
+    src->rate = metadata->data.stream_info.sample_rate;
+    src->channels = metadata->data.stream_info.channels;
+    src->format = SND_PCM_FORMAT_S32;
+    p->qbits = metadata->data.stream_info.bits_per_sample;
+  }
+  return;
+}
+
+/* デコーダのエラーを検出するコールバック関数 */
+void error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *user_data)
+{
+  fprintf(stderr, "デコードエラーを検出: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+  return;
+}
+
+/* libsndfileで読み込む音源を開く関数の定義 */
+PB_SOURCE *pb_source_open_sndfile(const char *path)
+{
+  PB_SOURCE *src;
+  SF_INFO info;
+  SNDFILE *file;
+
+  memset(&info, 0, sizeof(info));
+  if ((file = sf_open(path, SFM_READ, &info)) == NULL) {
+    fprintf(stderr, "%s: 再生ファイル・オープン・エラー: %s\n", path, sf_strerror(NULL));
+    return NULL;
+  }
+  if ((src = source_alloc("libsndfile", 0)) == NULL) {
+    sf_close(file);
+    return NULL;
+  }
+  src->priv = file;
+  src->format = SND_PCM_FORMAT_S32;			/* sf_readf_int()は32bit整数に揃える */
+  src->rate = (unsigned int)info.samplerate;
+  src->channels = (unsigned int)info.channels;
+  src->frames = (long)info.frames;
+  src->read = sndfile_read;
+  src->seek = sndfile_seek;
+  src->close = sndfile_close;
+  return src;
+}
+
+/* libsndfile音源から読み込む関数の定義 */
+long sndfile_read(PB_SOURCE *src, void *buf, long frames)
+{
+  return (long)sf_readf_int((SNDFILE *)src->priv, (int *)buf, (sf_count_t)frames);
+}
+
+/* libsndfile音源の位置を移動する関数の定義 */
+int sndfile_seek(PB_SOURCE *src, long frame)
+{
+  return sf_seek((SNDFILE *)src->priv, (sf_count_t)frame, SEEK_SET) < 0 ? -EIO : 0;
+}
+
+/* libsndfile音源を閉じる関数の定義 */
+void sndfile_close(PB_SOURCE *src)
+{
+  sf_close((SNDFILE *)src->priv);
+  free(src);
+}
@@ -0,0 +1,250 @@
+/******************************************************
+ サウンド・ファイルのヘッダ/メタデータ索引キャッシュ
+ ヘッダ・ファイル：MediaIndex.h
+ ******************************************************/
+#ifndef MEDIA_INDEX_H
+#define MEDIA_INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/* 索引ファイルは固定長スロットのハッシュ表で、スロットiはファイル位置(i + 1) * MI_SLOT_BYTESに置く
+   (先頭スロット分はファイル・ヘッダ)。パス名のハッシュで決まる位置から連続MI_PROBEスロットを
+   1回のpreadで読んで探す。各スロットは内容のハッシュを持ち、書込み途中や破損したスロットは空扱いとする */
+#define MI_MAGIC		"MEDIAIDX"		/* 索引ファイルの識別子 */
+#define MI_VERSION		(1)			/* 索引ファイルの版数 */
+#define MI_SLOT_BYTES		(1024)			/* 1スロットのバイト数 */
+#define MI_DEFAULT_SLOTS	(1u << 18)		/* 新規作成時のスロット数(疎ファイル) */
+#define MI_PROBE		(4)			/* 1回のpreadで調べるスロット数 */
+#define MI_SEEK_POINTS		(32)			/* 保存するシークポイント数の上限 */
+#define MI_FORMAT_BYTES		(40)			/* 保存するフォーマット情報のバイト数 */
+#define MI_PATH_BYTES		(376)			/* 保存するパス名のバイト数(終端を含む) */
+
+/*** 音源の種類の定義 ***/
+enum { MI_KIND_NONE, MI_KIND_WAVE, MI_KIND_FLAC };
+
+/*** 索引項目のフラグの定義 ***/
+#define MI_FLAG_RF64		(0x0001)		/* RF64/BW64形式のWAVE */
+
+/* シークポイント構造体の定義 */
+typedef struct{
+  uint64_t sample;					/* サンプル番号 */
+  uint64_t offset;					/* dataOffsetからのバイト位置 */
+} MI_SEEKPOINT;
+
+/* 索引項目(1スロット)構造体の定義 */
+typedef struct{
+  uint64_t check;					/* 以降の内容のハッシュ: 0=空きスロット */
+  uint64_t pathHash;					/* パス名のハッシュ */
+  uint64_t dev, ino, size;				/* 登録時のデバイス番号、iノード番号、ファイル・サイズ */
+  int64_t mtimeSec, mtimeNsec;				/* 登録時の更新時刻 */
+  uint64_t dataOffset;					/* WAVE:サウンドデータ先頭位置、FLAC:最初のフレーム位置 */
+  uint64_t frames;					/* 総フレーム数 */
+  uint32_t kind;					/* 音源の種類: MI_KIND_WAVE, MI_KIND_FLAC */
+  uint32_t flags;					/* MI_FLAG_RF64など */
+  uint32_t rate;					/* 標本化速度(Hz) */
+  uint16_t channels;					/* チャンネル数 */
+  uint16_t bits;					/* 量子化ビット数 */
+  uint32_t formatBytes;					/* WAVE:'fmt 'サブチャンクサイズ */
+  uint32_t numSeekPoints;				/* シークポイント数 */
+  unsigned char format[MI_FORMAT_BYTES];		/* WAVE:'fmt 'サブチャンクの内容(先頭16バイトを使用) */
+  MI_SEEKPOINT seek[MI_SEEK_POINTS];			/* FLAC:シークポイント */
+  char path[MI_PATH_BYTES];				/* パス名 */
+} MI_ENTRY;
+
+_Static_assert(sizeof(MI_ENTRY) == MI_SLOT_BYTES, "MI_ENTRYは1スロット長");
+
+/* 索引ファイル・ヘッダ構造体の定義 */
+typedef struct{
+  char magic[8];					/* MI_MAGIC */
+  uint32_t version;					/* MI_VERSION */
+  uint32_t slotBytes;					/* MI_SLOT_BYTES */
+  uint32_t slots;					/* スロット数 */
+} MI_FILEHEADER;
+
+/* 索引キャッシュ構造体の定義 */
+typedef struct{
+  int fd;						/* 索引ファイル記述子: -1=索引を使わない */
+  int writable;						/* 登録可能フラグ: set=1 clear=0 */
+  uint32_t slots;					/* スロット数 */
+  unsigned long hits, misses, stores;			/* ヒット、ミス、登録の回数 */
+} MEDIA_INDEX;
+
+#define MEDIA_INDEX_INIT	{-1, 0, 0, 0, 0, 0}
+
+/* FNV-1aハッシュを求める関数の定義 */
+static inline uint64_t mi_hash(const void *data, size_t bytes)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 0xcbf29ce484222325ull;
+
+  while (bytes-- > 0)
+    h = (h ^ *p++) * 0x100000001b3ull;
+  return h;
+}
+
+/* 索引項目の内容ハッシュを求める関数の定義: 0は空きスロットを表すので避ける */
+static inline uint64_t mi_entry_check(const MI_ENTRY *e)
+{
+  uint64_t h = mi_hash(&e->pathHash, sizeof(MI_ENTRY) - sizeof(e->check));
+  return h != 0 ? h : 1;
+}
+
+/* 索引ファイルを開く関数の定義。無いか空のファイルなら索引として初期化する
+   既存のファイルは索引でなければ(-Iの指定誤りなど)決して書き換えず、警告を出してmi->fd = -1のまま戻る */
+static int mi_open(MEDIA_INDEX *mi, const char *path)
+{
+  MI_FILEHEADER fh;
+  struct stat st;
+  int fd;
+
+  mi->fd = -1;
+  mi->writable = 1;
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+    mi->writable = 0;
+    if ((fd = open(path, O_RDONLY)) == -1) {
+      fprintf(stderr, "警告：索引ファイル %s を開けない: %s\n", path, strerror(errno));
+      return -1;
+    }
+  }
+  flock(fd, mi->writable ? LOCK_EX : LOCK_SH);
+  if (fstat(fd, &st) == -1)
+    goto invalid;
+  if (st.st_size == 0) {
+    if (!mi->writable)
+      goto invalid;
+    /* 作成したばかりの空ファイルを疎ファイルの索引として初期化する */
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.magic, MI_MAGIC, 8);
+    fh.version = MI_VERSION;
+    fh.slotBytes = MI_SLOT_BYTES;
+    fh.slots = MI_DEFAULT_SLOTS;
+    if (ftruncate(fd, (off_t)(fh.slots + 1) * MI_SLOT_BYTES) == -1
+	|| pwrite(fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh))
+      goto invalid;
+  } else if (pread(fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) || memcmp(fh.magic, MI_MAGIC, 8) != 0
+	     || fh.version != MI_VERSION || fh.slotBytes != MI_SLOT_BYTES || fh.slots == 0
+	     || st.st_size < (off_t)(fh.slots + 1) * MI_SLOT_BYTES) {
+    fprintf(stderr, "警告：%s は索引ファイルでないか版数が違うので使わない\n", path);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return -1;
+  }
+  flock(fd, LOCK_UN);
+  mi->fd = fd;
+  mi->slots = fh.slots;
+  return 0;
+
+ invalid:
+  fprintf(stderr, "警告：索引ファイル %s を使えない\n", path);
+  flock(fd, LOCK_UN);
+  close(fd);
+  return -1;
+}
+
+/* 索引ファイルを閉じる関数の定義 */
+static void mi_close(MEDIA_INDEX *mi)
+{
+  if (mi->fd >= 0)
+    close(mi->fd);
+  mi->fd = -1;
+}
+
+/* パス名のハッシュから探索するスロット範囲を求め、1回のpreadで読み込む関数の定義
+   戻り値: 読み込めたスロット数 */
+static int mi_read_probe(MEDIA_INDEX *mi, uint64_t pathHash, MI_ENTRY probe[MI_PROBE], uint32_t *first)
+{
+  uint32_t n = MI_PROBE;
+  ssize_t got;
+
+  *first = (uint32_t)(pathHash % mi->slots);
+  if (n > mi->slots - *first)
+    n = mi->slots - *first;
+  got = pread(mi->fd, probe, (size_t)n * MI_SLOT_BYTES, (off_t)(*first + 1) * MI_SLOT_BYTES);
+  return got > 0 ? (int)(got / MI_SLOT_BYTES) : 0;
+}
+
+/* 索引項目の鍵がファイルと一致するかを調べる関数の定義 */
+static inline int mi_entry_matches(const MI_ENTRY *e, uint64_t pathHash, const char *path)
+{
+  return e->check != 0 && e->check == mi_entry_check(e) && e->pathHash == pathHash
+    && strncmp(e->path, path, MI_PATH_BYTES) == 0;
+}
+
+/* パス名で索引を引く関数の定義。サイズ、更新時刻、iノードが登録時と同じ場合だけ採用する
+   戻り値: 0=ヒット(*outに項目)、-1=ミス */
+static int mi_lookup(MEDIA_INDEX *mi, const char *path, const struct stat *st, MI_ENTRY *out)
+{
+  MI_ENTRY probe[MI_PROBE];
+  uint64_t pathHash;
+  uint32_t first;
+  int i, n;
+
+  if (mi->fd < 0 || strlen(path) >= MI_PATH_BYTES)
+    return -1;
+  pathHash = mi_hash(path, strlen(path));
+  n = mi_read_probe(mi, pathHash, probe, &first);
+  for (i = 0; i < n && probe[i].check != 0; i++) {
+    if (!mi_entry_matches(&probe[i], pathHash, path))
+      continue;
+    if (probe[i].dev != (uint64_t)st->st_dev || probe[i].ino != (uint64_t)st->st_ino
+	|| probe[i].size != (uint64_t)st->st_size || probe[i].mtimeSec != (int64_t)st->st_mtim.tv_sec
+	|| probe[i].mtimeNsec != (int64_t)st->st_mtim.tv_nsec)
+      break;						/* 登録後に更新されたファイル */
+    *out = probe[i];
+    mi->hits++;
+    return 0;
+  }
+  mi->misses++;
+  return -1;
+}
+
+/* 索引項目を登録する関数の定義。eの鍵はこの関数で設定する
+   同じパス名の項目、空きスロット、探索範囲の先頭の順に書き込む。戻り値: 0=成功、-1=失敗 */
+static int mi_store(MEDIA_INDEX *mi, const char *path, const struct stat *st, MI_ENTRY *e)
+{
+  MI_ENTRY probe[MI_PROBE];
+  uint32_t first;
+  int i, n, slot = 0, result = -1;
+
+  if (mi->fd < 0 || !mi->writable || strlen(path) >= MI_PATH_BYTES)
+    return -1;
+  memset(e->path, 0, sizeof(e->path));
+  strcpy(e->path, path);
+  e->pathHash = mi_hash(path, strlen(path));
+  e->dev = (uint64_t)st->st_dev;
+  e->ino = (uint64_t)st->st_ino;
+  e->size = (uint64_t)st->st_size;
+  e->mtimeSec = (int64_t)st->st_mtim.tv_sec;
+  e->mtimeNsec = (int64_t)st->st_mtim.tv_nsec;
+  e->check = mi_entry_check(e);
+
+  /* 他のプレーヤとの同時登録は排他する。読出し側は内容ハッシュで書込み途中を検出する */
+  flock(mi->fd, LOCK_EX);
+  n = mi_read_probe(mi, e->pathHash, probe, &first);
+  for (i = 0; i < n; i++) {
+    if (mi_entry_matches(&probe[i], e->pathHash, path))
+      break;
+  }
+  if (i == n)
+    for (i = 0; i < n; i++)
+      if (probe[i].check == 0 || probe[i].check != mi_entry_check(&probe[i]))
+	break;
+  if (i < n)
+    slot = i;
+  if (pwrite(mi->fd, e, MI_SLOT_BYTES, (off_t)(first + (uint32_t)slot + 1) * MI_SLOT_BYTES) == MI_SLOT_BYTES) {
+    mi->stores++;
+    result = 0;
+  }
+  flock(mi->fd, LOCK_UN);
+  return result;
+}
+
+#endif
@@ -0,0 +1,216 @@
+/******************************************************
+ 再生スレッドの実時間スケジューリングとメモリ固定
+ ヘッダ・ファイル：RealtimeSched.h
+ ******************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <alsa/asoundlib.h>
+
+#define RT_DEFAULT_PRIORITY	(70)			/* 優先度を省略した時の実時間優先度 */
+#define RT_STACK_PREFAULT	(256 * 1024)		/* 事前フォールトするスタックのバイト数 */
+#define RT_PAGE_SIZE		(4096)			/* 事前フォールトでページに触れる間隔 */
+
+/* 実時間設定構造体の定義 */
+typedef struct{
+  int policy;						/* スケジューリング方針: SCHED_OTHER=変更しない */
+  int priority;						/* 実時間優先度 */
+  int cpu;						/* 固定するCPU番号: -1=固定しない */
+  int lock;						/* メモリ固定フラグ: set=1 clear=0 */
+} RT_CONFIG;
+
+#define RT_CONFIG_INIT	{SCHED_OTHER, 0, -1, 0}
+
+/* スケジューリング方針の名前を返す関数の定義 */
+static inline const char *rt_policy_name(int policy)
+{
+  switch (policy) {
+  case SCHED_FIFO:
+    return "SCHED_FIFO";
+  case SCHED_RR:
+    return "SCHED_RR";
+  default:
+    return "SCHED_OTHER";
+  }
+}
+
+/* 実時間スケジューリング指定(fifo[:優先度] または rr[:優先度])を解析する関数の定義 */
+static inline int rt_parse(RT_CONFIG *rc, const char *spec)
+{
+  const char *colon = strchr(spec, ':');
+  size_t length = colon ? (size_t)(colon - spec) : strlen(spec);
+  int policy;
+
+  if (length == 4 && strncmp(spec, "fifo", 4) == 0)
+    policy = SCHED_FIFO;
+  else if (length == 2 && strncmp(spec, "rr", 2) == 0)
+    policy = SCHED_RR;
+  else
+    return -1;
+
+  rc->policy = policy;
+  rc->priority = colon ? atoi(colon + 1) : RT_DEFAULT_PRIORITY;
+  if (rc->priority < sched_get_priority_min(policy) || rc->priority > sched_get_priority_max(policy))
+    return -1;
+  return 0;
+}
+
+/* CPU番号の指定を解析する関数の定義 */
+static inline int rt_parse_cpu(RT_CONFIG *rc, const char *spec)
+{
+  char *end;
+  long cpu = strtol(spec, &end, 10);
+
+  if (end == spec || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE)
+    return -1;
+  rc->cpu = (int)cpu;
+  return 0;
+}
+
+/* 確保済みの領域の全ページに書込み、ページフォールトを再生開始前に済ませる関数の定義 */
+static inline void rt_prefault(const RT_CONFIG *rc, void *ptr, size_t bytes)
+{
+  volatile unsigned char *p = (volatile unsigned char *)ptr;
+  size_t i;
+
+  if (!rc->lock || ptr == NULL)
+    return;
+  for (i = 0; i < bytes; i += RT_PAGE_SIZE)
+    p[i] = p[i];
+  if (bytes > 0)
+    p[bytes - 1] = p[bytes - 1];
+}
+
+/* 再生スレッドが使うスタックを事前フォールトする関数の定義 */
+static inline void rt_prefault_stack(void)
+{
+  volatile unsigned char stack[RT_STACK_PREFAULT];
+  size_t i;
+
+  for (i = 0; i < sizeof(stack); i += RT_PAGE_SIZE)
+    stack[i] = 0;
+}
+
+/* mmap転送のPCMバッファを無音で満たして事前フォールトする関数の定義 */
+static inline void rt_prefault_pcm(snd_pcm_t *handle)
+{
+  snd_pcm_hw_params_t *hwparams;
+  snd_pcm_access_t access;
+  snd_pcm_format_t format;
+  unsigned int channels;
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, frames;
+  snd_pcm_sframes_t avail;
+  int err;
+
+  snd_pcm_hw_params_alloca(&hwparams);
+  if (snd_pcm_hw_params_current(handle, hwparams) < 0
+      || snd_pcm_hw_params_get_access(hwparams, &access) < 0
+      || snd_pcm_hw_params_get_format(hwparams, &format) < 0
+      || snd_pcm_hw_params_get_channels(hwparams, &channels) < 0) {
+    printf("PCMバッファ：設定を取得できないため事前フォールトなし\n");
+    return;
+  }
+  if (access != SND_PCM_ACCESS_MMAP_INTERLEAVED
+      && access != SND_PCM_ACCESS_MMAP_NONINTERLEAVED
+      && access != SND_PCM_ACCESS_MMAP_COMPLEX) {
+    printf("PCMバッファ：RW転送のためカーネル側で管理(事前フォールト不要)\n");
+    return;
+  }
+
+  /* 再生開始前の準備状態では、バッファ全体が書込み可能となっている */
+  if ((avail = snd_pcm_avail_update(handle)) < 0) {
+    printf("PCMバッファ：利用可能量を取得できないため事前フォールトなし (%s)\n", snd_strerror(avail));
+    return;
+  }
+  frames = avail;
+  if ((err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames)) < 0) {
+    printf("PCMバッファ：mmap領域を取得できないため事前フォールトなし (%s)\n", snd_strerror(err));
+    return;
+  }
+  snd_pcm_areas_silence(areas, offset, channels, frames, format);
+  /* 書込み位置は進めない */
+  snd_pcm_mmap_commit(handle, offset, 0);
+  printf("PCMバッファ：mmap領域 %lu フレームを事前フォールト\n", (unsigned long)frames);
+}
+
+/* 補助スレッドを通常スケジューリングで起動する属性を用意する関数の定義
+   実時間化した再生スレッドから起動するスレッドが、方針と優先度を継承しないようにする */
+static inline void rt_normal_attr(pthread_attr_t *attr)
+{
+  struct sched_param param;
+
+  pthread_attr_init(attr);
+  memset(&param, 0, sizeof(param));
+  pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+  pthread_attr_setschedparam(attr, &param);
+}
+
+/* 呼出しスレッドに実時間設定を適用し、得られた設定を表示する関数の定義 */
+static inline void rt_start(const RT_CONFIG *rc, snd_pcm_t *handle)
+{
+  struct sched_param param;
+  struct rlimit limit;
+  int err, priority;
+
+  if (rc->policy == SCHED_OTHER && rc->cpu < 0 && !rc->lock)
+    return;
+  printf("*** 実時間設定 ***\n");
+
+  /* CPU固定: 他の処理と同じCPUを奪い合わないようにする */
+  if (rc->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(rc->cpu, &set);
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+      printf("CPU固定　　：CPU %d に固定できないため全CPUで継続 (%s)\n", rc->cpu, strerror(err));
+    else
+      printf("CPU固定　　：CPU %d\n", rc->cpu);
+  }
+
+  /* 実時間スケジューリング: 権限不足ならRLIMIT_RTPRIOの上限で再試行し、それも駄目なら通常のまま継続する */
+  if (rc->policy != SCHED_OTHER) {
+    priority = rc->priority;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    err = pthread_setschedparam(pthread_self(), rc->policy, &param);
+    if (err == EPERM && getrlimit(RLIMIT_RTPRIO, &limit) == 0
+        && limit.rlim_cur > 0 && limit.rlim_cur < (rlim_t)priority) {
+      param.sched_priority = priority = (int)limit.rlim_cur;
+      err = pthread_setschedparam(pthread_self(), rc->policy, &param);
+    }
+    if (err != 0)
+      printf("スケジュール：%s 優先度 %d を設定できないため SCHED_OTHER で継続 (%s)\n",
+             rt_policy_name(rc->policy), rc->priority, strerror(err));
+    else if (priority != rc->priority)
+      printf("スケジュール：%s 優先度 %d (要求 %d、RLIMIT_RTPRIO で制限)\n",
+             rt_policy_name(rc->policy), priority, rc->priority);
+    else
+      printf("スケジュール：%s 優先度 %d\n", rt_policy_name(rc->policy), priority);
+  }
+
+  /* メモリ固定: 巨大なファイル写像まで読み込まないよう、フォールト時に固定する */
+  if (rc->lock) {
+#ifdef MCL_ONFAULT
+    err = mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT);
+#else
+    err = mlockall(MCL_CURRENT | MCL_FUTURE);
+#endif
+    if (err == 0)
+      printf("メモリ固定　：mlockall 成功\n");
+    else if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+      printf("メモリ固定　：mlockall 失敗、事前フォールトのみで継続 (%s, RLIMIT_MEMLOCK %lu KB)\n",
+             strerror(errno), (unsigned long)(limit.rlim_cur / 1024));
+    else
+      printf("メモリ固定　：mlockall 失敗、事前フォールトのみで継続 (%s)\n", strerror(errno));
+    rt_prefault_stack();
+    rt_prefault_pcm(handle);
+  }
+  printf("\n");
+}
@@ -0,0 +1,534 @@
+/*****************************************************************************
+ 再生エンジン・ライブラリ：PCMの構成と出力方式(シンク)
+ ソースコード：playback_engine.c
+ ****************************************************************************/
+#include <stdatomic.h>
+#include "alsa/asoundlib.h"
+#include "PlaybackEngine.h"
+
+/* 出力方式(シンク)インタフェースの定義 */
+typedef struct{
+  const char *name;					/* 転送方法名 */
+  snd_pcm_access_t access;				/* PCMアクセス方法 */
+  /* 音源から最大framesを読んでPCMへ転送する: 戻り値は再生位置を進めるフレーム数、負=エラー */
+  long (*transfer)(PB_ENGINE *e, long frames);
+} PB_SINK;
+
+/* 再生エンジン構造体の定義
+   従来の再生プログラムがファイル・スコープ変数に持っていた状態を、ストリームごとにここへ集める */
+struct pb_engine{
+  PB_CONFIG config;					/* 再生設定 */
+  PB_SOURCE *src;					/* 音源 */
+  const PB_SINK *sink;					/* 出力方式 */
+  snd_pcm_t *handle;					/* PCMハンドル */
+  snd_pcm_uframes_t buffer_size;			/* バッファサイズ(frames) */
+  snd_pcm_uframes_t period_size;			/* 転送周期(frames) */
+  snd_pcm_uframes_t req_period_frames;			/* 転送周期の要求値(frames): アンダーラン時に拡大 */
+  size_t frameBytes;					/* 1フレーム当りのバイト数 */
+  unsigned char *block;					/* write/mmap_write転送のデータブロック */
+  int toStart;						/* mmap_direct転送の明示開始フラグ */
+  int endOfSource;					/* 音源終端フラグ */
+  atomic_long position;					/* 再生済フレーム数 */
+  atomic_int stop;					/* 停止要求フラグ */
+  unsigned long xruns;					/* アンダーラン回復回数 */
+};
+
+/*** ユーティリティ関数プロトタイプ宣言 ***/
+static int set_hwparams(PB_ENGINE *e, snd_pcm_hw_params_t *hwparams);
+static int set_period_frames(PB_ENGINE *e, snd_pcm_hw_params_t *hwparams);
+static int set_swparams(PB_ENGINE *e, snd_pcm_sw_params_t *swparams);
+static int alloc_block(PB_ENGINE *e);
+static int step_up_period(PB_ENGINE *e);
+static long rw_transfer(PB_ENGINE *e, long frames,
+			snd_pcm_sframes_t (*writei_func)(snd_pcm_t *, const void *, snd_pcm_uframes_t));
+static long sink_rw_transfer(PB_ENGINE *e, long frames);
+static long sink_mmap_transfer(PB_ENGINE *e, long frames);
+static long sink_direct_transfer(PB_ENGINE *e, long frames);
+
+/* 出力方式の一覧: PB_SINK_RW, PB_SINK_MMAP, PB_SINK_DIRECT の順 */
+static const PB_SINK sinks[] = {
+  {"write", SND_PCM_ACCESS_RW_INTERLEAVED, sink_rw_transfer},
+  {"mmap_write", SND_PCM_ACCESS_MMAP_INTERLEAVED, sink_mmap_transfer},
+  {"mmap_direct", SND_PCM_ACCESS_MMAP_INTERLEAVED, sink_direct_transfer},
+};
+
+/* PCMにHWパラメータを設定するユーティリティ関数の定義 */
+int set_hwparams(PB_ENGINE *e, snd_pcm_hw_params_t *hwparams)
+{
+  const PB_SOURCE *src = e->src;
+  unsigned int rateNear, buffer_time, period_time;
+  int err, dir = 0;
+
+  /* PCMに対する全構成空間のパラメータを充填する */
+  err = snd_pcm_hw_params_any(e->handle, hwparams);
+  if (err < 0) {
+    fprintf(stderr, "ハードウェア構成破綻: 適用できるハードウェア構成が無い: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を実際のハードウェア標本化速度のみを包含するように制限する */
+  err = snd_pcm_hw_params_set_rate_resample(e->handle, hwparams, e->config.resample);
+  if (err < 0) {
+    fprintf(stderr, "再標本化の設定失敗: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を出力方式のアクセス方法のみを包含するように制限する */
+  err = snd_pcm_hw_params_set_access(e->handle, hwparams,
+				     e->config.noninterleaved ? SND_PCM_ACCESS_MMAP_NONINTERLEAVED : e->sink->access);
+  if (err < 0) {
+    fprintf(stderr, "アクセスタイプ非適用: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を音源のフォーマットのみを包含するように制限する */
+  err = snd_pcm_hw_params_set_format(e->handle, hwparams, src->format);
+  if (err < 0) {
+    fprintf(stderr, "サンプルフォーマット %s 非適用: %s\n", snd_pcm_format_name(src->format), snd_strerror(err));
+    fprintf(stderr, "適用可能フォーマット:\n");
+    for (int fmt = 0; fmt <= SND_PCM_FORMAT_LAST; fmt++) {
+      if (snd_pcm_hw_params_test_format(e->handle, hwparams, (snd_pcm_format_t)fmt) == 0)
+	fprintf(stderr, "- %s\n", snd_pcm_format_name((snd_pcm_format_t)fmt));
+    }
+    return err;
+  }
+  /* 構成空間を唯一のチャンネル数を包含するように制限する */
+  err = snd_pcm_hw_params_set_channels(e->handle, hwparams, src->channels);
+  if (err < 0) {
+    fprintf(stderr, "チャンネル数 (%u) は非適用: %s\n", src->channels, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を標本化速度要求値に最も近い値に制限する */
+  rateNear = src->rate;
+  err = snd_pcm_hw_params_set_rate_near(e->handle, hwparams, &rateNear, 0);
+  if (err < 0) {
+    fprintf(stderr, "標本化速度 %uHz は非適用: %s\n", src->rate, snd_strerror(err));
+    return err;
+  }
+  if (rateNear != src->rate) {
+    fprintf(stderr, "標本化速度が整合しない (要求値 %uHz, 取得値 %uHz)\n", src->rate, rateNear);
+    return -EINVAL;
+  }
+
+  if (e->config.latency == PB_LATENCY_THROUGHPUT && e->req_period_frames == 0 && e->config.periods == 0) {
+    /* 構成空間からbuffer_timeの最大値を抽出し、500 msecを上限に4周期へ分割する(throughput) */
+    err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir);
+    if (buffer_time > 500000)
+      buffer_time = 500000;
+    if (buffer_time == 0) {
+      fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
+      return -EINVAL;
+    }
+    period_time = buffer_time / 4;
+    err = snd_pcm_hw_params_set_buffer_time_near(e->handle, hwparams, &buffer_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "buffer time設定不可 %u : %s\n", buffer_time, snd_strerror(err));
+      return err;
+    }
+    err = snd_pcm_hw_params_set_period_time_near(e->handle, hwparams, &period_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "period time設定不可 %u : %s\n", period_time, snd_strerror(err));
+      return err;
+    }
+  } else if ((err = set_period_frames(e, hwparams)) < 0)
+    return err;
+
+  /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
+  err = snd_pcm_hw_params(e->handle, hwparams);
+  if (err < 0) {
+    fprintf(stderr, "ハードウェアパラメータ設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* 構成空間からbuffer_sizeとperiod_sizeを取得する */
+  err = snd_pcm_hw_params_get_buffer_size(hwparams, &e->buffer_size);
+  if (err < 0) {
+    fprintf(stderr, "buffer size取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  err = snd_pcm_hw_params_get_period_size(hwparams, &e->period_size, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
+/* レイテンシ・プロファイルに従い転送周期と周期数をフレーム単位で折衝するユーティリティ関数の定義 */
+int set_period_frames(PB_ENGINE *e, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_uframes_t periodFrames, periodMin;
+  unsigned int periods;
+  int err, dir = 0;
+
+  /* 構成空間から転送周期の最小値を抽出する */
+  err = snd_pcm_hw_params_get_period_size_min(hwparams, &periodMin, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size最小値取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  switch (e->config.latency) {
+  case PB_LATENCY_LOW:		/* デバイスが許容する最小の転送周期を3周期 */
+    periodFrames = periodMin;
+    periods = 3;
+    break;
+  case PB_LATENCY_BALANCED:	/* 10 msecの転送周期を4周期 */
+    periodFrames = e->src->rate / 100;
+    periods = 4;
+    break;
+  default:			/* 125 msecの転送周期を4周期 */
+    periodFrames = e->src->rate / 8;
+    periods = 4;
+    break;
+  }
+  if (e->req_period_frames > 0)
+    periodFrames = e->req_period_frames;
+  if (e->config.periods > 0)
+    periods = e->config.periods;
+  if (periodFrames < periodMin)
+    periodFrames = periodMin;
+
+  /* 構成空間をperiod_size要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_period_size_near(e->handle, hwparams, &periodFrames, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size設定不可 %lu : %s\n", periodFrames, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を周期数要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_periods_near(e->handle, hwparams, &periods, &dir);
+  if (err < 0) {
+    fprintf(stderr, "periods設定不可 %u : %s\n", periods, snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
+/* PCMにSWパラメータを設定するユーティリティ関数の定義 */
+int set_swparams(PB_ENGINE *e, snd_pcm_sw_params_t *swparams)
+{
+  int err;
+
+  /* PCMに対する現在のソフトウェア構成を戻す */
+  err = snd_pcm_sw_params_current(e->handle, swparams);
+  if (err < 0) {
+    fprintf(stderr, "現在のソフトウェアパラメータ確定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* バッファが殆ど満杯となる再生開始閾値(frames)を設定する */
+  err = snd_pcm_sw_params_set_start_threshold(e->handle, swparams, (e->buffer_size / e->period_size) * e->period_size);
+  if (err < 0) {
+    fprintf(stderr, "再生開始閾値モード設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* PCMデバイスが再生可能とみなす最小のフレームサイズを設定する */
+  err = snd_pcm_sw_params_set_avail_min(e->handle, swparams, e->period_size);
+  if (err < 0) {
+    fprintf(stderr, "avail min設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* ソフトウェアパラメータを再生デバイスに書き込む */
+  err = snd_pcm_sw_params(e->handle, swparams);
+  if (err < 0) {
+    fprintf(stderr, "ソフトウェアパラメータ設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
+/* 現在の転送周期でデータブロックを割り当てるユーティリティ関数の定義(mmap_directと呼出し側の転送は不要) */
+int alloc_block(PB_ENGINE *e)
+{
+  if (e->sink == &sinks[PB_SINK_DIRECT] || e->src->read == NULL)
+    return 0;
+  free(e->block);
+  if ((e->block = (unsigned char *)malloc(e->period_size * e->frameBytes)) == NULL) {
+    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+/* アンダーラン発生時に転送周期を2倍に拡大してPCMを再構成するユーティリティ関数の定義 */
+int step_up_period(PB_ENGINE *e)
+{
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
+  snd_pcm_uframes_t oldPeriod = e->period_size;
+  int err;
+
+  /* 既定のthroughputプロファイル、または周期が125 msecに達していれば拡大しない */
+  if ((e->config.latency == PB_LATENCY_THROUGHPUT && e->req_period_frames == 0 && e->config.periods == 0)
+      || e->period_size * 2 > e->src->rate / 8)
+    return 0;
+  snd_pcm_hw_params_alloca(&hwparams);
+  snd_pcm_sw_params_alloca(&swparams);
+
+  snd_pcm_drop(e->handle);
+  e->req_period_frames = e->period_size * 2;
+  if ((err = set_hwparams(e, hwparams)) < 0)
+    return err;
+  if ((err = set_swparams(e, swparams)) < 0)
+    return err;
+  if ((err = alloc_block(e)) < 0)
+    return err;
+  printf("%s: アンダーラン検出: 転送周期を %lu → %lu フレームに拡大\n", e->config.device, oldPeriod, e->period_size);
+  return 1;
+}
+
+/* 転送エラーから回復し、必要なら転送周期を拡大する関数の定義 */
+int pb_engine_recover(PB_ENGINE *e, int err)
+{
+  if ((err = snd_pcm_recover(e->handle, err, 0)) < 0)
+    return err;
+  e->xruns++;
+  e->toStart = 1;
+  return step_up_period(e);
+}
+
+/* 1データブロックを読み、writei系関数でPCMへ書き込むユーティリティ関数の定義 */
+long rw_transfer(PB_ENGINE *e, long frames,
+		 snd_pcm_sframes_t (*writei_func)(snd_pcm_t *, const void *, snd_pcm_uframes_t))
+{
+  unsigned char *bufPtr = e->block;
+  long readFrames, frameCount;
+  snd_pcm_sframes_t written;
+  int err;
+
+  readFrames = e->src->read(e->src, e->block, frames);
+  if (readFrames < 0) {
+    fprintf(stderr, "音源読込みエラー: %s\n", strerror((int)-readFrames));
+    return readFrames;
+  }
+  if (readFrames < frames)
+    e->endOfSource = 1;
+  frameCount = readFrames;
+  while (frameCount > 0) {
+    written = writei_func(e->handle, bufPtr, (snd_pcm_uframes_t)frameCount);
+    if (written == -EAGAIN)
+      continue;
+    if (written < 0) {
+      if ((err = pb_engine_recover(e, (int)written)) < 0) {
+	fprintf(stderr, "Write転送エラー: %s\n", snd_strerror(err));
+	return err;
+      }
+      break;			/* １データブロック周期をスキップ */
+    }
+    bufPtr += written * e->frameBytes;
+    frameCount -= written;
+  }
+  return readFrames;
+}
+
+/* write転送の出力関数の定義 */
+long sink_rw_transfer(PB_ENGINE *e, long frames)
+{
+  return rw_transfer(e, frames, snd_pcm_writei);
+}
+
+/* mmap_write転送の出力関数の定義 */
+long sink_mmap_transfer(PB_ENGINE *e, long frames)
+{
+  return rw_transfer(e, frames, snd_pcm_mmap_writei);
+}
+
+/* mmap_direct転送の出力関数の定義: 音源からmmap領域へ直接読み込み、中間のデータブロックを持たない */
+long sink_direct_transfer(PB_ENGINE *e, long frames)
+{
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, contiguous;
+  snd_pcm_sframes_t avail, committed;
+  long readFrames, done = 0;
+  int err;
+
+  /* 再生用に書き込み可能なフレーム数を取得する */
+  avail = snd_pcm_avail_update(e->handle);
+  if (avail < 0) {
+    if ((err = pb_engine_recover(e, (int)avail)) < 0) {
+      fprintf(stderr, "書き込み可能フレーム取得失敗: %s\n", snd_strerror(err));
+      return err;
+    }
+    return 0;
+  }
+  if (avail < frames) {
+    if (e->toStart) {
+      e->toStart = 0;
+      if ((err = snd_pcm_start(e->handle)) < 0) {	/* バッファが満ちたらPCMを明示的に開始 */
+	fprintf(stderr, "PCM開始エラー: %s\n", snd_strerror(err));
+	return err;
+      }
+    } else if ((err = snd_pcm_wait(e->handle, -1)) < 0 && (err = pb_engine_recover(e, err)) < 0) {
+      fprintf(stderr, "PCM待機エラー: %s\n", snd_strerror(err));
+      return err;
+    }
+    return 0;
+  }
+
+  /* リングバッファ終端で折り返す場合はmmap_begin/commitを2回に分割する */
+  while (done < frames) {
+    contiguous = (snd_pcm_uframes_t)(frames - done);
+    if ((err = snd_pcm_mmap_begin(e->handle, &areas, &offset, &contiguous)) < 0) {
+      if ((err = pb_engine_recover(e, err)) < 0) {
+	fprintf(stderr, "mmap領域アクセス失敗: %s\n", snd_strerror(err));
+	return err;
+      }
+      break;
+    }
+    readFrames = e->src->read(e->src, (unsigned char *)areas[0].addr + areas[0].first / 8 + offset * e->frameBytes,
+			      (long)contiguous);
+    if (readFrames < 0) {
+      snd_pcm_mmap_commit(e->handle, offset, 0);
+      fprintf(stderr, "音源読込みエラー: %s\n", strerror((int)-readFrames));
+      return readFrames;
+    }
+    committed = snd_pcm_mmap_commit(e->handle, offset, (snd_pcm_uframes_t)readFrames);
+    if (committed > 0)
+      done += committed;
+    if (committed < 0 || committed != readFrames) {
+      /* コミットされなかったフレームは音源を戻して次回読み直す */
+      if (e->src->seek != NULL)
+	e->src->seek(e->src, atomic_load(&e->position) + done);
+      if ((err = pb_engine_recover(e, committed < 0 ? (int)committed : -EPIPE)) < 0) {
+	fprintf(stderr, "mmap領域コミットエラー: %s\n", snd_strerror(err));
+	return err;
+      }
+      break;
+    }
+    if (readFrames < (long)contiguous) {
+      e->endOfSource = 1;
+      break;
+    }
+  }
+  return done;
+}
+
+/* 再生エンジンを生成し、音源に合わせてPCMを構成する関数の定義 */
+PB_ENGINE *pb_engine_open(const PB_CONFIG *config, PB_SOURCE *src)
+{
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
+  PB_ENGINE *e;
+  int err;
+
+  if (config->sink < PB_SINK_RW || config->sink > PB_SINK_DIRECT) {
+    fprintf(stderr, "出力方式 %d は未定義\n", config->sink);
+    return NULL;
+  }
+  /* エンジンのシンクはインタリーブ配置だけを書くので、非インタリーブは呼出し側のmmap転送に限る */
+  if (config->noninterleaved && (config->sink == PB_SINK_RW || src->read != NULL)) {
+    fprintf(stderr, "非インタリーブ配置は呼出し側がmmap転送する場合のみ\n");
+    return NULL;
+  }
+  if ((e = (PB_ENGINE *)calloc(1, sizeof(PB_ENGINE))) == NULL) {
+    fprintf(stderr, "メモリ不足で再生エンジンを割当てられない\n");
+    return NULL;
+  }
+  snd_pcm_hw_params_alloca(&hwparams);
+  snd_pcm_sw_params_alloca(&swparams);
+  e->config = *config;
+  e->src = src;
+  e->sink = &sinks[config->sink];
+  e->req_period_frames = config->periodFrames;
+  e->frameBytes = (size_t)snd_pcm_format_physical_width(src->format) / 8 * src->channels;
+  e->toStart = 1;
+  atomic_init(&e->position, 0);
+  atomic_init(&e->stop, 0);
+
+  /* PCMをBlockモードでオープンする */
+  if ((err = snd_pcm_open(&e->handle, config->device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+    fprintf(stderr, "%s: PCMオープンエラー: %s\n", config->device, snd_strerror(err));
+    goto cleaning;
+  }
+  if ((err = set_hwparams(e, hwparams)) < 0) {
+    fprintf(stderr, "%s: hwparamsの設定失敗: %s\n", config->device, snd_strerror(err));
+    goto cleaning;
+  }
+  if ((err = set_swparams(e, swparams)) < 0) {
+    fprintf(stderr, "%s: swparamsの設定失敗: %s\n", config->device, snd_strerror(err));
+    goto cleaning;
+  }
+  if (alloc_block(e) < 0)
+    goto cleaning;
+  return e;
+
+ cleaning:
+  pb_engine_close(e);
+  return NULL;
+}
+
+/* 音源の終端または停止要求まで再生する関数の定義 */
+int pb_engine_run(PB_ENGINE *e)
+{
+  long n;
+
+  if (e->src->read == NULL)
+    return -EINVAL;			/* 転送は呼出し側が行う音源 */
+  while (!e->endOfSource && !atomic_load(&e->stop)) {
+    if ((n = e->sink->transfer(e, (long)e->period_size)) < 0)
+      return (int)n;
+    atomic_fetch_add(&e->position, n);
+  }
+  /* 停止要求なら即座に破棄し、終端なら残りを再生し切る */
+  if (atomic_load(&e->stop))
+    snd_pcm_drop(e->handle);
+  else
+    snd_pcm_drain(e->handle);
+  return 0;
+}
+
+/* 他スレッドやシグナル・ハンドラから停止を要求する関数の定義 */
+void pb_engine_stop(PB_ENGINE *e)
+{
+  atomic_store(&e->stop, 1);
+}
+
+/* 再生済フレーム数を返す関数の定義 */
+long pb_engine_position(PB_ENGINE *e)
+{
+  return atomic_load(&e->position);
+}
+
+/* アンダーラン回復回数を返す関数の定義 */
+unsigned long pb_engine_xruns(PB_ENGINE *e)
+{
+  return e->xruns;
+}
+
+/* 構成済のPCMハンドルを返す関数の定義 */
+snd_pcm_t *pb_engine_pcm(PB_ENGINE *e)
+{
+  return e->handle;
+}
+
+/* 現在の転送周期を返す関数の定義 */
+snd_pcm_uframes_t pb_engine_period(PB_ENGINE *e)
+{
+  return e->period_size;
+}
+
+/* バッファサイズを返す関数の定義 */
+snd_pcm_uframes_t pb_engine_buffer(PB_ENGINE *e)
+{
+  return e->buffer_size;
+}
+
+/* ALSAパラメータ情報を表示する関数の定義 */
+void pb_engine_print(PB_ENGINE *e, FILE *fp)
+{
+  fprintf(fp, "PCMデバイス：%s\n", e->config.device);
+  fprintf(fp, "音源：%s (%s, %uHz, %uチャンネル, %ld フレーム)\n", e->src->kind,
+	  snd_pcm_format_name(e->src->format), e->src->rate, e->src->channels, e->src->frames);
+  fprintf(fp, "転送方法: %s\n", e->sink->name);
+  fprintf(fp, "バッファサイズ：%lu フレーム (%.1f msec)\n", e->buffer_size,
+	  1000.0 * (double)e->buffer_size / (double)e->src->rate);
+  fprintf(fp, "転送周期：%lu フレーム (%.1f msec)\n", e->period_size,
+	  1000.0 * (double)e->period_size / (double)e->src->rate);
+}
+
+/* 再生エンジンを破棄する関数の定義 */
+void pb_engine_close(PB_ENGINE *e)
+{
+  if (e == NULL)
+    return;
+  if (e->handle != NULL)
+    snd_pcm_close(e->handle);
+  free(e->block);
+  free(e);
+}
@@ -4,258 +4,123 @@
  ソースコード：wave_rw_player_uchar.c
  ****************************************************************************/
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE			/* CPU固定(pthread_setaffinity_np)に必要 */
 
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "alsa/asoundlib.h"
+#include "PlaybackEngine.h"
 #include "WaveFormat.h"
+#include "MediaIndex.h"
+#include "WaveHeader.h"
+#include "PeriodStats.h"
+#include "RealtimeSched.h"
+#include "UringReader.h"
 
 /*** ユーティリティ関数プロトタイプ宣言 ***/
-static int wave_read_header(void);
-static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams);
+static int wave_read_header(const char *path);
 static int write_uchar(snd_pcm_t *handle);
+static void *prefetch_reader(void *arg);
+static long ring_acquire(unsigned char **block);
+static void ring_release(void);
+static void ring_sleep(void);
+static int parse_count(const char *s, long min, long max, long *value);
 static void usage(void);
 static snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
 
 /*** ALSAライブラリのパラメータ初期化 ***/
-static char *device = "plughw:0,0";			/* 再生PCMデバイス名 */
 static snd_pcm_format_t format = SND_PCM_FORMAT_S32_LE;	/* サンプル・フォーマット */
 static unsigned int rate = 44100;			/* 標本化速度(Hz) */
 static unsigned int numChannels = 1;			/* チャンネル数 */
-static unsigned int buffer_time = 0;			/* バッファ時間長(μsec) */
-static unsigned int period_time = 0;			/* 転送周期時間長(μsec) */
-static snd_pcm_uframes_t buffer_size = 0;		/* バッファサイズ(符号無しフレーム数) */
-static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(符号無しフレーム数) */
+static snd_pcm_uframes_t buffer_size = 0;		/* バッファサイズ(符号無しフレーム数): 再生エンジンから取得 */
+static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(符号無しフレーム数): 再生エンジンから取得 */
 static snd_output_t *output = NULL;			/* 出力オブジェクトに 対するALSA内部構造体へのハンドル */
 
+/*** 再生エンジン(PlaybackEngine.h)の宣言: PCMの構成とアンダーラン回復を委ねる ***/
+static PB_CONFIG config = PB_CONFIG_INIT;		/* 再生設定 */
+static PB_ENGINE *engine = NULL;			/* 再生エンジン */
+#define MAX_PERIOD_FRAMES (1 << 20)			/* 転送周期の要求値(-F)の上限(frames) */
+#define MAX_PERIODS (1024)				/* バッファ当りの周期数の要求値(-B)の上限 */
+
 /*** アプリケーション制御フラグの初期化 ***/
-static int mmap = 0;					/* 転送方法制御フラグ: write=0, mmap write=1  */
+static int mmap_access = 0;				/* 転送方法制御フラグ: write=0, mmap write=1  */
+static int filemap = 0;					/* ファイル入力方法制御フラグ: read=0, ファイルマップ=1 */
+#define READAHEAD_PERIODS (8)				/* ファイルマップ時に先読みを要求するデータブロック数 */
+static unsigned int prefetch = 0;			/* 先読みデータブロック数: 0=読込みスレッド無し */
+#define MAX_PREFETCH (256)				/* 先読みデータブロック数(-p)の上限 */
+static int uring = 0;					/* io_uring入力フラグ: set=1 clear=0 */
 static int verbose = 0;					/* 詳細情報表示フラグ: set=1 clear=0 */
-static int resample = 1;				/* 標本化速度変換設定フラグ: set=1 clear=0 */
+static PERIOD_STATS stats;				/* 転送周期統計: stats.enabled=1で計測 */
+static const char *statsJson = NULL;			/* 転送周期統計のJSON出力先: NULL=出力しない */
+static RT_CONFIG rt = RT_CONFIG_INIT;			/* 再生スレッドの実時間設定 */
+static MEDIA_INDEX mindex = MEDIA_INDEX_INIT;		/* ヘッダ索引キャッシュ: fd=-1で使わない */
                                                                               
 /*** ユーザデータの宣言 ***/
 static WAVEFORMATDESC fmtdesc;
 static WAVEFILEDESC filedesc;
 
-/* 再生ファイルからWAVEヘッダのデータを読み込むユーティリティ関数の定義 */
-int wave_read_header(void)
-{
-  FOURCC chunkID;
-  DWORD chunkSize;
-  GUID SubFormat;
-    
-  lseek(filedesc.fd, 0, SEEK_SET); 	/* ファイル先頭にrewind */
-  /* RIFFチャンクを読む */ 
-  read(filedesc.fd, &chunkID, sizeof(FOURCC));
-  read(filedesc.fd, &chunkSize, sizeof(DWORD));
-  if(chunkID != *(FOURCC *)RIFF_ID) {
-    fprintf(stderr, "ファイルエラー：RIFF形式でない\n");
-    return EXIT_FAILURE;
-  }
- 
-  /* WAVE IDを読む */  
-  read(filedesc.fd, &chunkID, sizeof(FOURCC));
-  if(chunkID != *(FOURCC *)WAVE_ID) {
-    fprintf(stderr, "ファイルエラー：WAVEフォーマットでない\n");
-    return EXIT_FAILURE; 
-  }
-    
-  /* 'fmt 'サブチャンク、'data'サブチャンクの情報を読む */
-  while(1){
-    read(filedesc.fd, &chunkID, sizeof(FOURCC));
-    read(filedesc.fd, &chunkSize, sizeof(DWORD));
-    if (chunkID == *(FOURCC *)FMT_ID) {
-      if((chunkSize != FORMAT_CHUNK_PCM_SIZE)  && (chunkSize != FORMAT_CHUNK_EX_SIZE)
-	 && (chunkSize != FORMAT_CHUNK_EXTENSIBLE_SIZE)) {
-	fprintf(stderr, "チャンクサイズ ＝ %d でWAVE規定サイズではない\n", chunkSize);
-	return EXIT_FAILURE; 
-      } 
-    	    			
-      /* サウンド・フォーマット情報を読み込む */ 
-      read(filedesc.fd, &fmtdesc, FORMAT_CHUNK_PCM_SIZE);          
-      /* formatTagの値を検査する */
-      if ((fmtdesc.formatTag != WAVE_FORMAT_PCM) && (fmtdesc.formatTag != WAVE_FORMAT_EXTENSIBLE)) {
-	fprintf(stderr, "フォマットコード ＝ %x でPCMフォーマットではない\n", fmtdesc.formatTag);
-	return EXIT_FAILURE; 
-      }
-	    
-      /* WAVEフォーマット区分単位で処理 */
-      switch(chunkSize){
-      case FORMAT_CHUNK_EXTENSIBLE_SIZE:
-	lseek(filedesc.fd, 8, SEEK_CUR);
-        read(filedesc.fd, &SubFormat, sizeof(GUID));
-	if ( SubFormat.subFormatCode != WAVE_FORMAT_PCM){
-	  fprintf(stderr, "拡張サブフォマットコード ＝ %x でLPCMフォーマットではない\n",  SubFormat.subFormatCode);
-	  return EXIT_FAILURE;
-	}
-	else if (memcmp(SubFormat.wave_guid_tag, WAVE_GUID_TAG, 14) != 0){
-	  fprintf(stderr, "GUIDタグ ＝ %x でWAVE_GUID_TAGではない\n",  (unsigned int)SubFormat.wave_guid_tag);	
-	  return EXIT_FAILURE; 
-	}
-	else{
-	  printf("チャンクサイズ　＝　%d で WAVEFORMATEXTENSIBLE 形式のLPCM\n", chunkSize);
-	}
-	break;
-      case FORMAT_CHUNK_EX_SIZE:
-	lseek(filedesc.fd, 2, SEEK_CUR);
-	printf("チャンクサイズ　＝　%d で WAVEFORMATEX 形式のLPCM\n", chunkSize);
-	break;
-      default:
-	printf("チャンクサイズ　＝　%d で 標準WAVE形式のLPCM\n", chunkSize);
-	break;
-      }
-    }
-    else if (chunkID == *(FOURCC *)DATA_ID){
-      /* サウンドデータの全フレーム数を設定する */          
-      filedesc.frameSize = (long)chunkSize / (long)fmtdesc.dataFrameSize;
-      break;
-    }
-    else{ /* その他のサブチャンクを読み飛ばす */        
-      lseek(filedesc.fd, (off_t)chunkSize, SEEK_CUR);
-    }                                                
-  }
-  return 0;
-}
-
-/* PCMにHWパラメータを設定するユーティリティ関数の定義 */
-int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
-{
-  unsigned int rateNear;
-  int err, dir;
+/*** 先読みリングバッファ(単一生産者・単一消費者)の定義 ***/
+typedef struct{
+  unsigned char *blocks;				/* データブロック配列(depth個) */
+  long *frames;						/* 各データブロックの有効フレーム数 */
+  unsigned int depth;					/* データブロック数(先読み深さ) */
+  long blockFrames;					/* データブロック当りのフレーム数(起動時に固定) */
+  size_t blockBytes;					/* データブロック当りのバイト数 */
+  long numFrames;					/* 読み込むサウンド総フレーム数 */
+  atomic_uint head;					/* 書込み位置: 読込みスレッドのみ更新 */
+  atomic_uint tail;					/* 読出し位置: 再生スレッドのみ更新 */
+  atomic_int done;					/* 読込み終了フラグ */
+  atomic_int quit;					/* 読込み中止要求フラグ */
+  unsigned long underruns;				/* 再生スレッドが空のリングを待った回数 */
+  unsigned long fillSum, fillCount;			/* 充填データブロック数の累計、計測回数 */
+  unsigned int fillMin;					/* 充填データブロック数の最小値 */
+} READ_RING;
 
-  /* PCMに対する全構成空間のパラメータを充填する */
-  err = snd_pcm_hw_params_any(handle, hwparams);
-  if (err < 0) {
-    fprintf(stderr, "ハードウェア構成破綻: 適用できるハードウェア構成が無い: %s\n", snd_strerror(err));
-    return err;
-  }
-  /* 構成空間を実際のハードウェア標本化速度のみを包含するように制限する */
-  err = snd_pcm_hw_params_set_rate_resample(handle, hwparams, resample);
-  if (err < 0) {
-    fprintf(stderr, "再標本化の設定失敗: %s\n", snd_strerror(err));
-    return err;
-  }
-  /* 構成空間を実際のアクセス方法のみを包含するように制限する */
-  if (mmap) {
-    err = snd_pcm_hw_params_set_access(handle, hwparams,
-				       SND_PCM_ACCESS_MMAP_INTERLEAVED);
-  } else
-    err = snd_pcm_hw_params_set_access(handle, hwparams,
-				       SND_PCM_ACCESS_RW_INTERLEAVED);
-  if (err < 0) {
-    fprintf(stderr, "アクセスタイプ非適用: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間を唯一のフォーマットを包含するように制限する */
-  err = snd_pcm_hw_params_set_format(handle, hwparams, format);
-  if (err < 0) {
-    fprintf(stderr, "サンプルフォーマット非適用: %s\n", snd_strerror(err));
-    fprintf(stderr, "適用可能フォーマット:\n");
-    for (int fmt = 0; fmt <= SND_PCM_FORMAT_LAST; fmt++) {
-      if (snd_pcm_hw_params_test_format(handle, hwparams, (snd_pcm_format_t)fmt) == 0)
-	fprintf(stderr, "- %s\n", snd_pcm_format_name((snd_pcm_format_t)fmt));
-    }
-    return err;
-  }
-	
-  /* 構成空間を唯一のチャンネル数を包含するように制限する */
-  err = snd_pcm_hw_params_set_channels(handle, hwparams, numChannels);
-  if (err < 0) {
-    fprintf(stderr, "チャンネル数 (%i) は非適用: %s\n", numChannels, snd_strerror(err));
-    return err;
-  }
-  /* 構成空間を標本化速度要求値に最も近い値に制限する */
-  rateNear = rate;
-  err = snd_pcm_hw_params_set_rate_near(handle, hwparams, &rateNear, 0);
-  if (err < 0) {
-    fprintf(stderr, "標本化速度 %iHz は非適用: %s\n", rate, snd_strerror(err));
-    return err;
-  }
-  if (rateNear != rate) {
-    fprintf(stderr, "標本化速度が整合しない (要求値 %iHz, 取得値 %iHz)\n", rate, rateNear);
-    return -EINVAL;
-  }
+static READ_RING ring;
+static pthread_t reader_thread;				/* 読込みスレッドID */
 
-  /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する */
-  err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
-  if (buffer_time > 500000)
-    buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
-  if (buffer_time > 0)
-    period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
-  else{
-    fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
-    return -EINVAL;
-  }
-		
-  /* 構成空間をbuffer_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間をperiod_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
-    return err;
-  }
-        
-  /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
-  err = snd_pcm_hw_params(handle, hwparams);
-  if (err < 0) {
-    fprintf(stderr, "ハードウェアパラメータ設定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間からbuffer_sizeとperiod_sizeを取得する */
-  err = snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
-  if (err < 0) {
-    fprintf(stderr, "buffer size取得不可 : %s\n", snd_strerror(err));
-    return err;
-  }
-  err = snd_pcm_hw_params_get_period_size(hwparams, &period_size, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period size取得不可 : %s\n", snd_strerror(err));
-    return err;
-  }
-  return 0;
-}
+/*** io_uring読込み器(UringReader.h)の宣言 ***/
+static URING_READER urd = URING_READER_INIT;
 
-/* PCMにSWパラメータを設定するユーティリティ関数の定義 */
-int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+/* 再生ファイルからWAVEヘッダのデータを読み込むユーティリティ関数の定義 */
+int wave_read_header(const char *path)
 {
-  int err;
+  WAVEHEADER wh;
 
-  /* PCMに対する現在のソフトウェア構成を戻す */
-  err = snd_pcm_sw_params_current(handle, swparams);
-  if (err < 0) {
-    fprintf(stderr, "現在のソフトウェアパラメータ確定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* バッファが殆ど満杯となる再生開始閾値(frames)を設定する */
-  err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (buffer_size / period_size) * period_size);
-  if (err < 0) {
-    fprintf(stderr, "再生開始閾値モード設定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-        
-  /* PCMデバイスが再生可能とみなす最小のフレームサイズを設定する */
-  err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_size);
-  if (err < 0) {
-    fprintf(stderr, "avail min設定不可: %s\n", snd_strerror(err));
-    return err;
+  /* 索引にあればそれを使い、無ければヘッダを一括読込みで解析する(RIFF, RF64/BW64) */
+  if (wave_parse_header_cached(filedesc.fd, path, &mindex, &wh) != 0) {
+    fprintf(stderr, "%s\n", wh.error);
+    return EXIT_FAILURE;
   }
-	
-  /* ソフトウェアパラメータを再生デバイスに書き込む */
-  err = snd_pcm_sw_params(handle, swparams);
-	
-  if (err < 0) {
-    fprintf(stderr, "ソフトウェアパラメータ設定不可: %s\n", snd_strerror(err));
-    return err;
+  fmtdesc = wh.fmt;
+  if (wh.cached)
+    printf("ヘッダ索引にヒット：ヘッダ解析を省略\n");
+
+  /* WAVEフォーマット区分を表示する */
+  switch(wh.fmtChunkSize){
+  case FORMAT_CHUNK_EXTENSIBLE_SIZE:
+    printf("チャンクサイズ　＝　%d で WAVEFORMATEXTENSIBLE 形式のLPCM\n", wh.fmtChunkSize);
+    break;
+  case FORMAT_CHUNK_EX_SIZE:
+    printf("チャンクサイズ　＝　%d で WAVEFORMATEX 形式のLPCM\n", wh.fmtChunkSize);
+    break;
+  default:
+    printf("チャンクサイズ　＝　%d で 標準WAVE形式のLPCM\n", wh.fmtChunkSize);
+    break;
   }
+  if (wh.rf64)
+    printf("RF64/BW64形式：サウンドデータ %llu bytes\n", (unsigned long long)wh.dataBytes);
+  if (wh.truncated)
+    fprintf(stderr, "警告：'data'サブチャンクがファイル終端で切れている。終端まで再生する\n");
+
+  /* サウンドデータの全フレーム数とデータ先頭位置を設定する */
+  filedesc.frameSize = wh.frames;
+  filedesc.dataOffset = wh.dataOffset;
   return 0;
 }
 
@@ -264,38 +129,175 @@ int write_uchar(snd_pcm_t *handle)
 {
   unsigned char *bufPtr;				/* 再生フレームバッファ */
   unsigned short frameBytes =  fmtdesc.dataFrameSize;	/* １フレームのバイト数 */
-  const long numSoundFrames = filedesc.frameSize;	/* 再生サウンド総フレーム数 */
+  long numSoundFrames = filedesc.frameSize;		/* 再生サウンド総フレーム数 */
   long nFramesBytes, frameCount, numPlayFrames = 0;	/* 再生済フレーム数の初期化 */
-  long readFrames, resFrames = numSoundFrames;		/* 未再生フレーム数の初期化 */
-  int err = 0; 
+  long readFrames, resFrames;				/* 未再生フレーム数 */
+  unsigned char *frameBlock = NULL;			/* 転送データブロック */
+  unsigned char *mapBase = MAP_FAILED;			/* ファイルマップ領域の先頭 */
+  unsigned char *mapData = NULL;			/* ファイルマップ領域中のサウンドデータ先頭 */
+  size_t mapLength = 0;					/* ファイルマップ領域のバイト数 */
+  size_t aheadBytes = 0, advisedBytes = 0;		/* 先読み窓のバイト数、先読み要求済のバイト数 */
+  int useUring = (uring && !filemap);			/* io_uring入力使用フラグ */
+  int useRing;						/* 読込みスレッド使用フラグ */
+  int readerStarted = 0;				/* 読込みスレッド起動済フラグ */
+  int err = 0, rc; 
 	
-  /*  オーディオサンプルの転送に適用するデータブロックにメモリを割り当てる  */	
-  unsigned char *frameBlock = (unsigned char *)malloc(period_size * frameBytes);
-  if (frameBlock == NULL) {
-    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
-    err = EXIT_FAILURE;
-    goto cleaning;
+  if (useUring) {
+    /* io_uringを準備する。非対応のカーネルではread()入力に切り替える */
+    err = uring_open(&urd, filedesc.fd, prefetch > 0 ? prefetch : URING_DEPTH, period_size * frameBytes,
+		     filedesc.dataOffset, filedesc.dataOffset + (off_t)numSoundFrames * frameBytes);
+    if (err < 0) {
+      fprintf(stderr, "io_uring利用不可(%s)のためreadで入力\n", strerror(-err));
+      uring_close(&urd);
+      useUring = 0;
+    } else if (verbose > 0)
+      printf("io_uring: 先行要求 %u データブロック, 登録済バッファ %s\n", urd.depth, urd.fixedBuffers ? "使用" : "不使用");
+    err = 0;
+  }
+  useRing = (prefetch > 0 && !filemap && !useUring);
+
+  if (useUring) {
+    /* データブロックはuring_open()で割り当て済 */
+  } else if (filemap) {
+    /* 'data'サブチャンクを含む範囲をページ境界から読み込み専用でマップする */
+    struct stat st;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    off_t mapOffset = filedesc.dataOffset - filedesc.dataOffset % pageSize;
+    if (fstat(filedesc.fd, &st) == -1 || st.st_size <= filedesc.dataOffset) {
+      fprintf(stderr, "サウンドデータ領域を確認できない\n");
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+    /* ファイル実長で総フレーム数を制限する */
+    if ((st.st_size - filedesc.dataOffset) / frameBytes < numSoundFrames)
+      numSoundFrames = (long)((st.st_size - filedesc.dataOffset) / frameBytes);
+    mapLength = (size_t)(filedesc.dataOffset - mapOffset) + (size_t)numSoundFrames * frameBytes;
+    mapBase = (unsigned char *)mmap(NULL, mapLength, PROT_READ, MAP_SHARED, filedesc.fd, mapOffset);
+    if (mapBase == MAP_FAILED) {
+      fprintf(stderr, "ファイルマップ失敗: %s\n", strerror(errno));
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+    mapData = mapBase + (filedesc.dataOffset - mapOffset);
+    madvise(mapBase, mapLength, MADV_SEQUENTIAL);	/* 順次アクセスをカーネルに通知 */
+    aheadBytes = (size_t)(READAHEAD_PERIODS * period_size * frameBytes);
+    aheadBytes = (aheadBytes + pageSize - 1) / pageSize * pageSize;
+  } else if (useRing) {
+    /* 先読みリングバッファにメモリを割り当て、読込みスレッドを起動する */
+    ring.depth = prefetch;
+    ring.blockFrames = (long)period_size;
+    ring.blockBytes = period_size * frameBytes;
+    ring.numFrames = numSoundFrames;
+    ring.blocks = (unsigned char *)malloc(ring.depth * ring.blockBytes);
+    ring.frames = (long *)malloc(ring.depth * sizeof(long));
+    if (ring.blocks == NULL || ring.frames == NULL) {
+      fprintf(stderr, "メモリ不足で先読みリングバッファを割当てられない\n");
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+    atomic_init(&ring.head, 0);
+    atomic_init(&ring.tail, 0);
+    atomic_init(&ring.done, 0);
+    atomic_init(&ring.quit, 0);
+    ring.underruns = ring.fillSum = ring.fillCount = 0;
+    ring.fillMin = ring.depth;
+    if ((err = pthread_create(&reader_thread, NULL, prefetch_reader, NULL)) != 0) {
+      fprintf(stderr, "読込みスレッド起動失敗: %s\n", strerror(err));
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+    readerStarted = 1;
+    /* 再生開始前にリングを満杯(またはファイル終端)まで充填する */
+    while (atomic_load(&ring.head) < ring.depth && !atomic_load(&ring.done))
+      ring_sleep();
+  } else {
+    /*  オーディオサンプルの転送に適用するデータブロックにメモリを割り当てる  */	
+    frameBlock = (unsigned char *)malloc(period_size * frameBytes);
+    if (frameBlock == NULL) {
+      fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
   }
 
+  resFrames = numSoundFrames;				/* 未再生フレーム数の初期化 */
   nFramesBytes = (long)(period_size * frameBytes);	/* サウンドファイルから読み込むバイト数の初期化 */
+  if (resFrames <= (long)period_size)
+    nFramesBytes = (long)(resFrames * frameBytes);
+  /* 読込みスレッドの起動後に、再生スレッドだけへ実時間設定を適用する(先読みバッファは充填済) */
+  rt_prefault(&rt, frameBlock, period_size * frameBytes);
+  rt_start(&rt, handle);
+  if (rt.lock && mapBase != MAP_FAILED)
+    munlock(mapBase, mapLength);			/* ファイルマップ領域はページキャッシュに任せる */
+  stats_start(&stats, rate);
   while(resFrames>0){
-    readFrames = (long)(read(filedesc.fd, frameBlock, (size_t)nFramesBytes)/frameBytes);
+    if (filemap) {
+      /* 先読み窓の終端に近づいたら、次の窓の先読みを要求する */
+      size_t playBytes = (size_t)(mapData - mapBase) + (size_t)numPlayFrames * frameBytes;
+      if (advisedBytes < mapLength && playBytes + aheadBytes / 2 >= advisedBytes) {
+	size_t adviseLength = mapLength - advisedBytes < aheadBytes ? mapLength - advisedBytes : aheadBytes;
+	madvise(mapBase + advisedBytes, adviseLength, MADV_WILLNEED);
+	advisedBytes += adviseLength;
+      }
+      /* ファイルマップ領域を直接転送に用いる */
+      readFrames = nFramesBytes / frameBytes;
+      bufPtr = mapData + numPlayFrames * frameBytes;
+    } else if (useUring) {
+      /* io_uringで読込みが完了したデータブロックを取り出す */
+      if ((readFrames = uring_acquire(&urd, &bufPtr, NULL)) > 0)
+	readFrames /= frameBytes;
+      if (readFrames <= 0) {
+	if (readFrames < 0) {
+	  fprintf(stderr, "io_uring読込みエラー: %s\n", strerror((int)-readFrames));
+	  err = EXIT_FAILURE;
+	  goto cleaning;
+	}
+	break;			/* ファイル終端 */
+      }
+    } else if (useRing) {
+      /* 読込みスレッドが充填したデータブロックを取り出す */
+      if ((readFrames = ring_acquire(&bufPtr)) == 0)
+	break;			/* ファイル終端 */
+    } else {
+      readFrames = (long)(read(filedesc.fd, frameBlock, (size_t)nFramesBytes)/frameBytes);
+      bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
+    }
+    stats_lap(&stats, &stats.read);
     frameCount = readFrames;	/* 書き込むサンプルフレーム数の初期値をサウンドファイルから読み込むフレーム数に設定 */
-    bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
     while (frameCount > 0) {
       err = (int)writei_func(handle, bufPtr, (snd_pcm_uframes_t)frameCount); /* PCMデバイスにサウンドフレームを転送 */
       if (err == -EAGAIN)
 	continue;
       if (err < 0) {
-	if (snd_pcm_recover(handle, err, 0) < 0) {
+	/* 再生エンジンで回復し、必要なら転送周期を拡大する */
+	rc = pb_engine_recover(engine, err);
+	if (stats_xrun(&stats, err, rc < 0 ? rc : 0, numPlayFrames) < 0) {
 	  fprintf(stderr, "Write転送エラー: %s\n", snd_strerror(err));
 	  goto cleaning;
 	}
+	/* 転送周期を拡大した場合は、read入力のデータブロックを再割当てする */
+	buffer_size = pb_engine_buffer(engine);
+	period_size = pb_engine_period(engine);
+	if (rc > 0 && frameBlock != NULL) {
+	  free(frameBlock);
+	  if ((frameBlock = (unsigned char *)malloc(period_size * frameBytes)) == NULL) {
+	    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+	    err = EXIT_FAILURE;
+	    goto cleaning;
+	  }
+	  nFramesBytes = (long)(period_size * frameBytes);
+	}
 	break;			/* １データブロック周期をスキップ */
       } 
       bufPtr += err * frameBytes;/* フレームバッファのポインタを実際に書いたフレーム数にフレーム当りのバイト数を乗じた分だけ進める */
       frameCount -= err;	 /* フレームバッファ中に残存する書き込み可能なフレーム数を算定 */
     }
+    stats_lap(&stats, &stats.write);
+    stats_period(&stats, handle);
+    if (useUring)
+      uring_release(&urd);
+    else if (useRing)
+      ring_release();
     numPlayFrames += readFrames;
 		
     /* データ・ブロック長以下の残データフレーム数の計算 */
@@ -304,13 +306,126 @@ int write_uchar(snd_pcm_t *handle)
   }
   snd_pcm_drop(handle);
   printf(" 合計　%lu フレームを再生して終了\n", numPlayFrames);
+  if (useRing) {
+    /* 先読み深さの調整に用いる統計を表示する */
+    printf(" 先読み深さ：%u データブロック\n", ring.depth);
+    printf(" リング充填数：平均 %.1f / 最小 %u データブロック\n",
+	   ring.fillCount > 0 ? (double)ring.fillSum / (double)ring.fillCount : 0.0, ring.fillMin);
+    printf(" リング枯渇回数：%lu 回\n", ring.underruns);
+  }
+  printf(" アンダーラン回復回数：%lu 回\n", pb_engine_xruns(engine));
   err = 0;
  cleaning:
+  stats_dump(&stats, stdout);			/* エラー終了時もそれまでの統計を残す */
+  stats_dump_json(&stats, statsJson);
+  if(useUring)
+    uring_close(&urd);
+  if(readerStarted){
+    atomic_store(&ring.quit, 1);
+    pthread_join(reader_thread, NULL);
+  }
+  if(ring.blocks != NULL){
+    free(ring.blocks);
+    ring.blocks = NULL;
+  }
+  if(ring.frames != NULL){
+    free(ring.frames);
+    ring.frames = NULL;
+  }
   if(frameBlock != NULL)
     free(frameBlock);
+  if(mapBase != MAP_FAILED)
+    munmap(mapBase, mapLength);
   return err;
 }
 
+/* サウンドファイルを読み込み、先読みリングバッファに充填するスレッド関数の定義 */
+void *prefetch_reader(void *arg)
+{
+  unsigned short frameBytes = fmtdesc.dataFrameSize;	/* １フレームのバイト数 */
+  long nFrames, resFrames = ring.numFrames;		/* 未読込みフレーム数の初期化 */
+  unsigned int head;
+  ssize_t readBytes;
+
+  while (resFrames > 0 && !atomic_load(&ring.quit)) {
+    head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    /* リングが満杯なら再生スレッドがデータブロックを解放するまで待つ */
+    if (head - atomic_load_explicit(&ring.tail, memory_order_acquire) >= ring.depth) {
+      ring_sleep();
+      continue;
+    }
+    /* 転送周期が拡大されてもデータブロックの大きさは変わらないので、起動時のフレーム数で読む */
+    nFrames = resFrames < ring.blockFrames ? resFrames : ring.blockFrames;
+    readBytes = read(filedesc.fd, ring.blocks + (head % ring.depth) * ring.blockBytes, (size_t)(nFrames * frameBytes));
+    if (readBytes < 0 && errno == EINTR)
+      continue;
+    if (readBytes <= 0)				/* ファイル終端または読込みエラー */
+      break;
+    ring.frames[head % ring.depth] = (long)readBytes / frameBytes;
+    resFrames -= (long)readBytes / frameBytes;
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+  }
+  atomic_store_explicit(&ring.done, 1, memory_order_release);
+  return NULL;
+}
+
+/* 先読みリングバッファから再生するデータブロックを取り出すユーティリティ関数の定義 */
+long ring_acquire(unsigned char **block)
+{
+  unsigned int tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  unsigned int filled;
+  int waited = 0;
+
+  while ((filled = atomic_load_explicit(&ring.head, memory_order_acquire) - tail) == 0) {
+    /* 読込み終了後にリングが空なら、全データを再生し終えた */
+    if (atomic_load_explicit(&ring.done, memory_order_acquire)
+	&& atomic_load_explicit(&ring.head, memory_order_acquire) == tail)
+      return 0;
+    if (!waited) {
+      ring.underruns++;
+      waited = 1;
+    }
+    ring_sleep();
+  }
+  /* リングの充填状態を記録する */
+  ring.fillSum += filled;
+  ring.fillCount++;
+  if (filled < ring.fillMin)
+    ring.fillMin = filled;
+
+  *block = ring.blocks + (tail % ring.depth) * ring.blockBytes;
+  return ring.frames[tail % ring.depth];
+}
+
+/* 再生済のデータブロックを読込みスレッドに返却するユーティリティ関数の定義 */
+void ring_release(void)
+{
+  unsigned int tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  atomic_store_explicit(&ring.tail, tail + 1, memory_order_release);
+}
+
+/* リングの状態が変わるまでデータブロック時間長の1/4だけ待機するユーティリティ関数の定義
+   読込みスレッドからも呼ぶので、再生スレッドが更新するperiod_sizeではなく固定のring.blockFramesを使う */
+void ring_sleep(void)
+{
+  long usec = (long)((double)ring.blockFrames * 1000000.0 / (double)rate / 4.0);
+  struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+  nanosleep(&ts, NULL);
+}
+
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
+
 /* 使用法を表示するユーティリティ関数の定義 */
 void usage(void)
 {
@@ -320,8 +435,20 @@ void usage(void)
 	 "-h,--help	         使用法\n"
 	 "-D,--device=デバイス名   再生デバイス\n"
 	 "-m,--mmap	         mmap_write転送\n"
+	 "-f,--filemap             ファイルマップ入力(read無しで直接転送)\n"
+	 "-p,--prefetch=深さ       読込みスレッドで先読みするデータブロック数\n"
+	 "-u,--uring               io_uringで先行読込み(非対応時はread)\n"
 	 "-v,--verbose             パラメータ設定値表示\n"
 	 "-n,--noresample          再標本化禁止\n"
+	 "-L,--latency=プロファイル low(最小周期), balanced(10 msec周期), throughput(500 msecバッファ)\n"
+	 "-F,--period-frames=数    転送周期(frames)\n"
+	 "-B,--periods=数          バッファ当りの周期数\n"
+	 "-S,--stats               転送周期ごとの所要時間とアンダーランを計測(SIGUSR1で途中表示)\n"
+	 "-J,--stats-json=ファイル 転送周期統計をJSONで出力(-Sを含む)\n"
+	 "-R,--realtime=方式[:優先度] 再生スレッドを fifo または rr で実時間実行(既定優先度 70)\n"
+	 "-A,--affinity=CPU番号    再生スレッドを指定CPUに固定\n"
+	 "-M,--mlock               mlockallでメモリ固定し、バッファを事前フォールト\n"
+	 "-I,--index=ファイル      ヘッダ索引キャッシュを使う(無ければ作成)\n"
 	 "\n");
   printf("適用サンプルフォーマット:");
   for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -339,36 +466,112 @@ int main(int argc, char *argv[])
       {"help", 0, NULL, 'h'},
       {"device", 1, NULL, 'D'},
       {"mmap", 0, NULL, 'm'},
+      {"filemap", 0, NULL, 'f'},
+      {"prefetch", 1, NULL, 'p'},
+      {"uring", 0, NULL, 'u'},
       {"verbose", 0, NULL, 'v'},
       {"noresample", 0, NULL, 'n'},
+      {"latency", 1, NULL, 'L'},
+      {"period-frames", 1, NULL, 'F'},
+      {"periods", 1, NULL, 'B'},
+      {"stats", 0, NULL, 'S'},
+      {"stats-json", 1, NULL, 'J'},
+      {"realtime", 1, NULL, 'R'},
+      {"affinity", 1, NULL, 'A'},
+      {"mlock", 0, NULL, 'M'},
+      {"index", 1, NULL, 'I'},
       {NULL, 0, NULL, 0},
     };
 	
-  snd_pcm_t *handle = NULL;		/* PCMハンドル */
-  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
-  snd_pcm_sw_params_t *swparams; 	/* PCMソフトウェア構成コンテナ */
+  snd_pcm_t *handle = NULL;		/* PCMハンドル: 再生エンジンが構成する */
+  PB_SOURCE source = {"WAVE"};		/* 再生エンジンへ渡すフォーマット記述: 転送はwrite_uchar()が行う */
   unsigned char *transfer_method; 	/* 転送方法名 */
   unsigned short qbits;			/* 量子化ビット数 */
   double playtime = 0;			/* 再生時間 */
+  long value;				/* 数値オプションの値 */
   int err, c, exit_code = 0;
 	
-  while ((c = getopt_long(argc, argv, "hD:mvn", long_option, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "hD:mfp:uvnL:F:B:SJ:R:A:MI:", long_option, NULL)) != -1) {
     switch (c) {
     case 'h':
       usage();
       return 0;
     case 'D':
-      device = strdup(optarg);		/* 再生デバイス名の指定 */
+      config.device = strdup(optarg);	/* 再生デバイス名の指定 */
       break;
     case 'm':
-      mmap = 1;
+      mmap_access = 1;
+      break;
+    case 'f':
+      filemap = 1;
+      break;
+    case 'p':
+      if (parse_count(optarg, 0, MAX_PREFETCH, &value) < 0) {
+	fprintf(stderr, "先読み深さは0〜%dの整数\n", MAX_PREFETCH);
+	return EXIT_FAILURE;
+      }
+      prefetch = (unsigned int)value;
+      break;
+    case 'u':
+      uring = 1;
       break;
     case 'v':
       verbose = 1;
       break;
     case 'n':
-      resample = 0;
+      config.resample = 0;
       break;		
+    case 'L':
+      if (strcmp(optarg, "low") == 0)
+	config.latency = PB_LATENCY_LOW;
+      else if (strcmp(optarg, "balanced") == 0)
+	config.latency = PB_LATENCY_BALANCED;
+      else if (strcmp(optarg, "throughput") == 0)
+	config.latency = PB_LATENCY_THROUGHPUT;
+      else {
+	fprintf(stderr, "レイテンシ・プロファイルは low, balanced, throughput のいずれか\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_count(optarg, 0, MAX_PERIOD_FRAMES, &value) < 0) {
+	fprintf(stderr, "転送周期は0〜%dフレームの整数\n", MAX_PERIOD_FRAMES);
+	return EXIT_FAILURE;
+      }
+      config.periodFrames = (snd_pcm_uframes_t)value;
+      break;
+    case 'B':
+      if (parse_count(optarg, 0, MAX_PERIODS, &value) < 0) {
+	fprintf(stderr, "バッファ当りの周期数は0〜%dの整数\n", MAX_PERIODS);
+	return EXIT_FAILURE;
+      }
+      config.periods = (unsigned int)value;
+      break;
+    case 'S':
+      stats.enabled = 1;
+      break;
+    case 'J':
+      stats.enabled = 1;
+      statsJson = strdup(optarg);
+      break;
+    case 'R':
+      if (rt_parse(&rt, optarg) < 0) {
+	fprintf(stderr, "実時間方式は fifo[:優先度] または rr[:優先度] (優先度 1〜99)\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      if (rt_parse_cpu(&rt, optarg) < 0) {
+	fprintf(stderr, "CPU番号は0以上の整数\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+      rt.lock = 1;
+      break;
+    case 'I':
+      mi_open(&mindex, optarg);
+      break;
     default:
       fprintf(stderr, "`--help'で使用方法を確認\n");
       return EXIT_FAILURE;
@@ -382,10 +585,6 @@ int main(int argc, char *argv[])
   /* 再生ファイルパス名の初期化 */	
   const char *filePath = NULL;
   
-  /* ALSA HW, SWパラメータ・コンテナの初期化 */
-  snd_pcm_hw_params_alloca(&hwparams); 
-  snd_pcm_sw_params_alloca(&swparams);
-    	
   /* 再生ファイルをオープンする */
   filePath = argv[optind];
   int fd = open(filePath, O_RDONLY, 0);
@@ -397,7 +596,7 @@ int main(int argc, char *argv[])
   filedesc.fd = fd;
     	
   /* ユーティリティ関数により再生ファイルのWAVフォーマット情報を取得する */
-  if(wave_read_header() != 0){
+  if(wave_read_header(filePath) != 0){
     exit_code = EXIT_FAILURE;
     goto cleaning;
   }
@@ -443,40 +642,28 @@ int main(int argc, char *argv[])
     goto cleaning;
   }
 	
-  if (mmap) {
+  if (mmap_access) {
     writei_func = snd_pcm_mmap_writei;
     transfer_method = "mmap_write";
+    config.sink = PB_SINK_MMAP;
   } else {
     writei_func = snd_pcm_writei;
     transfer_method = "write";
+    config.sink = PB_SINK_RW;
   }
 	
-  /* PCMをBlockモードでオープンする */
-  if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-    fprintf(stderr, "PCMオープンエラー: %s\n", snd_strerror(err));
-    exit_code = err;
-    goto cleaning;
-  }
-	
-  /* ユーティリティ関数によりPCMにHWパラメータを設定する */
-  if ((err = set_hwparams(handle, hwparams)) < 0) {
-    fprintf(stderr, "hwparamsの設定失敗: %s\n", snd_strerror(err));
-    printf("*** PCMハードウェア構成空間一覧 ***\n");
-    snd_pcm_hw_params_dump(hwparams, output);
-    printf("\n");
-    exit_code = err;
-    goto cleaning;
-  }
-	
-  /* ユーティリティ関数によりPCMにSWパラメータを設定する  */
-  if ((err = set_swparams(handle, swparams)) < 0) {
-    fprintf(stderr, "swparamsの設定失敗: %s\n", snd_strerror(err));
-    printf("*** ソフトウェア構成一覧 ***\n");
-    snd_pcm_sw_params_dump(swparams, output);
-    printf("\n");
-    exit_code = err;
+  /* 再生エンジンでPCMをオープンし、HW, SWパラメータを設定する */
+  source.format = format;
+  source.rate = rate;
+  source.channels = numChannels;
+  source.frames = filedesc.frameSize;
+  if ((engine = pb_engine_open(&config, &source)) == NULL) {
+    exit_code = EXIT_FAILURE;
     goto cleaning;
   }
+  handle = pb_engine_pcm(engine);
+  buffer_size = pb_engine_buffer(engine);
+  period_size = pb_engine_period(engine);
 
   if (verbose > 0){
     printf("*** PCM情報一覧 ***\n");
@@ -487,8 +674,11 @@ int main(int argc, char *argv[])
   /* ALSAパラメータ情報を表示する */
   printf("*** ALSAパラメータ ***\n");
   printf("内部フォーマット：%s\n", snd_pcm_format_name(format));
-  printf("PCMデバイス：%s\n", device);
+  printf("PCMデバイス：%s\n", config.device);
   printf("転送方法: %s\n", transfer_method);
+  printf("バッファサイズ：%lu フレーム (%.1f msec)\n", buffer_size, 1000.0 * (double)buffer_size / (double)rate);
+  printf("転送周期：%lu フレーム (%.1f msec)\n", period_size, 1000.0 * (double)period_size / (double)rate);
+  printf("ファイル入力: %s\n", filemap ? "filemap" : uring ? "io_uring" : (prefetch > 0 ? "read(先読みスレッド)" : "read"));
   printf("\n");
 
   /* ユーティリティ関数によりファイルからデータを読み、ALSA転送関数に渡してサウンドを再生する */
@@ -500,10 +690,11 @@ int main(int argc, char *argv[])
 
   /* 後始末 */        	
  cleaning:
+  mi_close(&mindex);
   if(output != NULL)
     snd_output_close(output);
-  if(handle != NULL)
-    snd_pcm_close(handle);
+  if(engine != NULL)
+    pb_engine_close(engine);		/* PCMも閉じる */
   snd_config_update_free_global();	
   if(fd != -1)
     close (fd);
@@ -15,6 +15,9 @@ static char RIFF_ID[4] = {'R', 'I', 'F', 'F'};
 static char WAVE_ID[4] = {'W', 'A', 'V', 'E'};
 static char FMT_ID[4] = {'f', 'm', 't', ' '};
 static char DATA_ID[4] = {'d', 'a', 't', 'a'};
+static char RF64_ID[4] = {'R', 'F', '6', '4'};		/* 4GBを超えるWAVE(EBU Tech 3306) */
+static char BW64_ID[4] = {'B', 'W', '6', '4'};		/* 4GBを超えるWAVE(ITU-R BS.2088) */
+static char DS64_ID[4] = {'d', 's', '6', '4'};		/* RF64/BW64の64bitサイズ・サブチャンク */
 
 /* WORD型の定義 */
 typedef unsigned char BYTE;			/* 8bit符号無し整数型 */
@@ -42,6 +45,7 @@ typedef struct format_descriptor{
 typedef struct waveFile_descriptor{
   int	fd;					/* 再生ファイル記述子 */
   long	frameSize;				/* 再生サウンドフレームサイズ（frames) */
+  off_t	dataOffset;				/* 'data'サブチャンクのサウンドデータ先頭位置(bytes) */
 }WAVEFILEDESC;
 
 
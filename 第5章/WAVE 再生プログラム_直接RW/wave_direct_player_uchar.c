@@ -4,263 +4,110 @@
  ソースコード：wave_direct_player_uchar.c
  ****************************************************************************/
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE			/* CPU固定(pthread_setaffinity_np)に必要 */
 
 #include <getopt.h>
 #include "alsa/asoundlib.h"
+#include "PlaybackEngine.h"
 #include "WaveFormat.h"
+#include "MediaIndex.h"
+#include "WaveHeader.h"
+#include "PeriodStats.h"
+#include "RealtimeSched.h"
 
 /*** ユーティリティ関数プロトタイプ宣言 ***/
-static int wave_read_header(void);
-static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams);
+static int wave_read_header(const char *path);
 static int direct_uchar(snd_pcm_t *handle);
+static int recover_xrun(int err, long numPlayFrames, unsigned char **stage);
+static long area_read(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames,
+		      off_t filePos, unsigned char *stage);
+static int parse_count(const char *s, long min, long max, long *value);
 static void usage(void);
 
 /*** ALSAライブラリのパラメータ初期化 ***/
-static char *device = "plughw:0,0";			/* 再生PCMデバイス名*/
 static snd_pcm_format_t format = SND_PCM_FORMAT_S32_LE;	/* サンプル・フォーマット */
 static unsigned int rate = 44100;			/* 標本化速度(Hz) */
 static unsigned int numChannels = 1;			/* チャンネル数 */
-static unsigned int buffer_time = 0;			/* バッファ時間長(μsec) */
-static unsigned int period_time = 0;			/* 転送周期時間長(μsec) */
-static snd_pcm_uframes_t buffer_size = 0;		/* バッファサイズ(符号無しフレーム数) */
-static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(符号無しフレーム数) */
+static snd_pcm_uframes_t buffer_size = 0;		/* バッファサイズ(符号無しフレーム数): 再生エンジンから取得 */
+static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(符号無しフレーム数): 再生エンジンから取得 */
 static snd_output_t *output = NULL;			/* 出力オブジェクトに 対するALSA内部構造体へのハンドル */
 
+/*** 再生エンジン(PlaybackEngine.h)の宣言: PCMの構成とアンダーラン回復を委ねる ***/
+static PB_CONFIG config = PB_CONFIG_INIT;		/* 再生設定: config.noninterleaved=1で非インタリーブmmap領域 */
+static PB_ENGINE *engine = NULL;			/* 再生エンジン */
+#define MAX_PERIOD_FRAMES (1 << 20)			/* 転送周期の要求値(-F)の上限(frames) */
+#define MAX_PERIODS (1024)				/* バッファ当りの周期数の要求値(-B)の上限 */
+
 /*** アプリケーション制御フラグの初期化 ***/
-static int mmap = 1;					/* 転送方法制御フラグ */
 static int verbose = 0;					/* 詳細情報表示フラグ: set=1 clear=0 */
-static int resample = 1;				/* 標本化速度変換設定フラグ: set=1 clear=0 */
+static PERIOD_STATS stats;				/* 転送周期統計: stats.enabled=1で計測 */
+static const char *statsJson = NULL;			/* 転送周期統計のJSON出力先: NULL=出力しない */
+static RT_CONFIG rt = RT_CONFIG_INIT;			/* 再生スレッドの実時間設定 */
+static MEDIA_INDEX mindex = MEDIA_INDEX_INIT;		/* ヘッダ索引キャッシュ: fd=-1で使わない */
 
 /*** ユーザデータの宣言 ***/
 static WAVEFORMATDESC fmtdesc;
 static WAVEFILEDESC filedesc;
 
 /* 再生ファイルからWAVEヘッダのデータを読み込むユーティリティ関数の定義 */
-int wave_read_header(void)
+int wave_read_header(const char *path)
 {
-  FOURCC chunkID;
-  DWORD chunkSize;
-  GUID SubFormat;
-    
+  WAVEHEADER wh;
 
-  lseek(filedesc.fd, 0, SEEK_SET); 	/* ファイル先頭にrewind */
-  /* RIFFチャンクを読む */ 
-  read(filedesc.fd, &chunkID, sizeof(FOURCC));
-  read(filedesc.fd, &chunkSize, sizeof(DWORD));
-  if(chunkID != *(FOURCC *)RIFF_ID) {
-    fprintf(stderr, "ファイルエラー：RIFF形式でない\n");
+  /* 索引にあればそれを使い、無ければヘッダを一括読込みで解析する(RIFF, RF64/BW64) */
+  if (wave_parse_header_cached(filedesc.fd, path, &mindex, &wh) != 0) {
+    fprintf(stderr, "%s\n", wh.error);
     return EXIT_FAILURE;
   }
- 
-  /* WAVE IDを読む */  
-  read(filedesc.fd, &chunkID, sizeof(FOURCC));
-  if(chunkID != *(FOURCC *)WAVE_ID) {
-    fprintf(stderr, "ファイルエラー：WAVEフォーマットでない\n");
-    return EXIT_FAILURE; 
-  }
-    
-  /* 'fmt 'サブチャンク、'data'サブチャンクの情報を読む */
-  while(1){
-    read(filedesc.fd, &chunkID, sizeof(FOURCC));
-    read(filedesc.fd, &chunkSize, sizeof(DWORD));
-    if (chunkID == *(FOURCC *)FMT_ID) {
-      if((chunkSize != FORMAT_CHUNK_PCM_SIZE)  && (chunkSize != FORMAT_CHUNK_EX_SIZE)
-	 && (chunkSize != FORMAT_CHUNK_EXTENSIBLE_SIZE)) {
-	fprintf(stderr, "チャンクサイズ ＝ %d でWAVE規定サイズではない\n", chunkSize);
-	return EXIT_FAILURE; 
-      } 
-    	    			
-      /* サウンド・フォーマット情報を読み込む */ 
-      read(filedesc.fd, &fmtdesc, FORMAT_CHUNK_PCM_SIZE);
-                
-      /* formatTagの値を検査する */
-      if ((fmtdesc.formatTag != WAVE_FORMAT_PCM) && (fmtdesc.formatTag != WAVE_FORMAT_EXTENSIBLE)) {
-	fprintf(stderr, "フォマットコード ＝ %x でPCMフォーマットではない\n", fmtdesc.formatTag);
-	return EXIT_FAILURE; 
-      }
-	    
-      /* WAVEフォーマット区分単位で処理 */
-      switch(chunkSize){
-      case FORMAT_CHUNK_EXTENSIBLE_SIZE:
-        lseek(filedesc.fd, 8, SEEK_CUR);
-        read(filedesc.fd, &SubFormat, sizeof(GUID));
-	if ( SubFormat.subFormatCode != WAVE_FORMAT_PCM){
-	  fprintf(stderr, "拡張サブフォマットコード ＝ %x でLPCMフォーマットではない\n",  SubFormat.subFormatCode);
-	  return EXIT_FAILURE;
-	}
-	else if (memcmp(SubFormat.wave_guid_tag, WAVE_GUID_TAG, 14) != 0){
-	  fprintf(stderr, "GUIDタグ ＝ %x でWAVE_GUID_TAGではない\n",  (unsigned int)SubFormat.wave_guid_tag);	
-	  return EXIT_FAILURE; 
-	}
-	else{
-	  printf("チャンクサイズ　＝　%d で WAVEFORMATEXTENSIBLE 形式のLPCM\n", chunkSize);
-	}
-	break;
-      case FORMAT_CHUNK_EX_SIZE:
-        lseek(filedesc.fd, 2, SEEK_CUR);
-	printf("チャンクサイズ　＝　%d で WAVEFORMATEX 形式のLPCM\n", chunkSize);
-	break;
-      default:
-	printf("チャンクサイズ　＝　%d で 標準WAVE形式のLPCM\n", chunkSize);
-	break;
-      }
-    }
-    else if (chunkID == *(FOURCC *)DATA_ID){
-      /* サウンドデータの全フレーム数を設定する */          
-      filedesc.frameSize = (long)chunkSize / (long)fmtdesc.dataFrameSize;
-      break;
-    }
-    else{ /* その他のサブチャンクを読み飛ばす */        
-      lseek(filedesc.fd, (off_t)chunkSize, SEEK_CUR);
-    }                                                
-  }
-  return 0;
-}
-
-/* PCMにHWパラメータを設定するユーティリティ関数の定義 */
-int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
-{
-  unsigned int rateNear;
-  int err, dir;
+  fmtdesc = wh.fmt;
+  if (wh.cached)
+    printf("ヘッダ索引にヒット：ヘッダ解析を省略\n");
 
-  /* PCMに対する全構成空間のパラメータを充填する */
-  err = snd_pcm_hw_params_any(handle, hwparams);
-  if (err < 0) {
-    fprintf(stderr, "ハードウェア構成破綻: 適用できるハードウェア構成が無い: %s\n", snd_strerror(err));
-    return err;
-  }
-  /* 構成空間を実際のハードウェア標本化速度のみを包含するように制限する */
-  err = snd_pcm_hw_params_set_rate_resample(handle, hwparams, resample);
-  if (err < 0) {
-    fprintf(stderr, "再標本化の設定失敗: %s\n", snd_strerror(err));
-    return err;
-  }
-  /* 構成空間を実際のアクセス方法のみを包含するように制限する */
-  if (mmap) {
-    err = snd_pcm_hw_params_set_access(handle, hwparams,
-				       SND_PCM_ACCESS_MMAP_INTERLEAVED);
-  } else
-    err = snd_pcm_hw_params_set_access(handle, hwparams,
-				       SND_PCM_ACCESS_RW_INTERLEAVED);
-  if (err < 0) {
-    fprintf(stderr, "アクセスタイプ非適用: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間を唯一のフォーマットを包含するように制限する */
-  err = snd_pcm_hw_params_set_format(handle, hwparams, format);
-  if (err < 0) {
-    fprintf(stderr, "サンプルフォーマット非適用: %s\n", snd_strerror(err));
-    fprintf(stderr, "適用可能フォーマット:\n");
-    for (int fmt = 0; fmt <= SND_PCM_FORMAT_LAST; fmt++) {
-      if (snd_pcm_hw_params_test_format(handle, hwparams, (snd_pcm_format_t)fmt) == 0)
-	fprintf(stderr, "- %s\n", snd_pcm_format_name((snd_pcm_format_t)fmt));
-    }
-    return err;
-  }
-	
-  /* 構成空間を唯一のチャンネル数を包含するように制限する */
-  err = snd_pcm_hw_params_set_channels(handle, hwparams, numChannels);
-  if (err < 0) {
-    fprintf(stderr, "チャンネル数 (%i) は非適用: %s\n", numChannels, snd_strerror(err));
-    return err;
-  }
-  /* 構成空間を標本化速度要求値に最も近い値に制限する */
-  rateNear = rate;
-  err = snd_pcm_hw_params_set_rate_near(handle, hwparams, &rateNear, 0);
-  if (err < 0) {
-    fprintf(stderr, "標本化速度 %iHz は非適用: %s\n", rate, snd_strerror(err));
-    return err;
-  }
-  if (rateNear != rate) {
-    fprintf(stderr, "標本化速度が整合しない (要求値 %iHz, 取得値 %iHz)\n", rate, rateNear);
-    return -EINVAL;
+  /* WAVEフォーマット区分を表示する */
+  switch(wh.fmtChunkSize){
+  case FORMAT_CHUNK_EXTENSIBLE_SIZE:
+    printf("チャンクサイズ　＝　%d で WAVEFORMATEXTENSIBLE 形式のLPCM\n", wh.fmtChunkSize);
+    break;
+  case FORMAT_CHUNK_EX_SIZE:
+    printf("チャンクサイズ　＝　%d で WAVEFORMATEX 形式のLPCM\n", wh.fmtChunkSize);
+    break;
+  default:
+    printf("チャンクサイズ　＝　%d で 標準WAVE形式のLPCM\n", wh.fmtChunkSize);
+    break;
   }
+  if (wh.rf64)
+    printf("RF64/BW64形式：サウンドデータ %llu bytes\n", (unsigned long long)wh.dataBytes);
+  if (wh.truncated)
+    fprintf(stderr, "警告：'data'サブチャンクがファイル終端で切れている。終端まで再生する\n");
 
-  /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する */
-  err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
-  if (buffer_time > 500000)
-    buffer_time = 500000;		/* buffer timeの上限を500 msecに設定 */
-  if (buffer_time > 0)
-    period_time = buffer_time / 4;	/* bufferを4つのperiods(チャンク)に分割 */
-  else{
-    fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
-    return -EINVAL;
-  }
-		
-  /* 構成空間をbuffer_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間をperiod_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
-    return err;
-  }
-        
-  /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
-  err = snd_pcm_hw_params(handle, hwparams);
-  if (err < 0) {
-    fprintf(stderr, "ハードウェアパラメータ設定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間からbuffer_sizeとperiod_sizeを取得する */
-  err = snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
-  if (err < 0) {
-    fprintf(stderr, "buffer size取得不可 : %s\n", snd_strerror(err));
-    return err;
-  }
-  err = snd_pcm_hw_params_get_period_size(hwparams, &period_size, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period size取得不可 : %s\n", snd_strerror(err));
-    return err;
-  }
+  /* サウンドデータの全フレーム数とデータ先頭位置を設定する */
+  filedesc.frameSize = wh.frames;
+  filedesc.dataOffset = wh.dataOffset;
   return 0;
 }
 
-/* PCMにSWパラメータを設定するユーティリティ関数の定義 */
-int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+/* 再生エンジンで転送エラーから回復し、転送周期を拡大した場合は中継バッファを再割当てするユーティリティ関数の定義 */
+int recover_xrun(int err, long numPlayFrames, unsigned char **stage)
 {
-  int err;
+  int rc = pb_engine_recover(engine, err);
 
-  /* PCMに対する現在のソフトウェア構成を戻す */
-  err = snd_pcm_sw_params_current(handle, swparams);
-  if (err < 0) {
-    fprintf(stderr, "現在のソフトウェアパラメータ確定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* バッファが殆ど満杯となる再生開始閾値(frames)を設定する */
-  err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (buffer_size / period_size) * period_size);
-  if (err < 0) {
-    fprintf(stderr, "再生開始閾値モード設定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-        
-  /* 少なくともperiod_size分のサンプルが処理可能な時に再生を許可する */
-  err = snd_pcm_sw_params_set_avail_min(handle, swparams, period_size);
-  if (err < 0) {
-    fprintf(stderr, "avail min設定不可: %s\n", snd_strerror(err));
-    return err;
-  }
-	
-  /* ソフトウェアパラメータを再生デバイスに書き込む */
-  err = snd_pcm_sw_params(handle, swparams);
-	
-  if (err < 0) {
-    fprintf(stderr, "ソフトウェアパラメータ設定不可: %s\n", snd_strerror(err));
+  if ((err = stats_xrun(&stats, err, rc < 0 ? rc : 0, numPlayFrames)) < 0)
     return err;
+  if (rc > 0) {
+    buffer_size = pb_engine_buffer(engine);
+    period_size = pb_engine_period(engine);
+    if (*stage != NULL) {
+      free(*stage);
+      if ((*stage = (unsigned char *)malloc(period_size * fmtdesc.dataFrameSize)) == NULL) {
+	fprintf(stderr, "メモリ不足で中継バッファを割当てられない\n");
+	return -ENOMEM;
+      }
+    }
   }
   return 0;
 }
- 
-/* サウンドデータの再生を行うユーティリティ関数の定義(SND_PCM_ACCESS_MMAP_INTERLEAVED) */
+
+/* サウンドデータの再生を行うユーティリティ関数の定義(SND_PCM_ACCESS_MMAP_INTERLEAVED/NONINTERLEAVED) */
 int direct_uchar(snd_pcm_t *handle)
 {
   const snd_pcm_channel_area_t *areas;			/* mmap領域構造体 */
@@ -270,20 +117,36 @@ int direct_uchar(snd_pcm_t *handle)
   const long numSoundFrames = filedesc.frameSize;	/* 再生サウンド総フレーム数 */
   long nFrames, numPlayFrames = 0;	                /* 再生済フレーム数の初期化 */
   long readFrames, resFrames = numSoundFrames;		/* 未再生フレーム数の初期化 */
-  unsigned int steps;					/* 隣接サンプル間距離（バイト単位） */
-  int err = 0, toStart = 1, i = 0;
-  unsigned char *frameBlock ;
-  unsigned char *mmap[4];
+  off_t filePos = filedesc.dataOffset;			/* 次に読み込むファイル位置 */
+  unsigned char *stage = NULL;				/* 非インタリーブ配置用の中継バッファ */
+  int err = 0, toStart = 1, endOfFile = 0;
 	
+  /* 非インタリーブ配置ではファイルのフレームを各チャンネル領域に振り分けるため中継バッファを用いる */
+  if (config.noninterleaved) {
+    stage = (unsigned char *)malloc(period_size * frameBytes);
+    if (stage == NULL) {
+      fprintf(stderr, "メモリ不足で中継バッファを割当てられない\n");
+      return EXIT_FAILURE;
+    }
+  }
+
   nFrames = (long)period_size;				/* 一回の転送フレーム数の要求値の初期設定 */
-  while(resFrames > 0){
+  if (resFrames <= (long)period_size)
+    nFrames = resFrames;
+  /* 中継バッファとmmap領域を事前フォールトし、実時間設定を適用する */
+  rt_prefault(&rt, stage, period_size * frameBytes);
+  rt_start(&rt, handle);
+  stats_start(&stats, rate);
+  while(resFrames > 0 && !endOfFile){
     /* 再生用に書き込み可能なフレーム数を取得する */
     avail = snd_pcm_avail_update(handle);
     if (avail < 0) {
-      if ((err = snd_pcm_recover(handle, (int)avail, 0)) < 0) {
+      if ((err = recover_xrun((int)avail, numPlayFrames, &stage)) < 0) {
 	fprintf(stderr, "書き込み可能フレーム取得失敗: %s\n", snd_strerror(err));
-	return err;
+	goto cleaning;
       }
+      /* 転送周期を拡大した場合に備えて転送フレーム数を更新する */
+      nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
       toStart = 1;
       continue;
     }
@@ -294,67 +157,153 @@ int direct_uchar(snd_pcm_t *handle)
 	err = snd_pcm_start(handle); /* PCMを明示的に開始 */
 	if (err < 0) {
 	  fprintf(stderr, "PCM開始エラー: %s\n", snd_strerror(err));
-	  return err;
+	  goto cleaning;
 	}
       } else {
 	err = snd_pcm_wait(handle, -1); /* PCMがready状態になるまで待機 */
 	if (err < 0) {
-	  if ((err = snd_pcm_recover(handle, err, 0)) < 0) {
+	  if ((err = recover_xrun(err, numPlayFrames, &stage)) < 0) {
 	    fprintf(stderr, "PCM待機エラー: %s\n", snd_strerror(err));
-	    return err;
+	    goto cleaning;
 	  }
 	  toStart = 1;
 	}
       }
       continue;
     }
-		
-    frames = (snd_pcm_uframes_t)nFrames;         
-    /* mmap領域へのアクセスを要求する */
-    err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
-    if (err < 0) {
-      if ((err = snd_pcm_recover(handle, err, 0)) < 0) {
-	fprintf(stderr, "mmap領域アクセス失敗: %s\n", snd_strerror(err));
-	return err;
+
+    /* 1データブロックを転送する。リングバッファ終端で折り返す場合はmmap_begin/commitを2回に分割する */
+    while (nFrames > 0) {
+      frames = (snd_pcm_uframes_t)nFrames;         
+      /* mmap領域へのアクセスを要求する(framesは終端までの連続フレーム数に制限される) */
+      err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+      if (err < 0) {
+	if ((err = recover_xrun(err, numPlayFrames, &stage)) < 0) {
+	  fprintf(stderr, "mmap領域アクセス失敗: %s\n", snd_strerror(err));
+	  goto cleaning;
+	}
+	toStart = 1;
+	break;
       }
-      toStart = 1;
-    }
-			
-    /* 転送データブロックををmmap領域に設定する */   		
-     if(i < 4){   		
-      mmap[i] = (unsigned char *)areas->addr + (areas->first / 8);	
-      steps = areas->step / 8 ;					
-      mmap[i] += (unsigned int)offset * steps;
-    }
-    frameBlock = mmap[i % 4];
-    			
-    /* 転送データブロック配列にサウンドフレームを読み込む */
-    readFrames = (long)(read(filedesc.fd, frameBlock, (size_t)(frames * frameBytes))/frameBytes);
-      	  
-    /* mmap領域のデータを転送する */
-    transferFrames = snd_pcm_mmap_commit(handle, offset, (snd_pcm_uframes_t)readFrames);
-    if (transferFrames < 0 || (snd_pcm_uframes_t)transferFrames != frames) {
-      if ((err = snd_pcm_recover(handle, transferFrames >= 0 ? -EPIPE : (int)transferFrames, 0)) < 0) {
-	fprintf(stderr, "mmap領域コミットエラー: %s\n", snd_strerror(err));
-	return err;
+
+      /* mmap_beginが返した領域にサウンドフレームを直接読み込む */
+      stats_mark(&stats);
+      readFrames = area_read(areas, offset, frames, filePos, stage);
+      stats_lap(&stats, &stats.read);
+      if (readFrames < 0) {
+	fprintf(stderr, "サウンドファイル読込みエラー: %s\n", strerror((int)-readFrames));
+	snd_pcm_mmap_commit(handle, offset, 0);
+	err = EXIT_FAILURE;
+	goto cleaning;
       }
-      toStart = 1;
+      if (readFrames < (long)frames)
+	endOfFile = 1;				/* ヘッダより短いファイル */
+
+      /* mmap領域のデータを転送する */
+      transferFrames = snd_pcm_mmap_commit(handle, offset, (snd_pcm_uframes_t)readFrames);
+      stats_lap(&stats, &stats.write);
+      if (transferFrames > 0) {
+	/* 実際にコミットされたフレーム数だけファイル位置を進める(未コミット分は次回読み直す) */
+	filePos += (off_t)transferFrames * frameBytes;
+	numPlayFrames += (long)transferFrames;
+	nFrames -= (long)transferFrames;
+      }
+      if (transferFrames < 0 || transferFrames != readFrames) {
+	err = transferFrames >= 0 ? -EPIPE : (int)transferFrames;
+	if ((err = recover_xrun(err, numPlayFrames, &stage)) < 0) {
+	  fprintf(stderr, "mmap領域コミットエラー: %s\n", snd_strerror(err));
+	  goto cleaning;
+	}
+	toStart = 1;
+	endOfFile = 0;
+	break;
+      }
+      if (endOfFile)
+	break;
     }
-   
-    numPlayFrames += (long)transferFrames;
+    stats_period(&stats, handle);
 		
-    /* データ・ブロック長以下の残データフレーム数の計算 */
-    if ((resFrames = numSoundFrames - numPlayFrames) <= (long)period_size){ 
-      nFrames = resFrames;
-    }
-    i++;
+    /* 次のデータブロック長を計算する */
+    resFrames = numSoundFrames - numPlayFrames;
+    nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
   }
 	
   snd_pcm_drop(handle);
   printf(" 合計 %lu フレームを再生して終了\n", numPlayFrames);
-  return 0;
+  printf(" アンダーラン回復回数：%lu 回\n", pb_engine_xruns(engine));
+  err = 0;
+ cleaning:
+  stats_dump(&stats, stdout);			/* エラー終了時もそれまでの統計を残す */
+  stats_dump_json(&stats, statsJson);
+  if(stage != NULL)
+    free(stage);
+  return err;
+}
+
+/* mmap領域にファイルのサウンドフレームを読み込むユーティリティ関数の定義 */
+long area_read(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames,
+	       off_t filePos, unsigned char *stage)
+{
+  unsigned short frameBytes = fmtdesc.dataFrameSize;	/* １フレームのバイト数 */
+  unsigned int sampleBytes = frameBytes / numChannels;	/* １サンプルのバイト数 */
+  size_t nBytes = (size_t)frames * frameBytes, done = 0;
+  unsigned char *dst;
+  ssize_t n;
+  int interleaved = 1;
+
+  /* 全チャンネルがファイルと同じインタリーブ配置で連続しているか、first/stepで確認する */
+  for (unsigned int ch = 0; ch < numChannels; ch++) {
+    if (areas[ch].addr != areas[0].addr || areas[ch].step != (unsigned int)frameBytes * 8
+	|| areas[ch].first != areas[0].first + ch * sampleBytes * 8) {
+      interleaved = 0;
+      break;
+    }
+  }
+  if (interleaved)	/* DMA領域へ直接読み込む */
+    dst = (unsigned char *)areas[0].addr + areas[0].first / 8 + offset * frameBytes;
+  else			/* 中継バッファに読み込んでから振り分ける */
+    dst = stage;
+  if (dst == NULL)
+    return -EINVAL;
+
+  while (done < nBytes) {
+    n = pread(filedesc.fd, dst + done, nBytes - done, filePos + (off_t)done);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      return -errno;
+    }
+    if (n == 0)
+      break;			/* ファイル終端 */
+    done += (size_t)n;
+  }
+  frames = done / frameBytes;
+
+  if (!interleaved) {
+    /* 各チャンネル領域のfirst/stepに従ってサンプルを配置する */
+    for (unsigned int ch = 0; ch < numChannels; ch++) {
+      unsigned char *chAddr = (unsigned char *)areas[ch].addr + areas[ch].first / 8;
+      unsigned int chStep = areas[ch].step / 8;
+      for (snd_pcm_uframes_t i = 0; i < frames; i++)
+	memcpy(chAddr + (offset + i) * chStep, stage + i * frameBytes + ch * sampleBytes, sampleBytes);
+    }
+  }
+  return (long)frames;
 }
  
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
+
 /* 使用法を表示するユーティリティ関数の定義 */
 void usage(void)
 {
@@ -365,6 +314,16 @@ void usage(void)
 	 "-D,--device	  再生デバイス\n"
 	 "-v,--verbose      パラメータ設定値表示\n"
 	 "-n,--noresample   再標本化禁止\n"
+	 "-L,--latency=プロファイル low(最小周期), balanced(10 msec周期), throughput(500 msecバッファ)\n"
+	 "-F,--period-frames=数    転送周期(frames)\n"
+	 "-B,--periods=数          バッファ当りの周期数\n"
+	 "-N,--noninterleaved 非インタリーブmmap領域\n"
+	 "-S,--stats               転送周期ごとの所要時間とアンダーランを計測(SIGUSR1で途中表示)\n"
+	 "-J,--stats-json=ファイル 転送周期統計をJSONで出力(-Sを含む)\n"
+	 "-R,--realtime=方式[:優先度] 再生スレッドを fifo または rr で実時間実行(既定優先度 70)\n"
+	 "-A,--affinity=CPU番号    再生スレッドを指定CPUに固定\n"
+	 "-M,--mlock               mlockallでメモリ固定し、バッファを事前フォールト\n"
+	 "-I,--index=ファイル      ヘッダ索引キャッシュを使う(無ければ作成)\n"
 	 "\n");
   printf("適用サンプルフォーマット:");
   for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -383,31 +342,95 @@ int main(int argc, char *argv[])
       {"device", 1, NULL, 'D'},
       {"verbose", 0, NULL, 'v'},
       {"noresample", 0, NULL, 'n'},
+      {"latency", 1, NULL, 'L'},
+      {"period-frames", 1, NULL, 'F'},
+      {"periods", 1, NULL, 'B'},
+      {"noninterleaved", 0, NULL, 'N'},
+      {"stats", 0, NULL, 'S'},
+      {"stats-json", 1, NULL, 'J'},
+      {"realtime", 1, NULL, 'R'},
+      {"affinity", 1, NULL, 'A'},
+      {"mlock", 0, NULL, 'M'},
+      {"index", 1, NULL, 'I'},
       {NULL, 0, NULL, 0},
     };
 	
-  snd_pcm_t *handle = NULL;				/* PCMハンドル */
-  snd_pcm_hw_params_t *hwparams;			/* PCMハードウェア構成空間コンテナ */
-  snd_pcm_sw_params_t *swparams;			/* PCMソフトウェア構成コンテナ */
+  snd_pcm_t *handle = NULL;				/* PCMハンドル: 再生エンジンが構成する */
+  PB_SOURCE source = {"WAVE"};				/* 再生エンジンへ渡すフォーマット記述: 転送はdirect_uchar()が行う */
   unsigned char *transfer_method = "mmap_direct";	/* 転送方法名 */                                             
   unsigned short qbits;					/* 量子化ビット数 */
   double playtime = 0;					/* 再生時間 */
+  long value;					/* 数値オプションの値 */
   int err, c, exit_code = 0;
 		
-  while ((c = getopt_long(argc, argv, "hD:vn", long_option, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "hD:vnNL:F:B:SJ:R:A:MI:", long_option, NULL)) != -1) {
     switch (c) {
     case 'h':
       usage();
       return 0;
     case 'D':
-      device = strdup(optarg); /* 再生デバイス名の指定 */
+      config.device = strdup(optarg); /* 再生デバイス名の指定 */
       break;
     case 'v':
       verbose = 1;
       break;
     case 'n':
-      resample = 0;
+      config.resample = 0;
+      break;
+    case 'L':
+      if (strcmp(optarg, "low") == 0)
+	config.latency = PB_LATENCY_LOW;
+      else if (strcmp(optarg, "balanced") == 0)
+	config.latency = PB_LATENCY_BALANCED;
+      else if (strcmp(optarg, "throughput") == 0)
+	config.latency = PB_LATENCY_THROUGHPUT;
+      else {
+	fprintf(stderr, "レイテンシ・プロファイルは low, balanced, throughput のいずれか\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_count(optarg, 0, MAX_PERIOD_FRAMES, &value) < 0) {
+	fprintf(stderr, "転送周期は0〜%dフレームの整数\n", MAX_PERIOD_FRAMES);
+	return EXIT_FAILURE;
+      }
+      config.periodFrames = (snd_pcm_uframes_t)value;
+      break;
+    case 'B':
+      if (parse_count(optarg, 0, MAX_PERIODS, &value) < 0) {
+	fprintf(stderr, "バッファ当りの周期数は0〜%dの整数\n", MAX_PERIODS);
+	return EXIT_FAILURE;
+      }
+      config.periods = (unsigned int)value;
+      break;
+    case 'N':
+      config.noninterleaved = 1;
       break;		
+    case 'S':
+      stats.enabled = 1;
+      break;
+    case 'J':
+      stats.enabled = 1;
+      statsJson = strdup(optarg);
+      break;
+    case 'R':
+      if (rt_parse(&rt, optarg) < 0) {
+	fprintf(stderr, "実時間方式は fifo[:優先度] または rr[:優先度] (優先度 1〜99)\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      if (rt_parse_cpu(&rt, optarg) < 0) {
+	fprintf(stderr, "CPU番号は0以上の整数\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+      rt.lock = 1;
+      break;
+    case 'I':
+      mi_open(&mindex, optarg);
+      break;
     default:
       fprintf(stderr, "`--help'で使用方法を確認\n");
       return EXIT_FAILURE;
@@ -422,10 +445,6 @@ int main(int argc, char *argv[])
   /* 再生ファイルパス名の初期化 */
   const char *filePath = NULL;
 
-  /* ALSA HW, SWパラメータ・コンテナの初期化 */
-  snd_pcm_hw_params_alloca(&hwparams); 
-  snd_pcm_sw_params_alloca(&swparams);
-    	
   /* 再生ファイルをオープンする */
   filePath = argv[optind];
   int fd = open(filePath, O_RDONLY, 0);
@@ -437,7 +456,7 @@ int main(int argc, char *argv[])
   filedesc.fd = fd;
     	
   /* ユーティリティ関数により再生ファイルのWAVフォーマット情報を取得する */
-  if(wave_read_header() != 0){
+  if(wave_read_header(filePath) != 0){
     exit_code = EXIT_FAILURE;
     goto cleaning;
   }
@@ -483,32 +502,19 @@ int main(int argc, char *argv[])
     goto cleaning;
   }
 	
-  /* PCMをBlockモードでオープンする */
-  if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-    fprintf(stderr, "PCMオープンエラー: %s\n", snd_strerror(err));
-    exit_code = err;
-    goto cleaning;
-  }
-	
-  /* ユーティリティ関数によりPCMにHWパラメータを設定する */
-  if ((err = set_hwparams(handle, hwparams)) < 0) {
-    fprintf(stderr, "hwparamsの設定失敗: %s\n", snd_strerror(err));
-    printf("*** PCMハードウェア構成空間一覧 ***\n");
-    snd_pcm_hw_params_dump(hwparams, output);
-    printf("\n");
-    exit_code = err;
-    goto cleaning;
-  }
-	
-  /* ユーティリティ関数によりPCMにSWパラメータを設定する  */
-  if ((err = set_swparams(handle, swparams)) < 0) {
-    fprintf(stderr, "swparamsの設定失敗: %s\n", snd_strerror(err));
-    printf("*** ソフトウェア構成一覧 ***\n");
-    snd_pcm_sw_params_dump(swparams, output);
-    printf("\n");
-    exit_code = err;
+  /* 再生エンジンでPCMをオープンし、HW, SWパラメータを設定する(mmap領域への転送はdirect_uchar()が行う) */
+  config.sink = PB_SINK_DIRECT;
+  source.format = format;
+  source.rate = rate;
+  source.channels = numChannels;
+  source.frames = filedesc.frameSize;
+  if ((engine = pb_engine_open(&config, &source)) == NULL) {
+    exit_code = EXIT_FAILURE;
     goto cleaning;
   }
+  handle = pb_engine_pcm(engine);
+  buffer_size = pb_engine_buffer(engine);
+  period_size = pb_engine_period(engine);
 
   if (verbose > 0){
     printf("*** PCM情報一覧 ***\n");
@@ -519,8 +525,10 @@ int main(int argc, char *argv[])
   /* ALSAパラメータ情報を表示する */
   printf("*** ALSAパラメータ ***\n");
   printf("内部フォーマット：%s\n", snd_pcm_format_name(format));
-  printf("PCMデバイス：%s\n", device);
+  printf("PCMデバイス：%s\n", config.device);
   printf("転送方法: %s\n", transfer_method);
+  printf("バッファサイズ：%lu フレーム (%.1f msec)\n", buffer_size, 1000.0 * (double)buffer_size / (double)rate);
+  printf("転送周期：%lu フレーム (%.1f msec)\n", period_size, 1000.0 * (double)period_size / (double)rate);
   printf("\n");
 
   /* ユーティリティ関数によりファイルからデータを読み、ALSA転送関数に渡してサウンドを再生する */
@@ -532,10 +540,11 @@ int main(int argc, char *argv[])
 
   /* 後始末 */        	
  cleaning:
+  mi_close(&mindex);
   if(output != NULL)
     snd_output_close(output);
-  if(handle != NULL)
-    snd_pcm_close(handle);
+  if(engine != NULL)
+    pb_engine_close(engine);		/* PCMも閉じる */
   snd_config_update_free_global();	
   if(fd != -1)
     close (fd);
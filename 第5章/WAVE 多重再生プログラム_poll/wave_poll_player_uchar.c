@@ -0,0 +1,696 @@
+/*****************************************************************************
+ 実例プログラム：WAVEサウンド・ファイル多重再生プログラム
+ 		     - poll/epollイベント駆動read/write転送 -
+ ソースコード：wave_poll_player_uchar.c
+ ****************************************************************************/
+#define _FILE_OFFSET_BITS 64
+
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include "alsa/asoundlib.h"
+#include "WaveFormat.h"
+#include "MediaIndex.h"
+#include "WaveHeader.h"
+
+#define MAX_EVENTS (64)					/* epoll_waitで一度に受け取る最大イベント数 */
+
+/*** 再生ストリーム構造体の定義 ***/
+typedef struct{
+  const char *filePath;					/* 再生ファイルパス名 */
+  char deviceName[256];					/* 再生PCMデバイス名 */
+  WAVEFORMATDESC fmtdesc;				/* サウンドフォーマット */
+  WAVEFILEDESC filedesc;				/* 再生サウンド・ファイル */
+  snd_pcm_t *handle;					/* PCMハンドル */
+  snd_pcm_format_t format;				/* サンプル・フォーマット */
+  snd_pcm_uframes_t buffer_size;			/* バッファサイズ(符号無しフレーム数) */
+  snd_pcm_uframes_t period_size;			/* データブロック・サイズ(符号無しフレーム数) */
+  snd_pcm_uframes_t reqPeriodFrames;			/* 転送周期の要求値(frames): 0=プロファイルに従う */
+  struct pollfd *pfds;					/* PCMのポーリング記述子配列 */
+  int numPfds;						/* ポーリング記述子数 */
+  unsigned char *frameBlock;				/* 転送データブロック */
+  long blockFrames;					/* データブロック中の有効フレーム数 */
+  long blockPos;					/* データブロック中の転送済フレーム数 */
+  long numPlayFrames;					/* 再生済フレーム数 */
+  unsigned long xruns;					/* アンダーラン回復回数 */
+  int active;						/* 再生中フラグ */
+} STREAM;
+
+/*** ユーティリティ関数プロトタイプ宣言 ***/
+static int wave_read_header(STREAM *st);
+static int set_hwparams(STREAM *st, snd_pcm_hw_params_t *hwparams);
+static int set_swparams(STREAM *st, snd_pcm_sw_params_t *swparams);
+static int set_period_frames(STREAM *st, snd_pcm_hw_params_t *hwparams);
+static int step_up_period(STREAM *st);
+static int stream_open(STREAM *st, int index, snd_pcm_hw_params_t *hwparams, snd_pcm_sw_params_t *swparams);
+static int stream_write(STREAM *st);
+static void stream_close(STREAM *st);
+static int event_loop(STREAM *streams, int numStreams);
+static int parse_count(const char *s, long min, long max, long *value);
+static void usage(void);
+
+/*** ALSAライブラリのパラメータ初期化 ***/
+static char *device = "plughw:0,0";			/* 再生PCMデバイス名("%d"はストリーム番号に置換) */
+static snd_output_t *output = NULL;			/* 出力オブジェクトに 対するALSA内部構造体へのハンドル */
+
+/*** アプリケーション制御フラグの初期化 ***/
+static int verbose = 0;					/* 詳細情報表示フラグ: set=1 clear=0 */
+static int resample = 1;				/* 標本化速度変換設定フラグ: set=1 clear=0 */
+
+/*** レイテンシ・プロファイルの定義 ***/
+enum { LATENCY_LOW, LATENCY_BALANCED, LATENCY_THROUGHPUT };
+static int latency = LATENCY_THROUGHPUT;		/* レイテンシ・プロファイル */
+static snd_pcm_uframes_t req_period_frames = 0;		/* 転送周期の要求値(frames): 0=プロファイルに従う */
+static unsigned int req_periods = 0;			/* バッファ当りの周期数の要求値: 0=プロファイルに従う */
+#define MAX_PERIOD_FRAMES (1 << 20)			/* 転送周期の要求値(-F)の上限(frames) */
+#define MAX_PERIODS (1024)				/* バッファ当りの周期数の要求値(-B)の上限 */
+static MEDIA_INDEX mindex = MEDIA_INDEX_INIT;		/* ヘッダ索引キャッシュ: fd=-1で使わない */
+
+/* 再生ファイルからWAVEヘッダのデータを読み込むユーティリティ関数の定義 */
+int wave_read_header(STREAM *st)
+{
+  WAVEHEADER wh;
+
+  /* 索引にあればそれを使い、無ければヘッダを一括読込みで解析する(RIFF, RF64/BW64) */
+  if (wave_parse_header_cached(st->filedesc.fd, st->filePath, &mindex, &wh) != 0) {
+    fprintf(stderr, "%s: %s\n", st->filePath, wh.error);
+    return EXIT_FAILURE;
+  }
+  if (wh.truncated)
+    fprintf(stderr, "%s: 警告：'data'サブチャンクがファイル終端で切れている。終端まで再生する\n", st->filePath);
+
+  /* サウンド・フォーマット、全フレーム数とデータ先頭位置を設定する */
+  st->fmtdesc = wh.fmt;
+  st->filedesc.frameSize = wh.frames;
+  st->filedesc.dataOffset = wh.dataOffset;
+  return 0;
+}
+
+/* PCMにHWパラメータを設定するユーティリティ関数の定義 */
+int set_hwparams(STREAM *st, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_t *handle = st->handle;
+  unsigned int rate = st->fmtdesc.samplesPerSec;	/* 標本化速度(Hz) */
+  unsigned int numChannels = st->fmtdesc.numChannels;	/* チャンネル数 */
+  unsigned int buffer_time = 0, period_time = 0;	/* バッファ時間長、転送周期時間長(μsec) */
+  unsigned int rateNear;
+  int err, dir;
+
+  /* PCMに対する全構成空間のパラメータを充填する */
+  err = snd_pcm_hw_params_any(handle, hwparams);
+  if (err < 0) {
+    fprintf(stderr, "ハードウェア構成破綻: 適用できるハードウェア構成が無い: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を実際のハードウェア標本化速度のみを包含するように制限する */
+  err = snd_pcm_hw_params_set_rate_resample(handle, hwparams, resample);
+  if (err < 0) {
+    fprintf(stderr, "再標本化の設定失敗: %s\n", snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を実際のアクセス方法のみを包含するように制限する */
+  err = snd_pcm_hw_params_set_access(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
+  if (err < 0) {
+    fprintf(stderr, "アクセスタイプ非適用: %s\n", snd_strerror(err));
+    return err;
+  }
+	
+  /* 構成空間を唯一のフォーマットを包含するように制限する */
+  err = snd_pcm_hw_params_set_format(handle, hwparams, st->format);
+  if (err < 0) {
+    fprintf(stderr, "サンプルフォーマット非適用: %s\n", snd_strerror(err));
+    return err;
+  }
+	
+  /* 構成空間を唯一のチャンネル数を包含するように制限する */
+  err = snd_pcm_hw_params_set_channels(handle, hwparams, numChannels);
+  if (err < 0) {
+    fprintf(stderr, "チャンネル数 (%i) は非適用: %s\n", numChannels, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を標本化速度要求値に最も近い値に制限する */
+  rateNear = rate;
+  err = snd_pcm_hw_params_set_rate_near(handle, hwparams, &rateNear, 0);
+  if (err < 0) {
+    fprintf(stderr, "標本化速度 %iHz は非適用: %s\n", rate, snd_strerror(err));
+    return err;
+  }
+  if (rateNear != rate) {
+    fprintf(stderr, "標本化速度が整合しない (要求値 %iHz, 取得値 %iHz)\n", rate, rateNear);
+    return -EINVAL;
+  }
+
+  if (latency == LATENCY_THROUGHPUT && st->reqPeriodFrames == 0 && req_periods == 0) {
+    /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する(throughput) */
+    err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
+    if (buffer_time > 500000)
+      buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
+    if (buffer_time > 0)
+      period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
+    else{
+      fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
+      return -EINVAL;
+    }
+
+    /* 構成空間をbuffer_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
+      return err;
+    }
+
+    /* 構成空間をperiod_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
+      return err;
+    }
+  } else {
+    /* 転送周期と周期数をフレーム単位で折衝する(low, balanced, または明示指定) */
+    err = set_period_frames(st, hwparams);
+    if (err < 0)
+      return err;
+  }
+
+  /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
+  err = snd_pcm_hw_params(handle, hwparams);
+  if (err < 0) {
+    fprintf(stderr, "ハードウェアパラメータ設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+	
+  /* 構成空間からbuffer_sizeとperiod_sizeを取得する */
+  err = snd_pcm_hw_params_get_buffer_size(hwparams, &st->buffer_size);
+  if (err < 0) {
+    fprintf(stderr, "buffer size取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  err = snd_pcm_hw_params_get_period_size(hwparams, &st->period_size, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
+/* レイテンシ・プロファイルに従い転送周期と周期数をフレーム単位で折衝するユーティリティ関数の定義 */
+int set_period_frames(STREAM *st, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_t *handle = st->handle;
+  snd_pcm_uframes_t periodFrames, periodMin;
+  unsigned int periods;
+  int err, dir = 0;
+
+  /* 構成空間から転送周期の最小値を抽出する */
+  err = snd_pcm_hw_params_get_period_size_min(hwparams, &periodMin, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size最小値取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  switch (latency) {
+  case LATENCY_LOW:		/* デバイスが許容する最小の転送周期を3周期 */
+    periodFrames = periodMin;
+    periods = 3;
+    break;
+  case LATENCY_BALANCED:	/* 10 msecの転送周期を4周期 */
+    periodFrames = st->fmtdesc.samplesPerSec / 100;
+    periods = 4;
+    break;
+  default:			/* 125 msecの転送周期を4周期 */
+    periodFrames = st->fmtdesc.samplesPerSec / 8;
+    periods = 4;
+    break;
+  }
+  if (st->reqPeriodFrames > 0)
+    periodFrames = st->reqPeriodFrames;
+  if (req_periods > 0)
+    periods = req_periods;
+  if (periodFrames < periodMin)
+    periodFrames = periodMin;
+
+  /* 構成空間をperiod_size要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_period_size_near(handle, hwparams, &periodFrames, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size設定不可 %lu : %s\n", periodFrames, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を周期数要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_periods_near(handle, hwparams, &periods, &dir);
+  if (err < 0) {
+    fprintf(stderr, "periods設定不可 %u : %s\n", periods, snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
+/* PCMにSWパラメータを設定するユーティリティ関数の定義 */
+int set_swparams(STREAM *st, snd_pcm_sw_params_t *swparams)
+{
+  snd_pcm_t *handle = st->handle;
+  int err;
+
+  /* PCMに対する現在のソフトウェア構成を戻す */
+  err = snd_pcm_sw_params_current(handle, swparams);
+  if (err < 0) {
+    fprintf(stderr, "現在のソフトウェアパラメータ確定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+	
+  /* バッファが殆ど満杯となる再生開始閾値(frames)を設定する */
+  err = snd_pcm_sw_params_set_start_threshold(handle, swparams, (st->buffer_size / st->period_size) * st->period_size);
+  if (err < 0) {
+    fprintf(stderr, "再生開始閾値モード設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+        
+  /* period_size分の空きができた時にポーリング記述子を書込み可能にする */
+  err = snd_pcm_sw_params_set_avail_min(handle, swparams, st->period_size);
+  if (err < 0) {
+    fprintf(stderr, "avail min設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+	
+  /* ソフトウェアパラメータを再生デバイスに書き込む */
+  err = snd_pcm_sw_params(handle, swparams);
+	
+  if (err < 0) {
+    fprintf(stderr, "ソフトウェアパラメータ設定不可: %s\n", snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
+/* 再生ファイルとPCMをオープンし、ストリームを準備するユーティリティ関数の定義 */
+int stream_open(STREAM *st, int index, snd_pcm_hw_params_t *hwparams, snd_pcm_sw_params_t *swparams)
+{
+  const char *pos;
+  int err;
+
+  /* デバイス名中の"%d"をストリーム番号に置換する(例: file:'/tmp/ch%d.raw',raw) */
+  if ((pos = strstr(device, "%d")) != NULL)
+    snprintf(st->deviceName, sizeof(st->deviceName), "%.*s%d%s", (int)(pos - device), device, index, pos + 2);
+  else
+    snprintf(st->deviceName, sizeof(st->deviceName), "%s", device);
+
+  /* 再生ファイルをオープンし、WAVフォーマット情報を取得する */
+  st->filedesc.fd = open(st->filePath, O_RDONLY, 0);
+  if (st->filedesc.fd == -1) {
+    fprintf(stderr, "%s: 再生ファイル・オープン・エラー\n", st->filePath);
+    return -errno;
+  }
+  if (wave_read_header(st) != 0)
+    return -EINVAL;
+
+  switch(st->fmtdesc.bitsPerSample){
+  case 16:
+    st->format = SND_PCM_FORMAT_S16_LE;
+    break;
+  case 24:	
+    st->format = SND_PCM_FORMAT_S24_3LE;
+    break;
+  case 32:	
+    st->format = SND_PCM_FORMAT_S32_LE;
+    break;
+  default:
+    fprintf(stderr, "%s: サポート外の量子化ビット数：%d\n", st->filePath, st->fmtdesc.bitsPerSample);
+    return -EINVAL;
+  }
+
+  /* PCMをNon-Blockモードでオープンし、HW/SWパラメータを設定する */
+  if ((err = snd_pcm_open(&st->handle, st->deviceName, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0) {
+    fprintf(stderr, "%s: PCMオープンエラー: %s\n", st->deviceName, snd_strerror(err));
+    return err;
+  }
+  if ((err = set_hwparams(st, hwparams)) < 0) {
+    fprintf(stderr, "%s: hwparamsの設定失敗: %s\n", st->filePath, snd_strerror(err));
+    return err;
+  }
+  if ((err = set_swparams(st, swparams)) < 0) {
+    fprintf(stderr, "%s: swparamsの設定失敗: %s\n", st->filePath, snd_strerror(err));
+    return err;
+  }
+
+  /* PCMのポーリング記述子を取得する */
+  st->numPfds = snd_pcm_poll_descriptors_count(st->handle);
+  if (st->numPfds <= 0) {
+    fprintf(stderr, "%s: ポーリング記述子数が不正\n", st->deviceName);
+    return -EINVAL;
+  }
+  st->pfds = (struct pollfd *)calloc((size_t)st->numPfds, sizeof(struct pollfd));
+  st->frameBlock = (unsigned char *)malloc(st->period_size * st->fmtdesc.dataFrameSize);
+  if (st->pfds == NULL || st->frameBlock == NULL) {
+    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+    return -ENOMEM;
+  }
+  if ((err = snd_pcm_poll_descriptors(st->handle, st->pfds, (unsigned int)st->numPfds)) < 0) {
+    fprintf(stderr, "%s: ポーリング記述子取得失敗: %s\n", st->deviceName, snd_strerror(err));
+    return err;
+  }
+
+  if (verbose > 0){
+    printf("*** ストリーム %d: PCM情報一覧 ***\n", index);
+    snd_pcm_dump(st->handle, output);
+    printf("\n");	
+  }
+  printf("ストリーム %d: %s -> %s (%uHz, %uチャンネル, %s, %ld フレーム, 周期 %lu / バッファ %lu フレーム)\n", index,
+	 st->filePath, st->deviceName, st->fmtdesc.samplesPerSec, st->fmtdesc.numChannels, snd_pcm_format_name(st->format),
+	 st->filedesc.frameSize, st->period_size, st->buffer_size);
+  st->active = 1;
+  return 0;
+}
+
+/* アンダーラン発生時にストリームの転送周期を2倍に拡大してPCMを再構成するユーティリティ関数の定義 */
+int step_up_period(STREAM *st)
+{
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
+  snd_pcm_uframes_t oldPeriod = st->period_size;
+  unsigned char *block;
+  int err;
+
+  /* 既定のthroughputプロファイル、または周期が125 msecに達していれば拡大しない */
+  if ((latency == LATENCY_THROUGHPUT && st->reqPeriodFrames == 0 && req_periods == 0)
+      || st->period_size * 2 > st->fmtdesc.samplesPerSec / 8)
+    return 0;
+  snd_pcm_hw_params_alloca(&hwparams); 
+  snd_pcm_sw_params_alloca(&swparams);
+
+  snd_pcm_drop(st->handle);
+  st->reqPeriodFrames = st->period_size * 2;
+  if ((err = set_hwparams(st, hwparams)) < 0)
+    return err;
+  if ((err = set_swparams(st, swparams)) < 0)
+    return err;
+  /* 転送中のデータブロックを保ったまま拡大する */
+  block = (unsigned char *)realloc(st->frameBlock, st->period_size * st->fmtdesc.dataFrameSize);
+  if (block == NULL)
+    return -ENOMEM;
+  st->frameBlock = block;
+  printf("%s: アンダーラン検出: 転送周期を %lu → %lu フレームに拡大\n", st->filePath, oldPeriod, st->period_size);
+  return 1;
+}
+
+/* 書込み可能になったストリームにサウンドフレームを転送するユーティリティ関数の定義 */
+int stream_write(STREAM *st)
+{
+  unsigned short frameBytes = st->fmtdesc.dataFrameSize;	/* １フレームのバイト数 */
+  long resFrames, nFrames;
+  ssize_t readBytes;
+  int err;
+
+  while (1) {
+    /* データブロックを転送し終えたら、次のデータブロックを読み込む */
+    if (st->blockPos >= st->blockFrames) {
+      st->numPlayFrames += st->blockFrames;
+      st->blockFrames = st->blockPos = 0;
+      resFrames = st->filedesc.frameSize - st->numPlayFrames;
+      if (resFrames <= 0)
+	return 1;				/* 再生終了 */
+      nFrames = resFrames < (long)st->period_size ? resFrames : (long)st->period_size;
+      readBytes = read(st->filedesc.fd, st->frameBlock, (size_t)(nFrames * frameBytes));
+      if (readBytes <= 0)
+	return 1;				/* ヘッダより短いファイル */
+      st->blockFrames = (long)readBytes / frameBytes;
+    }
+    /* PCMデバイスにサウンドフレームを転送(Non-Blockモード) */
+    err = (int)snd_pcm_writei(st->handle, st->frameBlock + st->blockPos * frameBytes,
+			      (snd_pcm_uframes_t)(st->blockFrames - st->blockPos));
+    if (err == -EAGAIN)
+      return 0;					/* バッファ満杯、次のイベントを待つ */
+    if (err < 0) {
+      if (snd_pcm_recover(st->handle, err, 0) < 0) {
+	fprintf(stderr, "%s: Write転送エラー: %s\n", st->filePath, snd_strerror(err));
+	return err;
+      }
+      st->xruns++;
+      if ((err = step_up_period(st)) < 0)
+	return err;
+      continue;
+    }
+    st->blockPos += err;
+  }
+}
+
+/* ストリームの資源を開放するユーティリティ関数の定義 */
+void stream_close(STREAM *st)
+{
+  if (st->handle != NULL) {
+    snd_pcm_drop(st->handle);
+    snd_pcm_close(st->handle);
+    st->handle = NULL;
+  }
+  if (st->filedesc.fd > 0) {
+    close(st->filedesc.fd);
+    st->filedesc.fd = -1;
+  }
+  free(st->pfds);
+  free(st->frameBlock);
+  st->pfds = NULL;
+  st->frameBlock = NULL;
+  st->active = 0;
+}
+
+/* 1スレッドで全ストリームを駆動するイベントループの定義 */
+int event_loop(STREAM *streams, int numStreams)
+{
+  struct epoll_event ev, events[MAX_EVENTS];
+  int epfd, numActive = 0, nEvents, err = 0;
+  int failed = 0;			/* 中止したストリームの有無: 他のストリームは再生を続ける */
+
+  /* 全ストリームのポーリング記述子をepollに登録する(data: ストリーム番号 << 32 | 記述子番号) */
+  if ((epfd = epoll_create1(0)) == -1) {
+    fprintf(stderr, "epoll生成失敗: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < numStreams; i++) {
+    if (!streams[i].active)
+      continue;
+    for (int k = 0; k < streams[i].numPfds; k++) {
+      ev.events = streams[i].pfds[k].events;
+      ev.data.u64 = ((uint64_t)i << 32) | (uint64_t)k;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, streams[i].pfds[k].fd, &ev) == -1) {
+	fprintf(stderr, "%s: epoll登録失敗: %s\n", streams[i].filePath, strerror(errno));
+	close(epfd);
+	return EXIT_FAILURE;
+      }
+    }
+    numActive++;
+  }
+
+  while (numActive > 0) {
+    nEvents = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (nEvents == -1) {
+      if (errno == EINTR)
+	continue;
+      fprintf(stderr, "epoll待機エラー: %s\n", strerror(errno));
+      err = EXIT_FAILURE;
+      break;
+    }
+    for (int e = 0; e < nEvents; e++) {
+      STREAM *st = &streams[events[e].data.u64 >> 32];
+      unsigned short revents;
+      int done;
+      if (!st->active)
+	continue;
+
+      /* epollの結果をALSAに渡し、PCMとしての実イベントに変換する */
+      st->pfds[events[e].data.u64 & 0xffffffff].revents = (short)events[e].events;
+      err = snd_pcm_poll_descriptors_revents(st->handle, st->pfds, (unsigned int)st->numPfds, &revents);
+      for (int k = 0; k < st->numPfds; k++)
+	st->pfds[k].revents = 0;
+      if (err < 0) {
+	fprintf(stderr, "%s: イベント取得失敗: %s\n", st->filePath, snd_strerror(err));
+	done = -1;
+      } else if (revents & POLLERR) {
+	/* XRUN、SUSPEND等から回復する */
+	if (snd_pcm_recover(st->handle, snd_pcm_state(st->handle) == SND_PCM_STATE_SUSPENDED ? -ESTRPIPE : -EPIPE, 0) < 0)
+	  done = -1;
+	else {
+	  st->xruns++;
+	  done = step_up_period(st) < 0 ? -1 : stream_write(st);
+	}
+      } else if (revents & POLLOUT)
+	done = stream_write(st);
+      else
+	done = 0;
+      err = 0;
+
+      /* 再生を終えたストリームをepollから外す */
+      if (done != 0) {
+	for (int k = 0; k < st->numPfds; k++)
+	  epoll_ctl(epfd, EPOLL_CTL_DEL, st->pfds[k].fd, NULL);
+	printf("ストリーム %d: 合計 %ld フレームを再生して%s (アンダーラン回復 %lu 回)\n", (int)(st - streams),
+	       st->numPlayFrames, done > 0 ? "終了" : "中止", st->xruns);
+	if (done < 0)
+	  failed = 1;
+	stream_close(st);
+	numActive--;
+      }
+    }
+  }
+  close(epfd);
+  return failed ? EXIT_FAILURE : err;
+}
+
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
+
+/* 使用法を表示するユーティリティ関数の定義 */
+void usage(void)
+{
+  printf(
+	 "使用法: wave_poll_player_uchar [オプション]... サウンドファイル...\n"
+	 "-h,--help	         使用法\n"
+	 "-D,--device=デバイス名   再生デバイス(\"%%d\"はストリーム番号に置換)\n"
+	 "-v,--verbose             パラメータ設定値表示\n"
+	 "-n,--noresample          再標本化禁止\n"
+	 "-L,--latency=プロファイル low(最小周期), balanced(10 msec周期), throughput(500 msecバッファ)\n"
+	 "-F,--period-frames=数    転送周期(frames)\n"
+	 "-B,--periods=数          バッファ当りの周期数\n"
+	 "-I,--index=ファイル      ヘッダ索引キャッシュを使う(無ければ作成)\n"
+	 "\n"
+	 "例: wave_poll_player_uchar -D null a.wav b.wav c.wav\n"
+	 "    wave_poll_player_uchar -D \"file:'/tmp/ch%%d.raw',raw\" a.wav b.wav\n"
+	 "\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option long_option[] =
+    {
+      {"help", 0, NULL, 'h'},
+      {"device", 1, NULL, 'D'},
+      {"verbose", 0, NULL, 'v'},
+      {"noresample", 0, NULL, 'n'},
+      {"latency", 1, NULL, 'L'},
+      {"period-frames", 1, NULL, 'F'},
+      {"periods", 1, NULL, 'B'},
+      {"index", 1, NULL, 'I'},
+      {NULL, 0, NULL, 0},
+    };
+	
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams; 	/* PCMソフトウェア構成コンテナ */
+  STREAM *streams = NULL;		/* 再生ストリーム配列 */
+  int numStreams;			/* 再生ストリーム数 */
+  long value;				/* 数値オプションの値 */
+  int err, c, exit_code = 0;
+	
+  while ((c = getopt_long(argc, argv, "hD:vnL:F:B:I:", long_option, NULL)) != -1) {
+    switch (c) {
+    case 'h':
+      usage();
+      return 0;
+    case 'D':
+      device = strdup(optarg);		/* 再生デバイス名の指定 */
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'n':
+      resample = 0;
+      break;		
+    case 'L':
+      if (strcmp(optarg, "low") == 0)
+	latency = LATENCY_LOW;
+      else if (strcmp(optarg, "balanced") == 0)
+	latency = LATENCY_BALANCED;
+      else if (strcmp(optarg, "throughput") == 0)
+	latency = LATENCY_THROUGHPUT;
+      else {
+	fprintf(stderr, "レイテンシ・プロファイルは low, balanced, throughput のいずれか\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_count(optarg, 0, MAX_PERIOD_FRAMES, &value) < 0) {
+	fprintf(stderr, "転送周期は0〜%dフレームの整数\n", MAX_PERIOD_FRAMES);
+	return EXIT_FAILURE;
+      }
+      req_period_frames = (snd_pcm_uframes_t)value;
+      break;
+    case 'B':
+      if (parse_count(optarg, 0, MAX_PERIODS, &value) < 0) {
+	fprintf(stderr, "バッファ当りの周期数は0〜%dの整数\n", MAX_PERIODS);
+	return EXIT_FAILURE;
+      }
+      req_periods = (unsigned int)value;
+      break;
+    case 'I':
+      mi_open(&mindex, optarg);
+      break;
+    default:
+      fprintf(stderr, "`--help'で使用方法を確認\n");
+      return EXIT_FAILURE;
+    }
+  }
+	                                         
+  if (optind > argc-1) {
+    usage();
+    return 0;
+  }
+  
+  /* ALSA HW, SWパラメータ・コンテナの初期化 */
+  snd_pcm_hw_params_alloca(&hwparams); 
+  snd_pcm_sw_params_alloca(&swparams);
+
+  /* ALSAの出力オブジェクトの設定 */
+  err = snd_output_stdio_attach(&output, stdout, 0);
+  if (err < 0) {
+    fprintf(stderr, "ALSAログ出力設定失敗: %s\n", snd_strerror(err));
+    exit_code = err;
+    goto cleaning;
+  }
+
+  /* 再生ファイル毎にストリームを準備する */
+  numStreams = argc - optind;
+  streams = (STREAM *)calloc((size_t)numStreams, sizeof(STREAM));
+  if (streams == NULL) {
+    fprintf(stderr, "メモリ不足でストリームを割当てられない\n");
+    exit_code = EXIT_FAILURE;
+    goto cleaning;
+  }
+  printf("*** 再生ストリーム一覧 ***\n");
+  for (int i = 0; i < numStreams; i++) {
+    streams[i].filePath = argv[optind + i];
+    if (stream_open(&streams[i], i, hwparams, swparams) < 0) {
+      exit_code = EXIT_FAILURE;
+      goto cleaning;
+    }
+  }
+  if (mindex.fd >= 0)
+    printf("ヘッダ索引：ヒット %lu, ミス %lu, 登録 %lu\n", mindex.hits, mindex.misses, mindex.stores);
+  printf("\n");
+
+  /* 1スレッドのイベントループで全ストリームを再生する */
+  err = event_loop(streams, numStreams);
+  if (err != 0){
+    fprintf(stderr, "再生転送失敗\n");
+    exit_code = err;
+  }
+
+  /* 後始末 */        	
+ cleaning:
+  mi_close(&mindex);
+  if (streams != NULL) {
+    for (int i = 0; i < numStreams; i++)
+      stream_close(&streams[i]);
+    free(streams);
+  }
+  if(output != NULL)
+    snd_output_close(output);
+  snd_config_update_free_global();	
+  return exit_code;
+}
@@ -0,0 +1,266 @@
+/******************************************************
+ io_uringによるファイルの先行読込み
+ ヘッダ・ファイル：UringReader.h
+ ******************************************************/
+#ifndef URING_READER_H
+#define URING_READER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* ファイルの[start, end)をデータブロック単位で順に読む。最大depth個のデータブロックの読込み要求を
+   先行して投入しておき、再生側が1ブロック取り出して返すたびに次の要求を積む。
+   シーク後は先行要求を1ブロックに絞り、順次読みが続くたびに2倍にしてdepthまで戻す */
+#define URING_DEPTH (4)					/* io_uringで先行して要求するデータブロック数の既定値 */
+#define URING_PENDING LONG_MIN				/* 読込み完了待ちを示すデータブロック状態 */
+
+/* io_uring読込み器構造体の定義 */
+typedef struct{
+  int fd;						/* io_uringファイル記述子 */
+  int fileFd;						/* 読み込むファイルの記述子 */
+  unsigned int *sqHead, *sqTail, *sqMask, *sqArray;	/* 投入キューの制御変数 */
+  unsigned int *cqHead, *cqTail, *cqMask;		/* 完了キューの制御変数 */
+  struct io_uring_sqe *sqes;				/* 投入キュー・エントリ配列 */
+  struct io_uring_cqe *cqes;				/* 完了キュー・エントリ配列 */
+  void *sqRing, *cqRing;				/* キューのマップ領域 */
+  size_t sqRingBytes, cqRingBytes, sqesBytes;		/* マップ領域のバイト数 */
+  unsigned char *blocks;				/* データブロック配列(depth個) */
+  long *results;					/* 各データブロックの読込み結果(bytes) */
+  off_t *offsets;					/* 各データブロックの読込み位置 */
+  unsigned int depth;					/* データブロック数(先行要求数) */
+  size_t blockBytes;					/* データブロック当りのバイト数 */
+  int fixedBuffers;					/* 登録済バッファ使用フラグ */
+  unsigned int toSubmit;				/* 未投入の読込み要求数 */
+  unsigned int window;					/* 先行要求するデータブロック数(1〜depth) */
+  unsigned int next;					/* 次に取り出すデータブロック番号 */
+  unsigned int queued;					/* 要求を積んだデータブロック数(次に積む番号) */
+  off_t nextOffset, endOffset;				/* 次の読込み位置、データ終端位置 */
+} URING_READER;
+
+#define URING_READER_INIT	{.fd = -1, .fileFd = -1}
+
+/* データブロックへの読込み要求を投入キューに積む関数の定義 */
+static inline void uring_queue_read(URING_READER *ur, unsigned int slot)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int tail, index;
+  size_t length;
+
+  ur->offsets[slot] = ur->nextOffset;
+  if (ur->nextOffset >= ur->endOffset) {
+    ur->results[slot] = 0;				/* データ終端 */
+    return;
+  }
+  length = (size_t)(ur->endOffset - ur->nextOffset) < ur->blockBytes ?
+    (size_t)(ur->endOffset - ur->nextOffset) : ur->blockBytes;
+
+  tail = *ur->sqTail;
+  index = tail & *ur->sqMask;
+  sqe = &ur->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = ur->fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = ur->fileFd;
+  sqe->addr = (unsigned long)(ur->blocks + slot * ur->blockBytes);
+  sqe->len = (unsigned int)length;
+  sqe->off = (unsigned long long)ur->nextOffset;
+  sqe->buf_index = (unsigned short)slot;
+  sqe->user_data = slot;
+  ur->sqArray[index] = index;
+  __atomic_store_n(ur->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  ur->results[slot] = URING_PENDING;
+  ur->nextOffset += (off_t)length;
+  ur->toSubmit++;
+}
+
+/* 完了キューを刈り取り、未投入の要求を投入して、slotのデータブロックが完了するまで待つ関数の定義
+   slot < 0なら全ての要求の完了を待つ。戻り値: 0=成功、負=-errno */
+static inline int uring_wait(URING_READER *ur, int slot)
+{
+  unsigned int head, i;
+  int ret, waiting;
+
+  for (;;) {
+    /* 完了キューを刈り取り、各データブロックの読込み結果を記録する */
+    head = *ur->cqHead;
+    while (head != __atomic_load_n(ur->cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cqMask];
+      ur->results[cqe->user_data] = cqe->res;
+      head++;
+    }
+    __atomic_store_n(ur->cqHead, head, __ATOMIC_RELEASE);
+
+    if (slot >= 0)
+      waiting = (ur->results[slot] == URING_PENDING);
+    else
+      for (waiting = 0, i = 0; i < ur->depth; i++)
+	waiting |= (ur->results[i] == URING_PENDING);
+    if (!waiting && ur->toSubmit == 0)
+      return 0;
+    /* 未投入の要求を投入し、必要なデータブロックが未完了なら完了を待つ(1回のシステムコール) */
+    ret = (int)syscall(__NR_io_uring_enter, ur->fd, ur->toSubmit, waiting ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      return -errno;
+    }
+    ur->toSubmit -= (unsigned int)ret < ur->toSubmit ? (unsigned int)ret : ur->toSubmit;
+  }
+}
+
+/* 読込みに使う命令をカーネルが実装しているか確認する関数の定義
+   io_uring_setupは5.1から使えるが、IORING_OP_READは5.6からなので、命令一覧の問合せ(5.6以降)で確かめる。
+   戻り値: 0=対応、負=-errno(問合せ自体が無い古いカーネルは-EOPNOTSUPP) */
+static inline int uring_probe(URING_READER *ur)
+{
+  struct io_uring_probe *probe;
+  int err = 0;
+
+  probe = (struct io_uring_probe *)calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+  if (probe == NULL)
+    return -ENOMEM;
+  if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    err = (errno == EINVAL) ? -EOPNOTSUPP : -errno;
+  else if (probe->last_op < IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+	   || !(probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED))
+    err = -EOPNOTSUPP;
+  free(probe);
+  return err;
+}
+
+/* 読込み位置startからwindow個のデータブロックの読込み要求を投入し直す関数の定義
+   実行中の要求の完了を待ってから積み直すので、シーク時に呼んでもデータブロックを壊さない */
+static inline int uring_restart(URING_READER *ur, off_t start, unsigned int window)
+{
+  int err;
+
+  if ((err = uring_wait(ur, -1)) < 0)
+    return err;
+  ur->nextOffset = start;
+  ur->window = window < 1 ? 1 : window > ur->depth ? ur->depth : window;
+  ur->next = ur->queued = 0;
+  while (ur->queued < ur->window)
+    uring_queue_read(ur, ur->queued++ % ur->depth);
+  return 0;
+}
+
+/* io_uringを準備し、ファイルの[start, end)の先行読込み要求を投入する関数の定義
+   戻り値: 0=成功、負=-errno(非対応のカーネルなど。呼出し側はread()に切り替える) */
+static inline int uring_open(URING_READER *ur, int fileFd, unsigned int depth, size_t blockBytes, off_t start, off_t end)
+{
+  struct io_uring_params params;
+  struct iovec *iov;
+  unsigned char *sq, *cq;
+  int err;
+
+  memset(&params, 0, sizeof(params));
+  ur->fileFd = fileFd;
+  ur->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  if (ur->fd < 0)
+    return -errno;
+  if ((err = uring_probe(ur)) < 0)
+    return err;
+
+  /* 投入キュー、完了キュー、投入キュー・エントリ配列をマップする */
+  ur->sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ur->cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ur->sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  ur->sqRing = mmap(NULL, ur->sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+  ur->cqRing = mmap(NULL, ur->cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+  ur->sqes = (struct io_uring_sqe *)mmap(NULL, ur->sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					 ur->fd, IORING_OFF_SQES);
+  if (ur->sqRing == MAP_FAILED || ur->cqRing == MAP_FAILED || ur->sqes == MAP_FAILED)
+    return -ENOMEM;
+  sq = (unsigned char *)ur->sqRing;
+  cq = (unsigned char *)ur->cqRing;
+  ur->sqHead = (unsigned int *)(sq + params.sq_off.head);
+  ur->sqTail = (unsigned int *)(sq + params.sq_off.tail);
+  ur->sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  ur->sqArray = (unsigned int *)(sq + params.sq_off.array);
+  ur->cqHead = (unsigned int *)(cq + params.cq_off.head);
+  ur->cqTail = (unsigned int *)(cq + params.cq_off.tail);
+  ur->cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* データブロック配列をページ境界に揃えて割り当て、カーネルに登録する */
+  ur->depth = depth;
+  ur->blockBytes = blockBytes;
+  if (posix_memalign((void **)&ur->blocks, 4096, depth * blockBytes) != 0)
+    ur->blocks = NULL;
+  ur->results = (long *)malloc(depth * sizeof(long));
+  ur->offsets = (off_t *)malloc(depth * sizeof(off_t));
+  iov = (struct iovec *)malloc(depth * sizeof(struct iovec));
+  if (ur->blocks == NULL || ur->results == NULL || ur->offsets == NULL || iov == NULL) {
+    free(iov);
+    return -ENOMEM;
+  }
+  for (unsigned int i = 0; i < depth; i++) {
+    iov[i].iov_base = ur->blocks + i * blockBytes;
+    iov[i].iov_len = blockBytes;
+  }
+  /* 登録できない場合(RLIMIT_MEMLOCK等)は通常のREAD要求を用いる */
+  ur->fixedBuffers = (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_BUFFERS, iov, depth) == 0);
+  free(iov);
+
+  /* 全データブロックの読込み要求を先行して投入する */
+  ur->endOffset = end;
+  ur->toSubmit = 0;
+  for (unsigned int i = 0; i < depth; i++)
+    ur->results[i] = 0;
+  return uring_restart(ur, start, depth) < 0 ? -EIO : 0;
+}
+
+/* 読込みが完了したデータブロックを取り出す関数の定義。*offsetにはブロックのファイル位置を返す
+   戻り値: 読み込めたバイト数、0=データ終端、負=-errno */
+static inline long uring_acquire(URING_READER *ur, unsigned char **block, off_t *offset)
+{
+  unsigned int slot = ur->next % ur->depth;
+  int err;
+
+  if ((err = uring_wait(ur, (int)slot)) < 0)
+    return err;
+  if (ur->results[slot] < 0)
+    return ur->results[slot];				/* 読込みエラー(-errno) */
+  *block = ur->blocks + slot * ur->blockBytes;
+  if (offset != NULL)
+    *offset = ur->offsets[slot];
+  return ur->results[slot];
+}
+
+/* 使い終えたデータブロックを返し、先行要求の数を広げながら次の読込み要求を積む関数の定義 */
+static inline void uring_release(URING_READER *ur)
+{
+  ur->next++;
+  if (ur->window < ur->depth)
+    ur->window = ur->window * 2 > ur->depth ? ur->depth : ur->window * 2;
+  while (ur->queued - ur->next < ur->window)
+    uring_queue_read(ur, ur->queued++ % ur->depth);
+}
+
+/* io_uringの資源を開放する関数の定義 */
+static inline void uring_close(URING_READER *ur)
+{
+  if (ur->fd >= 0)
+    close(ur->fd);					/* 未完了の要求はカーネルが取り消す */
+  if (ur->sqRing != NULL && ur->sqRing != MAP_FAILED)
+    munmap(ur->sqRing, ur->sqRingBytes);
+  if (ur->cqRing != NULL && ur->cqRing != MAP_FAILED)
+    munmap(ur->cqRing, ur->cqRingBytes);
+  if (ur->sqes != NULL && (void *)ur->sqes != MAP_FAILED)
+    munmap(ur->sqes, ur->sqesBytes);
+  free(ur->blocks);
+  free(ur->results);
+  free(ur->offsets);
+  memset(ur, 0, sizeof(*ur));
+  ur->fd = -1;
+  ur->fileFd = -1;
+}
+
+#endif
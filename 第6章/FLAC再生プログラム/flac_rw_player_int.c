@@ -3,21 +3,73 @@
  		     -  標準read/write転送  -
  ソースコード：flac_rw_player_int.c
  ****************************************************************************/
+#define _GNU_SOURCE			/* CPU固定(pthread_setaffinity_np)に必要 */
+
 #include <stdbool.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "alsa/asoundlib.h"
 #include "FLAC/stream_decoder.h" 
 #include "FLAC/metadata.h"
+#include "PeriodStats.h"
+#include "RealtimeSched.h"
+#include "MediaIndex.h"
+#include "UringReader.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 /* ユーティリティ関数のプロトタイプ宣言 */
 static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
 static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams);
-static long flac_read_int_frames (int *datablock, long nFrames);
+static int set_period_frames(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
+static snd_pcm_format_t negotiate_format(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
+static int step_up_period(snd_pcm_t *handle);
+static long flac_read_int_frames (void *datablock, long nFrames);
+static long flac_read_play_frames(void *dataBlock, long nFrames);
+static int flac_seek_frames(FLAC__uint64 sample);
+static int parse_position(const char *s, FLAC__uint64 *pos);
+static int parse_segments(void);
 static void buffer2block(void);
+static void select_interleave(unsigned int channels);
 static int flac_write_int(snd_pcm_t *handle);
+static int flac_direct_int(snd_pcm_t *handle);
+static void *decode_worker(void *arg);
+static long ring_acquire(unsigned char **block);
+static void ring_release(void);
+static void ring_sleep(void);
+static int flac_parallel_decode(const char *filePath);
+static void *parallel_worker(void *arg);
+static int flac_index_lookup(const char *filePath);
+static void flac_index_store(const char *filePath);
+static void print_streaminfo(void);
+static int flac_input_open(const char *filePath);
+static void flac_input_close(void);
+static int parse_count(const char *s, long min, long max, long *value);
 static void usage(void);
 static snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
 
+/* 平面配置のデコーダバッファをインターリーブ配置に変換し、左詰めするカーネル関数の型 */
+typedef void (*INTERLEAVE_FUNC)(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift);
+static void interleave_generic(void *out, const FLAC__int32 *const src[], int pos, int n,
+			       unsigned int channels, unsigned int shift);
+static void interleave_s16_generic(void *out, const FLAC__int32 *const src[], int pos, int n,
+				   unsigned int channels, unsigned int shift);
+static void interleave_s24_generic(void *out, const FLAC__int32 *const src[], int pos, int n,
+				   unsigned int channels, unsigned int shift);
+static INTERLEAVE_FUNC interleave_func = interleave_generic;	/* 選択された変換カーネル */
+static INTERLEAVE_FUNC interleave_fallback = interleave_generic;	/* チャンネル数不一致時の変換カーネル */
+static const char *interleave_name = "scalar";			/* 選択された変換カーネル名 */
+
 /*** ALSAライブラリのパラメータ初期化 ***/
 static char *device = "plughw:0,0";			/* 再生PCMデバイス名*/
 static snd_pcm_format_t format = SND_PCM_FORMAT_S32_LE;	/* サンプル・コンテナのフォーマット */
@@ -30,15 +82,42 @@ static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(
 static snd_output_t *output = NULL;			/* 出力オブジェクトに 対するALSA内部構造体へのハンドル */
 
 /*** アプリケーション制御フラグの初期化 ***/
-static int mmap = 0;					/* 転送方法制御フラグ: write=0, mmap write=1  */
+static int mmap_access = 0;				/* 転送方法制御フラグ: write=0, mmap write=1  */
+static int direct = 0;					/* mmap領域への直接デコード・フラグ: set=1 clear=0 */
 static int verbose = 0;					/* 詳細情報表示フラグ: set=1 clear=0 */
 static int resample = 1;				/* 標本化速度変換設定フラグ: set=1 clear=0 */
+static int wide = 0;					/* 32bit出力固定フラグ: set=1 clear=0 */
+static unsigned int sampleBytes = 4;			/* 出力サンプル当りのバイト数 */
+static unsigned int decodeAhead = 0;			/* 先行デコードするデータブロック数: 0=デコードスレッド無し */
+static unsigned int parallel = 0;			/* 並列デコードのスレッド数: 0=再生する */
+static const char *outPath = NULL;			/* 並列デコードの出力ファイル名: NULL=出力しない */
+static PERIOD_STATS stats;				/* 転送周期統計: stats.enabled=1で計測 */
+static const char *statsJson = NULL;			/* 転送周期統計のJSON出力先: NULL=出力しない */
+static RT_CONFIG rt = RT_CONFIG_INIT;			/* 再生スレッドの実時間設定 */
+static MEDIA_INDEX mindex = MEDIA_INDEX_INIT;		/* メタデータ索引キャッシュ: fd=-1で使わない */
+
+/*** レイテンシ・プロファイルの定義 ***/
+enum { LATENCY_LOW, LATENCY_BALANCED, LATENCY_THROUGHPUT };
+static int latency = LATENCY_THROUGHPUT;		/* レイテンシ・プロファイル */
+static snd_pcm_uframes_t req_period_frames = 0;		/* 転送周期の要求値(frames): 0=プロファイルに従う */
+static unsigned int req_periods = 0;			/* バッファ当りの周期数の要求値: 0=プロファイルに従う */
+#define MAX_PERIOD_FRAMES (1 << 20)			/* 転送周期の要求値(-F)の上限(frames) */
+#define MAX_PERIODS (1024)				/* バッファ当りの周期数の要求値(-B)の上限 */
 
 /* libFLAC規定のコールバック関数の宣言 */
 static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, 
 							const FLAC__int32 * const buffer[], void *user_data);
 static void metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *user_data);
 static void error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *user_data);
+static FLAC__StreamDecoderReadStatus read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes,
+						   void *client_data);
+static FLAC__StreamDecoderSeekStatus seek_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 absolute_byte_offset,
+						   void *client_data);
+static FLAC__StreamDecoderTellStatus tell_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *absolute_byte_offset,
+						   void *client_data);
+static FLAC__StreamDecoderLengthStatus length_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *stream_length,
+						       void *client_data);
+static FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder, void *client_data);
 
 /*** 共通ユーザデータの定義、宣言 ***/
 typedef struct{
@@ -52,10 +131,134 @@ typedef struct{
   int block_pos;					/* 転送データブロックの現在位置 */
   long counter;						/* 要求に対して、未転送のサンプル・フレーム数 */
   unsigned int qbits;					/* 量子化ビット数 */
+  FLAC__uint64 *seekSamples;				/* SEEKTABLEのシークポイント(サンプル番号) */
+  FLAC__uint64 *seekOffsets;				/* シークポイントのフレーム位置(最初のフレームからのbytes) */
+  unsigned int numSeekPoints;				/* シークポイント数 */
+  const FLAC__int32 *chan[FLAC__MAX_CHANNELS];		/* デコーダバッファのチャンネル・ポインタの写し */
+  FLAC__uint64 skip;					/* シーク後に読み捨てるサンプル・フレーム数 */
 } FLAC_DECODER ;
 
 static FLAC_DECODER dflac;
 
+/*** FLACファイル入力(FLAC__stream_decoder_init_stream()のコールバック)の定義 ***/
+#define FLAC_PREFETCH_KBYTES (1024)			/* 先読みバッファの既定サイズ(KiB) */
+#define MAX_PREFETCH_KBYTES (65536)			/* 先読みバッファのサイズ(-p)の上限(KiB) */
+#define FLAC_INPUT_ALIGN (4096)				/* 先読みの読込み位置とバッファのアライメント(bytes) */
+#define FLAC_READAHEAD_BYTES (1024 * 1024)		/* ファイルマップ時に先読みを要求する窓(bytes) */
+
+enum { INPUT_PREFETCH, INPUT_FILEMAP, INPUT_MEMORY };
+
+typedef struct{
+  int fd;						/* FLACファイル記述子 */
+  FLAC__uint64 length;					/* ファイル長(bytes) */
+  FLAC__uint64 pos;					/* 次に読み出すファイル位置 */
+  const unsigned char *data;				/* ファイル全体の内容: NULL=先読みバッファ経由で読む */
+  unsigned char *map;					/* ファイルマップ領域: MAP_FAILED=マップしない */
+  unsigned char *buf;					/* 先読みバッファ(read入力)、またはファイル全体を読み込んだメモリ */
+  size_t bufBytes;					/* 先読みバッファ(データブロック)のバイト数 */
+  FLAC__uint64 bufStart;				/* 先読みバッファ先頭のファイル位置 */
+  size_t bufFill;					/* 先読みバッファの有効バイト数 */
+  FLAC__uint64 advised;					/* ファイルマップの先読み要求済みバイト数 */
+  unsigned long reads;					/* ファイルの読込み回数 */
+  const unsigned char *block;				/* 現在の先読みバッファ(bufまたはio_uringのデータブロック) */
+  int uring;						/* io_uring入力フラグ: set=1 clear=0(read入力) */
+  int held;						/* io_uringのデータブロック取出し中フラグ */
+} FLAC_INPUT;
+
+static int inputMode = INPUT_PREFETCH;			/* FLACファイルの入力方法 */
+static size_t prefetchBytes = FLAC_PREFETCH_KBYTES * 1024;	/* 先読みバッファのバイト数 */
+static int useUring = 0;				/* io_uring先行読込みフラグ: set=1 clear=0 */
+static FLAC_INPUT input = {-1, 0, 0, NULL, MAP_FAILED, NULL, 0, 0, 0, 0, 0, NULL, 0, 0};
+static URING_READER urd = URING_READER_INIT;		/* io_uring読込み器(UringReader.h) */
+static long flac_input_fill(FLAC_INPUT *in);
+
+/*** 再生区間の定義 ***/
+#define MAX_SEGMENTS (64)				/* 再生区間数の上限 */
+
+typedef struct{
+  FLAC__uint64 start, end;				/* 再生区間 [start, end) のサンプル番号 */
+} PLAY_SEGMENT;
+
+static const char *segSpecs[MAX_SEGMENTS];		/* 再生区間指定文字列 */
+static unsigned int numSegSpecs = 0;			/* 再生区間指定数: 0=全体を再生 */
+static PLAY_SEGMENT segments[MAX_SEGMENTS];		/* 再生区間 */
+static unsigned int numSegments = 0;			/* 再生区間数 */
+static unsigned int curSegment = 0;			/* 再生中の区間番号 */
+static int segStarted = 0;				/* 再生中の区間の開始済フラグ */
+static FLAC__uint64 segPos = 0;			/* 次にデコードするサンプル番号 */
+static FLAC__uint64 playFrames;				/* 全区間の合計フレーム数 */
+
+/*** フレーム位置索引(SEEKTABLEの無いファイル用)の定義 ***/
+/* 区画の参照は定数時間だが、記録されるのはデコードを終えた範囲だけなので、索引が効くのは
+   再生済みの範囲へのシーク(区間の繰返しや近傍)に限られる。未再生の範囲への最初のシークは
+   libFLACの二分探索になる */
+#define FRAME_INDEX_GRID (32768)			/* 索引の区画長(サンプル・フレーム数) */
+
+typedef struct{
+  FLAC__uint64 sample;					/* フレーム先頭のサンプル番号 */
+  FLAC__uint64 offset;					/* フレーム先頭のファイル位置: 0=未記録 */
+} FRAME_POINT;
+
+typedef struct{
+  FRAME_POINT *points;					/* 区画ごとに最初に始まるフレームの位置 */
+  size_t numBuckets;					/* 区画数 */
+  unsigned long hits, misses;				/* 索引によるシーク、libFLACによるシークの回数 */
+} FRAME_INDEX;
+
+static FRAME_INDEX findex;				/* points=NULLで索引を使わない */
+
+static void frame_index_record(const FLAC__Frame *frame);
+static const FRAME_POINT *frame_index_find(FLAC__uint64 sample);
+
+/*** 先行デコード・リングバッファ(単一生産者・単一消費者)の定義 ***/
+#define MAX_DECODE_AHEAD (256)				/* 先行デコード深さの上限 */
+
+typedef struct{
+  unsigned char *blocks;				/* データブロック配列(depth個) */
+  long *frames;						/* 各データブロックの有効フレーム数 */
+  unsigned int depth;					/* データブロック数(先行デコード深さ) */
+  long blockFrames;					/* データブロック当りのフレーム数 */
+  size_t blockBytes;					/* データブロック当りのバイト数 */
+  atomic_uint head;					/* 書込み位置: デコードスレッドのみ更新 */
+  atomic_uint tail;					/* 読出し位置: 再生スレッドのみ更新 */
+  atomic_int done;					/* デコード終了フラグ */
+  atomic_int error;					/* デコードエラー・フラグ */
+  atomic_int quit;					/* デコード中止要求フラグ */
+  unsigned long underruns;				/* 再生スレッドが空のリングを待った回数 */
+  unsigned long fillSum, fillCount;			/* 充填データブロック数の累計、計測回数 */
+  unsigned int fillMin;					/* 充填データブロック数の最小値 */
+} DECODE_RING;
+
+static DECODE_RING ring;
+static pthread_t decoder_thread;			/* デコードスレッドID */
+
+/*** 並列デコード(オフライン処理)の定義 ***/
+#define RANGES_PER_THREAD 4				/* スレッド当りの分割範囲数(負荷分散用) */
+#define MAX_PARALLEL (256)				/* 並列デコードのスレッド数の上限 */
+
+typedef struct{
+  FLAC__uint64 start, end;				/* デコード範囲 [start, end) のサンプル番号 */
+} DECODE_RANGE;
+
+typedef struct{
+  pthread_t thread;					/* ワーカ・スレッドID */
+  FLAC__StreamDecoder *decoder;				/* ワーカ専用のFLACデコーダ */
+  const char *filePath;					/* FLACファイル名 */
+  FLAC__uint64 pos, end;				/* 現在のデコード位置、範囲の終端 */
+  unsigned char *block;					/* 変換用データブロック(最大FLACブロック長) */
+  int outFd;						/* 出力ファイル記述子: -1=出力しない */
+  int error;						/* エラー・フラグ */
+  unsigned long ranges;					/* 処理した範囲数 */
+} RANGE_WORKER;
+
+static DECODE_RANGE *ranges;				/* 分割範囲の配列 */
+static unsigned int numRanges;				/* 分割範囲数 */
+static atomic_uint nextRange;				/* 次に処理する範囲の番号 */
+
+static FLAC__StreamDecoderWriteStatus range_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+							   const FLAC__int32 * const buffer[], void *user_data);
+static void range_error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *user_data);
+
 /* PCMにHWパラメータを設定するユーティリティ関数の定義 */
 int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
 {
@@ -75,7 +278,7 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
     return err;
   }
   /* 構成空間を実際のアクセス方法のみを包含するように制限する */
-  if (mmap) {
+  if (mmap_access) {
     err = snd_pcm_hw_params_set_access(handle, hwparams,
 				       SND_PCM_ACCESS_MMAP_INTERLEAVED);
   } else
@@ -87,6 +290,8 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
   }
 	
   /* 構成空間を唯一のフォーマットを包含するように制限する */
+  format = negotiate_format(handle, hwparams);
+  sampleBytes = (unsigned int)snd_pcm_format_physical_width(format) / 8;
   err = snd_pcm_hw_params_set_format(handle, hwparams, format);
   if (err < 0) {
     fprintf(stderr, "サンプルフォーマット非適用: %s\n", snd_strerror(err));
@@ -116,31 +321,38 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
     return -EINVAL;
   }
 
-  /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する */
-  err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
-  if (buffer_time > 500000)
-    buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
-  if (buffer_time > 0)
-    period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
-  else{
-    fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
-    return -EINVAL;
-  }
-		
-  /* 構成空間をbuffer_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間をperiod_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
-    return err;
+  if (latency == LATENCY_THROUGHPUT && req_period_frames == 0 && req_periods == 0) {
+    /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する(throughput) */
+    err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
+    if (buffer_time > 500000)
+      buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
+    if (buffer_time > 0)
+      period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
+    else{
+      fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
+      return -EINVAL;
+    }
+
+    /* 構成空間をbuffer_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
+      return err;
+    }
+
+    /* 構成空間をperiod_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
+      return err;
+    }
+  } else {
+    /* 転送周期と周期数をフレーム単位で折衝する(low, balanced, または明示指定) */
+    err = set_period_frames(handle, hwparams);
+    if (err < 0)
+      return err;
   }
-        
+
   /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
   err = snd_pcm_hw_params(handle, hwparams);
   if (err < 0) {
@@ -162,6 +374,57 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
   return 0;
 }
 
+/* レイテンシ・プロファイルに従い転送周期と周期数をフレーム単位で折衝するユーティリティ関数の定義 */
+int set_period_frames(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_uframes_t periodFrames, periodMin;
+  unsigned int periods;
+  int err, dir = 0;
+
+  /* 構成空間から転送周期の最小値を抽出する */
+  err = snd_pcm_hw_params_get_period_size_min(hwparams, &periodMin, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size最小値取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  switch (latency) {
+  case LATENCY_LOW:		/* デバイスが許容する最小の転送周期を3周期 */
+    periodFrames = periodMin;
+    periods = 3;
+    break;
+  case LATENCY_BALANCED:	/* 10 msecの転送周期を4周期 */
+    periodFrames = rate / 100;
+    periods = 4;
+    break;
+  default:			/* 125 msecの転送周期を4周期 */
+    periodFrames = rate / 8;
+    periods = 4;
+    break;
+  }
+  if (req_period_frames > 0)
+    periodFrames = req_period_frames;
+  if (req_periods > 0)
+    periods = req_periods;
+  if (periodFrames < periodMin)
+    periodFrames = periodMin;
+
+  /* 構成空間をperiod_size要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_period_size_near(handle, hwparams, &periodFrames, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size設定不可 %lu : %s\n", periodFrames, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を周期数要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_periods_near(handle, hwparams, &periods, &dir);
+  if (err < 0) {
+    fprintf(stderr, "periods設定不可 %u : %s\n", periods, snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
 /* PCMにSWパラメータを設定するユーティリティ関数の定義 */
 int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
 {
@@ -198,8 +461,23 @@ int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
   return 0;
 }
  
+/* 量子化ビット数に一致するサンプル・フォーマットを選択するユーティリティ関数の定義 */
+snd_pcm_format_t negotiate_format(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_format_t native = SND_PCM_FORMAT_S32_LE;
+
+  /* 16bit, 24bit音源は同じ幅のフォーマットを優先し、PCMが受け付けなければ32bitに拡張する */
+  if (!wide && dflac.qbits == 16)
+    native = SND_PCM_FORMAT_S16_LE;
+  else if (!wide && dflac.qbits == 24)
+    native = SND_PCM_FORMAT_S24_3LE;
+  if (native != SND_PCM_FORMAT_S32_LE && snd_pcm_hw_params_test_format(handle, hwparams, native) == 0)
+    return native;
+  return SND_PCM_FORMAT_S32_LE;
+}
+
 /* 要求サンプル・フレーム数のFLACデータのデコードを制御するユーティリティ関数の定義 */
-long flac_read_int_frames(int *dataBlock, long nFrames)
+long flac_read_int_frames(void *dataBlock, long nFrames)
 {	
   dflac.block_pos = 0;
   dflac.dataBlock = dataBlock;
@@ -230,63 +508,629 @@ long flac_read_int_frames(int *dataBlock, long nFrames)
 void buffer2block(void)
 {	
   const FLAC__Frame *frame = dflac.frame;
-  const FLAC__int32 *const *dec_buffer = dflac.dec_buffer;
-
-  int *dataBlock = (int *)dflac.dataBlock;
-  unsigned int shift = 32 - frame->header.bits_per_sample;
-  for (int i = 0 ; i < (int)frame->header.blocksize && dflac.counter > 0 ; i++){	
-    if (dflac.buffer_pos >= (int)frame->header.blocksize)
-      break ;
-    for (int j = 0 ; j < (int)frame->header.channels ; j++)
-      dataBlock [dflac.block_pos + j] = dec_buffer [j][dflac.buffer_pos] << shift;
-    dflac.block_pos += (int)frame->header.channels;
-    dflac.counter --;
-    dflac.buffer_pos++;
-  }				
+  unsigned int channels = frame->header.channels;
+  int n = (int)frame->header.blocksize - dflac.buffer_pos;	/* 一括転送するフレーム数 */
+
+  if (n > dflac.counter)
+    n = (int)dflac.counter;
+  /* データブロックの外(シーク中のデコードなど)では転送しない */
+  if (n <= 0 || dflac.dataBlock == NULL)
+    return;
+
+  /* 出力フォーマットのビット幅に左詰めする */
+  void *dst = (unsigned char *)dflac.dataBlock + (size_t)dflac.block_pos * sampleBytes;
+  unsigned int shift = (unsigned int)snd_pcm_format_width(format) - frame->header.bits_per_sample;
+
+  /* 選択済みカーネルはストリームのチャンネル数に特化しているので、不一致なら汎用版を使う */
+  if (channels == numChannels)
+    interleave_func(dst, dflac.dec_buffer, dflac.buffer_pos, n, channels, shift);
+  else
+    interleave_fallback(dst, dflac.dec_buffer, dflac.buffer_pos, n, channels, shift);
+  dflac.block_pos += n * (int)channels;
+  dflac.counter -= n;
+  dflac.buffer_pos += n;
+  return;
+}
+
+/* 再生区間に従ってデータブロックをデコードするユーティリティ関数の定義
+   区間の先頭でシークし、区間の終端でデータブロックを打ち切る。戻り値: フレーム数、0=全区間終了、負=エラー */
+long flac_read_play_frames(void *dataBlock, long nFrames)
+{
+  PLAY_SEGMENT *seg;
+  long readFrames;
+
+  while (curSegment < numSegments) {
+    seg = &segments[curSegment];
+    if (!segStarted) {
+      /* 直前の区間の終端(最初の区間ではファイル先頭)から続く区間はシークしない */
+      if (seg->start != segPos && flac_seek_frames(seg->start) < 0)
+	return -1;
+      segPos = seg->start;
+      segStarted = 1;
+    }
+    if ((FLAC__uint64)nFrames > seg->end - segPos)
+      nFrames = (long)(seg->end - segPos);
+    if ((readFrames = flac_read_int_frames(dataBlock, nFrames)) < 0)
+      return readFrames;
+    segPos += (FLAC__uint64)readFrames;
+    if (readFrames == 0 || segPos >= seg->end) {
+      curSegment++;
+      segStarted = 0;
+    }
+    if (readFrames > 0)
+      return readFrames;
+  }
+  return 0;
+}
+
+/* 任意のサンプル位置にシークするユーティリティ関数の定義
+   フレーム位置索引に目標以前のフレームがあれば、そこからデコードして目標までを読み捨てる。
+   無ければlibFLACのシーク(SEEKTABLEまたは二分探索)を使う。戻り値: 0=成功、-1=失敗 */
+int flac_seek_frames(FLAC__uint64 sample)
+{
+  const FRAME_POINT *p;
+
+  if (sample >= dflac.total_frames) {
+    fprintf(stderr, "シーク位置 %llu が総フレーム数 %llu を超える\n",
+	    (unsigned long long)sample, (unsigned long long)dflac.total_frames);
+    return -1;
+  }
+  /* デコーダバッファの未転送データと、前のデータブロックの未転送要求は捨てる */
+  dflac.frame = NULL;
+  dflac.buffer_pos = 0;
+  dflac.counter = 0;
+  dflac.skip = 0;
+
+  if ((p = frame_index_find(sample)) != NULL && p->offset <= input.length
+      && FLAC__stream_decoder_flush(dflac.decoder)) {
+    input.pos = p->offset;
+    dflac.skip = sample - p->sample;
+    findex.hits++;
+    return 0;
+  }
+  findex.misses++;
+  if (!FLAC__stream_decoder_seek_absolute(dflac.decoder, sample)) {
+    fprintf(stderr, "シーク失敗: %s\n",
+	    FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(dflac.decoder)]);
+    /* SEEK_ERROR状態はflushで復帰させる */
+    FLAC__stream_decoder_flush(dflac.decoder);
+    return -1;
+  }
+  return 0;
+}
+
+/* デコードしたフレームの次のフレーム位置を索引に記録するユーティリティ関数の定義
+   区画ごとに最初に始まるフレームだけを記録するので、位置の取得は区画当り1回程度で済む */
+void frame_index_record(const FLAC__Frame *frame)
+{
+  FLAC__uint64 next, offset;
+  size_t b;
+
+  if (findex.points == NULL || frame->header.number_type != FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER)
+    return;
+  next = frame->header.number.sample_number + frame->header.blocksize;
+  b = (size_t)(next / FRAME_INDEX_GRID);
+  if (b >= findex.numBuckets || (findex.points[b].offset != 0 && findex.points[b].sample <= next))
+    return;
+  /* 書込みコールバック中のデコード位置は、このフレームの終端(次のフレームの先頭)を指す */
+  if (FLAC__stream_decoder_get_decode_position(dflac.decoder, &offset) && offset > 0) {
+    findex.points[b].sample = next;
+    findex.points[b].offset = offset;
+  }
+}
+
+/* 目標サンプル以前で最も近い記録済みフレームを索引から探すユーティリティ関数の定義
+   目標と同じ区画、無ければ直前の区画を調べる。戻り値: 記録、NULL=記録無し */
+const FRAME_POINT *frame_index_find(FLAC__uint64 sample)
+{
+  size_t b = (size_t)(sample / FRAME_INDEX_GRID);
+
+  if (findex.points == NULL || b >= findex.numBuckets)
+    return NULL;
+  if (findex.points[b].offset != 0 && findex.points[b].sample <= sample)
+    return &findex.points[b];
+  if (b > 0 && findex.points[b - 1].offset != 0)
+    return &findex.points[b - 1];
+  return NULL;
+}
+
+/* 再生位置の指定文字列をサンプル番号に変換するユーティリティ関数の定義
+   整数はサンプル番号、':'を含むか's'で終われば時刻([[時:]分:]秒[.小数])とする。戻り値: 0=成功、-1=書式誤り */
+int parse_position(const char *s, FLAC__uint64 *pos)
+{
+  size_t len = strlen(s);
+  double t = 0.0, v;
+  char *end;
+
+  if (len == 0)
+    return -1;
+  if (strchr(s, ':') == NULL && s[len - 1] != 's') {
+    if (*s < '0' || *s > '9')
+      return -1;
+    *pos = (FLAC__uint64)strtoull(s, &end, 10);
+    return *end == '\0' ? 0 : -1;
+  }
+  do {
+    /* 各欄は数字と小数点だけ(空白、符号、nan/inf、16進、指数表記は受け付けない) */
+    if (strspn(s, "0123456789.") == 0)
+      return -1;
+    v = strtod(s, &end);
+    if (end != s + strspn(s, "0123456789.") || !isfinite(v))
+      return -1;
+    t = t * 60.0 + v;
+    s = end + 1;
+  } while (*end == ':');
+  if (!(*end == '\0' || (*end == 's' && end[1] == '\0')) || !isfinite(t) || t * (double)rate >= 18446744073709551615.0)
+    return -1;
+  *pos = (FLAC__uint64)(t * (double)rate + 0.5);
+  return 0;
+}
+
+/* 再生区間の指定文字列("開始-終了"、どちらも省略可)を解析するユーティリティ関数の定義
+   指定が無ければファイル全体を1区間とする。戻り値: 0=成功、-1=指定誤り */
+int parse_segments(void)
+{
+  char spec[128], *dash;
+  FLAC__uint64 start, end;
+  unsigned int i;
+
+  numSegments = 0;
+  playFrames = 0;
+  if (numSegSpecs == 0) {
+    segments[numSegments].start = 0;
+    segments[numSegments++].end = dflac.total_frames;
+    playFrames = dflac.total_frames;
+    return 0;
+  }
+  for (i = 0; i < numSegSpecs; i++) {
+    snprintf(spec, sizeof(spec), "%s", segSpecs[i]);
+    start = 0;
+    end = dflac.total_frames;
+    if ((dash = strchr(spec, '-')) != NULL)
+      *dash++ = '\0';
+    if ((spec[0] != '\0' && parse_position(spec, &start) < 0)
+	|| (dash != NULL && *dash != '\0' && parse_position(dash, &end) < 0)) {
+      fprintf(stderr, "再生区間 %s の書式誤り: 位置はサンプル番号または[[時:]分:]秒[.小数]\n", segSpecs[i]);
+      return -1;
+    }
+    if (end > dflac.total_frames)
+      end = dflac.total_frames;
+    if (start >= end) {
+      fprintf(stderr, "再生区間 %s が空、またはファイルの範囲外\n", segSpecs[i]);
+      return -1;
+    }
+    segments[numSegments].start = start;
+    segments[numSegments++].end = end;
+    playFrames += end - start;
+  }
+  return 0;
+}
+
+/* 任意チャンネル数に対応する変換カーネル(スカラ版)の定義 */
+void interleave_generic(void *out, const FLAC__int32 *const src[], int pos, int n,
+			unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  for (int i = 0 ; i < n ; i++)
+    for (unsigned int j = 0 ; j < channels ; j++)
+      *dst++ = (int)((unsigned int)src[j][pos + i] << shift);
+}
+
+/* S16_LE出力用の変換カーネル(スカラ版)の定義 */
+void interleave_s16_generic(void *out, const FLAC__int32 *const src[], int pos, int n,
+			    unsigned int channels, unsigned int shift)
+{
+  short *dst = (short *)out;
+  for (int i = 0 ; i < n ; i++)
+    for (unsigned int j = 0 ; j < channels ; j++)
+      *dst++ = (short)((unsigned int)src[j][pos + i] << shift);
+}
+
+/* S24_3LE出力用の変換カーネル(スカラ版)の定義 */
+void interleave_s24_generic(void *out, const FLAC__int32 *const src[], int pos, int n,
+			    unsigned int channels, unsigned int shift)
+{
+  unsigned char *dst = (unsigned char *)out;
+  for (int i = 0 ; i < n ; i++)
+    for (unsigned int j = 0 ; j < channels ; j++){
+      unsigned int v = (unsigned int)src[j][pos + i] << shift;
+      *dst++ = (unsigned char)v;
+      *dst++ = (unsigned char)(v >> 8);
+      *dst++ = (unsigned char)(v >> 16);
+    }
+}
+
+#ifdef __SSE2__
+/* 4x4要素の32bit整数行列を転置するSSE2補助関数 */
+static inline void transpose4_sse2(__m128i *r0, __m128i *r1, __m128i *r2, __m128i *r3)
+{
+  __m128i t0 = _mm_unpacklo_epi32(*r0, *r1);
+  __m128i t1 = _mm_unpacklo_epi32(*r2, *r3);
+  __m128i t2 = _mm_unpackhi_epi32(*r0, *r1);
+  __m128i t3 = _mm_unpackhi_epi32(*r2, *r3);
+
+  *r0 = _mm_unpacklo_epi64(t0, t1);
+  *r1 = _mm_unpackhi_epi64(t0, t1);
+  *r2 = _mm_unpacklo_epi64(t2, t3);
+  *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+#define LOAD_SHIFT_SSE2(c, i) _mm_sll_epi32(_mm_loadu_si128((const __m128i *)(src[c] + pos + (i))), cnt)
+
+/* モノラル用変換カーネル(SSE2版) */
+static void interleave_1ch_sse2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 4 <= n ; i += 4)
+    _mm_storeu_si128((__m128i *)(dst + i), LOAD_SHIFT_SSE2(0, i));
+  interleave_generic(dst + i, src, pos + i, n - i, 1, shift);
+}
+
+/* ステレオ用変換カーネル(SSE2版) */
+static void interleave_2ch_sse2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 4 <= n ; i += 4){
+    __m128i l = LOAD_SHIFT_SSE2(0, i);
+    __m128i r = LOAD_SHIFT_SSE2(1, i);
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(l, r));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 4), _mm_unpackhi_epi32(l, r));
+  }
+  interleave_generic(dst + 2 * i, src, pos + i, n - i, 2, shift);
+}
+
+/* 5.1ch用変換カーネル(SSE2版): 前4chを転置し、残り2chを64bit単位で後置する */
+static void interleave_6ch_sse2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 4 <= n ; i += 4){
+    __m128i c0 = LOAD_SHIFT_SSE2(0, i), c1 = LOAD_SHIFT_SSE2(1, i);
+    __m128i c2 = LOAD_SHIFT_SSE2(2, i), c3 = LOAD_SHIFT_SSE2(3, i);
+    __m128i c4 = LOAD_SHIFT_SSE2(4, i), c5 = LOAD_SHIFT_SSE2(5, i);
+    __m128i u0 = _mm_unpacklo_epi32(c4, c5);
+    __m128i u1 = _mm_unpackhi_epi32(c4, c5);
+    int *d = dst + 6 * i;
+
+    transpose4_sse2(&c0, &c1, &c2, &c3);
+    _mm_storeu_si128((__m128i *)(d +  0), c0);
+    _mm_storel_epi64((__m128i *)(d +  4), u0);
+    _mm_storeu_si128((__m128i *)(d +  6), c1);
+    _mm_storel_epi64((__m128i *)(d + 10), _mm_srli_si128(u0, 8));
+    _mm_storeu_si128((__m128i *)(d + 12), c2);
+    _mm_storel_epi64((__m128i *)(d + 16), u1);
+    _mm_storeu_si128((__m128i *)(d + 18), c3);
+    _mm_storel_epi64((__m128i *)(d + 22), _mm_srli_si128(u1, 8));
+  }
+  interleave_generic(dst + 6 * i, src, pos + i, n - i, 6, shift);
+}
+
+/* 7.1ch用変換カーネル(SSE2版): 4ch単位の転置を2回行う */
+static void interleave_8ch_sse2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 4 <= n ; i += 4){
+    __m128i c0 = LOAD_SHIFT_SSE2(0, i), c1 = LOAD_SHIFT_SSE2(1, i);
+    __m128i c2 = LOAD_SHIFT_SSE2(2, i), c3 = LOAD_SHIFT_SSE2(3, i);
+    __m128i c4 = LOAD_SHIFT_SSE2(4, i), c5 = LOAD_SHIFT_SSE2(5, i);
+    __m128i c6 = LOAD_SHIFT_SSE2(6, i), c7 = LOAD_SHIFT_SSE2(7, i);
+    int *d = dst + 8 * i;
+
+    transpose4_sse2(&c0, &c1, &c2, &c3);
+    transpose4_sse2(&c4, &c5, &c6, &c7);
+    _mm_storeu_si128((__m128i *)(d +  0), c0);
+    _mm_storeu_si128((__m128i *)(d +  4), c4);
+    _mm_storeu_si128((__m128i *)(d +  8), c1);
+    _mm_storeu_si128((__m128i *)(d + 12), c5);
+    _mm_storeu_si128((__m128i *)(d + 16), c2);
+    _mm_storeu_si128((__m128i *)(d + 20), c6);
+    _mm_storeu_si128((__m128i *)(d + 24), c3);
+    _mm_storeu_si128((__m128i *)(d + 28), c7);
+  }
+  interleave_generic(dst + 8 * i, src, pos + i, n - i, 8, shift);
+}
+
+/* S16_LE出力のモノラル用変換カーネル(SSE2版): 飽和パックで8サンプルずつ16bit化する */
+static void interleave_1ch_s16_sse2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				    unsigned int channels, unsigned int shift)
+{
+  short *dst = (short *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 8 <= n ; i += 8)
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(LOAD_SHIFT_SSE2(0, i), LOAD_SHIFT_SSE2(0, i + 4)));
+  interleave_s16_generic(dst + i, src, pos + i, n - i, 1, shift);
+}
+
+/* S16_LE出力のステレオ用変換カーネル(SSE2版) */
+static void interleave_2ch_s16_sse2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				    unsigned int channels, unsigned int shift)
+{
+  short *dst = (short *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 4 <= n ; i += 4){
+    __m128i l = LOAD_SHIFT_SSE2(0, i);
+    __m128i r = LOAD_SHIFT_SSE2(1, i);
+    _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r)));
+  }
+  interleave_s16_generic(dst + 2 * i, src, pos + i, n - i, 2, shift);
+}
+#endif /* __SSE2__ */
+
+#ifdef HAVE_X86_SIMD
+#define LOAD_SHIFT_AVX2(c, i) _mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)(src[c] + pos + (i))), cnt)
+
+/* モノラル用変換カーネル(AVX2版) */
+__attribute__((target("avx2")))
+static void interleave_1ch_avx2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 8 <= n ; i += 8)
+    _mm256_storeu_si256((__m256i *)(dst + i), LOAD_SHIFT_AVX2(0, i));
+  interleave_generic(dst + i, src, pos + i, n - i, 1, shift);
+}
+
+/* ステレオ用変換カーネル(AVX2版): レーン内で交互配置した後、128bitレーンを並べ替える */
+__attribute__((target("avx2")))
+static void interleave_2ch_avx2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 8 <= n ; i += 8){
+    __m256i l = LOAD_SHIFT_AVX2(0, i);
+    __m256i r = LOAD_SHIFT_AVX2(1, i);
+    __m256i lo = _mm256_unpacklo_epi32(l, r);
+    __m256i hi = _mm256_unpackhi_epi32(l, r);
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  interleave_generic(dst + 2 * i, src, pos + i, n - i, 2, shift);
+}
+
+/* 7.1ch用変換カーネル(AVX2版): 8x8要素の転置で8フレームを一括変換する */
+__attribute__((target("avx2")))
+static void interleave_8ch_avx2(void *out, const FLAC__int32 *const src[], int pos, int n,
+				unsigned int channels, unsigned int shift)
+{
+  int *dst = (int *)out;
+  const __m128i cnt = _mm_cvtsi32_si128((int)shift);
+  int i = 0;
+
+  for ( ; i + 8 <= n ; i += 8){
+    __m256i t0 = LOAD_SHIFT_AVX2(0, i), t1 = LOAD_SHIFT_AVX2(1, i);
+    __m256i t2 = LOAD_SHIFT_AVX2(2, i), t3 = LOAD_SHIFT_AVX2(3, i);
+    __m256i t4 = LOAD_SHIFT_AVX2(4, i), t5 = LOAD_SHIFT_AVX2(5, i);
+    __m256i t6 = LOAD_SHIFT_AVX2(6, i), t7 = LOAD_SHIFT_AVX2(7, i);
+    __m256i a0 = _mm256_unpacklo_epi32(t0, t1), a1 = _mm256_unpackhi_epi32(t0, t1);
+    __m256i a2 = _mm256_unpacklo_epi32(t2, t3), a3 = _mm256_unpackhi_epi32(t2, t3);
+    __m256i a4 = _mm256_unpacklo_epi32(t4, t5), a5 = _mm256_unpackhi_epi32(t4, t5);
+    __m256i a6 = _mm256_unpacklo_epi32(t6, t7), a7 = _mm256_unpackhi_epi32(t6, t7);
+    __m256i b0 = _mm256_unpacklo_epi64(a0, a2), b1 = _mm256_unpackhi_epi64(a0, a2);
+    __m256i b2 = _mm256_unpacklo_epi64(a1, a3), b3 = _mm256_unpackhi_epi64(a1, a3);
+    __m256i b4 = _mm256_unpacklo_epi64(a4, a6), b5 = _mm256_unpackhi_epi64(a4, a6);
+    __m256i b6 = _mm256_unpacklo_epi64(a5, a7), b7 = _mm256_unpackhi_epi64(a5, a7);
+    __m256i *d = (__m256i *)(dst + 8 * i);
+
+    _mm256_storeu_si256(d + 0, _mm256_permute2x128_si256(b0, b4, 0x20));
+    _mm256_storeu_si256(d + 1, _mm256_permute2x128_si256(b1, b5, 0x20));
+    _mm256_storeu_si256(d + 2, _mm256_permute2x128_si256(b2, b6, 0x20));
+    _mm256_storeu_si256(d + 3, _mm256_permute2x128_si256(b3, b7, 0x20));
+    _mm256_storeu_si256(d + 4, _mm256_permute2x128_si256(b0, b4, 0x31));
+    _mm256_storeu_si256(d + 5, _mm256_permute2x128_si256(b1, b5, 0x31));
+    _mm256_storeu_si256(d + 6, _mm256_permute2x128_si256(b2, b6, 0x31));
+    _mm256_storeu_si256(d + 7, _mm256_permute2x128_si256(b3, b7, 0x31));
+  }
+  interleave_generic(dst + 8 * i, src, pos + i, n - i, 8, shift);
+}
+#endif /* HAVE_X86_SIMD */
+
+/* 出力フォーマット、チャンネル数、CPUの命令セットに応じて変換カーネルを選択するユーティリティ関数の定義 */
+void select_interleave(unsigned int channels)
+{
+  /* 16bit, 24bit出力 */
+  if (format == SND_PCM_FORMAT_S24_3LE){
+    interleave_func = interleave_fallback = interleave_s24_generic;
+    interleave_name = "scalar S24_3LE";
+    return;
+  }
+  if (format == SND_PCM_FORMAT_S16_LE){
+    interleave_func = interleave_fallback = interleave_s16_generic;
+    interleave_name = "scalar S16_LE";
+#ifdef __SSE2__
+    switch (channels){
+    case 1: interleave_func = interleave_1ch_s16_sse2; interleave_name = "SSE2 1ch S16_LE"; break;
+    case 2: interleave_func = interleave_2ch_s16_sse2; interleave_name = "SSE2 2ch S16_LE"; break;
+    }
+#endif
+    return;
+  }
+
+  /* 32bit出力 */
+  interleave_func = interleave_fallback = interleave_generic;
+  interleave_name = "scalar";
+#ifdef __SSE2__
+  switch (channels){
+  case 1: interleave_func = interleave_1ch_sse2; interleave_name = "SSE2 1ch"; break;
+  case 2: interleave_func = interleave_2ch_sse2; interleave_name = "SSE2 2ch"; break;
+  case 6: interleave_func = interleave_6ch_sse2; interleave_name = "SSE2 6ch"; break;
+  case 8: interleave_func = interleave_8ch_sse2; interleave_name = "SSE2 8ch"; break;
+  }
+#endif
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")){
+    switch (channels){
+    case 1: interleave_func = interleave_1ch_avx2; interleave_name = "AVX2 1ch"; break;
+    case 2: interleave_func = interleave_2ch_avx2; interleave_name = "AVX2 2ch"; break;
+    case 8: interleave_func = interleave_8ch_avx2; interleave_name = "AVX2 8ch"; break;
+    }
+  }
+#endif
   return;
 }
 
+/* アンダーラン発生時に転送周期を2倍に拡大してPCMを再構成するユーティリティ関数の定義 */
+int step_up_period(snd_pcm_t *handle)
+{
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
+  snd_pcm_uframes_t oldPeriod = period_size;
+  int err;
+
+  /* 既定のthroughputプロファイル、または周期が125 msecに達していれば拡大しない */
+  if ((latency == LATENCY_THROUGHPUT && req_period_frames == 0 && req_periods == 0) || period_size * 2 > rate / 8)
+    return 0;
+  snd_pcm_hw_params_alloca(&hwparams); 
+  snd_pcm_sw_params_alloca(&swparams);
+
+  snd_pcm_drop(handle);
+  req_period_frames = period_size * 2;
+  if ((err = set_hwparams(handle, hwparams)) < 0)
+    return err;
+  if ((err = set_swparams(handle, swparams)) < 0)
+    return err;
+  printf("アンダーラン検出: 転送周期を %lu → %lu フレームに拡大\n", oldPeriod, period_size);
+  return 1;
+}
+
 /* FLACサウンドデータの読込み、および再生を制御するユーティリティ関数の定義(標準read/write転送) */
 int flac_write_int(snd_pcm_t *handle)
 {
-  int *bufPtr;						/* 再生フレームバッファ */
-  const long numSoundFrames = (long)dflac.total_frames;	/* 再生サウンド総フレーム数 */
+  unsigned char *bufPtr;				/* 再生フレームバッファ */
+  unsigned char *frameBlock = NULL;			/* 同期デコード用データブロック */
+  const long numSoundFrames = (long)playFrames;		/* 再生サウンド総フレーム数(全区間の合計) */
+  const long frameBytes = (long)sampleBytes * numChannels;	/* 1フレーム当りのバイト数 */
   long nFrames, frameCount, numPlayFrames = 0;		/* 再生済フレーム数の初期化 */
   long readFrames, resFrames = numSoundFrames;		/* 未再生フレーム数の初期化 */
+  int useRing = (decodeAhead > 0);			/* デコードスレッド使用フラグ */
+  int workerStarted = 0;				/* デコードスレッド起動済フラグ */
   int err = 0; 
 	
-  /*  オーディオサンプルの転送に適用するデータブロックにメモリを割り当てる  */	
-  int *frameBlock = (int *)malloc(period_size * sizeof(int) * numChannels);
-  if (frameBlock == NULL) {
-    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
-    err = EXIT_FAILURE;
-    goto cleaning;
+  if (useRing) {
+    /* 先行デコード・リングバッファにメモリを割り当て、デコードスレッドを起動する */
+    ring.depth = decodeAhead;
+    ring.blockFrames = (long)period_size;
+    ring.blockBytes = period_size * frameBytes;
+    ring.blocks = (unsigned char *)malloc(ring.depth * ring.blockBytes);
+    ring.frames = (long *)malloc(ring.depth * sizeof(long));
+    if (ring.blocks == NULL || ring.frames == NULL) {
+      fprintf(stderr, "メモリ不足で先行デコード・リングバッファを割当てられない\n");
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+    /* 再生中のページフォールトを避けるため、全データブロックに事前に触れておく */
+    memset(ring.blocks, 0, ring.depth * ring.blockBytes);
+    atomic_init(&ring.head, 0);
+    atomic_init(&ring.tail, 0);
+    atomic_init(&ring.done, 0);
+    atomic_init(&ring.error, 0);
+    atomic_init(&ring.quit, 0);
+    ring.underruns = ring.fillSum = ring.fillCount = 0;
+    ring.fillMin = ring.depth;
+    if ((err = pthread_create(&decoder_thread, NULL, decode_worker, NULL)) != 0) {
+      fprintf(stderr, "デコードスレッド起動失敗: %s\n", strerror(err));
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+    workerStarted = 1;
+    /* 再生開始前にリングを満杯(またはストリーム終端)まで充填する */
+    while (atomic_load(&ring.head) < ring.depth && !atomic_load(&ring.done))
+      ring_sleep();
+  } else {
+    /*  オーディオサンプルの転送に適用するデータブロックにメモリを割り当てる  */	
+    frameBlock = (unsigned char *)malloc(period_size * frameBytes);
+    if (frameBlock == NULL) {
+      fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
   }
   nFrames = (long)period_size;	/* サウンドファイルから読み込むフレーム数の初期化 */
+  /* デコードスレッドの起動後に、再生スレッドだけへ実時間設定を適用する */
+  rt_prefault(&rt, frameBlock, period_size * frameBytes);
+  rt_start(&rt, handle);
+  stats_start(&stats, rate);
   while(resFrames>0){
-    readFrames = flac_read_int_frames (frameBlock, nFrames);
-    if (readFrames < 0) {
-      fprintf(stderr, "エラーによりFLACデコード中止\n");
-      err = EXIT_FAILURE;
-      goto cleaning;
+    if (useRing) {
+      /* デコードスレッドが充填したデータブロックを取り出す */
+      if ((readFrames = ring_acquire(&bufPtr)) == 0) {
+	if (atomic_load(&ring.error)) {
+	  fprintf(stderr, "エラーによりFLACデコード中止\n");
+	  err = EXIT_FAILURE;
+	  goto cleaning;
+	}
+	break;			/* ストリーム終端 */
+      }
+    } else {
+      readFrames = flac_read_play_frames(frameBlock, nFrames);
+      if (readFrames < 0) {
+	fprintf(stderr, "エラーによりFLACデコード中止\n");
+	err = EXIT_FAILURE;
+	goto cleaning;
+      }
+      if (readFrames == 0)
+	break;			/* ストリーム終端 */
+      bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
     }
+    stats_lap(&stats, &stats.read);
     frameCount = readFrames;	/* 書き込むサンプルフレーム数の初期値をサウンドファイルから読み込むフレーム数に設定 */
-    bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
     while (frameCount > 0) {
       err = (int)writei_func(handle, bufPtr, (snd_pcm_uframes_t)frameCount); /* PCMデバイスにサウンドフレームを転送 */
       if (err == -EAGAIN)
 	continue;
       if (err < 0) {
-	if (snd_pcm_recover(handle, err, 0) < 0) {
+	if (stats_xrun(&stats, err, snd_pcm_recover(handle, err, 0), numPlayFrames) < 0) {
 	  fprintf(stderr, "Write転送エラー: %s\n", snd_strerror(err));
 	  goto cleaning;
 	}
+	/* 転送周期を拡大した場合は同期デコード用データブロックを再割当てする
+	   (リングのデータブロックは任意のフレーム数で転送できるので、そのまま使う) */
+	if ((err = step_up_period(handle)) < 0)
+	  goto cleaning;
+	if (err > 0 && frameBlock != NULL) {
+	  free(frameBlock);
+	  if ((frameBlock = (unsigned char *)malloc(period_size * frameBytes)) == NULL) {
+	    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+	    err = EXIT_FAILURE;
+	    goto cleaning;
+	  }
+	  nFrames = (long)period_size;
+	}
 	break;				/* １データブロック周期をスキップ */
       } 
-      bufPtr += err *numChannels;	/* フレームバッファのポインタを実際に書いたフレーム数にチャンネル数を乗じた分だけ
-					   進める */
+      bufPtr += err * frameBytes;	/* フレームバッファのポインタを実際に書いたフレーム数にフレーム当りのバイト数を
+					   乗じた分だけ進める */
       frameCount -= err;		/* フレームバッファ中に残存する書き込み可能なフレーム数を算定 */
     }
+    stats_lap(&stats, &stats.write);
+    stats_period(&stats, handle);
+    if (useRing)
+      ring_release();
     numPlayFrames += readFrames;
 		
     /* データ・ブロック長以下の残データフレーム数の計算 */
@@ -295,20 +1139,460 @@ int flac_write_int(snd_pcm_t *handle)
   }
   snd_pcm_drop(handle);
   printf(" 合計　%lu フレームを再生して終了\n", numPlayFrames);
+  if (findex.hits + findex.misses > 0)
+    printf(" シーク：フレーム位置索引 %lu 回, libFLAC %lu 回\n", findex.hits, findex.misses);
+  if (useRing) {
+    /* 先行デコード深さの調整に用いる統計を表示する */
+    printf(" 先行デコード深さ：%u データブロック\n", ring.depth);
+    printf(" リング充填数：平均 %.1f / 最小 %u データブロック\n",
+	   ring.fillCount > 0 ? (double)ring.fillSum / (double)ring.fillCount : 0.0, ring.fillMin);
+    printf(" リング枯渇回数：%lu 回\n", ring.underruns);
+  }
   err = 0;
  cleaning:
+  stats_dump(&stats, stdout);			/* エラー終了時もそれまでの統計を残す */
+  stats_dump_json(&stats, statsJson);
+  if(workerStarted){
+    atomic_store(&ring.quit, 1);
+    pthread_join(decoder_thread, NULL);
+  }
+  if(ring.blocks != NULL){
+    free(ring.blocks);
+    ring.blocks = NULL;
+  }
+  if(ring.frames != NULL){
+    free(ring.frames);
+    ring.frames = NULL;
+  }
   if(frameBlock != NULL)
     free(frameBlock);
   return err;
 }
 
+/* FLACサウンドデータをmmap領域に直接デコードし、再生を制御するユーティリティ関数の定義(mmap_direct転送)
+   write_callbackがmmap_beginの返した領域へ変換・インターリーブするので、中間のデータブロックを使わない。
+   領域に収まらなかったFLACブロックの残りはデコーダバッファに置いたまま、次の領域の先頭に転送する */
+int flac_direct_int(snd_pcm_t *handle)
+{
+  const snd_pcm_channel_area_t *areas;			/* mmap領域構造体 */
+  snd_pcm_uframes_t offset, frames;			/* offset:mmap領域オフセット   */
+  snd_pcm_sframes_t avail, transferFrames;
+  const long numSoundFrames = (long)playFrames;		/* 再生サウンド総フレーム数(全区間の合計) */
+  const unsigned int frameBytes = sampleBytes * numChannels;	/* 1フレーム当りのバイト数 */
+  long nFrames, numPlayFrames = 0;			/* 再生済フレーム数の初期化 */
+  long readFrames, resFrames = numSoundFrames;		/* 未再生フレーム数の初期化 */
+  unsigned char *dst;					/* デコード先のmmap領域 */
+  unsigned char *carry = NULL;				/* コミットできなかったデコード済みフレームの退避領域 */
+  long carryFrames = 0, rest;				/* 退避フレーム数、今回退避するフレーム数 */
+  int err = 0, toStart = 1, endOfStream = 0;
+
+  nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
+  rt_start(&rt, handle);
+  stats_start(&stats, rate);
+  while (resFrames > 0 && !endOfStream) {
+    /* 再生用に書き込み可能なフレーム数を取得する */
+    avail = snd_pcm_avail_update(handle);
+    if (avail < 0) {
+      if ((err = stats_xrun(&stats, (int)avail, snd_pcm_recover(handle, (int)avail, 0), numPlayFrames)) < 0) {
+	fprintf(stderr, "書き込み可能フレーム取得失敗: %s\n", snd_strerror(err));
+	goto cleaning;
+      }
+      if ((err = step_up_period(handle)) < 0)
+	goto cleaning;
+      nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
+      toStart = 1;
+      continue;
+    }
+
+    if (avail < nFrames) {
+      if (toStart) {
+	toStart = 0;
+	err = snd_pcm_start(handle); /* PCMを明示的に開始 */
+	if (err < 0) {
+	  fprintf(stderr, "PCM開始エラー: %s\n", snd_strerror(err));
+	  goto cleaning;
+	}
+      } else {
+	err = snd_pcm_wait(handle, -1); /* PCMがready状態になるまで待機 */
+	if (err < 0) {
+	  if ((err = stats_xrun(&stats, err, snd_pcm_recover(handle, err, 0), numPlayFrames)) < 0) {
+	    fprintf(stderr, "PCM待機エラー: %s\n", snd_strerror(err));
+	    goto cleaning;
+	  }
+	  toStart = 1;
+	}
+      }
+      continue;
+    }
+
+    /* 1データブロックを転送する。リングバッファ終端や再生区間の境界ではmmap_begin/commitを分割する */
+    while (nFrames > 0) {
+      frames = (snd_pcm_uframes_t)nFrames;
+      /* mmap領域へのアクセスを要求する(framesは終端までの連続フレーム数に制限される) */
+      err = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+      if (err < 0) {
+	if ((err = stats_xrun(&stats, err, snd_pcm_recover(handle, err, 0), numPlayFrames)) < 0) {
+	  fprintf(stderr, "mmap領域アクセス失敗: %s\n", snd_strerror(err));
+	  goto cleaning;
+	}
+	toStart = 1;
+	break;
+      }
+      /* 変換カーネルはインターリーブ配置で連続した出力を前提とするので、first/stepで確認する */
+      for (unsigned int ch = 0; ch < numChannels; ch++) {
+	if (areas[ch].addr != areas[0].addr || areas[ch].step != frameBytes * 8
+	    || areas[ch].first != areas[0].first + ch * sampleBytes * 8) {
+	  fprintf(stderr, "mmap領域がインターリーブ配置でないため直接デコードできない\n");
+	  snd_pcm_mmap_commit(handle, offset, 0);
+	  err = EXIT_FAILURE;
+	  goto cleaning;
+	}
+      }
+      dst = (unsigned char *)areas[0].addr + areas[0].first / 8 + offset * frameBytes;
+
+      stats_mark(&stats);
+      if (carryFrames > 0) {
+	/* 前回コミットできなかったデコード済みフレームを先に書き戻す */
+	readFrames = carryFrames < (long)frames ? carryFrames : (long)frames;
+	memcpy(dst, carry, (size_t)readFrames * frameBytes);
+	carryFrames -= readFrames;
+	memmove(carry, carry + (size_t)readFrames * frameBytes, (size_t)carryFrames * frameBytes);
+      } else {
+	/* mmap_beginが返した領域にFLACフレームを直接デコードする */
+	readFrames = flac_read_play_frames(dst, (long)frames);
+      }
+      stats_lap(&stats, &stats.read);
+      if (readFrames < 0) {
+	fprintf(stderr, "エラーによりFLACデコード中止\n");
+	snd_pcm_mmap_commit(handle, offset, 0);
+	err = EXIT_FAILURE;
+	goto cleaning;
+      }
+      if (readFrames == 0) {
+	snd_pcm_mmap_commit(handle, offset, 0);
+	endOfStream = 1;			/* ストリーム終端 */
+	break;
+      }
+
+      /* mmap領域のデータを転送する */
+      transferFrames = snd_pcm_mmap_commit(handle, offset, (snd_pcm_uframes_t)readFrames);
+      stats_lap(&stats, &stats.write);
+      if (transferFrames > 0) {
+	/* 実際にコミットされたフレーム数だけ再生位置を進める */
+	numPlayFrames += (long)transferFrames;
+	nFrames -= (long)transferFrames;
+      }
+      if (transferFrames < 0 || transferFrames != readFrames) {
+	/* デコード済みのデータは読み直せないので、コミットできなかった分を回復前に退避する */
+	rest = readFrames - (transferFrames > 0 ? (long)transferFrames : 0);
+	unsigned char *saved = (unsigned char *)malloc((size_t)(rest + carryFrames) * frameBytes);
+	if (saved == NULL) {
+	  fprintf(stderr, "メモリ不足で未コミットのフレームを退避できない\n");
+	  err = EXIT_FAILURE;
+	  goto cleaning;
+	}
+	memcpy(saved, dst + (size_t)(readFrames - rest) * frameBytes, (size_t)rest * frameBytes);
+	if (carryFrames > 0)
+	  memcpy(saved + (size_t)rest * frameBytes, carry, (size_t)carryFrames * frameBytes);
+	free(carry);
+	carry = saved;
+	carryFrames += rest;
+	err = transferFrames >= 0 ? -EPIPE : (int)transferFrames;
+	if ((err = stats_xrun(&stats, err, snd_pcm_recover(handle, err, 0), numPlayFrames)) < 0) {
+	  fprintf(stderr, "mmap領域コミットエラー: %s\n", snd_strerror(err));
+	  goto cleaning;
+	}
+	toStart = 1;
+	break;
+      }
+    }
+    stats_period(&stats, handle);
+
+    /* 次のデータブロック長を計算する */
+    resFrames = numSoundFrames - numPlayFrames;
+    nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
+  }
+
+  snd_pcm_drop(handle);
+  printf(" 合計　%lu フレームを再生して終了\n", numPlayFrames);
+  if (findex.hits + findex.misses > 0)
+    printf(" シーク：フレーム位置索引 %lu 回, libFLAC %lu 回\n", findex.hits, findex.misses);
+  err = 0;
+ cleaning:
+  stats_dump(&stats, stdout);			/* エラー終了時もそれまでの統計を残す */
+  stats_dump_json(&stats, statsJson);
+  free(carry);
+  return err;
+}
+
+/* FLACストリームをデコードし、先行デコード・リングバッファに充填するスレッド関数の定義 */
+void *decode_worker(void *arg)
+{
+  long decFrames, resFrames = (long)playFrames;		/* 未デコード・フレーム数の初期化 */
+  unsigned int head;
+
+  while (resFrames > 0 && !atomic_load(&ring.quit)) {
+    head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    /* リングが満杯なら再生スレッドがデータブロックを解放するまで待つ(背圧) */
+    if (head - atomic_load_explicit(&ring.tail, memory_order_acquire) >= ring.depth) {
+      ring_sleep();
+      continue;
+    }
+    decFrames = flac_read_play_frames(ring.blocks + (head % ring.depth) * ring.blockBytes,
+				      resFrames < ring.blockFrames ? resFrames : ring.blockFrames);
+    if (decFrames < 0) {
+      atomic_store_explicit(&ring.error, 1, memory_order_relaxed);
+      break;
+    }
+    if (decFrames == 0)				/* ストリーム終端 */
+      break;
+    ring.frames[head % ring.depth] = decFrames;
+    resFrames -= decFrames;
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+  }
+  atomic_store_explicit(&ring.done, 1, memory_order_release);
+  return NULL;
+}
+
+/* 先行デコード・リングバッファから再生するデータブロックを取り出すユーティリティ関数の定義 */
+long ring_acquire(unsigned char **block)
+{
+  unsigned int tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  unsigned int filled;
+  int waited = 0;
+
+  while ((filled = atomic_load_explicit(&ring.head, memory_order_acquire) - tail) == 0) {
+    /* デコード終了後にリングが空なら、全データを再生し終えた */
+    if (atomic_load_explicit(&ring.done, memory_order_acquire)
+	&& atomic_load_explicit(&ring.head, memory_order_acquire) == tail)
+      return 0;
+    if (!waited) {
+      ring.underruns++;
+      waited = 1;
+    }
+    ring_sleep();
+  }
+  /* リングの充填状態を記録する */
+  ring.fillSum += filled;
+  ring.fillCount++;
+  if (filled < ring.fillMin)
+    ring.fillMin = filled;
+
+  *block = ring.blocks + (tail % ring.depth) * ring.blockBytes;
+  return ring.frames[tail % ring.depth];
+}
+
+/* 再生済のデータブロックをデコードスレッドに返却するユーティリティ関数の定義 */
+void ring_release(void)
+{
+  unsigned int tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+  atomic_store_explicit(&ring.tail, tail + 1, memory_order_release);
+}
+
+/* リングの状態が変わるまでデータブロック長の1/4だけ待機するユーティリティ関数の定義 */
+void ring_sleep(void)
+{
+  long usec = (long)((double)ring.blockFrames * 1000000.0 / (double)rate / 4.0);
+  struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+  nanosleep(&ts, NULL);
+}
+
+/* FLACストリームを範囲分割し、複数スレッドで並列にデコードするユーティリティ関数の定義(オフライン処理) */
+int flac_parallel_decode(const char *filePath)
+{
+  const FLAC__uint64 total = dflac.total_frames;	/* 総サンプルフレーム数 */
+  RANGE_WORKER *workers = NULL;				/* ワーカ配列 */
+  unsigned int numWorkers = 0;				/* 起動済ワーカ数 */
+  unsigned int maxRanges = parallel * RANGES_PER_THREAD;
+  FLAC__uint64 prev = 0, target;
+  struct timespec t0, t1;
+  double elapsed;
+  int outFd = -1, err = 0;
+
+  /* 出力フォーマットは量子化ビット数に合わせる(PCMが無いので構成空間の確認はしない) */
+  if (!wide && dflac.qbits == 16)
+    format = SND_PCM_FORMAT_S16_LE;
+  else if (!wide && dflac.qbits == 24)
+    format = SND_PCM_FORMAT_S24_3LE;
+  else
+    format = SND_PCM_FORMAT_S32_LE;
+  sampleBytes = (unsigned int)snd_pcm_format_physical_width(format) / 8;
+  select_interleave(numChannels);
+
+  /* 分割位置は目標位置以降で最初のシークポイント(フレーム先頭)とし、無ければ目標位置そのものとする */
+  if ((ranges = (DECODE_RANGE *)malloc(maxRanges * sizeof(DECODE_RANGE))) == NULL) {
+    fprintf(stderr, "メモリ不足で分割範囲を割当てられない\n");
+    return EXIT_FAILURE;
+  }
+  numRanges = 0;
+  for (unsigned int k = 1 ; k <= maxRanges && prev < total ; k++) {
+    target = total * k / maxRanges;
+    if (k < maxRanges && dflac.numSeekPoints > 0) {
+      FLAC__uint64 best = total;
+      for (unsigned int i = 0 ; i < dflac.numSeekPoints ; i++)
+	if (dflac.seekSamples[i] >= target && dflac.seekSamples[i] < best)
+	  best = dflac.seekSamples[i];
+      target = best;
+    }
+    if (target <= prev)
+      continue;
+    ranges[numRanges].start = prev;
+    ranges[numRanges].end = target;
+    numRanges++;
+    prev = target;
+  }
+  atomic_init(&nextRange, 0);
+
+  /* 出力ファイルを全長で確保し、各ワーカが自分の範囲の位置に書き込む */
+  if (outPath != NULL) {
+    if ((outFd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0
+	|| ftruncate(outFd, (off_t)(total * sampleBytes * numChannels)) < 0) {
+      fprintf(stderr, "出力ファイル作成失敗: %s: %s\n", outPath, strerror(errno));
+      err = EXIT_FAILURE;
+      goto cleaning;
+    }
+  }
+
+  printf("*** 並列デコード ***\n");
+  printf("出力フォーマット：%s\n", snd_pcm_format_name(format));
+  printf("出力ファイル：%s\n", outPath != NULL ? outPath : "(無し)");
+  printf("分割方法：%s\n", dflac.numSeekPoints > 0 ? "SEEKTABLE" : "等分割(シーク)");
+  printf("スレッド数：%u, 分割範囲数：%u\n", parallel, numRanges);
+
+  if ((workers = (RANGE_WORKER *)calloc(parallel, sizeof(RANGE_WORKER))) == NULL) {
+    fprintf(stderr, "メモリ不足でワーカを割当てられない\n");
+    err = EXIT_FAILURE;
+    goto cleaning;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (numWorkers = 0 ; numWorkers < parallel ; numWorkers++) {
+    workers[numWorkers].filePath = filePath;
+    workers[numWorkers].outFd = outFd;
+    if ((err = pthread_create(&workers[numWorkers].thread, NULL, parallel_worker, &workers[numWorkers])) != 0) {
+      fprintf(stderr, "ワーカ・スレッド起動失敗: %s\n", strerror(err));
+      err = EXIT_FAILURE;
+      break;
+    }
+  }
+  for (unsigned int i = 0 ; i < numWorkers ; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (workers[i].error)
+      err = EXIT_FAILURE;
+    if (verbose > 0)
+      printf("ワーカ %u: %lu 範囲\n", i, workers[i].ranges);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  elapsed = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  if (err == 0) {
+    printf(" 合計　%lu フレームをデコードして終了\n", (unsigned long)total);
+    printf(" 処理時間：%.3f 秒 (再生時間の %.1f 倍速)\n", elapsed,
+	   elapsed > 0.0 ? (double)total / (double)rate / elapsed : 0.0);
+  } else
+    fprintf(stderr, "エラーにより並列デコード中止\n");
+ cleaning:
+  if (workers != NULL)
+    free(workers);
+  if (outFd >= 0)
+    close(outFd);
+  free(ranges);
+  ranges = NULL;
+  return err;
+}
+
+/* 分割範囲を順に取り出し、専用のデコーダでデコードするワーカ・スレッド関数の定義 */
+void *parallel_worker(void *arg)
+{
+  RANGE_WORKER *w = (RANGE_WORKER *)arg;
+  unsigned int k;
+
+  w->block = (unsigned char *)malloc((size_t)FLAC__MAX_BLOCK_SIZE * sampleBytes * numChannels);
+  if (w->block == NULL || (w->decoder = FLAC__stream_decoder_new()) == NULL) {
+    fprintf(stderr, "ワーカのデコーダ割当てエラー\n");
+    w->error = 1;
+    goto cleaning;
+  }
+  if (FLAC__stream_decoder_init_file(w->decoder, w->filePath, range_write_callback, NULL, range_error_callback, w)
+      != FLAC__STREAM_DECODER_INIT_STATUS_OK
+      || !FLAC__stream_decoder_process_until_end_of_metadata(w->decoder)) {
+    fprintf(stderr, "ワーカのデコーダ初期化エラー\n");
+    w->error = 1;
+    goto cleaning;
+  }
+
+  while (!w->error && (k = atomic_fetch_add(&nextRange, 1)) < numRanges) {
+    w->pos = ranges[k].start;
+    w->end = ranges[k].end;
+    /* 範囲の先頭にシークする(先頭フレームはシーク時に書込みコールバックへ渡される) */
+    if (!FLAC__stream_decoder_seek_absolute(w->decoder, w->pos)) {
+      fprintf(stderr, "シーク失敗 (%lu): %s\n", (unsigned long)w->pos,
+	      FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(w->decoder)]);
+      w->error = 1;
+      break;
+    }
+    while (!w->error && w->pos < w->end) {
+      if (!FLAC__stream_decoder_process_single(w->decoder)) {
+	fprintf(stderr, "デコードエラー (%lu)\n", (unsigned long)w->pos);
+	w->error = 1;
+      }
+      else if (FLAC__stream_decoder_get_state(w->decoder) >= FLAC__STREAM_DECODER_END_OF_STREAM)
+	break;
+    }
+    if (w->pos < w->end) {
+      fprintf(stderr, "範囲 %lu - %lu のデコードが終端に達しない\n", (unsigned long)ranges[k].start, (unsigned long)w->end);
+      w->error = 1;
+    }
+    w->ranges++;
+  }
+ cleaning:
+  if (w->decoder != NULL) {
+    FLAC__stream_decoder_finish(w->decoder);
+    FLAC__stream_decoder_delete(w->decoder);
+  }
+  free(w->block);
+  return NULL;
+}
+
+/* 並列デコードのワーカが、範囲内のデコードデータを変換して出力するコールバック関数 */
+FLAC__StreamDecoderWriteStatus range_write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+						    const FLAC__int32 *const buffer[], void *user_data)
+{
+  RANGE_WORKER *w = (RANGE_WORKER *)user_data;
+  const size_t frameBytes = (size_t)sampleBytes * numChannels;
+  unsigned int shift = (unsigned int)snd_pcm_format_width(format) - frame->header.bits_per_sample;
+  FLAC__uint64 n = frame->header.blocksize;
+
+  if (frame->header.channels != numChannels || w->pos >= w->end) {
+    if (frame->header.channels != numChannels)
+      w->error = 1;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+  }
+  if (n > w->end - w->pos)
+    n = w->end - w->pos;
+  interleave_func(w->block, buffer, 0, (int)n, numChannels, shift);
+  if (w->outFd >= 0 && pwrite(w->outFd, w->block, (size_t)n * frameBytes, (off_t)(w->pos * frameBytes)) != (ssize_t)(n * frameBytes)) {
+    fprintf(stderr, "出力ファイル書込みエラー: %s\n", strerror(errno));
+    w->error = 1;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  }
+  w->pos += n;
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+/* 並列デコードのワーカがデコーダのエラーを検出するコールバック関数
+   破損したフレームは出力に欠落を残すので、ワーカのエラーとして並列デコードを失敗させる */
+void range_error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *user_data)
+{
+  fprintf(stderr, "デコードエラーを検出: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+  ((RANGE_WORKER *)user_data)->error = 1;
+  return;
+}
+
 /* デコードデータを取得するコールバック関数 */
 FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,	       
 						const FLAC__int32 *const buffer[], void *user_data)
 {
-  dflac.frame = frame;
-  dflac.dec_buffer = buffer;
-  dflac.buffer_pos = 0;
+  unsigned int ch;
 
   if (frame->header.blocksize > FLAC__MAX_BLOCK_SIZE){	
     fprintf(stderr, "FLACブロックサイズが上限を超えた (%d) > FLAC__MAX_BLOCK_SIZE (%d)\n", frame->header.blocksize, 
@@ -316,6 +1600,21 @@ FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder
     dflac.size_spec = 0;
     return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
   }
+  frame_index_record(frame);
+  /* 索引からのシーク後は、目標サンプルより前のフレームを丸ごと読み捨てる */
+  if (dflac.skip >= frame->header.blocksize) {
+    dflac.skip -= frame->header.blocksize;
+    dflac.frame = NULL;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+  }
+  /* シーク先のフレームでは、libFLACが目標位置に合わせたスタック上の配列を渡すので、
+     次のデコードまで使えるようにチャンネル・ポインタを写しておく */
+  for (ch = 0; ch < frame->header.channels && ch < FLAC__MAX_CHANNELS; ch++)
+    dflac.chan[ch] = buffer[ch];
+  dflac.frame = frame;
+  dflac.dec_buffer = dflac.chan;
+  dflac.buffer_pos = (int)dflac.skip;
+  dflac.skip = 0;
   buffer2block() ;
   return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
@@ -329,15 +1628,321 @@ void metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMet
     rate = metadata->data.stream_info.sample_rate;
     numChannels = metadata->data.stream_info.channels;
     dflac.qbits = metadata->data.stream_info.bits_per_sample;
-
-    printf("標本化速度          : %u Hz\n", rate);		
-    printf("チャンネル数        : %u\n", numChannels);		
-    printf("量子化ビット数      : %u\n", dflac.qbits);		
-    printf("総フレーム数        : %ld\n", (long)dflac.total_frames);
+    print_streaminfo();
+  }
+  /* 並列デコードの分割位置に用いるため、SEEKTABLEのシークポイントを保存する */
+  else if(metadata->type == FLAC__METADATA_TYPE_SEEKTABLE && dflac.seekSamples == NULL) {
+    const FLAC__StreamMetadata_SeekTable *table = &metadata->data.seek_table;
+    dflac.seekSamples = (FLAC__uint64 *)malloc((table->num_points + 1) * sizeof(FLAC__uint64));
+    dflac.seekOffsets = (FLAC__uint64 *)malloc((table->num_points + 1) * sizeof(FLAC__uint64));
+    if (dflac.seekSamples != NULL && dflac.seekOffsets != NULL)
+      for (unsigned int i = 0 ; i < table->num_points ; i++)
+	if (table->points[i].sample_number != FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER) {
+	  dflac.seekSamples[dflac.numSeekPoints] = table->points[i].sample_number;
+	  dflac.seekOffsets[dflac.numSeekPoints++] = table->points[i].stream_offset;
+	}
   }
   return;
 }
 
+/* FLAC音源パラメータを表示するユーティリティ関数の定義 */
+void print_streaminfo(void)
+{
+  printf("標本化速度          : %u Hz\n", rate);		
+  printf("チャンネル数        : %u\n", numChannels);		
+  printf("量子化ビット数      : %u\n", dflac.qbits);		
+  printf("総フレーム数        : %ld\n", (long)dflac.total_frames);
+}
+
+/* 索引キャッシュからSTREAMINFOとシークポイントを得るユーティリティ関数の定義
+   戻り値: 0=ヒット、-1=ミス(メタデータを解析する) */
+int flac_index_lookup(const char *filePath)
+{
+  MI_ENTRY e;
+  struct stat st;
+
+  if (mindex.fd < 0 || stat(filePath, &st) == -1 || mi_lookup(&mindex, filePath, &st, &e) != 0
+      || e.kind != MI_KIND_FLAC || e.numSeekPoints > MI_SEEK_POINTS)
+    return -1;
+  dflac.total_frames = e.frames;
+  rate = e.rate;
+  numChannels = e.channels;
+  dflac.qbits = e.bits;
+  if (e.numSeekPoints > 0) {
+    dflac.seekSamples = (FLAC__uint64 *)malloc(e.numSeekPoints * sizeof(FLAC__uint64));
+    dflac.seekOffsets = (FLAC__uint64 *)malloc(e.numSeekPoints * sizeof(FLAC__uint64));
+    if (dflac.seekSamples != NULL && dflac.seekOffsets != NULL)
+      for (dflac.numSeekPoints = 0 ; dflac.numSeekPoints < e.numSeekPoints ; dflac.numSeekPoints++) {
+	dflac.seekSamples[dflac.numSeekPoints] = e.seek[dflac.numSeekPoints].sample;
+	dflac.seekOffsets[dflac.numSeekPoints] = e.seek[dflac.numSeekPoints].offset;
+      }
+  }
+  print_streaminfo();
+  return 0;
+}
+
+/* STREAMINFO、最初のフレーム位置とシークポイントを索引キャッシュに登録するユーティリティ関数の定義
+   シークポイントが多いときは等間隔に間引いてMI_SEEK_POINTS個にする */
+void flac_index_store(const char *filePath)
+{
+  MI_ENTRY e;
+  struct stat st;
+  FLAC__uint64 firstFrame;
+  unsigned int i, k;
+
+  if (mindex.fd < 0 || !mindex.writable || stat(filePath, &st) == -1
+      || !FLAC__stream_decoder_get_decode_position(dflac.decoder, &firstFrame))
+    return;
+  memset(&e, 0, sizeof(e));
+  e.kind = MI_KIND_FLAC;
+  e.rate = rate;
+  e.channels = (uint16_t)numChannels;
+  e.bits = (uint16_t)dflac.qbits;
+  e.frames = dflac.total_frames;
+  e.dataOffset = firstFrame;
+  if (dflac.seekSamples != NULL && dflac.seekOffsets != NULL)
+    for (i = 0 ; i < MI_SEEK_POINTS && i < dflac.numSeekPoints ; i++) {
+      k = dflac.numSeekPoints <= MI_SEEK_POINTS ? i : (unsigned int)((unsigned long)i * dflac.numSeekPoints / MI_SEEK_POINTS);
+      e.seek[i].sample = dflac.seekSamples[k];
+      e.seek[i].offset = dflac.seekOffsets[k];
+      e.numSeekPoints = i + 1;
+    }
+  mi_store(&mindex, filePath, &st, &e);
+}
+
+/* FLACファイルを開き、入力方法に応じてファイルマップ、全体の読込み、または先読みバッファを用意する
+   ユーティリティ関数の定義。戻り値: 0=成功、-1=失敗 */
+int flac_input_open(const char *filePath)
+{
+  struct stat st;
+  size_t done = 0;
+  ssize_t n;
+
+  if ((input.fd = open(filePath, O_RDONLY)) == -1 || fstat(input.fd, &st) == -1) {
+    fprintf(stderr, "ファイル %s を開けない: %s\n", filePath, strerror(errno));
+    return -1;
+  }
+  if (st.st_size <= 0) {
+    fprintf(stderr, "ファイル %s が空\n", filePath);
+    return -1;
+  }
+  input.length = (FLAC__uint64)st.st_size;
+  input.pos = 0;
+
+  switch (inputMode) {
+  case INPUT_FILEMAP:
+    /* ファイル全体を読み込み専用でマップし、先読み窓はread_callbackで進める */
+    input.map = (unsigned char *)mmap(NULL, (size_t)input.length, PROT_READ, MAP_SHARED, input.fd, 0);
+    if (input.map == MAP_FAILED) {
+      fprintf(stderr, "ファイルマップ失敗: %s\n", strerror(errno));
+      return -1;
+    }
+    madvise(input.map, (size_t)input.length, MADV_SEQUENTIAL);	/* 順次アクセスをカーネルに通知 */
+    input.data = input.map;
+    break;
+  case INPUT_MEMORY:
+    /* 再生前にファイル全体をメモリに読み込み、再生中はファイルシステムに触れない */
+    if ((input.buf = (unsigned char *)malloc((size_t)input.length)) == NULL) {
+      fprintf(stderr, "メモリ不足でファイル全体を読み込めない\n");
+      return -1;
+    }
+    while (done < (size_t)input.length) {
+      n = pread(input.fd, input.buf + done, (size_t)input.length - done, (off_t)done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0) {
+	fprintf(stderr, "ファイル読込みエラー: %s\n", n < 0 ? strerror(errno) : "ファイルが短くなった");
+	return -1;
+      }
+      done += (size_t)n;
+      input.reads++;
+    }
+    input.data = input.buf;
+    break;
+  default:
+    /* ページ境界に揃えた先読みバッファに、揃えた位置から大きな単位で読み込む */
+    input.bufBytes = (prefetchBytes + FLAC_INPUT_ALIGN - 1) / FLAC_INPUT_ALIGN * FLAC_INPUT_ALIGN;
+    input.bufStart = input.bufFill = 0;
+    posix_fadvise(input.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (useUring) {
+      /* io_uringでデータブロックを先行して要求する。使えなければread()で読む */
+      int err = uring_open(&urd, input.fd, URING_DEPTH, input.bufBytes, 0, (off_t)input.length);
+      if (err == 0) {
+	input.uring = 1;
+	break;
+      }
+      fprintf(stderr, "io_uringを使えないためreadで読み込む: %s\n", strerror(-err));
+      uring_close(&urd);
+    }
+    if (posix_memalign((void **)&input.buf, FLAC_INPUT_ALIGN, input.bufBytes) != 0) {
+      input.buf = NULL;
+      fprintf(stderr, "メモリ不足で先読みバッファを割当てられない\n");
+      return -1;
+    }
+    break;
+  }
+  return 0;
+}
+
+/* FLACファイルの入力を閉じるユーティリティ関数の定義 */
+void flac_input_close(void)
+{
+  if (input.map != MAP_FAILED)
+    munmap(input.map, (size_t)input.length);
+  input.map = MAP_FAILED;
+  if (input.uring)
+    uring_close(&urd);
+  input.uring = input.held = 0;
+  input.block = NULL;
+  if (input.buf != NULL)
+    free(input.buf);
+  input.buf = NULL;
+  input.data = NULL;
+  if (input.fd >= 0)
+    close(input.fd);
+  input.fd = -1;
+}
+
+/* 読出し位置を含むデータブロックを先読みバッファとして用意するユーティリティ関数の定義
+   io_uringでは先行要求済みのデータブロックを順に取り出す。シークで外れたら読出し位置の1ブロックだけを
+   要求し直し(先行要求の完了待ちを1ブロック分に抑える)、順次読みが続けば先行要求を広げる。
+   read入力ではページ境界に揃えた位置からpreadで詰め直す。戻り値: 読出し位置以降のバイト数、0=終端、負=-errno */
+long flac_input_fill(FLAC_INPUT *in)
+{
+  FLAC__uint64 start = in->pos / FLAC_INPUT_ALIGN * FLAC_INPUT_ALIGN;
+  unsigned char *block;
+  off_t offset;
+  long got;
+  int err, sequential = (in->pos == in->bufStart + in->bufFill);	/* 直前のブロックの続きを読む */
+
+  in->bufFill = 0;
+  if (!in->uring) {
+    do
+      got = pread(in->fd, in->buf, in->bufBytes, (off_t)start);
+    while (got < 0 && errno == EINTR);
+    if (got < 0)
+      return -errno;
+    in->reads++;
+    in->block = in->buf;
+    in->bufStart = start;
+    in->bufFill = (size_t)got;
+    return in->pos < start + (FLAC__uint64)got ? (long)(start + (FLAC__uint64)got - in->pos) : 0;
+  }
+
+  if (in->held) {
+    in->held = 0;
+    if (sequential)
+      uring_release(&urd);				/* 順次読み: 先行要求を広げて次のブロックへ */
+    else if ((err = uring_restart(&urd, (off_t)start, 1)) < 0)
+      return err;					/* シーク: 読出し位置の1ブロックだけ要求する */
+  }
+  for (int retry = 0; ; retry++) {
+    if ((got = uring_acquire(&urd, &block, &offset)) < 0)
+      return got;
+    in->held = 1;
+    in->reads++;
+    if (in->pos >= (FLAC__uint64)offset && in->pos < (FLAC__uint64)offset + (FLAC__uint64)got)
+      break;
+    if (retry > 0)
+      return 0;						/* 積み直しても読めない: 終端 */
+    /* 先行要求が読出し位置を含まなければ、読出し位置から1ブロックだけ積み直す */
+    in->held = 0;
+    if ((err = uring_restart(&urd, (off_t)start, 1)) < 0)
+      return err;
+  }
+  in->block = block;
+  in->bufStart = (FLAC__uint64)offset;
+  in->bufFill = (size_t)got;
+  return (long)(in->bufStart + in->bufFill - in->pos);
+}
+
+/* デコーダにFLACストリームのデータを渡すコールバック関数 */
+FLAC__StreamDecoderReadStatus read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes,
+					    void *client_data)
+{
+  FLAC_INPUT *in = (FLAC_INPUT *)client_data;
+  size_t want = *bytes, n, done = 0;
+  ssize_t got;
+
+  *bytes = 0;
+  if (in->pos >= in->length)
+    return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+
+  if (in->data != NULL) {
+    /* ファイルマップでは、読出し位置が先読み窓の中ほどを過ぎたら次の窓を要求する */
+    if (in->map != MAP_FAILED && in->advised < in->length && in->pos + FLAC_READAHEAD_BYTES / 2 >= in->advised) {
+      if (in->advised < in->pos)
+	in->advised = in->pos / FLAC_INPUT_ALIGN * FLAC_INPUT_ALIGN;	/* シークで窓を飛び越した */
+      n = in->length - in->advised < FLAC_READAHEAD_BYTES ? (size_t)(in->length - in->advised) : FLAC_READAHEAD_BYTES;
+      madvise(in->map + in->advised, n, MADV_WILLNEED);
+      in->advised += n;
+    }
+    n = in->length - in->pos < want ? (size_t)(in->length - in->pos) : want;
+    memcpy(buffer, in->data + in->pos, n);
+    in->pos += n;
+    *bytes = n;
+    return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+  }
+
+  while (done < want && in->pos < in->length) {
+    /* 読出し位置が先読みバッファの外なら、次のデータブロックを用意する */
+    if (in->pos < in->bufStart || in->pos >= in->bufStart + in->bufFill) {
+      if ((got = flac_input_fill(in)) < 0) {
+	fprintf(stderr, "ファイル読込みエラー: %s\n", strerror((int)-got));
+	return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+      }
+      if (got == 0) {
+	in->length = in->pos;				/* 再生中にファイルが短くなった */
+	break;
+      }
+    }
+    n = (size_t)(in->bufStart + in->bufFill - in->pos);
+    if (n > want - done)
+      n = want - done;
+    memcpy(buffer + done, in->block + (in->pos - in->bufStart), n);
+    in->pos += n;
+    done += n;
+  }
+  *bytes = done;
+  return done > 0 ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE : FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+}
+
+/* 読出し位置を移動するコールバック関数 */
+FLAC__StreamDecoderSeekStatus seek_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 absolute_byte_offset,
+					    void *client_data)
+{
+  FLAC_INPUT *in = (FLAC_INPUT *)client_data;
+
+  if (absolute_byte_offset > in->length)
+    return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+  in->pos = absolute_byte_offset;
+  return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+/* 読出し位置を返すコールバック関数 */
+FLAC__StreamDecoderTellStatus tell_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *absolute_byte_offset,
+					    void *client_data)
+{
+  *absolute_byte_offset = ((FLAC_INPUT *)client_data)->pos;
+  return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+/* ストリーム長を返すコールバック関数 */
+FLAC__StreamDecoderLengthStatus length_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *stream_length,
+						void *client_data)
+{
+  *stream_length = ((FLAC_INPUT *)client_data)->length;
+  return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+/* ストリーム終端を判定するコールバック関数 */
+FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder, void *client_data)
+{
+  const FLAC_INPUT *in = (const FLAC_INPUT *)client_data;
+
+  return in->pos >= in->length;
+}
+
 /* デコーダのエラーを検出するコールバック関数 */
 void error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *user_data)
 {
@@ -345,6 +1950,19 @@ void error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderError
   return;
 }
 
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
+
 /* 使用法を表示するユーティリティ関数の定義 */
 void usage(void)
 {
@@ -354,9 +1972,30 @@ void usage(void)
 	 "-h,--help	  使用法\n"
 	 "-D,--device	  再生デバイス\n"
 	 "-m,--mmap	  mmap_write転送\n"
+	 "-d,--direct	  mmap_direct転送(mmap領域へ直接デコード、-mを含む)\n"
+	 "-w,--wide	  32bit出力固定(量子化ビット数に合わせたフォーマットを選ばない)\n"
+	 "-a,--decode-ahead=深さ   デコードスレッドで先行デコードするデータブロック数\n"
+	 "-P,--parallel=数         再生せず、指定スレッド数で並列デコード(オフライン処理)\n"
+	 "-o,--output=ファイル     並列デコード結果をRAW形式で出力\n"
 	 "-v,--verbose      パラメータ設定値表示\n"
 	 "-n,--noresample   再標本化禁止\n"
-	 "\n");
+	 "-L,--latency=プロファイル low(最小周期), balanced(10 msec周期), throughput(500 msecバッファ)\n"
+	 "-F,--period-frames=数    転送周期(frames)\n"
+	 "-B,--periods=数          バッファ当りの周期数\n"
+	 "-S,--stats               転送周期ごとの所要時間とアンダーランを計測(SIGUSR1で途中表示)\n"
+	 "-J,--stats-json=ファイル 転送周期統計をJSONで出力(-Sを含む)\n"
+	 "-R,--realtime=方式[:優先度] 再生スレッドを fifo または rr で実時間実行(既定優先度 70)\n"
+	 "-A,--affinity=CPU番号    再生スレッドを指定CPUに固定\n"
+	 "-M,--mlock               mlockallでメモリ固定し、バッファを事前フォールト\n"
+	 "-I,--index=ファイル      メタデータ索引キャッシュを使う(無ければ作成)\n"
+	 "-f,--filemap             FLACファイルをmmapでマップして入力\n"
+	 "-r,--preload             再生前にFLACファイル全体をメモリに読み込んで入力\n"
+	 "-p,--prefetch=KiB        先読みバッファのサイズ(既定 %d KiB)\n"
+	 "-u,--uring               io_uringで先読みバッファ単位に先行読込み(非対応時はread)\n"
+	 "-s,--start=位置          指定位置から再生(--segment=位置- と同じ)\n"
+	 "-g,--segment=開始-終了   指定区間を再生(どちらも省略可、繰り返して複数区間を順に再生)\n"
+	 "                         位置はサンプル番号、または[[時:]分:]秒[.小数](例 1:30, 90.5s)\n"
+	 "\n", FLAC_PREFETCH_KBYTES);
   printf("適用サンプルフォーマット:");
   for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
     const char *s = snd_pcm_format_name((snd_pcm_format_t)k);
@@ -373,8 +2012,28 @@ int main(int argc, char *argv[])
       {"help", 0, NULL, 'h'},
       {"device", 1, NULL, 'D'},
       {"mmap", 0, NULL, 'm'},
+      {"direct", 0, NULL, 'd'},
+      {"wide", 0, NULL, 'w'},
+      {"decode-ahead", 1, NULL, 'a'},
+      {"parallel", 1, NULL, 'P'},
+      {"output", 1, NULL, 'o'},
       {"verbose", 0, NULL, 'v'},
       {"noresample", 0, NULL, 'n'},
+      {"latency", 1, NULL, 'L'},
+      {"period-frames", 1, NULL, 'F'},
+      {"periods", 1, NULL, 'B'},
+      {"stats", 0, NULL, 'S'},
+      {"stats-json", 1, NULL, 'J'},
+      {"realtime", 1, NULL, 'R'},
+      {"affinity", 1, NULL, 'A'},
+      {"mlock", 0, NULL, 'M'},
+      {"index", 1, NULL, 'I'},
+      {"start", 1, NULL, 's'},
+      {"segment", 1, NULL, 'g'},
+      {"filemap", 0, NULL, 'f'},
+      {"preload", 0, NULL, 'r'},
+      {"prefetch", 1, NULL, 'p'},
+      {"uring", 0, NULL, 'u'},
       {NULL, 0, NULL, 0},
     };
 	
@@ -383,9 +2042,10 @@ int main(int argc, char *argv[])
   snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
   unsigned char *transfer_method ;	/* 転送方法名 */
   double playtime = 0;			/* 再生時間 */
+  long value;				/* 数値オプションの値 */
   int err, c, exit_code = 0;
 	
-  while ((c = getopt_long(argc, argv, "hD:mvn", long_option, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "hD:mdwa:P:o:vnL:F:B:SJ:R:A:MI:s:g:frp:u", long_option, NULL)) != -1) {
     switch (c) {
     case 'h':
       usage();
@@ -394,7 +2054,31 @@ int main(int argc, char *argv[])
       device = strdup(optarg); /* 再生デバイス名の指定 */
       break;
     case 'm':
-      mmap = 1;
+      mmap_access = 1;
+      break;
+    case 'd':
+      mmap_access = 1;
+      direct = 1;
+      break;
+    case 'w':
+      wide = 1;
+      break;
+    case 'a':
+      if (parse_count(optarg, 0, MAX_DECODE_AHEAD, &value) < 0) {
+	fprintf(stderr, "先行デコード深さは0〜%dの整数\n", MAX_DECODE_AHEAD);
+	return EXIT_FAILURE;
+      }
+      decodeAhead = (unsigned int)value;
+      break;
+    case 'P':
+      if (parse_count(optarg, 0, MAX_PARALLEL, &value) < 0) {
+	fprintf(stderr, "並列デコードのスレッド数は0〜%dの整数\n", MAX_PARALLEL);
+	return EXIT_FAILURE;
+      }
+      parallel = (unsigned int)value;
+      break;
+    case 'o':
+      outPath = optarg;
       break;
     case 'v':
       verbose = 1;
@@ -402,6 +2086,81 @@ int main(int argc, char *argv[])
     case 'n':
       resample = 0;
       break;	
+    case 'L':
+      if (strcmp(optarg, "low") == 0)
+	latency = LATENCY_LOW;
+      else if (strcmp(optarg, "balanced") == 0)
+	latency = LATENCY_BALANCED;
+      else if (strcmp(optarg, "throughput") == 0)
+	latency = LATENCY_THROUGHPUT;
+      else {
+	fprintf(stderr, "レイテンシ・プロファイルは low, balanced, throughput のいずれか\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_count(optarg, 0, MAX_PERIOD_FRAMES, &value) < 0) {
+	fprintf(stderr, "転送周期は0〜%dフレームの整数\n", MAX_PERIOD_FRAMES);
+	return EXIT_FAILURE;
+      }
+      req_period_frames = (snd_pcm_uframes_t)value;
+      break;
+    case 'B':
+      if (parse_count(optarg, 0, MAX_PERIODS, &value) < 0) {
+	fprintf(stderr, "バッファ当りの周期数は0〜%dの整数\n", MAX_PERIODS);
+	return EXIT_FAILURE;
+      }
+      req_periods = (unsigned int)value;
+      break;
+    case 'S':
+      stats.enabled = 1;
+      break;
+    case 'J':
+      stats.enabled = 1;
+      statsJson = optarg;
+      break;
+    case 'R':
+      if (rt_parse(&rt, optarg) < 0) {
+	fprintf(stderr, "実時間方式は fifo[:優先度] または rr[:優先度] (優先度 1〜99)\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      if (rt_parse_cpu(&rt, optarg) < 0) {
+	fprintf(stderr, "CPU番号は0以上の整数\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+      rt.lock = 1;
+      break;
+    case 'I':
+      mi_open(&mindex, optarg);
+      break;
+    case 's':
+    case 'g':
+      if (numSegSpecs >= MAX_SEGMENTS) {
+	fprintf(stderr, "再生区間は %d 区間まで\n", MAX_SEGMENTS);
+	return EXIT_FAILURE;
+      }
+      segSpecs[numSegSpecs++] = optarg;
+      break;
+    case 'f':
+      inputMode = INPUT_FILEMAP;
+      break;
+    case 'r':
+      inputMode = INPUT_MEMORY;
+      break;
+    case 'p':
+      if (parse_count(optarg, 1, MAX_PREFETCH_KBYTES, &value) < 0) {
+	fprintf(stderr, "先読みバッファのサイズは1〜%d KiBの整数\n", MAX_PREFETCH_KBYTES);
+	return EXIT_FAILURE;
+      }
+      prefetchBytes = (size_t)value * 1024;
+      break;
+    case 'u':
+      useUring = 1;
+      break;
     default:
       fprintf(stderr, "`--help'で使用方法を確認\n");
       return EXIT_FAILURE; 
@@ -417,6 +2176,7 @@ int main(int argc, char *argv[])
   const char *filePath = NULL;
  
   FLAC__bool success = true;
+  int indexed = 0;			/* 索引キャッシュ・ヒット・フラグ */
   FLAC__StreamDecoderInitStatus init_status; 
 	
   /* ALSA HW, SWパラメータ・コンテナの初期化 */
@@ -434,24 +2194,42 @@ int main(int argc, char *argv[])
     exit_code = EXIT_FAILURE;
     goto cleaning;
   }
+  /* 索引にあればメタデータ・ブロックをコールバックで受け取らず、デコード開始時に読み流させる */
+  indexed = (flac_index_lookup(filePath) == 0);
+  if (indexed) {
+    FLAC__stream_decoder_set_metadata_ignore_all(dflac.decoder);
+    printf("メタデータ索引にヒット：メタデータ解析を省略\n");
+  }
+  /* 並列デコードの分割位置を得るため、SEEKTABLEも受け取る */
+  else
+    FLAC__stream_decoder_set_metadata_respond(dflac.decoder, FLAC__METADATA_TYPE_SEEKTABLE);
 	 
-  /* デコーダのインスタンスを初期化する */
-  init_status = FLAC__stream_decoder_init_file(dflac.decoder, filePath, write_callback, metadata_callback, 
-						error_callback, &dflac);
+  /* デコーダのインスタンスを初期化する。ファイルの読込みはlibFLACのstdioに任せず、
+     ファイルマップ、メモリ、または先読みバッファから入力コールバックで渡す */
+  if (flac_input_open(filePath) < 0) {
+    exit_code = EXIT_FAILURE;
+    goto cleaning;
+  }
+  init_status = FLAC__stream_decoder_init_stream(dflac.decoder, read_callback, seek_callback, tell_callback,
+						  length_callback, eof_callback, write_callback, metadata_callback,
+						  error_callback, &input);
   if(init_status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
     fprintf(stderr, "デコーダ初期化エラー: %s\n", FLAC__StreamDecoderInitStatusString[init_status]);
     exit_code = EXIT_FAILURE;
     goto cleaning;
   }
 	
-  /* メタデータを読む */
-  success = FLAC__stream_decoder_process_until_end_of_metadata (dflac.decoder);
-  if(success == false){
-    fprintf(stderr, "メタデータのデコード失敗\n");
-    fprintf(stderr, "デコーダの状態: %s\n", FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(dflac.decoder)]);
-    exit_code = EXIT_FAILURE;
-    goto cleaning;
-  }	
+  /* メタデータを読み、索引に登録する */
+  if (!indexed) {
+    success = FLAC__stream_decoder_process_until_end_of_metadata (dflac.decoder);
+    if(success == false){
+      fprintf(stderr, "メタデータのデコード失敗\n");
+      fprintf(stderr, "デコーダの状態: %s\n", FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(dflac.decoder)]);
+      exit_code = EXIT_FAILURE;
+      goto cleaning;
+    }
+    flac_index_store(filePath);
+  }
   playtime = (double)dflac.total_frames / (double)rate ;	/* サウンド再生時間の算出 */ 
  
   switch(dflac.qbits){
@@ -470,8 +2248,38 @@ int main(int argc, char *argv[])
     goto cleaning;
   }
   printf("再生時間：%.0lf秒\n", playtime);
+
+  /* 再生区間を決める。SEEKTABLEが無ければ、デコードしながらフレーム位置索引を作り、再生済みの範囲へのシークに使う */
+  if (parse_segments() < 0) {
+    exit_code = EXIT_FAILURE;
+    goto cleaning;
+  }
+  if (numSegSpecs > 0) {
+    if (parallel > 0) {
+      fprintf(stderr, "再生区間の指定は並列デコードと併用できない\n");
+      exit_code = EXIT_FAILURE;
+      goto cleaning;
+    }
+    for (unsigned int i = 0; i < numSegments; i++)
+      printf("再生区間 %u：%llu - %llu (%.3f - %.3f秒)\n", i,
+	     (unsigned long long)segments[i].start, (unsigned long long)segments[i].end,
+	     (double)segments[i].start / (double)rate, (double)segments[i].end / (double)rate);
+    if (dflac.numSeekPoints == 0) {
+      findex.numBuckets = (size_t)(dflac.total_frames / FRAME_INDEX_GRID) + 2;
+      findex.points = (FRAME_POINT *)calloc(findex.numBuckets, sizeof(FRAME_POINT));
+      /* メタデータを読み終えていれば、最初のフレーム位置を区画0に置く */
+      if (findex.points != NULL && !indexed)
+	FLAC__stream_decoder_get_decode_position(dflac.decoder, &findex.points[0].offset);
+    }
+  }
   printf("\n");
 
+  /* 並列デコード(オフライン処理)ではPCMを開かない */
+  if (parallel > 0) {
+    exit_code = flac_parallel_decode(filePath);
+    goto cleaning;
+  }
+
   /* ALSAの出力オブジェクト、転送関数、アクセス方法の設定 */
   err = snd_output_stdio_attach(&output, stdout, 0);
   if (err < 0) {
@@ -480,7 +2288,15 @@ int main(int argc, char *argv[])
     goto cleaning;
   }
 	
-  if (mmap) {
+  if (direct) {
+    /* 直接デコードはデコードスレッドのデータブロックを経由しないので、先行デコードと併用しない */
+    if (decodeAhead > 0) {
+      fprintf(stderr, "mmap_direct転送は先行デコードと併用できない\n");
+      exit_code = EXIT_FAILURE;
+      goto cleaning;
+    }
+    transfer_method = "mmap_direct";
+  } else if (mmap_access) {
     writei_func = snd_pcm_mmap_writei;
     transfer_method = "mmap_write";
   } else {
@@ -515,6 +2331,9 @@ int main(int argc, char *argv[])
     goto cleaning;
   }
 
+  /* 出力フォーマットとチャンネル数に特化した変換カーネルを選択する */
+  select_interleave(numChannels);
+
   if (verbose > 0){
     printf("*** PCM情報一覧 ***\n");
     snd_pcm_dump(handle, output);
@@ -526,14 +2345,28 @@ int main(int argc, char *argv[])
   printf("内部フォーマット：%s\n", snd_pcm_format_name(format));
   printf("PCMデバイス：%s\n", device);
   printf("転送方法: %s\n", transfer_method);
+  printf("変換カーネル: %s\n", interleave_name);
+  if (inputMode == INPUT_FILEMAP)
+    printf("入力: ファイルマップ\n");
+  else if (inputMode == INPUT_MEMORY)
+    printf("入力: メモリ(再生前に %llu bytes を読込み)\n", (unsigned long long)input.length);
+  else if (input.uring)
+    printf("入力: io_uring 先行要求 %d × %zu KiB\n", URING_DEPTH, input.bufBytes / 1024);
+  else
+    printf("入力: 先読みバッファ %zu KiB\n", input.bufBytes / 1024);
+  printf("デコード: %s\n", direct ? "mmap領域へ直接" : decodeAhead > 0 ? "先行デコードスレッド" : "同期");
+  printf("バッファサイズ：%lu フレーム (%.1f msec)\n", buffer_size, 1000.0 * (double)buffer_size / (double)rate);
+  printf("転送周期：%lu フレーム (%.1f msec)\n", period_size, 1000.0 * (double)period_size / (double)rate);
   printf("\n");
 
   /* ユーティリティ関数によりファイルからデータを読み、ALSA転送関数に渡してサウンドを再生する */
-  err = flac_write_int(handle);
+  err = direct ? flac_direct_int(handle) : flac_write_int(handle);
   if (err != 0){
     fprintf(stderr, "再生転送失敗\n");
     exit_code = err;
   }
+  if (inputMode == INPUT_PREFETCH)
+    printf(" ファイル読込み：%lu 回\n", input.reads);
 
   /* 後始末 */        	
  cleaning:
@@ -541,6 +2374,14 @@ int main(int argc, char *argv[])
     FLAC__stream_decoder_finish (dflac.decoder) ;
   if(dflac.decoder != NULL)
     FLAC__stream_decoder_delete(dflac.decoder);
+  if(dflac.seekSamples != NULL)
+    free(dflac.seekSamples);
+  if(dflac.seekOffsets != NULL)
+    free(dflac.seekOffsets);
+  if(findex.points != NULL)
+    free(findex.points);
+  flac_input_close();
+  mi_close(&mindex);
   if(output != NULL)
     snd_output_close(output);
   if(handle != NULL)
@@ -0,0 +1,280 @@
+/******************************************************
+ 転送周期の計測とアンダーラン記録
+ ヘッダ・ファイル：PeriodStats.h
+ ******************************************************/
+#ifndef PERIOD_STATS_H
+#define PERIOD_STATS_H
+
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+/* HDR形式ヒストグラム: 2のべき乗ごとの区間を16等分し、相対誤差約6%で値域全体を記録する */
+#define HIST_SUB_BITS	(4)
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(HIST_SUB + (64 - HIST_SUB_BITS) * HIST_SUB)
+#define XRUN_LOG_MAX	(256)				/* 記録するアンダーラン事象の上限 */
+
+/* ヒストグラム構造体の定義 */
+typedef struct{
+  uint64_t counts[HIST_BUCKETS];			/* 区間ごとの度数 */
+  uint64_t total;					/* 総度数 */
+  uint64_t min, max;					/* 最小値、最大値 */
+  double sum;						/* 総和(平均値の算出用) */
+} HDR_HIST;
+
+/* アンダーラン事象構造体の定義 */
+typedef struct{
+  uint64_t time;					/* 計測開始からの経過時間(nsec) */
+  int error;						/* 検出したエラーコード */
+  int recovered;					/* snd_pcm_recover()の戻り値 */
+  long frames;						/* 発生時の再生済フレーム数 */
+} XRUN_EVENT;
+
+/* 転送周期統計構造体の定義 */
+typedef struct{
+  int enabled;						/* 計測フラグ: set=1 clear=0 */
+  unsigned int rate;					/* 標本化速度(Hz) */
+  uint64_t start;					/* 計測開始時刻(nsec) */
+  uint64_t mark;					/* 区間計測の開始時刻(nsec) */
+  unsigned long periods;				/* 計測した転送周期数 */
+  HDR_HIST read;					/* 読込み/デコード時間(nsec) */
+  HDR_HIST write;					/* 転送関数の所要時間(nsec) */
+  HDR_HIST delay;					/* snd_pcm_delay()の値(frames) */
+  HDR_HIST avail;					/* snd_pcm_avail()の値(frames) */
+  XRUN_EVENT xruns[XRUN_LOG_MAX];			/* アンダーラン記録 */
+  unsigned long numXruns;				/* アンダーラン発生回数 */
+} PERIOD_STATS;
+
+static volatile sig_atomic_t stats_dump_request = 0;	/* SIGUSR1による表示要求 */
+
+/* 単調増加時計をnsecで取得する関数の定義 */
+static inline uint64_t stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* 値をヒストグラムの区間番号に変換する関数の定義 */
+static inline int hist_index(uint64_t v)
+{
+  int e;
+  if (v < HIST_SUB)
+    return (int)v;
+  e = 63 - __builtin_clzll(v);				/* 最上位ビットの位置 */
+  return HIST_SUB + (e - HIST_SUB_BITS) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* 区間番号を区間の下限値に変換する関数の定義 */
+static inline uint64_t hist_lower(int idx)
+{
+  int e;
+  if (idx < HIST_SUB)
+    return (uint64_t)idx;
+  e = (idx - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+  return (uint64_t)(HIST_SUB + (idx - HIST_SUB) % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/* ヒストグラムに値を記録する関数の定義 */
+static inline void hist_record(HDR_HIST *h, uint64_t v)
+{
+  if (h->total == 0 || v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+  h->counts[hist_index(v)]++;
+  h->total++;
+  h->sum += (double)v;
+}
+
+/* ヒストグラムの百分位点(区間の下限値)を求める関数の定義 */
+static uint64_t hist_percentile(const HDR_HIST *h, double percent)
+{
+  uint64_t rank = (uint64_t)((double)h->total * percent / 100.0 + 0.5), count = 0;
+  if (rank < 1)
+    rank = 1;
+  for (int i = 0 ; i < HIST_BUCKETS ; i++) {
+    count += h->counts[i];
+    if (count >= rank) {
+      uint64_t v = hist_lower(i);
+      return v < h->min ? h->min : (v > h->max ? h->max : v);
+    }
+  }
+  return h->max;
+}
+
+/* SIGUSR1を受けて表示要求を立てるシグナル・ハンドラの定義 */
+static void stats_sigusr1(int sig)
+{
+  stats_dump_request = 1;
+}
+
+/* 計測を開始する関数の定義(計測フラグが立っていなければ何もしない) */
+static void stats_start(PERIOD_STATS *ps, unsigned int rate)
+{
+  struct sigaction sa;
+
+  if (!ps->enabled)
+    return;
+  memset(ps, 0, sizeof(*ps));
+  ps->enabled = 1;
+  ps->rate = rate;
+  ps->start = ps->mark = stats_clock();
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_sigusr1;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* 区間計測の開始時刻を記録する関数の定義 */
+static inline void stats_mark(PERIOD_STATS *ps)
+{
+  if (ps->enabled)
+    ps->mark = stats_clock();
+}
+
+/* 前回の記録からの経過時間をヒストグラムに記録する関数の定義 */
+static inline void stats_lap(PERIOD_STATS *ps, HDR_HIST *h)
+{
+  uint64_t now;
+  if (!ps->enabled)
+    return;
+  now = stats_clock();
+  hist_record(h, now - ps->mark);
+  ps->mark = now;
+}
+
+/* アンダーランと回復結果を記録する関数の定義(回復結果をそのまま返す) */
+static int stats_xrun(PERIOD_STATS *ps, int error, int recovered, long frames)
+{
+  if (ps->enabled) {
+    if (ps->numXruns < XRUN_LOG_MAX) {
+      XRUN_EVENT *ev = &ps->xruns[ps->numXruns];
+      ev->time = stats_clock() - ps->start;
+      ev->error = error;
+      ev->recovered = recovered;
+      ev->frames = frames;
+    }
+    ps->numXruns++;
+  }
+  return recovered;
+}
+
+/* 転送周期統計を表示する関数の定義(計測を開始していなければ何もしない) */
+static void stats_dump(const PERIOD_STATS *ps, FILE *fp)
+{
+  const struct { const char *name; const HDR_HIST *h; double scale; const char *unit; } rows[] = {
+    {"読込み/デコード", &ps->read, 1000.0, "usec"},
+    {"転送関数", &ps->write, 1000.0, "usec"},
+    {"delay", &ps->delay, 1.0, "frames"},
+    {"avail", &ps->avail, 1.0, "frames"},
+  };
+  unsigned long n = ps->numXruns < XRUN_LOG_MAX ? ps->numXruns : XRUN_LOG_MAX;
+
+  if (!ps->enabled || ps->start == 0)
+    return;
+  fprintf(fp, "*** 転送周期統計 (%lu 周期, 経過 %.3f 秒) ***\n", ps->periods,
+	  (double)(stats_clock() - ps->start) / 1e9);
+  fprintf(fp, "%10s %10s %10s %10s %10s %10s %10s  %-6s  項目\n",
+	  "min", "mean", "50%", "90%", "99%", "99.9%", "max", "単位");
+  for (unsigned int r = 0 ; r < sizeof(rows) / sizeof(rows[0]) ; r++) {
+    const HDR_HIST *h = rows[r].h;
+    if (h->total == 0)
+      continue;
+    fprintf(fp, "%10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f  %-6s  %s\n",
+	    (double)h->min / rows[r].scale, h->sum / (double)h->total / rows[r].scale,
+	    (double)hist_percentile(h, 50.0) / rows[r].scale, (double)hist_percentile(h, 90.0) / rows[r].scale,
+	    (double)hist_percentile(h, 99.0) / rows[r].scale, (double)hist_percentile(h, 99.9) / rows[r].scale,
+	    (double)h->max / rows[r].scale, rows[r].unit, rows[r].name);
+  }
+  /* 転送関数の所要時間の分布(空でない区間のみ) */
+  if (ps->write.total > 0) {
+    uint64_t count = 0;
+    fprintf(fp, "転送関数の所要時間分布:\n");
+    for (int i = 0 ; i < HIST_BUCKETS ; i++) {
+      if (ps->write.counts[i] == 0)
+	continue;
+      count += ps->write.counts[i];
+      fprintf(fp, "  %12.3f usec以上: %8lu (累積 %7.3f%%)\n", (double)hist_lower(i) / 1000.0,
+	      (unsigned long)ps->write.counts[i], 100.0 * (double)count / (double)ps->write.total);
+    }
+  }
+  fprintf(fp, "*** アンダーラン記録 (%lu 件) ***\n", ps->numXruns);
+  for (unsigned long i = 0 ; i < n ; i++)
+    fprintf(fp, "  %10.3f msec: %s, 回復%s, 再生済 %ld フレーム\n", (double)ps->xruns[i].time / 1e6,
+	    snd_strerror(ps->xruns[i].error), ps->xruns[i].recovered < 0 ? "失敗" : "成功", ps->xruns[i].frames);
+  if (ps->numXruns > n)
+    fprintf(fp, "  (以降 %lu 件は記録上限を超えたため省略)\n", ps->numXruns - n);
+}
+
+/* 1つのヒストグラムをJSONで出力する関数の定義 */
+static void stats_json_hist(FILE *fp, const char *name, const HDR_HIST *h, const char *unit, int last)
+{
+  int first = 1;
+  fprintf(fp, "    \"%s\": {\"unit\": \"%s\", \"count\": %lu, \"min\": %lu, \"max\": %lu, \"mean\": %.1f,\n",
+	  name, unit, (unsigned long)h->total, (unsigned long)h->min, (unsigned long)h->max,
+	  h->total > 0 ? h->sum / (double)h->total : 0.0);
+  fprintf(fp, "      \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu,\n",
+	  (unsigned long)hist_percentile(h, 50.0), (unsigned long)hist_percentile(h, 90.0),
+	  (unsigned long)hist_percentile(h, 99.0), (unsigned long)hist_percentile(h, 99.9));
+  fprintf(fp, "      \"buckets\": [");
+  for (int i = 0 ; i < HIST_BUCKETS ; i++) {
+    if (h->counts[i] == 0)
+      continue;
+    fprintf(fp, "%s[%lu, %lu]", first ? "" : ", ", (unsigned long)hist_lower(i), (unsigned long)h->counts[i]);
+    first = 0;
+  }
+  fprintf(fp, "]}%s\n", last ? "" : ",");
+}
+
+/* 転送周期統計をJSONファイルに出力する関数の定義(計測を開始していなければ何もしない) */
+static int stats_dump_json(const PERIOD_STATS *ps, const char *path)
+{
+  unsigned long n = ps->numXruns < XRUN_LOG_MAX ? ps->numXruns : XRUN_LOG_MAX;
+  FILE *fp;
+
+  if (!ps->enabled || ps->start == 0 || path == NULL)
+    return 0;
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "統計ファイル作成失敗: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "{\n  \"rate\": %u,\n  \"periods\": %lu,\n  \"elapsed_ns\": %lu,\n", ps->rate, ps->periods,
+	  (unsigned long)(stats_clock() - ps->start));
+  fprintf(fp, "  \"histograms\": {\n");
+  stats_json_hist(fp, "read_ns", &ps->read, "ns", 0);
+  stats_json_hist(fp, "write_ns", &ps->write, "ns", 0);
+  stats_json_hist(fp, "delay_frames", &ps->delay, "frames", 0);
+  stats_json_hist(fp, "avail_frames", &ps->avail, "frames", 1);
+  fprintf(fp, "  },\n  \"xrun_count\": %lu,\n  \"xruns\": [", ps->numXruns);
+  for (unsigned long i = 0 ; i < n ; i++)
+    fprintf(fp, "%s\n    {\"time_ns\": %lu, \"error\": %d, \"recovered\": %d, \"frames\": %ld}", i ? "," : "",
+	    (unsigned long)ps->xruns[i].time, ps->xruns[i].error, ps->xruns[i].recovered, ps->xruns[i].frames);
+  fprintf(fp, "%s]\n}\n", n ? "\n  " : "");
+  fclose(fp);
+  return 0;
+}
+
+/* 転送周期の終わりにPCMの遅延と空き容量を記録し、表示要求があれば表示する関数の定義 */
+static void stats_period(PERIOD_STATS *ps, snd_pcm_t *handle)
+{
+  snd_pcm_sframes_t delay, avail;
+
+  if (!ps->enabled)
+    return;
+  if (snd_pcm_delay(handle, &delay) == 0 && delay >= 0)
+    hist_record(&ps->delay, (uint64_t)delay);
+  if ((avail = snd_pcm_avail(handle)) >= 0)
+    hist_record(&ps->avail, (uint64_t)avail);
+  ps->periods++;
+  if (stats_dump_request) {
+    stats_dump_request = 0;
+    stats_dump(ps, stdout);
+    fflush(stdout);
+  }
+  ps->mark = stats_clock();				/* 計測自体の時間を次の区間に含めない */
+}
+
+#endif
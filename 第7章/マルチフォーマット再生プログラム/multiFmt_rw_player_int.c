@@ -3,14 +3,24 @@
  		     - 標準read/write転送 -
  ソースコード：multiFmt_rw_player_int.c
  **********************************************************************************************/
+#define _GNU_SOURCE			/* CPU固定(pthread_setaffinity_np)に必要 */
+
 #include <getopt.h>
+#include <pthread.h>
 #include "alsa/asoundlib.h"
 #include "sndfile.h" 
+#include "PeriodStats.h"
+#include "RealtimeSched.h"
 
 /*** ユーティリティ関数プロトタイプ宣言 ***/
 static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
 static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams);
+static int set_period_frames(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
+static int step_up_period(snd_pcm_t *handle);
+static snd_pcm_format_t negotiate_format(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
+static int alloc_blocks(unsigned char **frameBlock, int **workBlock);
 static int multi_fmt_write_int(snd_pcm_t *handle);
+static int parse_count(const char *s, long min, long max, long *value);
 static void usage(void);
 static snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
 
@@ -26,13 +36,48 @@ static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(
 static snd_output_t *output = NULL;			/* 出力オブジェクトに 対するALSA内部構造体へのハンドル */
 
 /*** アプリケーション制御フラグの初期化 ***/
-static int mmap = 0;					/* 転送方法制御フラグ: write=0, mmap write=1  */
+static int mmap_access = 0;				/* 転送方法制御フラグ: write=0, mmap write=1  */
 static int verbose = 0;					/* 饒舌情報表示フラグ: set=1 clear=0 */
 static int resample = 1;				/* 標本化速度変換設定フラグ: set=1 clear=0 */
+static int wide = 0;					/* 32bit出力固定フラグ: set=1 clear=0 */
+static unsigned int qbits = 32;				/* 音源の量子化ビット数 */
+static unsigned int sampleBytes = 4;			/* 出力サンプル当りのバイト数 */
+static PERIOD_STATS stats;				/* 転送周期統計: stats.enabled=1で計測 */
+static const char *statsJson = NULL;			/* 転送周期統計のJSON出力先: NULL=出力しない */
+static RT_CONFIG rt = RT_CONFIG_INIT;			/* 再生スレッドの実時間設定 */
+
+/*** レイテンシ・プロファイルの定義 ***/
+enum { LATENCY_LOW, LATENCY_BALANCED, LATENCY_THROUGHPUT };
+static int latency = LATENCY_THROUGHPUT;		/* レイテンシ・プロファイル */
+static snd_pcm_uframes_t req_period_frames = 0;		/* 転送周期の要求値(frames): 0=プロファイルに従う */
+static unsigned int req_periods = 0;			/* バッファ当りの周期数の要求値: 0=プロファイルに従う */
+#define MAX_PERIOD_FRAMES (1 << 20)			/* 転送周期の要求値(-F)の上限(frames) */
+#define MAX_PERIODS (1024)				/* バッファ当りの周期数の要求値(-B)の上限 */
+
+/*** 再生リストの曲の定義 ***/
+#define PRELOAD_PERIODS (4)				/* 次の曲で先行デコードする転送周期数 */
+typedef struct{
+  const char *path;					/* サウンドファイル名 */
+  SNDFILE *file;					/* libsndfileハンドル: NULL=未オープン */
+  SF_INFO info;						/* サウンドファイル情報 */
+  unsigned int qbits;					/* 量子化ビット数 */
+  snd_pcm_format_t format;				/* 読込み時の出力フォーマット */
+  unsigned char *preload;				/* 先行デコードしたフレーム */
+  long preloadFrames;					/* 先行デコードするフレーム数(要求値、結果) */
+  long preloadPos;					/* 再生済の先行デコード・フレーム数 */
+  int status;						/* オープン結果: 0=成功 */
+} TRACK;
 
-/*** libsndfileパラメータの宣言 ***/
-static SNDFILE *infile;
-static SF_INFO infileInfo;
+static TRACK *tracks = NULL;				/* 再生リスト */
+static int numTracks = 0;				/* 再生リストの曲数 */
+
+static long read_native_frames(TRACK *t, void *block, int *work, long nFrames);
+static int track_open(TRACK *t);
+static int track_compatible(const TRACK *t);
+static void print_track_info(const TRACK *t);
+static void *preload_worker(void *arg);
+static int add_track(const char *path);
+static int read_playlist(const char *listPath);
 
 /* PCMにHWパラメータを設定するユーティリティ関数の定義 */
 int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
@@ -53,7 +98,7 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
     return err;
   }
   /* 構成空間を実際のアクセス方法のみを包含するように制限する */
-  if (mmap) {
+  if (mmap_access) {
     err = snd_pcm_hw_params_set_access(handle, hwparams,
 				       SND_PCM_ACCESS_MMAP_INTERLEAVED);
   } else
@@ -65,6 +110,8 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
   }
 	
   /* 構成空間を唯一のフォーマットを包含するように制限する */
+  format = negotiate_format(handle, hwparams);
+  sampleBytes = (unsigned int)snd_pcm_format_physical_width(format) / 8;
   err = snd_pcm_hw_params_set_format(handle, hwparams, format);
   if (err < 0) {
     fprintf(stderr, "サンプルフォーマット非適用: %s\n", snd_strerror(err));
@@ -94,31 +141,38 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
     return -EINVAL;
   }
 
-  /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する */
-  err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
-  if (buffer_time > 500000)
-    buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
-  if (buffer_time > 0)
-    period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
-  else{
-    fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
-    return -EINVAL;
-  }
-		
-  /* 構成空間をbuffer_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間をperiod_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
-    return err;
+  if (latency == LATENCY_THROUGHPUT && req_period_frames == 0 && req_periods == 0) {
+    /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する(throughput) */
+    err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
+    if (buffer_time > 500000)
+      buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
+    if (buffer_time > 0)
+      period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
+    else{
+      fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
+      return -EINVAL;
+    }
+
+    /* 構成空間をbuffer_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
+      return err;
+    }
+
+    /* 構成空間をperiod_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
+      return err;
+    }
+  } else {
+    /* 転送周期と周期数をフレーム単位で折衝する(low, balanced, または明示指定) */
+    err = set_period_frames(handle, hwparams);
+    if (err < 0)
+      return err;
   }
-        
+
   /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
   err = snd_pcm_hw_params(handle, hwparams);
   if (err < 0) {
@@ -140,6 +194,57 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
   return 0;
 }
 
+/* レイテンシ・プロファイルに従い転送周期と周期数をフレーム単位で折衝するユーティリティ関数の定義 */
+int set_period_frames(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_uframes_t periodFrames, periodMin;
+  unsigned int periods;
+  int err, dir = 0;
+
+  /* 構成空間から転送周期の最小値を抽出する */
+  err = snd_pcm_hw_params_get_period_size_min(hwparams, &periodMin, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size最小値取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  switch (latency) {
+  case LATENCY_LOW:		/* デバイスが許容する最小の転送周期を3周期 */
+    periodFrames = periodMin;
+    periods = 3;
+    break;
+  case LATENCY_BALANCED:	/* 10 msecの転送周期を4周期 */
+    periodFrames = rate / 100;
+    periods = 4;
+    break;
+  default:			/* 125 msecの転送周期を4周期 */
+    periodFrames = rate / 8;
+    periods = 4;
+    break;
+  }
+  if (req_period_frames > 0)
+    periodFrames = req_period_frames;
+  if (req_periods > 0)
+    periods = req_periods;
+  if (periodFrames < periodMin)
+    periodFrames = periodMin;
+
+  /* 構成空間をperiod_size要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_period_size_near(handle, hwparams, &periodFrames, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size設定不可 %lu : %s\n", periodFrames, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を周期数要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_periods_near(handle, hwparams, &periods, &dir);
+  if (err < 0) {
+    fprintf(stderr, "periods設定不可 %u : %s\n", periods, snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
 /* PCMにSWパラメータを設定するユーティリティ関数の定義 */
 int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
 {
@@ -176,67 +281,417 @@ int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
   return 0;
 }
 
-/* サウンドデータの再生を行うユーティリティ関数の定義 */
+/* アンダーラン発生時に転送周期を2倍に拡大してPCMを再構成するユーティリティ関数の定義 */
+int step_up_period(snd_pcm_t *handle)
+{
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
+  snd_pcm_uframes_t oldPeriod = period_size;
+  int err;
+
+  /* 既定のthroughputプロファイル、または周期が125 msecに達していれば拡大しない */
+  if ((latency == LATENCY_THROUGHPUT && req_period_frames == 0 && req_periods == 0) || period_size * 2 > rate / 8)
+    return 0;
+  snd_pcm_hw_params_alloca(&hwparams); 
+  snd_pcm_sw_params_alloca(&swparams);
+
+  snd_pcm_drop(handle);
+  req_period_frames = period_size * 2;
+  if ((err = set_hwparams(handle, hwparams)) < 0)
+    return err;
+  if ((err = set_swparams(handle, swparams)) < 0)
+    return err;
+  printf("アンダーラン検出: 転送周期を %lu → %lu フレームに拡大\n", oldPeriod, period_size);
+  return 1;
+}
+
+/* 量子化ビット数に一致するサンプル・フォーマットを選択するユーティリティ関数の定義 */
+snd_pcm_format_t negotiate_format(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_format_t native = SND_PCM_FORMAT_S32_LE;
+
+  /* 16bit, 24bit音源は同じ幅のフォーマットを優先し、PCMが受け付けなければ32bitに拡張する */
+  if (!wide && qbits == 16)
+    native = SND_PCM_FORMAT_S16_LE;
+  else if (!wide && qbits == 24)
+    native = SND_PCM_FORMAT_S24_3LE;
+  if (native != SND_PCM_FORMAT_S32_LE && snd_pcm_hw_params_test_format(handle, hwparams, native) == 0)
+    return native;
+  return SND_PCM_FORMAT_S32_LE;
+}
+
+/* 出力フォーマットでサウンドファイルからフレームを読み込むユーティリティ関数の定義 */
+long read_native_frames(TRACK *t, void *block, int *work, long nFrames)
+{
+  long readFrames;
+
+  switch (t->format) {
+  case SND_PCM_FORMAT_S16_LE:
+    return (long)sf_readf_short(t->file, (short *)block, (sf_count_t)nFrames);
+  case SND_PCM_FORMAT_S24_3LE:
+    /* 左詰め32bitで読み、上位3バイトを詰めて書き込む */
+    readFrames = (long)sf_readf_int(t->file, work, (sf_count_t)nFrames);
+    for (long i = 0; i < readFrames * (long)t->info.channels; i++) {
+      unsigned char *dst = (unsigned char *)block + 3 * i;
+      unsigned int v = (unsigned int)work[i];
+      dst[0] = (unsigned char)(v >> 8);
+      dst[1] = (unsigned char)(v >> 16);
+      dst[2] = (unsigned char)(v >> 24);
+    }
+    return readFrames;
+  default:
+    return (long)sf_readf_int(t->file, (int *)block, (sf_count_t)nFrames);
+  }
+}
+
+/* サウンドファイルをオープンし、形式と量子化ビット数を確認するユーティリティ関数の定義 */
+int track_open(TRACK *t)
+{
+  memset(&t->info, 0, sizeof(t->info));
+  if(!(t->file = sf_open(t->path, SFM_READ, &t->info))){
+    fprintf(stderr, "再生ファイル・オープン・エラー: %s: %s\n", t->path, sf_strerror(NULL));
+    return -1;
+  }
+  switch(t->info.format & SF_FORMAT_TYPEMASK) {
+  case SF_FORMAT_WAV:
+  case SF_FORMAT_WAVEX:
+  case SF_FORMAT_AIFF:
+  case SF_FORMAT_FLAC:
+    break;
+  default:
+    fprintf(stderr, "サポート外のファイルフォーマット: %s\n", t->path);
+    sf_close(t->file);
+    t->file = NULL;
+    return -1;
+  }
+  switch(t->info.format & SF_FORMAT_SUBMASK){
+  case SF_FORMAT_PCM_16:
+    t->qbits = 16;
+    break;
+  case SF_FORMAT_PCM_24:
+    t->qbits = 24;
+    break;
+  case SF_FORMAT_PCM_32:
+    t->qbits = 32;
+    break;
+  default:
+    fprintf(stderr, "サポート外の量子化ビット数: %s\n", t->path);
+    sf_close(t->file);
+    t->file = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* 曲が現在のPCM構成のまま再生できるか判定するユーティリティ関数の定義 */
+int track_compatible(const TRACK *t)
+{
+  return (unsigned int)t->info.samplerate == rate && (unsigned int)t->info.channels == numChannels
+    && (wide || t->qbits == qbits);
+}
+
+/* 再生ファイルの情報を表示するユーティリティ関数の定義 */
+void print_track_info(const TRACK *t)
+{
+  printf("*** サウンドファイル情報 ***\n");
+  printf("ファイル名：%s\n", t->path);
+  switch(t->info.format & SF_FORMAT_TYPEMASK) {
+  case SF_FORMAT_WAV: 
+    printf("ファイルフォーマット：WAVE\n");
+    break;
+  case SF_FORMAT_WAVEX: 
+    printf("ファイルフォーマット：拡張WAVE\n");
+    break;
+  case SF_FORMAT_AIFF: 
+    printf("ファイルフォーマット：AIFF\n");
+    break;
+  case SF_FORMAT_FLAC: 
+    printf("ファイルフォーマット：FLAC\n");
+    break; 
+  }
+  printf("データフォーマット：符号付%ubit\n", t->qbits);
+  printf("標本化速度：%dHz\n", t->info.samplerate);
+  printf("チャンネル数：%dチャンネル\n", t->info.channels);
+  printf("再生時間：%.0lf秒\n", (double)t->info.frames / (double)t->info.samplerate);
+  printf("\n");
+}
+
+/* 再生中の曲の裏で次の曲をオープンし、先頭の転送周期を先行デコードするスレッド関数の定義
+   PCMの再構成が必要な曲は、再構成後のフォーマットが決まらないので情報だけ取得して閉じる */
+void *preload_worker(void *arg)
+{
+  TRACK *t = (TRACK *)arg;
+  size_t frameBytes = (size_t)snd_pcm_format_physical_width(t->format) / 8 * numChannels;
+  int *work = NULL;
+
+  if ((t->status = track_open(t)) != 0 || !track_compatible(t) || t->preloadFrames <= 0) {
+    if (t->status == 0 && !track_compatible(t)) {
+      sf_close(t->file);		/* 再構成後に開き直す */
+      t->file = NULL;
+    }
+    t->preloadFrames = 0;
+    return NULL;
+  }
+  t->preload = (unsigned char *)malloc((size_t)t->preloadFrames * frameBytes);
+  if (t->format == SND_PCM_FORMAT_S24_3LE)
+    work = (int *)malloc((size_t)t->preloadFrames * sizeof(int) * numChannels);
+  if (t->preload == NULL || (t->format == SND_PCM_FORMAT_S24_3LE && work == NULL))
+    t->preloadFrames = 0;		/* 先行デコードせず、再生時に読み込む */
+  else if ((t->preloadFrames = read_native_frames(t, t->preload, work, t->preloadFrames)) < 0)
+    t->preloadFrames = 0;
+  t->preloadPos = 0;
+  free(work);
+  return NULL;
+}
+
+/* 再生リストに曲を加えるユーティリティ関数の定義 */
+int add_track(const char *path)
+{
+  TRACK *p = (TRACK *)realloc(tracks, sizeof(TRACK) * (numTracks + 1));
+
+  if (p == NULL) {
+    fprintf(stderr, "メモリ不足で再生リストを作成できない\n");
+    return -1;
+  }
+  tracks = p;
+  memset(&tracks[numTracks], 0, sizeof(TRACK));
+  tracks[numTracks].path = strdup(path);
+  numTracks++;
+  return 0;
+}
+
+/* 再生リスト・ファイル(1行1曲、#で始まる行は注釈)を読み込むユーティリティ関数の定義
+   相対パスは再生リスト・ファイルのディレクトリを起点とする */
+int read_playlist(const char *listPath)
+{
+  char line[4096], path[8192];
+  const char *slash = strrchr(listPath, '/');
+  FILE *fp;
+
+  if ((fp = fopen(listPath, "r")) == NULL) {
+    fprintf(stderr, "再生リストを開けない: %s: %s\n", listPath, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+    if (line[0] == '/' || slash == NULL)
+      snprintf(path, sizeof(path), "%s", line);
+    else
+      snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - listPath), listPath, line);
+    if (add_track(path) < 0) {
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+/* 現在の転送周期とフォーマットでデータブロックを割り当て直すユーティリティ関数の定義 */
+int alloc_blocks(unsigned char **frameBlock, int **workBlock)
+{
+  free(*frameBlock);
+  free(*workBlock);
+  *workBlock = NULL;
+  *frameBlock = (unsigned char *)malloc(period_size * sampleBytes * numChannels);
+  if (format == SND_PCM_FORMAT_S24_3LE)
+    *workBlock = (int *)malloc(period_size * sizeof(int) * numChannels);
+  if (*frameBlock == NULL || (format == SND_PCM_FORMAT_S24_3LE && *workBlock == NULL)) {
+    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+    return -1;
+  }
+  rt_prefault(&rt, *frameBlock, period_size * sampleBytes * numChannels);
+  rt_prefault(&rt, *workBlock, period_size * sizeof(int) * numChannels);
+  return 0;
+}
+
+/* 再生リストの曲を同じPCMに続けて転送するユーティリティ関数の定義
+   次の曲は再生中に別スレッドでオープンと先行デコードを済ませ、PCM構成が同じならdrop/prepare無しで続けて書き込む */
 int multi_fmt_write_int(snd_pcm_t *handle)
 {
-  int *bufPtr;						/* 再生フレームバッファ */
-  const long numSoundFrames = (long)infileInfo.frames;	/* 再生サウンド総フレーム数 */
-  long nFrames, frameCount, numPlayFrames = 0;		/* 再生済フレーム数の初期化 */
-  long readFrames, resFrames = numSoundFrames;		/* 未再生フレーム数の初期化 */
-  int err = 0; 
-	
+  snd_pcm_hw_params_t *hwparams;			/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;			/* PCMソフトウェア構成コンテナ */
+  unsigned char *bufPtr;				/* 再生フレームバッファ */
+  long frameCount, numPlayFrames = 0;			/* 再生済フレーム数の初期化 */
+  long readFrames, resFrames;				/* 未再生フレーム数 */
+  long frameBytes = (long)sampleBytes * numChannels;	/* 1フレーム当りのバイト数 */
+  unsigned char *frameBlock = NULL;			/* 転送データブロック */
+  int *workBlock = NULL;				/* S24_3LE変換用の作業ブロック */
+  pthread_t preload_thread;				/* 先行オープン・スレッドID */
+  pthread_attr_t preload_attr;				/* 先行オープン・スレッドの属性 */
+  int preloading = 0;					/* 先行オープン・スレッド起動済フラグ */
+  int k = 0, played = 0, reconfigs = 0, err = 0;
+  TRACK *t = &tracks[0], *next;
+
+  snd_pcm_hw_params_alloca(&hwparams);
+  snd_pcm_sw_params_alloca(&swparams);
+  /* 先行オープン・スレッドは再生スレッドの実時間設定を継承せず、通常スケジューリングで動かす */
+  rt_normal_attr(&preload_attr);
   /*  オーディオサンプルの転送に適用するデータブロックにメモリを割り当てる  */	
-  int *frameBlock = (int *)malloc(period_size * sizeof(int) * numChannels);
-  if (frameBlock == NULL) {
-    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+  if (alloc_blocks(&frameBlock, &workBlock) < 0) {
     err = EXIT_FAILURE;
     goto cleaning;
   }
-  nFrames = (long)period_size; /* サウンドファイルから読み込むフレーム数の初期化 */
-  while(resFrames>0){
-    readFrames = (long)sf_readf_int(infile, frameBlock, (sf_count_t )nFrames);
-    frameCount = readFrames;	/* 書き込むサンプルフレーム数の初期値をサウンドファイルから読み込むフレーム数に設定 */
-    bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
-    while (frameCount > 0) {
-      err = (int)writei_func(handle, bufPtr, (snd_pcm_uframes_t)frameCount);	/* PCMデバイスにサウンドフレームを転送 */
-      if (err == -EAGAIN)
-	continue;
-      if (err < 0) {
-	if (snd_pcm_recover(handle, err, 0) < 0) {
-	  fprintf(stderr, "Write転送エラー: %s\n", snd_strerror(err));
+  rt_start(&rt, handle);
+  stats_start(&stats, rate);
+  while (t != NULL) {
+    /* 次の曲のオープンと先行デコードを再生中に始める */
+    next = (k + 1 < numTracks) ? &tracks[k + 1] : NULL;
+    if (next != NULL) {
+      next->format = format;
+      next->preloadFrames = (long)(PRELOAD_PERIODS * period_size);
+      if (pthread_create(&preload_thread, &preload_attr, preload_worker, next) == 0)
+	preloading = 1;
+      else
+	preload_worker(next);		/* スレッドを起動できなければ、その場でオープンする */
+    }
+
+    t->format = format;
+    resFrames = (long)t->info.frames;
+    while(resFrames>0){
+      long nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
+      if (t->preloadPos < t->preloadFrames) {
+	/* 先行デコード済のフレームをそのまま転送する */
+	readFrames = t->preloadFrames - t->preloadPos < nFrames ? t->preloadFrames - t->preloadPos : nFrames;
+	bufPtr = t->preload + t->preloadPos * frameBytes;
+	t->preloadPos += readFrames;
+      } else {
+	readFrames = read_native_frames(t, frameBlock, workBlock, nFrames);
+	bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
+      }
+      if (readFrames <= 0)
+	break;			/* ヘッダより短いファイル */
+      stats_lap(&stats, &stats.read);
+      frameCount = readFrames;	/* 書き込むサンプルフレーム数の初期値をサウンドファイルから読み込むフレーム数に設定 */
+      while (frameCount > 0) {
+	err = (int)writei_func(handle, bufPtr, (snd_pcm_uframes_t)frameCount);	/* PCMデバイスにサウンドフレームを転送 */
+	if (err == -EAGAIN)
+	  continue;
+	if (err < 0) {
+	  if (stats_xrun(&stats, err, snd_pcm_recover(handle, err, 0), numPlayFrames) < 0) {
+	    fprintf(stderr, "Write転送エラー: %s\n", snd_strerror(err));
+	    goto cleaning;
+	  }
+	  /* 転送周期を拡大した場合はデータブロックを再割当てする */
+	  if ((err = step_up_period(handle)) < 0)
+	    goto cleaning;
+	  if (err > 0 && alloc_blocks(&frameBlock, &workBlock) < 0) {
+	    err = EXIT_FAILURE;
+	    goto cleaning;
+	  }
+	  break;	/* １データブロック周期をスキップ */
+	} 
+	bufPtr += err * frameBytes;	/* フレームバッファのポインタを実際に書いたフレーム数にフレーム当りのバイト数を乗じた分だけ進める */
+	frameCount -= err;		/* フレームバッファ中に残存する書き込み可能なフレーム数を算定 */
+      }
+      stats_lap(&stats, &stats.write);
+      stats_period(&stats, handle);
+      numPlayFrames += readFrames;
+      resFrames -= readFrames;	/* 未再生フレーム数の計算 */
+    }
+    played++;
+    sf_close(t->file);
+    t->file = NULL;
+    free(t->preload);
+    t->preload = NULL;
+
+    /* 次の曲の準備を待つ。オープンできない曲は飛ばす */
+    if (preloading) {
+      pthread_join(preload_thread, NULL);
+      preloading = 0;
+    }
+    while (next != NULL && next->status != 0) {
+      fprintf(stderr, "再生できない曲を飛ばす: %s\n", next->path);
+      k++;
+      next = (k + 1 < numTracks) ? &tracks[k + 1] : NULL;
+      if (next != NULL) {
+	next->format = format;
+	next->preloadFrames = (long)(PRELOAD_PERIODS * period_size);
+	preload_worker(next);
+      }
+    }
+    if (next != NULL) {
+      if (!track_compatible(next)) {
+	/* 標本化速度、チャンネル数、フォーマットが変わる時だけ、前の曲を再生し切ってからPCMを再構成する */
+	if (next->file == NULL && track_open(next) < 0) {
+	  err = EXIT_FAILURE;
+	  goto cleaning;
+	}
+	snd_pcm_drain(handle);
+	rate = (unsigned int)next->info.samplerate;
+	numChannels = (unsigned int)next->info.channels;
+	qbits = next->qbits;
+	if ((err = set_hwparams(handle, hwparams)) < 0 || (err = set_swparams(handle, swparams)) < 0)
+	  goto cleaning;
+	frameBytes = (long)sampleBytes * numChannels;
+	if (alloc_blocks(&frameBlock, &workBlock) < 0) {
+	  err = EXIT_FAILURE;
 	  goto cleaning;
 	}
-	break;	/* １データブロック周期をスキップ */
-      } 
-      bufPtr += err *numChannels;	/* フレームバッファのポインタを実際に書いたフレーム数にチャンネル数を乗じた分だけ進める */
-      frameCount -= err;		/* フレームバッファ中に残存する書き込み可能なフレーム数を算定 */
+	reconfigs++;
+	printf("PCMを再構成: %s, %u Hz, %u チャンネル, 転送周期 %lu フレーム\n",
+	       snd_pcm_format_name(format), rate, numChannels, period_size);
+      }
+      print_track_info(next);
     }
-    numPlayFrames += readFrames;
-		
-    /* データ・ブロック長以下の残データフレーム数の計算 */
-    if ((resFrames = numSoundFrames - numPlayFrames) <= (long)period_size) 
-      nFrames = resFrames;
+    k++;
+    t = next;
   }
   snd_pcm_drop(handle);
   printf(" 合計　%lu フレームを再生して終了\n", numPlayFrames);
+  if (numTracks > 1)
+    printf(" 再生曲数：%d / %d 曲 (PCM再構成 %d 回)\n", played, numTracks, reconfigs);
   err = 0;
  cleaning:
+  stats_dump(&stats, stdout);			/* エラー終了時もそれまでの統計を残す */
+  stats_dump_json(&stats, statsJson);
+  if(preloading)
+    pthread_join(preload_thread, NULL);
+  pthread_attr_destroy(&preload_attr);
   if(frameBlock != NULL)
     free(frameBlock);
+  if(workBlock != NULL)
+    free(workBlock);
   return err;
 }
  
+/* 数値オプションを10進整数として解釈し、範囲[min, max]にあるか確かめるユーティリティ関数の定義
+   戻り値: 0=成功、-1=整数でない、または範囲外 */
+int parse_count(const char *s, long min, long max, long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE || *value < min || *value > max)
+    return -1;
+  return 0;
+}
+
 /* 使用法を表示するユーティリティ関数の定義 */
 void usage(void)
 {
   int k;
   printf(
 	 "使用法: multiFmt_rw_player_int [オプション]... [サウンドファイル]...\n"
+	 "複数のサウンドファイルは曲間を空けずに続けて再生する\n"
 	 "-h,--help	  使用法\n"
 	 "-D,--device	  再生デバイス\n"
 	 "-m,--mmap	         mmap_write転送\n"
+	 "-w,--wide	         32bit出力固定(量子化ビット数に合わせたフォーマットを選ばない)\n"
 	 "-v,--verbose      パラメータ設定値表示\n"
 	 "-n,--noresample   再標本化禁止\n"
+	 "-L,--latency=プロファイル low(最小周期), balanced(10 msec周期), throughput(500 msecバッファ)\n"
+	 "-F,--period-frames=数    転送周期(frames)\n"
+	 "-B,--periods=数          バッファ当りの周期数\n"
+	 "-S,--stats               転送周期ごとの所要時間とアンダーランを計測(SIGUSR1で途中表示)\n"
+	 "-J,--stats-json=ファイル 転送周期統計をJSONで出力(-Sを含む)\n"
+	 "-R,--realtime=方式[:優先度] 再生スレッドを fifo または rr で実時間実行(既定優先度 70)\n"
+	 "-A,--affinity=CPU番号    再生スレッドを指定CPUに固定\n"
+	 "-M,--mlock               mlockallでメモリ固定し、バッファを事前フォールト\n"
+	 "-l,--playlist=ファイル   再生リスト(1行1曲)の曲をサウンドファイルの前に加える\n"
 	 "\n");
   printf("適用サンプルフォーマット:");
   for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -254,8 +709,18 @@ int main(int argc, char *argv[])
       {"help", 0, NULL, 'h'},
       {"device", 1, NULL, 'D'},
       {"mmap", 0, NULL, 'm'},
+      {"wide", 0, NULL, 'w'},
       {"verbose", 0, NULL, 'v'},
       {"noresample", 0, NULL, 'n'},
+      {"latency", 1, NULL, 'L'},
+      {"period-frames", 1, NULL, 'F'},
+      {"periods", 1, NULL, 'B'},
+      {"stats", 0, NULL, 'S'},
+      {"stats-json", 1, NULL, 'J'},
+      {"realtime", 1, NULL, 'R'},
+      {"affinity", 1, NULL, 'A'},
+      {"mlock", 0, NULL, 'M'},
+      {"playlist", 1, NULL, 'l'},
       {NULL, 0, NULL, 0},
     };
 	
@@ -263,11 +728,10 @@ int main(int argc, char *argv[])
   snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
   snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
   unsigned char *transfer_method;	/* 転送方法名 */ 
-  double playtime = 0;
+  long value;				/* 数値オプションの値 */
   int err, c, exit_code = 0;
-  int informat, dformat;		/* ファイルフォーマット、データフォーマット */
 	
-  while ((c = getopt_long(argc, argv, "hD:mvn", long_option, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "hD:mwvnL:F:B:SJ:l:R:A:M", long_option, NULL)) != -1) {
     switch (c) {
     case 'h':
       usage();
@@ -276,7 +740,10 @@ int main(int argc, char *argv[])
       device = strdup(optarg); /* 再生デバイス名の指定 */
       break;
     case 'm':
-      mmap = 1;
+      mmap_access = 1;
+      break;
+    case 'w':
+      wide = 1;
       break;
     case 'v':
       verbose = 1;
@@ -284,81 +751,88 @@ int main(int argc, char *argv[])
     case 'n':
       resample = 0;
       break;	
+    case 'L':
+      if (strcmp(optarg, "low") == 0)
+	latency = LATENCY_LOW;
+      else if (strcmp(optarg, "balanced") == 0)
+	latency = LATENCY_BALANCED;
+      else if (strcmp(optarg, "throughput") == 0)
+	latency = LATENCY_THROUGHPUT;
+      else {
+	fprintf(stderr, "レイテンシ・プロファイルは low, balanced, throughput のいずれか\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      if (parse_count(optarg, 0, MAX_PERIOD_FRAMES, &value) < 0) {
+	fprintf(stderr, "転送周期は0〜%dフレームの整数\n", MAX_PERIOD_FRAMES);
+	return EXIT_FAILURE;
+      }
+      req_period_frames = (snd_pcm_uframes_t)value;
+      break;
+    case 'B':
+      if (parse_count(optarg, 0, MAX_PERIODS, &value) < 0) {
+	fprintf(stderr, "バッファ当りの周期数は0〜%dの整数\n", MAX_PERIODS);
+	return EXIT_FAILURE;
+      }
+      req_periods = (unsigned int)value;
+      break;
+    case 'S':
+      stats.enabled = 1;
+      break;
+    case 'J':
+      stats.enabled = 1;
+      statsJson = strdup(optarg);
+      break;
+    case 'R':
+      if (rt_parse(&rt, optarg) < 0) {
+	fprintf(stderr, "実時間方式は fifo[:優先度] または rr[:優先度] (優先度 1〜99)\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      if (rt_parse_cpu(&rt, optarg) < 0) {
+	fprintf(stderr, "CPU番号は0以上の整数\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+      rt.lock = 1;
+      break;
+    case 'l':
+      if (read_playlist(optarg) < 0)
+	return EXIT_FAILURE;
+      break;
     default:
       fprintf(stderr, "`--help'で使用方法を確認\n");
       return EXIT_FAILURE;
     }
   }
 	
-  if (optind > argc-1) {
+  /* 再生リストを作成する */
+  for (int f = optind ; f < argc ; f++)
+    if (add_track(argv[f]) < 0)
+      return EXIT_FAILURE;
+  if (numTracks == 0) {
     usage();
     return 0;
   }
-  /* 再生ファイルパス名の初期化 */	
-  const char *filePath = NULL;
   	
   /* ALSA HW, SWパラメータ・コンテナの初期化 */
   snd_pcm_hw_params_alloca(&hwparams); 
   snd_pcm_sw_params_alloca(&swparams);
 	
-  /* 再生ファイルをオープンする */
-  filePath = argv[optind];	
-  if(!(infile = sf_open(filePath, SFM_READ, &infileInfo))){
-    fprintf(stderr, "再生ファイル・オープン・エラー: %s\n", sf_strerror(infile));
+  /* 最初の再生ファイルをオープンし、フォーマット情報を取得する */
+  if (track_open(&tracks[0]) < 0) {
     exit_code = EXIT_FAILURE;
     goto cleaning;
   }
-    	
-  /* 再生ファイルのフォーマット情報を取得する */
-  informat = infileInfo.format & SF_FORMAT_TYPEMASK;	/* ファイルフォーマットの取得 */
-  dformat = infileInfo.format & SF_FORMAT_SUBMASK;	/* データフォーマットの取得 */
-  numChannels = (unsigned int)infileInfo.channels;	/* チャンネル数の取得 */
-  rate = (unsigned int)infileInfo.samplerate;		/* 標本化速度の取得 */ 
-  playtime = (double)infileInfo.frames / (double)rate;	/* サウンド再生時間の算出 */	 
+  numChannels = (unsigned int)tracks[0].info.channels;	/* チャンネル数の取得 */
+  rate = (unsigned int)tracks[0].info.samplerate;	/* 標本化速度の取得 */ 
+  qbits = tracks[0].qbits;				/* 量子化ビット数の取得 */
 	
   /* 再生ファイルの情報を表示する */	
-  printf("*** サウンドファイル情報 ***\n");
-  printf("ファイル名：%s\n", filePath);
-	
-  switch(informat) {
-  case SF_FORMAT_WAV: 
-    printf("ファイルフォーマット：WAVE\n");
-    break;
-  case SF_FORMAT_WAVEX: 
-    printf("ファイルフォーマット：拡張WAVE\n");
-    break;
-  case SF_FORMAT_AIFF: 
-    printf("ファイルフォーマット：AIFF\n");
-    break;
-  case SF_FORMAT_FLAC: 
-    printf("ファイルフォーマット：FLAC\n");
-    break; 
-  default:
-    fprintf(stderr, "サポート外のファイルフォーマット\n");
-    exit_code = EXIT_FAILURE;
-    goto cleaning; 
-  }
-    
-  switch(dformat){
-  case SF_FORMAT_PCM_16: 
-    printf("データフォーマット：符号付16bit\n");
-    break;
-  case SF_FORMAT_PCM_24: 
-    printf("データフォーマット：符号付24bit\n");
-    break;
-  case SF_FORMAT_PCM_32: 
-    printf("データフォーマット：符号付32bit\n");
-    break;	
-  default:
-    fprintf(stderr, "サポート外の量子化ビット数\n");
-    exit_code = EXIT_FAILURE;
-    goto cleaning;
-  }
-    	
-  printf("標本化速度：%dHz\n", rate);
-  printf("チャンネル数：%dチャンネル\n", numChannels);
-  printf("再生時間：%.0lf秒\n", playtime);
-  printf("\n");
+  print_track_info(&tracks[0]);
 
   /* ALSAの出力オブジェクト、転送関数、アクセス方法の設定 */
   err = snd_output_stdio_attach(&output, stdout, 0);
@@ -368,7 +842,7 @@ int main(int argc, char *argv[])
     goto cleaning;
   }
 	
-  if (mmap) {
+  if (mmap_access) {
     writei_func = snd_pcm_mmap_writei;
     transfer_method = (unsigned char *)"mmap_write";
   } else {
@@ -414,6 +888,8 @@ int main(int argc, char *argv[])
   printf("内部フォーマット：%s\n", snd_pcm_format_name(format));
   printf("PCMデバイス：%s\n", device);
   printf("転送方法: %s\n", transfer_method);
+  printf("バッファサイズ：%lu フレーム (%.1f msec)\n", buffer_size, 1000.0 * (double)buffer_size / (double)rate);
+  printf("転送周期：%lu フレーム (%.1f msec)\n", period_size, 1000.0 * (double)period_size / (double)rate);
   printf("\n");
 
   /* ユーティリティ関数によりファイルからデータを読み、ALSA転送関数に渡してサウンドを再生する */
@@ -430,8 +906,13 @@ int main(int argc, char *argv[])
   if(handle != NULL)
     snd_pcm_close(handle);
   snd_config_update_free_global();	
-  if(infile != NULL)
-    sf_close(infile);
+  for (int k = 0 ; k < numTracks ; k++) {
+    if(tracks[k].file != NULL)
+      sf_close(tracks[k].file);
+    free(tracks[k].preload);
+    free((char *)tracks[k].path);
+  }
+  free(tracks);
   return exit_code;
 }
 
@@ -5,6 +5,7 @@
 #include <getopt.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <atomic>
 #include "alsa/asoundlib.h"
 #include "sndfile.h" 
 #include "FL/Fl.H"
@@ -17,12 +18,19 @@
 #include "FL/Fl_Menu_Item.H"
 #include "FL/Fl_Choice.H"
 #include "FL/Fl_Hor_Value_Slider.H"
+#include "RealtimeSched.h"
 
 /*** ユーティリティ関数プロトタイプ宣言 ***/
 static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
 static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams);
+static int set_period_frames(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams);
+static int step_up_period(snd_pcm_t *handle);
 static int gui_write_int(snd_pcm_t *handle);
+static int pause_pcm(snd_pcm_t *handle, long *numPlayFrames);
+static int resume_pcm(snd_pcm_t *handle, int mode);
+static void wake_player(void);
 static void *player(void *arg);
+static void usage(void);
 static snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
 
 /*** ALSAライブラリのパラメータ初期化 ***/
@@ -36,13 +44,42 @@ static snd_pcm_uframes_t buffer_size = 0;		/* バッファサイズ(符号無し
 static snd_pcm_uframes_t period_size = 0;		/* データブロック・サイズ(符号無しフレーム数) */
 
 /*** アプリケーション制御パラメータ宣言 ***/
-static int mmap = 0;					/* 転送方法制御フラグ: write=0, mmap write=1  */
+static int mmap_access = 0;				/* 転送方法制御フラグ: write=0, mmap write=1  */
 static int resample = 1;				/* 標本化速度変換設定フラグ: set=1 clear=0 */
+static int canPause = 0;				/* ハードウェア一時停止対応フラグ: set=1 clear=0 */
+
+/*** 再生の間も開いたままにするPCMの状態 ***/
+static snd_pcm_t *pcm = NULL;				/* PCMハンドル: NULL=未オープン */
+static const char *pcmDevice = NULL;			/* pcmを開いたデバイス名 */
+static unsigned int pcmRate = 0, pcmChannels = 0;	/* pcmに設定した標本化速度、チャンネル数 */
+static int pcmLatency = -1;				/* pcmに設定したレイテンシ・プロファイル */
+static bool pcmConfigured = false;			/* 上記の設定でHW, SWパラメータを設定済みのフラグ */
+
+/*** レイテンシ・プロファイルの定義 ***/
+enum { LATENCY_LOW, LATENCY_BALANCED, LATENCY_THROUGHPUT };
+static int latency = LATENCY_THROUGHPUT;		/* レイテンシ・プロファイル */
+static snd_pcm_uframes_t req_period_frames = 0;		/* 転送周期の要求値(frames): 0=プロファイルに従う */
+static unsigned int req_periods = 0;			/* バッファ当りの周期数の要求値: 0=プロファイルに従う */
 static pthread_t play_thread;				/* 再生処理スレッドID */
+static RT_CONFIG rt = RT_CONFIG_INIT;			/* 再生スレッドの実時間設定 */
 static char filePath[256] = {0};			/* サウンドファイルパス名 */
 static bool isPlay = false;				/* 再生状態識別フラグ */
 static bool isStop = false;				/* 停止状態識別フラグ */
 
+/*** 再生位置の公開: 再生スレッドが書き、GUIの表示タイマーが読む(GUIロック不要) ***/
+#define DISPLAY_INTERVAL (1.0 / 30.0)			/* 再生位置表示の更新間隔(秒) */
+static std::atomic<long> playFrames(0);			/* 再生済フレーム数 */
+static std::atomic<long> playTotal(0);			/* 再生総フレーム数 */
+static std::atomic<unsigned int> playRate(0);		/* 再生中の標本化速度(Hz) */
+static std::atomic<bool> playEnded(false);		/* 再生終了通知フラグ */
+static std::atomic<long> seekRequest(-1);		/* 移動先フレーム位置の要求: -1=要求なし */
+static std::atomic<bool> pauseRequest(false);		/* 一時停止要求フラグ */
+static pthread_mutex_t pauseMutex = PTHREAD_MUTEX_INITIALIZER;	/* 一時停止中の待機用ミューテックス */
+static pthread_cond_t pauseCond = PTHREAD_COND_INITIALIZER;	/* 一時停止中の待機を解く条件変数 */
+
+/*** 一時停止方式の定義 ***/
+enum { PAUSE_NONE, PAUSE_HW, PAUSE_DROP };
+
 /*** libsndfileパラメータの宣言 ***/
 static SNDFILE *infile;
 static SF_INFO infileInfo;
@@ -51,6 +88,7 @@ static SF_INFO infileInfo;
 static Fl_Window *MainWindow;	
 static Fl_File_Chooser *FileDlg;			/* ファイル選択ダイアログボックス */
 static Fl_Choice *PcmDevice;				/* pcmデバイス選択ポップアップ */
+static Fl_Choice *Latency;				/* レイテンシ・プロファイル選択ポップアップ */
 static Fl_Box *PlayFile;				/* 再生ファイル名表示ボックス */
 static Fl_Box *PlayState;				/* 再生状態表示ボックス */
 static Fl_Hor_Value_Slider *TimeBar;			/* 再生時間表示スライダ */
@@ -60,7 +98,10 @@ static void cb_loadFile(Fl_Menu_Item *w, void *d);
 static void cb_exit(Fl_Menu_Item *w, void *d);
 static void cb_butPlay(Fl_Button *w, void *d);
 static void cb_butStop(Fl_Button *w, void *d);
+static void cb_butPause(Fl_Button *w, void *d);
 static void cb_pcmDevice(Fl_Choice *w, void *d);
+static void cb_display(void *d);
+static void cb_timeBar(Fl_Hor_Value_Slider *w, void *d);
 
 /* PCMにHWパラメータを設定するユーティリティ関数の定義 */
 int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
@@ -81,7 +122,7 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
     return err;
   }
   /* 構成空間を実際のアクセス方法のみを包含するように制限する */
-  if (mmap) {
+  if (mmap_access) {
     err = snd_pcm_hw_params_set_access(handle, hwparams,
 				       SND_PCM_ACCESS_MMAP_INTERLEAVED);
   } else
@@ -122,37 +163,45 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
     return -EINVAL;
   }
 
-  /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する */
-  err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
-  if (buffer_time > 500000)
-    buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
-  if (buffer_time > 0)
-    period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
-  else{
-    fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
-    return -EINVAL;
-  }
-		
-  /* 構成空間をbuffer_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
-    return err;
-  }
-	
-  /* 構成空間をperiod_time要求値に最も近い値に制限する */
-  err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
-  if (err < 0) {
-    fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
-    return err;
+  if (latency == LATENCY_THROUGHPUT && req_period_frames == 0 && req_periods == 0) {
+    /* 構成空間からbuffer_timeおよびperiod_timeの最大値を抽出する(throughput) */
+    err = snd_pcm_hw_params_get_buffer_time_max(hwparams, &buffer_time, &dir); 
+    if (buffer_time > 500000)
+      buffer_time = 500000; /* buffer timeの上限を500 msecに設定 */
+    if (buffer_time > 0)
+      period_time = buffer_time / 4; /* bufferを4つのperiods(チャンク)に分割 */
+    else{
+      fprintf(stderr, "エラー: buffer_timeはゼロまたは負の値\n");
+      return -EINVAL;
+    }
+
+    /* 構成空間をbuffer_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_buffer_time_near(handle, hwparams, &buffer_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "buffer time設定不可 %i : %s\n", buffer_time, snd_strerror(err));
+      return err;
+    }
+
+    /* 構成空間をperiod_time要求値に最も近い値に制限する */
+    err = snd_pcm_hw_params_set_period_time_near(handle, hwparams, &period_time, &dir);
+    if (err < 0) {
+      fprintf(stderr, "period time設定不可 %i : %s\n", period_time, snd_strerror(err));
+      return err;
+    }
+  } else {
+    /* 転送周期と周期数をフレーム単位で折衝する(low, balanced, または明示指定) */
+    err = set_period_frames(handle, hwparams);
+    if (err < 0)
+      return err;
   }
-        
+
   /* 構成空間から選定された唯一のPCM ハードウェア構成を導入し、PCMの準備を行う */
   err = snd_pcm_hw_params(handle, hwparams);
   if (err < 0) {
     fprintf(stderr, "ハードウェアパラメータ設定不可: %s\n", snd_strerror(err));
     return err;
   }
+  canPause = snd_pcm_hw_params_can_pause(hwparams);	/* 一時停止方式の選択に用いる */
 	
   /* 構成空間からbuffer_sizeとperiod_sizeを取得する */
   err = snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size);
@@ -168,6 +217,57 @@ int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
   return 0;
 }
 
+/* レイテンシ・プロファイルに従い転送周期と周期数をフレーム単位で折衝するユーティリティ関数の定義 */
+int set_period_frames(snd_pcm_t *handle, snd_pcm_hw_params_t *hwparams)
+{
+  snd_pcm_uframes_t periodFrames, periodMin;
+  unsigned int periods;
+  int err, dir = 0;
+
+  /* 構成空間から転送周期の最小値を抽出する */
+  err = snd_pcm_hw_params_get_period_size_min(hwparams, &periodMin, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size最小値取得不可 : %s\n", snd_strerror(err));
+    return err;
+  }
+  switch (latency) {
+  case LATENCY_LOW:		/* デバイスが許容する最小の転送周期を3周期 */
+    periodFrames = periodMin;
+    periods = 3;
+    break;
+  case LATENCY_BALANCED:	/* 10 msecの転送周期を4周期 */
+    periodFrames = rate / 100;
+    periods = 4;
+    break;
+  default:			/* 125 msecの転送周期を4周期 */
+    periodFrames = rate / 8;
+    periods = 4;
+    break;
+  }
+  if (req_period_frames > 0)
+    periodFrames = req_period_frames;
+  if (req_periods > 0)
+    periods = req_periods;
+  if (periodFrames < periodMin)
+    periodFrames = periodMin;
+
+  /* 構成空間をperiod_size要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_period_size_near(handle, hwparams, &periodFrames, &dir);
+  if (err < 0) {
+    fprintf(stderr, "period size設定不可 %lu : %s\n", periodFrames, snd_strerror(err));
+    return err;
+  }
+  /* 構成空間を周期数要求値に最も近い値に制限する */
+  dir = 0;
+  err = snd_pcm_hw_params_set_periods_near(handle, hwparams, &periods, &dir);
+  if (err < 0) {
+    fprintf(stderr, "periods設定不可 %u : %s\n", periods, snd_strerror(err));
+    return err;
+  }
+  return 0;
+}
+
 /* PCMにSWパラメータを設定するユーティリティ関数の定義 */
 int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
 {
@@ -204,6 +304,31 @@ int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
   return 0;
 }
  
+/* アンダーラン発生時に転送周期を2倍に拡大してPCMを再構成するユーティリティ関数の定義 */
+int step_up_period(snd_pcm_t *handle)
+{
+  snd_pcm_hw_params_t *hwparams;	/* PCMハードウェア構成空間コンテナ */
+  snd_pcm_sw_params_t *swparams;	/* PCMソフトウェア構成コンテナ */
+  snd_pcm_uframes_t oldPeriod = period_size;
+  int err;
+
+  /* 既定のthroughputプロファイル、または周期が125 msecに達していれば拡大しない */
+  if ((latency == LATENCY_THROUGHPUT && req_period_frames == 0 && req_periods == 0) || period_size * 2 > rate / 8)
+    return 0;
+  snd_pcm_hw_params_alloca(&hwparams); 
+  snd_pcm_sw_params_alloca(&swparams);
+
+  snd_pcm_drop(handle);
+  req_period_frames = period_size * 2;
+  if ((err = set_hwparams(handle, hwparams)) < 0)
+    return err;
+  if ((err = set_swparams(handle, swparams)) < 0)
+    return err;
+  pcmConfigured = false;		/* 拡大した転送周期は次の再生で構成し直して戻す */
+  printf("アンダーラン検出: 転送周期を %lu → %lu フレームに拡大\n", oldPeriod, period_size);
+  return 1;
+}
+
 /* サウンドデータの再生を行うユーティリティ関数の定義 */
 int gui_write_int(snd_pcm_t *handle)
 {
@@ -213,9 +338,10 @@ int gui_write_int(snd_pcm_t *handle)
   long readFrames, resFrames = numSoundFrames;		/* 未再生フレーム数の初期化 */
   int err = 0; 
 
-  Fl::lock();
-  TimeBar->range(0,(double)numSoundFrames/(double)rate);
-  Fl::unlock();
+  playFrames.store(0, std::memory_order_relaxed);
+  playTotal.store(numSoundFrames, std::memory_order_relaxed);
+  playRate.store(rate, std::memory_order_relaxed);
+  seekRequest.store(-1, std::memory_order_relaxed);
 	
   /*  オーディオサンプルの転送に適用するデータブロックにメモリを割り当てる  */	
   int *frameBlock = (int *)malloc(period_size * sizeof(int) * numChannels);
@@ -225,7 +351,49 @@ int gui_write_int(snd_pcm_t *handle)
     goto cleaning;
   }
   nFrames = (long)period_size; /* サウンドファイルから読み込むフレーム数の初期化 */
+  /* GUIスレッドはそのままに、再生スレッドだけへ実時間設定を適用する */
+  rt_prefault(&rt, frameBlock, period_size * sizeof(int) * numChannels);
+  rt_start(&rt, handle);
   while(resFrames>0 && !isStop){
+    /* 一時停止が要求されたら、再開・停止・移動の要求まで待つ */
+    if (pauseRequest.load(std::memory_order_acquire)) {
+      int mode = pause_pcm(handle, &numPlayFrames);
+      if (mode < 0) {
+	err = mode;
+	goto cleaning;
+      }
+      playFrames.store(numPlayFrames, std::memory_order_relaxed);
+      pthread_mutex_lock(&pauseMutex);
+      while (pauseRequest.load(std::memory_order_acquire) && !isStop
+	     && seekRequest.load(std::memory_order_acquire) < 0)
+	pthread_cond_wait(&pauseCond, &pauseMutex);
+      pthread_mutex_unlock(&pauseMutex);
+      /* 停止と移動はPCMを破棄するので、再開の必要はない */
+      if (isStop)
+	break;
+      if (seekRequest.load(std::memory_order_acquire) < 0 && (err = resume_pcm(handle, mode)) < 0)
+	goto cleaning;
+      resFrames = numSoundFrames - numPlayFrames;
+      nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
+    }
+    /* 表示スライダで移動が要求されたら、PCMに溜まった旧位置のサウンドを破棄して新しい位置から充填し直す */
+    long target = seekRequest.exchange(-1, std::memory_order_acquire);
+    if (target >= 0) {
+      snd_pcm_drop(handle);
+      if (sf_seek(infile, (sf_count_t)target, SEEK_SET) < 0)
+	fprintf(stderr, "再生位置の移動失敗: %s\n", sf_strerror(infile));
+      else
+	numPlayFrames = target;
+      if ((err = snd_pcm_prepare(handle)) < 0) {
+	fprintf(stderr, "PCM準備エラー: %s\n", snd_strerror(err));
+	goto cleaning;
+      }
+      playFrames.store(numPlayFrames, std::memory_order_relaxed);
+      resFrames = numSoundFrames - numPlayFrames;
+      nFrames = resFrames < (long)period_size ? resFrames : (long)period_size;
+      if (nFrames <= 0)
+	break;
+    }
     readFrames = (long)sf_readf_int(infile, frameBlock, (sf_count_t )nFrames);
     frameCount = readFrames;	/* 書き込むサンプルフレーム数の初期値をサウンドファイルから読み込むフレーム数に設定 */
     bufPtr = frameBlock;	/* 書き込むサンプルのポインタの初期値をフレームブロックの先頭に設定 */
@@ -238,28 +406,33 @@ int gui_write_int(snd_pcm_t *handle)
 	  fprintf(stderr, "Write転送エラー: %s\n", snd_strerror(err));
 	  goto cleaning;
 	}
+	/* 転送周期を拡大した場合はデータブロックを再割当てする */
+	if ((err = step_up_period(handle)) < 0)
+	  goto cleaning;
+	if (err > 0) {
+	  free(frameBlock);
+	  if ((frameBlock = (int *)malloc(period_size * sizeof(int) * numChannels)) == NULL) {
+	    fprintf(stderr, "メモリ不足でデータブロックを割当てられない\n");
+	    err = EXIT_FAILURE;
+	    goto cleaning;
+	  }
+	  nFrames = (long)period_size;
+	}
 	break;	/* １データブロック周期をスキップ */
       } 
       bufPtr += err *numChannels;	/* フレームバッファのポインタを実際に書いたフレーム数にチャンネル数を乗じた分だけ進める */
       frameCount -= err;		/* フレームバッファ中に残存する書き込み可能なフレーム数を算定 */
     }
     numPlayFrames += readFrames;
-    Fl::lock();
-    TimeBar->value((double)numPlayFrames/(double)rate);
-    Fl::awake();
-    Fl::unlock();
+    playFrames.store(numPlayFrames, std::memory_order_relaxed);	/* 表示は表示タイマーに任せる */
 		
     /* データ・ブロック長以下の残データフレーム数の計算 */
     if ((resFrames = numSoundFrames - numPlayFrames) <= (long)period_size) 
       nFrames = resFrames;
   }
   snd_pcm_drop(handle);
-  if(!isStop){
-    Fl::lock();
-    PlayState->label("再生終了");
-    Fl::awake();
-    Fl::unlock();
-  }
+  if(!isStop)
+    playEnded.store(true, std::memory_order_release);
   printf(" 合計　%lu フレームを再生して終了\n", numPlayFrames);
   err = 0;
  cleaning:
@@ -268,6 +441,62 @@ int gui_write_int(snd_pcm_t *handle)
   return err;
 }
 
+/* PCMを一時停止するユーティリティ関数の定義
+   ハードウェアが対応していればsnd_pcm_pause()でバッファを保ったまま止め、
+   非対応なら未再生分を破棄してその分だけ読込み位置を戻す。戻り値は一時停止方式 */
+int pause_pcm(snd_pcm_t *handle, long *numPlayFrames)
+{
+  snd_pcm_sframes_t delay = 0;
+  int err;
+
+  if (snd_pcm_state(handle) != SND_PCM_STATE_RUNNING)
+    return PAUSE_NONE;				/* 再生開始前なら止めるものがない */
+  if (canPause && snd_pcm_pause(handle, 1) == 0)
+    return PAUSE_HW;
+
+  if (snd_pcm_delay(handle, &delay) < 0 || delay < 0)
+    delay = 0;
+  if (delay > *numPlayFrames)
+    delay = *numPlayFrames;
+  snd_pcm_drop(handle);
+  if (sf_seek(infile, (sf_count_t)(*numPlayFrames - delay), SEEK_SET) < 0)
+    fprintf(stderr, "一時停止位置への移動失敗: %s\n", sf_strerror(infile));
+  else
+    *numPlayFrames -= delay;
+  if ((err = snd_pcm_prepare(handle)) < 0) {
+    fprintf(stderr, "PCM準備エラー: %s\n", snd_strerror(err));
+    return err;
+  }
+  return PAUSE_DROP;
+}
+
+/* 一時停止を解除するユーティリティ関数の定義
+   dropで止めた場合は準備済なので、続く転送でバッファが満ちると再生が再開する */
+int resume_pcm(snd_pcm_t *handle, int mode)
+{
+  int err;
+
+  if (mode != PAUSE_HW)
+    return 0;
+  if ((err = snd_pcm_pause(handle, 0)) < 0) {
+    fprintf(stderr, "一時停止の解除失敗: %s\n", snd_strerror(err));
+    snd_pcm_drop(handle);
+    if ((err = snd_pcm_prepare(handle)) < 0) {
+      fprintf(stderr, "PCM準備エラー: %s\n", snd_strerror(err));
+      return err;
+    }
+  }
+  return 0;
+}
+
+/* 一時停止中の再生スレッドを起こすユーティリティ関数の定義 */
+void wake_player(void)
+{
+  pthread_mutex_lock(&pauseMutex);
+  pthread_cond_broadcast(&pauseCond);
+  pthread_mutex_unlock(&pauseMutex);
+}
+
 /* マルチフォーマット再生制御ユーティリティ関数の定義 */
 void *player(void *arg)
 {
@@ -276,7 +505,7 @@ void *player(void *arg)
   snd_pcm_sw_params_t *swparams; 	/* PCMソフトウェア構成コンテナ */
   unsigned char *transfer_method;	/* 転送方法名 */
   double playtime = 0;
-  int err, c;
+  int err = 0, c;
   int informat, dformat;		/* ファイルフォーマット、データフォーマット */
 
   /* ALSA HW, SWパラメータ・コンテナの初期化 */
@@ -337,7 +566,7 @@ void *player(void *arg)
   printf("再生時間：%.0lf秒\n", playtime);
   printf("\n");
 
-  if (mmap) {
+  if (mmap_access) {
     writei_func = snd_pcm_mmap_writei;
     transfer_method = (unsigned char *)"mmap_write";
   } else {
@@ -345,21 +574,43 @@ void *player(void *arg)
     transfer_method = (unsigned char *)"write";
   }
 	
-  /* PCMをBlockモードでオープンする */
-  if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-    fprintf(stderr, "PCMオープンエラー: %s\n", snd_strerror(err));
-    goto cleaning;
-  }
-	
-  /* ユーティリティ関数によりPCMにHWパラメータを設定する */
-  if ((err = set_hwparams(handle, hwparams)) < 0) {
-    fprintf(stderr, "hwparamsの設定失敗: %s\n", snd_strerror(err));
-    goto cleaning;
+  /* 前の再生と同じデバイスならPCMを開いたまま使う。デバイスが変われば開き直す */
+  if (pcm != NULL && strcmp(pcmDevice, device) != 0) {
+    snd_pcm_close(pcm);
+    pcm = NULL;
+  }
+  if (pcm == NULL) {
+    /* PCMをBlockモードでオープンする */
+    if ((err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+      fprintf(stderr, "PCMオープンエラー: %s\n", snd_strerror(err));
+      pcm = NULL;
+      goto cleaning;
+    }
+    pcmDevice = device;
+    pcmConfigured = false;
   }
-	
-  /* ユーティリティ関数によりPCMにSWパラメータを設定する  */
-  if ((err = set_swparams(handle, swparams)) < 0) {
-    fprintf(stderr, "swparamsの設定失敗: %s\n", snd_strerror(err));
+  handle = pcm;
+
+  if (!pcmConfigured || pcmRate != rate || pcmChannels != numChannels || pcmLatency != latency) {
+    /* 標本化速度、チャンネル数、レイテンシ・プロファイルが変わった時だけ構成し直す */
+    snd_pcm_drop(handle);
+    /* ユーティリティ関数によりPCMにHWパラメータを設定する */
+    if ((err = set_hwparams(handle, hwparams)) < 0) {
+      fprintf(stderr, "hwparamsの設定失敗: %s\n", snd_strerror(err));
+      goto cleaning;
+    }
+    /* ユーティリティ関数によりPCMにSWパラメータを設定する  */
+    if ((err = set_swparams(handle, swparams)) < 0) {
+      fprintf(stderr, "swparamsの設定失敗: %s\n", snd_strerror(err));
+      goto cleaning;
+    }
+    pcmRate = rate;
+    pcmChannels = numChannels;
+    pcmLatency = latency;
+    pcmConfigured = true;
+  } else if ((err = snd_pcm_prepare(handle)) < 0) {
+    /* 同じ構成なら前の再生の終了時に止めたPCMを準備し直すだけでよい */
+    fprintf(stderr, "PCM準備エラー: %s\n", snd_strerror(err));
     goto cleaning;
   }
   
@@ -368,6 +619,9 @@ void *player(void *arg)
   printf("内部フォーマット：%s\n", snd_pcm_format_name(format));
   printf("PCMデバイス：%s\n", device);
   printf("転送方法: %s\n", transfer_method);
+  printf("バッファサイズ：%lu フレーム (%.1f msec)\n", buffer_size, 1000.0 * (double)buffer_size / (double)rate);
+  printf("転送周期：%lu フレーム (%.1f msec)\n", period_size, 1000.0 * (double)period_size / (double)rate);
+  printf("一時停止方式：%s\n", canPause ? "snd_pcm_pause" : "drop/prepare");
   printf("\n");
 
   /* ユーティリティ関数によりファイルからデータを読み、ALSA転送関数に渡してサウンドを再生する */
@@ -381,9 +635,12 @@ void *player(void *arg)
  cleaning:
   isPlay = false;
   isStop = false;
-  if(handle != NULL)
-    snd_pcm_close(handle);
-  snd_config_update_free_global();	
+  pauseRequest.store(false, std::memory_order_relaxed);
+  if(err != 0 && pcm != NULL){
+    /* 状態の分からないPCMは閉じ、次の再生で開き直す */
+    snd_pcm_close(pcm);
+    pcm = NULL;
+  }
   if(infile != NULL)
     sf_close(infile);
   return((void *)0);
@@ -439,9 +696,14 @@ void cb_butPlay(Fl_Button *w, void *d)
     default:
       break;
     }
+    latency = Latency->value();		/* LATENCY_LOW, LATENCY_BALANCED, LATENCY_THROUGHPUT の順 */
+    req_period_frames = 0;		/* 前回の再生で拡大した転送周期を初期化 */
     PlayState->label("再生中");
+    pauseRequest.store(false, std::memory_order_relaxed);
     pthread_create(&play_thread, NULL, player, NULL);
   }
+  else if (pauseRequest.load(std::memory_order_relaxed))
+    cb_butPause(NULL, NULL);		/* 一時停止中なら再開する */
   else 
     fl_message("再生中止するには停止ボタン");
   return;
@@ -453,10 +715,26 @@ void cb_butStop(Fl_Button *w, void *d)
   if (isPlay){
     isStop = true;
     PlayState->label("再生停止");
+    wake_player();			/* 一時停止中の再生スレッドも終了させる */
   }
   return;
 }
 
+/* 一時停止ボタン操作コールバック関数: 押すたびに一時停止と再開を切り替える */
+void cb_butPause(Fl_Button *w, void *d)
+{
+  bool pause;
+
+  if (!isPlay || isStop)
+    return;
+  pause = !pauseRequest.load(std::memory_order_relaxed);
+  pauseRequest.store(pause, std::memory_order_release);
+  PlayState->label(pause ? "一時停止" : "再生中");
+  if (!pause)
+    wake_player();
+  return;
+}
+
 /* PCMデバイス選択操作コールバック関数 */
 void cb_pcmDevice(Fl_Choice *w, void *d)
 {
@@ -465,8 +743,101 @@ void cb_pcmDevice(Fl_Choice *w, void *d)
   return;
 }
 
-int main(void)
+/* 再生スレッドが公開した再生位置と終了通知を表示に反映するタイマー・コールバック関数 */
+void cb_display(void *d)
+{
+  static long shownFrames = -1, shownTotal = -1;	/* 表示済の再生位置と総フレーム数 */
+  static unsigned int shownRate = 0;			/* 表示済の標本化速度 */
+  unsigned int r = playRate.load(std::memory_order_relaxed);
+  long total = playTotal.load(std::memory_order_relaxed);
+  long frames = playFrames.load(std::memory_order_relaxed);
+
+  if (r > 0 && (total != shownTotal || r != shownRate)) {
+    TimeBar->range(0, (double)total / (double)r);
+    shownTotal = total;
+    shownRate = r;
+    shownFrames = -1;
+  }
+  /* 値が変わった時だけ再描画させる。ドラッグ中と移動要求の処理待ちの間は利用者の操作位置を保つ */
+  if (r > 0 && frames != shownFrames && Fl::pushed() != TimeBar
+      && seekRequest.load(std::memory_order_relaxed) < 0) {
+    TimeBar->value((double)frames / (double)r);
+    shownFrames = frames;
+  }
+  if (playEnded.exchange(false, std::memory_order_acquire))
+    PlayState->label("再生終了");
+  Fl::repeat_timeout(DISPLAY_INTERVAL, cb_display);
+}
+
+/* 再生時間スライダ操作コールバック関数: 離した位置へ再生位置を移動する */
+void cb_timeBar(Fl_Hor_Value_Slider *w, void *d)
+{
+  unsigned int r = playRate.load(std::memory_order_relaxed);
+  long total = playTotal.load(std::memory_order_relaxed);
+  long target;
+
+  if (!isPlay || r == 0)
+    return;
+  target = (long)(w->value() * (double)r);
+  if (target < 0)
+    target = 0;
+  if (target > total)
+    target = total;
+  seekRequest.store(target, std::memory_order_release);
+  wake_player();			/* 一時停止中でも位置を移動する */
+  return;
+}
+
+/* 使用法を表示するユーティリティ関数の定義 */
+void usage(void)
 {
+  printf(
+	 "使用法: gui_player [オプション]...\n"
+	 "-h,--help	         使用法\n"
+	 "-R,--realtime=方式[:優先度] 再生スレッドを fifo または rr で実時間実行(既定優先度 70)\n"
+	 "-A,--affinity=CPU番号    再生スレッドを指定CPUに固定\n"
+	 "-M,--mlock               mlockallでメモリ固定し、バッファを事前フォールト\n"
+	 "\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const struct option long_option[] =
+    {
+      {"help", 0, NULL, 'h'},
+      {"realtime", 1, NULL, 'R'},
+      {"affinity", 1, NULL, 'A'},
+      {"mlock", 0, NULL, 'M'},
+      {NULL, 0, NULL, 0},
+    };
+  int c;
+
+  while ((c = getopt_long(argc, argv, "hR:A:M", long_option, NULL)) != -1) {
+    switch (c) {
+    case 'h':
+      usage();
+      return 0;
+    case 'R':
+      if (rt_parse(&rt, optarg) < 0) {
+	fprintf(stderr, "実時間方式は fifo[:優先度] または rr[:優先度] (優先度 1〜99)\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      if (rt_parse_cpu(&rt, optarg) < 0) {
+	fprintf(stderr, "CPU番号は0以上の整数\n");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+      rt.lock = 1;
+      break;
+    default:
+      fprintf(stderr, "`--help'で使用方法を確認\n");
+      return EXIT_FAILURE;
+    }
+  }
+
   /* ---------- GUI 定義開始 ---------- */
   MainWindow = new Fl_Window(0, 0, 400, 350, "gui_player");			
   Fl_Menu_Item FileItem[] = {
@@ -491,15 +862,30 @@ int main(void)
   PcmDevice->callback((Fl_Callback *)cb_pcmDevice);
   PcmDevice->menu(DeviceItem);
   PlayState = new Fl_Box(150, 130, 100, 35,"---再生状態---");
-  Fl_Button *butPlay = new Fl_Button(90, 180, 90, 45, "@>");
+  Fl_Button *butPlay = new Fl_Button(40, 180, 90, 45, "@>");
   butPlay->callback((Fl_Callback *)cb_butPlay);
-  Fl_Button *butStop = new Fl_Button(220, 180, 90, 45, "@square");
+  Fl_Button *butPause = new Fl_Button(155, 180, 90, 45, "@||");
+  butPause->callback((Fl_Callback *)cb_butPause);
+  Fl_Button *butStop = new Fl_Button(270, 180, 90, 45, "@square");
   butStop->callback((Fl_Callback *)cb_butStop);
-  new Fl_Box(115, 225, 50, 15, "再生");
-  new Fl_Box(245, 225, 50, 15, "停止");	
+  new Fl_Box(65, 225, 50, 15, "再生");
+  new Fl_Box(175, 225, 50, 15, "一時停止");
+  new Fl_Box(295, 225, 50, 15, "停止");	
   TimeBar = new Fl_Hor_Value_Slider(50, 270, 300, 30);
   TimeBar->type(FL_HOR_FILL_SLIDER);
   TimeBar->selection_color(FL_BLUE);
+  TimeBar->when(FL_WHEN_RELEASE);
+  TimeBar->callback((Fl_Callback *)cb_timeBar);
+  Fl_Menu_Item LatencyItem[] = {
+    {"low", 0,  0, 0, 0, FL_NORMAL_LABEL, 0, 14, 0},
+    {"balanced", 0,  0, 0, 0, FL_NORMAL_LABEL, 0, 14, 0},
+    {"throughput", 0,  0, 0, 0, FL_NORMAL_LABEL, 0, 14, 0},
+    {0}
+  };
+  Latency = new Fl_Choice(175, 310, 115, 30, "レイテンシ");
+  Latency->down_box(FL_BORDER_BOX);
+  Latency->menu(LatencyItem);
+  Latency->value(LATENCY_THROUGHPUT);
  
   MainWindow->end();
   FileDlg = new Fl_File_Chooser(".", "オーディオファイル (*.{wav,aif,aiff,flac})", Fl_File_Chooser::SINGLE, 
@@ -507,6 +893,15 @@ int main(void)
   /* ----- GUI 定義終了------ */
 
   MainWindow->show();	/* ウィンドウを可視化 */	
+  Fl::add_timeout(DISPLAY_INTERVAL, cb_display);	/* 再生位置表示の定期更新を開始 */
   Fl::lock();
-  return Fl::run();	/* GUIイベントループ実行 */
+  c = Fl::run();	/* GUIイベントループ実行 */
+
+  /* 再生の間も開いたままにしたPCMを閉じる(再生中ならプロセス終了に任せる) */
+  if (!isPlay) {
+    if (pcm != NULL)
+      snd_pcm_close(pcm);
+    snd_config_update_free_global();
+  }
+  return c;
 }